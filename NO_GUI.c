@@ -27,6 +27,8 @@
  *
  * Usage:
  *   ./image_bw_converter [options] <input.(png|jpg|bmp)> <output.png>
+ *   Either path may be "-" to read stdin / write stdout, e.g.
+ *   curl -s URL | ./image_bw_converter - - > out.png
  *
  * basic usage:
  *  ./image_bw_converter input.png output.png
@@ -40,6 +42,7 @@
  */
 
 #define DEFAULT_DPI 300
+#define STDOUT_BUFFER (1 << 20)
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
@@ -48,6 +51,7 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "stb_image_write.h"
 
@@ -82,6 +86,10 @@ static ErrorCode saveBWImage(const char *outputPath, unsigned char *pixelBuffer,
 static ErrorCode convertToBW(const char *inputPath, const char *outputPath,
                              const BWConfig *config);
 
+static bool isStdio(const char *path) {
+    return strcmp(path, "-") == 0;
+}
+
 int main(int argc, char *argv[]) {
     BWConfig config = {
         .brightnessThreshold = 128, .invertOutput = false, .verboseMode = false};
@@ -113,6 +121,11 @@ int main(int argc, char *argv[]) {
         showUsage(argv[0]);
         return EXIT_FAILURE;
     }
+    // The PNG reaches stdout in one large block rather than 4 KiB pieces;
+    // glibc ignores the size unless the buffer is given too
+    static char stdoutBuffer[STDOUT_BUFFER];
+    if (isStdio(argv[optind + 1]))
+        setvbuf(stdout, stdoutBuffer, _IOFBF, sizeof(stdoutBuffer));
     return convertToBW(argv[optind], argv[optind + 1], &config);
 }
 
@@ -120,6 +133,7 @@ static void showUsage(const char *programName) {
     fprintf(
         stderr,
         "Usage: %s [options] <input> <output>\n"
+        "  <input>/<output> may be - for stdin/stdout\n"
         "Options:\n"
         "  -t threshold    brightness cutoff (0-255, default: 128)\n"
         "  -i               invert black/white (after dithering)\n"
@@ -133,10 +147,37 @@ static void showVersion(void) {
     printf("image_bw_converter version 2.1.2 (19/04/2025) by Bahey Shalash\n");
 }
 
+// stb_image callbacks on stdin; skipping reads and discards, pipes cannot seek
+static int stdinRead(void *user, char *data, int size) {
+    return (int)fread(data, 1, size, (FILE *)user);
+}
+
+static void stdinSkip(void *user, int n) {
+    char buf[4096];
+    while (n > 0) {
+        size_t chunk = n < (int)sizeof(buf) ? (size_t)n : sizeof(buf);
+        size_t got = fread(buf, 1, chunk, (FILE *)user);
+        if (!got)
+            break;
+        n -= (int)got;
+    }
+}
+
+static int stdinEof(void *user) {
+    return feof((FILE *)user) || ferror((FILE *)user);
+}
+
 static ErrorCode loadGrayImage(const char *inputPath, unsigned char **grayBuffer,
                                int *imgWidth, int *imgHeight, const BWConfig *config) {
     int channels;
-    unsigned char *rgb = stbi_load(inputPath, imgWidth, imgHeight, &channels, 3);
+    unsigned char *rgb;
+    if (isStdio(inputPath)) {
+        const stbi_io_callbacks callbacks = {stdinRead, stdinSkip, stdinEof};
+        rgb = stbi_load_from_callbacks(&callbacks, stdin, imgWidth, imgHeight, &channels,
+                                       3);
+    } else {
+        rgb = stbi_load(inputPath, imgWidth, imgHeight, &channels, 3);
+    }
     if (!rgb) {
         fprintf(stderr, "Error: cannot load '%s'\n", inputPath);
         return ERR_LOAD;
@@ -197,6 +238,12 @@ static void diffuseImage(unsigned char *pixelBuffer, float *errorBuffer, int img
     }
 }
 
+// stbi_write_png_to_func hands over the whole encoded PNG in one call
+static void writeStdout(void *context, void *data, int size) {
+    if (fwrite(data, 1, size, stdout) != (size_t)size)
+        *(bool *)context = true;
+}
+
 static ErrorCode saveBWImage(const char *outputPath, unsigned char *pixelBuffer,
                              int imgWidth, int imgHeight, const BWConfig *config) {
     if (config->verboseMode) {
@@ -206,7 +253,16 @@ static ErrorCode saveBWImage(const char *outputPath, unsigned char *pixelBuffer,
         fprintf(stderr, "Output: %d×%d px (~%.2fmm × %.2fmm at %ddpi)\n", imgWidth,
                 imgHeight, w_mm, h_mm, DEFAULT_DPI);
     }
-    if (!stbi_write_png(outputPath, imgWidth, imgHeight, 1, pixelBuffer, imgWidth)) {
+    int ok;
+    if (isStdio(outputPath)) {
+        bool failed = false;
+        ok = stbi_write_png_to_func(writeStdout, &failed, imgWidth, imgHeight, 1,
+                                    pixelBuffer, imgWidth);
+        ok = ok && !failed && fflush(stdout) == 0;
+    } else {
+        ok = stbi_write_png(outputPath, imgWidth, imgHeight, 1, pixelBuffer, imgWidth);
+    }
+    if (!ok) {
         fprintf(stderr, "Error: cannot write '%s'\n", outputPath);
         return ERR_WRITE;
     }
@@ -0,0 +1,526 @@
+/*
+ * File: bw_anim.c
+ * ---------------------------
+ * Description:
+ *   Multi-frame (animated GIF) input and 1-bit GIF output.
+ *
+ *   All frames are decoded with stbi_load_gif_from_memory and dithered
+ *   concurrently on the library pool, one frame per worker at a time. The
+ *   result is either a numbered image sequence or an animated two-colour
+ *   GIF that keeps the source frame delays.
+ *
+ *   Independent dithering of every frame makes static areas shimmer. With
+ *   temporalDither the frames are processed in order instead: pixels whose
+ *   luma moved by no more than temporalTolerance since their output was
+ *   last dithered keep that output and only push their error to the
+ *   neighbours, so just the changed regions are re-dithered.
+ *
+ * Author: Bahey Shalash
+ * Version: 2.1.2
+ * Date: 19/04/2025
+ */
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bw_internal.h"
+#include "stb_image.h"
+
+#define GIF_MIN_CODE 2 /* GIF requires at least 2 even for two colours */
+#define GIF_MAX_CODE 4095
+
+/* ---- GIF encoding ---- */
+
+typedef struct {
+    FILE *fp;
+    unsigned char block[255];
+    int blockLen;
+    uint32_t bits;
+    int bitCount;
+} GifBits;
+
+static void gifPutByte(GifBits *gb, unsigned char b) {
+    gb->block[gb->blockLen++] = b;
+    if (gb->blockLen == 255) {
+        fputc(255, gb->fp);
+        fwrite(gb->block, 1, 255, gb->fp);
+        gb->blockLen = 0;
+    }
+}
+
+static void gifPutCode(GifBits *gb, int code, int size) {
+    gb->bits |= (uint32_t)code << gb->bitCount;
+    gb->bitCount += size;
+    while (gb->bitCount >= 8) {
+        gifPutByte(gb, (unsigned char)(gb->bits & 0xFF));
+        gb->bits >>= 8;
+        gb->bitCount -= 8;
+    }
+}
+
+/* LZW-compress palette indices (0 = black, 1 = white) as GIF image data. */
+static ErrorCode gifWriteLZW(FILE *fp, const unsigned char *idx, size_t n) {
+    uint16_t(*next)[4] = calloc(GIF_MAX_CODE + 1, sizeof(*next));
+    if (!next)
+        return ERR_MEMORY;
+    const int clearCode = 1 << GIF_MIN_CODE;
+    GifBits gb = {.fp = fp};
+    int codeSize = GIF_MIN_CODE + 1, maxCode = clearCode + 1;
+
+    fputc(GIF_MIN_CODE, fp);
+    gifPutCode(&gb, clearCode, codeSize);
+    int cur = idx[0];
+    for (size_t i = 1; i < n; i++) {
+        int c = idx[i];
+        if (next[cur][c]) {
+            cur = next[cur][c];
+            continue;
+        }
+        gifPutCode(&gb, cur, codeSize);
+        next[cur][c] = (uint16_t)++maxCode;
+        if (maxCode >= (1 << codeSize))
+            codeSize++;
+        if (maxCode == GIF_MAX_CODE) {
+            gifPutCode(&gb, clearCode, codeSize);
+            memset(next, 0, (GIF_MAX_CODE + 1) * sizeof(*next));
+            codeSize = GIF_MIN_CODE + 1;
+            maxCode = clearCode + 1;
+        }
+        cur = c;
+    }
+    gifPutCode(&gb, cur, codeSize);
+    gifPutCode(&gb, clearCode + 1, codeSize); /* end of information */
+    if (gb.bitCount)
+        gifPutByte(&gb, (unsigned char)gb.bits);
+    if (gb.blockLen) {
+        fputc(gb.blockLen, fp);
+        fwrite(gb.block, 1, gb.blockLen, fp);
+    }
+    fputc(0, fp);
+    free(next);
+    return ERR_OK;
+}
+
+static void putLE16(FILE *fp, int v) {
+    fputc(v & 0xFF, fp);
+    fputc((v >> 8) & 0xFF, fp);
+}
+
+ErrorCode writeGIF(FILE *fp, const BWBitmap *frames, const int *delaysMs, int count) {
+    int w = frames[0].w, h = frames[0].h;
+    unsigned char *idx = malloc((size_t)w * h);
+    if (!idx)
+        return ERR_MEMORY;
+    static const unsigned char header[] = {'G', 'I', 'F', '8', '9', 'a'};
+    fwrite(header, 1, sizeof(header), fp);
+    putLE16(fp, w);
+    putLE16(fp, h);
+    fputc(0x80, fp); /* global colour table of 2 entries */
+    fputc(0, fp);
+    fputc(0, fp);
+    static const unsigned char colours[] = {0, 0, 0, 255, 255, 255};
+    fwrite(colours, 1, sizeof(colours), fp);
+    if (count > 1) {
+        static const unsigned char loop[] = {0x21, 0xFF, 0x0B, 'N', 'E', 'T', 'S',
+                                             'C',  'A',  'P',  'E', '2', '.', '0',
+                                             0x03, 0x01, 0x00, 0x00, 0x00};
+        fwrite(loop, 1, sizeof(loop), fp);
+    }
+
+    ErrorCode r = ERR_OK;
+    for (int f = 0; f < count && r == ERR_OK; f++) {
+        const BWBitmap *bm = &frames[f];
+        for (int y = 0; y < h; y++) {
+            const unsigned char *row = bm->bits + (size_t)y * bm->stride;
+            for (int x = 0; x < w; x++)
+                idx[(size_t)y * w + x] = (row[x >> 3] >> (7 - (x & 7))) & 1;
+        }
+        int delay = delaysMs ? (delaysMs[f] + 5) / 10 : 0;
+        static const unsigned char gce[] = {0x21, 0xF9, 0x04, 0x04};
+        fwrite(gce, 1, sizeof(gce), fp);
+        putLE16(fp, delay);
+        fputc(0, fp);
+        fputc(0, fp);
+        fputc(0x2C, fp);
+        putLE16(fp, 0);
+        putLE16(fp, 0);
+        putLE16(fp, w);
+        putLE16(fp, h);
+        fputc(0, fp);
+        r = gifWriteLZW(fp, idx, (size_t)w * h);
+    }
+    fputc(0x3B, fp);
+    if (ferror(fp) && r == ERR_OK)
+        r = ERR_WRITE;
+    free(idx);
+    return r;
+}
+
+ErrorCode saveGIF(const char *path, const BWBitmap *frames, const int *delaysMs,
+                  int count, const BWConfig *cfg) {
+    FILE *fp = openOutput(path);
+    if (!fp)
+        return ERR_WRITE;
+    if (cfg->verboseMode)
+        fprintf(stderr, "Writing '%s' (%d frame%s)\n", path, count, count == 1 ? "" : "s");
+    ErrorCode r = writeGIF(fp, frames, delaysMs, count);
+    if (!closeOutput(fp) && r == ERR_OK)
+        r = ERR_WRITE;
+    return r;
+}
+
+/* writeGIF into a new buffer. */
+ErrorCode encodeGIF(const BWBitmap *frames, const int *delaysMs, int count,
+                    unsigned char **out, size_t *outSize) {
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *mem = open_memstream(&buf, &len);
+    if (!mem)
+        return ERR_MEMORY;
+    ErrorCode r = writeGIF(mem, frames, delaysMs, count);
+    if (fclose(mem) != 0 && r == ERR_OK)
+        r = ERR_WRITE;
+    if (r == ERR_OK) {
+        *out = (unsigned char *)buf;
+        *outSize = len;
+    } else {
+        free(buf);
+    }
+    return r;
+}
+
+/* ---- Frame-parallel dithering ---- */
+
+typedef struct {
+    unsigned char *rgb; /* frames stacked, w*h*3 each */
+    int *delays;        /* ms per frame */
+    int w, h, count;
+    BWConfig cfg; /* per-frame copy: single-threaded, quiet */
+    BWFormat fmt;
+    const char *pattern; /* printf pattern for sequences, NULL to keep frames */
+    BWBitmap *frames;
+    BWStats *stats;
+    pthread_mutex_t lock;
+    atomic_int next;
+    ErrorCode result;
+} AnimJob;
+
+/* Accept exactly one integer conversion such as %d or %04d. */
+static bool validPattern(const char *p) {
+    int conversions = 0;
+    for (; *p; p++) {
+        if (*p != '%')
+            continue;
+        if (p[1] == '%') {
+            p++;
+            continue;
+        }
+        p++;
+        while (*p >= '0' && *p <= '9')
+            p++;
+        if (*p != 'd')
+            return false;
+        conversions++;
+    }
+    return conversions == 1;
+}
+
+static void addFrameStats(BWStats *total, const BWStats *frame) {
+    for (int y = 0; y < frame->height; y++)
+        total->rowBlack[y] += frame->rowBlack[y];
+    for (int i = 0; i < frame->tilesX * frame->tilesY; i++)
+        total->tileBlack[i] += frame->tileBlack[i];
+    for (int k = 0; k < BW_RUN_BINS; k++)
+        total->runHistogram[k] += frame->runHistogram[k];
+    total->blackPixels += frame->blackPixels;
+}
+
+static ErrorCode finishFrame(AnimJob *job, int f, BWBitmap *bm, BWStats *fs) {
+    ErrorCode r = ERR_OK;
+    if (job->pattern) {
+        char path[PATH_MAX];
+        int n = snprintf(path, sizeof(path), job->pattern, f);
+        r = n > 0 && n < (int)sizeof(path)
+                ? saveBWImage(path, job->fmt, bm, &job->cfg, NULL)
+                : ERR_WRITE;
+        free(bm->bits);
+    } else {
+        job->frames[f] = *bm;
+    }
+    pthread_mutex_lock(&job->lock);
+    if (fs) {
+        addFrameStats(job->stats, fs);
+        bw_stats_free(fs);
+    }
+    if (r != ERR_OK && job->result == ERR_OK)
+        job->result = r;
+    pthread_mutex_unlock(&job->lock);
+    return r;
+}
+
+/* One of `width` participants pulling frames until none are left. */
+static void animWorker(void *arg, int index) {
+    AnimJob *job = arg;
+    (void)index;
+    size_t total = (size_t)job->w * job->h;
+    unsigned char *gray = malloc(total);
+    for (;;) {
+        int f = atomic_fetch_add(&job->next, 1);
+        if (f >= job->count)
+            break;
+        BWBitmap bm;
+        BWStats fs;
+        ErrorCode r = ERR_MEMORY;
+        if (gray) {
+            rgbToGray(job->rgb + f * total * 3, gray, (int)total);
+            r = ditherGrayPlane(gray, job->w, job->h, &job->cfg, NULL, &bm,
+                                job->stats ? &fs : NULL, NULL);
+        }
+        if (r == ERR_OK) {
+            finishFrame(job, f, &bm, job->stats ? &fs : NULL);
+        } else {
+            pthread_mutex_lock(&job->lock);
+            if (job->result == ERR_OK)
+                job->result = r;
+            pthread_mutex_unlock(&job->lock);
+        }
+    }
+    free(gray);
+}
+
+/* Frames in order, holding the output of pixels whose luma barely changed. */
+static void runTemporal(AnimJob *job, int tolerance) {
+    size_t total = (size_t)job->w * job->h;
+    unsigned char *gray = malloc(total), *heldGray = malloc(total);
+    unsigned char *hold = malloc(total);
+    if (!gray || !heldGray || !hold) {
+        job->result = ERR_MEMORY;
+        goto done;
+    }
+    bool invert = job->cfg.invertOutput;
+    for (int f = 0; f < job->count && job->result == ERR_OK; f++) {
+        rgbToGray(job->rgb + f * total * 3, gray, (int)total);
+        /* A held pixel is compared with its luma when its output was last
+         * dithered, not the previous frame's, so a slow drift still lands. */
+        if (f == 0) {
+            memcpy(heldGray, gray, total);
+        } else {
+            for (size_t i = 0; i < total; i++) {
+                int d = gray[i] - heldGray[i];
+                if (d < -tolerance || d > tolerance) {
+                    hold[i] = HOLD_FREE;
+                    heldGray[i] = gray[i];
+                }
+            }
+        }
+
+        BWBitmap bm;
+        BWStats fs;
+        ErrorCode r = ditherGrayPlane(gray, job->w, job->h, &job->cfg, f > 0 ? hold : NULL,
+                                      &bm, job->stats ? &fs : NULL, NULL);
+        if (r != ERR_OK) {
+            job->result = r;
+            break;
+        }
+        /* The next frame holds this frame's (pre-inversion) output. */
+        for (int y = 0; y < job->h; y++) {
+            const unsigned char *row = bm.bits + (size_t)y * bm.stride;
+            for (int x = 0; x < job->w; x++) {
+                bool white = ((row[x >> 3] >> (7 - (x & 7))) & 1) ^ invert;
+                hold[(size_t)y * job->w + x] = white ? 255 : 0;
+            }
+        }
+        finishFrame(job, f, &bm, job->stats ? &fs : NULL);
+    }
+done:
+    free(gray);
+    free(heldGray);
+    free(hold);
+}
+
+static int workerCount(const BWConfig *cfg, int frames) {
+    int n = cfg->threads > 0 ? cfg->threads : poolThreads();
+    return n < frames ? n : frames;
+}
+
+static unsigned char *readWholeFile(const char *path, int *len) {
+    bool piped = isStdioPath(path);
+    FILE *fp = piped ? stdin : fopen(path, "rb");
+    if (!fp)
+        return NULL;
+    /* Read in growing chunks: stdin has no size to ask for. */
+    size_t cap = 1 << 16, size = 0;
+    unsigned char *buf = malloc(cap);
+    while (buf) {
+        size += fread(buf + size, 1, cap - size, fp);
+        if (size < cap || cap >= INT_MAX / 2)
+            break;
+        unsigned char *grown = realloc(buf, cap * 2);
+        if (!grown) {
+            free(buf);
+            buf = NULL;
+            break;
+        }
+        buf = grown;
+        cap *= 2;
+    }
+    if (buf && (ferror(fp) || size == 0 || size == cap)) {
+        free(buf);
+        buf = NULL;
+    }
+    *len = (int)size;
+    if (!piped)
+        fclose(fp);
+    return buf;
+}
+
+/* For stdin only one byte can be pushed back; of the formats stb_image reads,
+ * only GIF starts with 'G'. */
+bool isGIFFile(const char *path) {
+    if (isStdioPath(path)) {
+        int c = getc(stdin);
+        if (c == EOF)
+            return false;
+        ungetc(c, stdin);
+        return c == 'G';
+    }
+    unsigned char sig[6];
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+        return false;
+    bool gif = isGIFData(sig, fread(sig, 1, sizeof(sig), fp));
+    fclose(fp);
+    return gif;
+}
+
+bool isGIFData(const unsigned char *data, size_t size) {
+    return size >= 6 && !memcmp(data, "GIF8", 4);
+}
+
+/* Decode the GIF in `file` into a job for runAnimation; `name` is for logs. */
+static ErrorCode loadAnimation(AnimJob *job, const unsigned char *file, size_t size,
+                               const char *name, BWFormat fmt, const BWConfig *cfg) {
+    int w, h, count, comp, *delays = NULL;
+    unsigned char *rgb =
+        size <= INT_MAX ? stbi_load_gif_from_memory(file, (int)size, &delays, &w, &h,
+                                                    &count, &comp, 3)
+                        : NULL;
+    if (!rgb)
+        return ERR_LOAD;
+    if (cfg->verboseMode)
+        fprintf(stderr, "Loaded '%s' (%dx%d, %d frame%s)\n", name, w, h, count,
+                count == 1 ? "" : "s");
+    *job = (AnimJob){.rgb = rgb, .delays = delays, .w = w, .h = h, .count = count,
+                     .cfg = *cfg, .fmt = fmt};
+    job->cfg.verboseMode = false;
+    atomic_init(&job->next, 0);
+    pthread_mutex_init(&job->lock, NULL);
+    return ERR_OK;
+}
+
+/* Dither every frame, into job->frames or the files of job->pattern. */
+static ErrorCode runAnimation(AnimJob *job, const BWConfig *cfg, BWStats *stats) {
+    if (stats) {
+        ErrorCode r = statsBegin(stats, job->w, job->h, cfg);
+        if (r != ERR_OK)
+            return r;
+        job->stats = stats;
+    }
+    if (cfg->temporalDither) {
+        runTemporal(job, cfg->temporalTolerance);
+    } else {
+        int nw = workerCount(cfg, job->count);
+        parallelFor(nw, nw, animWorker, job);
+    }
+    return job->result;
+}
+
+/* Release `job`; `stats` is completed or, after an error `r`, freed. */
+static void endAnimation(AnimJob *job, ErrorCode r, BWStats *stats) {
+    if (job->frames) {
+        for (int f = 0; f < job->count; f++)
+            free(job->frames[f].bits);
+        free(job->frames);
+    }
+    if (stats && r == ERR_OK) {
+        stats->frames = job->count;
+        double area = (double)job->w * job->h * job->count;
+        stats->blackFraction = area > 0 ? stats->blackPixels / area : 0.0;
+    } else if (stats) {
+        bw_stats_free(stats);
+    }
+    pthread_mutex_destroy(&job->lock);
+    stbi_image_free(job->rgb);
+    free(job->delays);
+}
+
+ErrorCode convertAnimation(const char *in, const unsigned char *data, size_t size,
+                           const char *out, BWFormat fmt, const BWConfig *cfg,
+                           BWStats *stats) {
+    int len = 0;
+    unsigned char *file = data ? NULL : readWholeFile(in, &len);
+    if (!data && !file)
+        return ERR_LOAD;
+    AnimJob job;
+    ErrorCode r = loadAnimation(&job, data ? data : file, data ? size : (size_t)len, in,
+                                fmt, cfg);
+    free(file);
+    if (r != ERR_OK)
+        return r;
+
+    char pattern[PATH_MAX];
+    bool gifOut = fmt == BW_FORMAT_GIF;
+    if (!gifOut && job.count > 1) {
+        if (isStdioPath(out)) {
+            r = ERR_CONFIG; /* a sequence cannot go to stdout */
+        } else if (strchr(out, '%')) {
+            if (!validPattern(out) || strlen(out) >= sizeof(pattern))
+                r = ERR_CONFIG;
+            else
+                strcpy(pattern, out);
+        } else if (!suffixedPath(pattern, sizeof(pattern), out, "_%03d")) {
+            r = ERR_WRITE;
+        }
+        job.pattern = pattern;
+    } else {
+        job.frames = calloc(job.count, sizeof(*job.frames));
+        if (!job.frames)
+            r = ERR_MEMORY;
+    }
+    if (r == ERR_OK)
+        r = runAnimation(&job, cfg, stats);
+    if (r == ERR_OK && job.frames)
+        r = gifOut ? saveGIF(out, job.frames, job.delays, job.count, cfg)
+                   : saveBWImage(out, fmt, &job.frames[0], cfg, NULL);
+    if (cfg->verboseMode && r == ERR_OK && job.pattern)
+        fprintf(stderr, "Wrote %d frames as '%s'\n", job.count, pattern);
+    endAnimation(&job, r, stats);
+    return r;
+}
+
+ErrorCode encodeAnimation(const unsigned char *data, size_t size, BWFormat fmt,
+                          const BWConfig *cfg, unsigned char **out, size_t *outSize,
+                          BWStats *stats) {
+    *out = NULL;
+    *outSize = 0;
+    AnimJob job;
+    ErrorCode r = loadAnimation(&job, data, size, "memory", fmt, cfg);
+    if (r != ERR_OK)
+        return r;
+    bool gifOut = fmt == BW_FORMAT_GIF;
+    if (!gifOut && job.count > 1)
+        r = ERR_CONFIG; /* a sequence needs files */
+    else if (!(job.frames = calloc(job.count, sizeof(*job.frames))))
+        r = ERR_MEMORY;
+    if (r == ERR_OK)
+        r = runAnimation(&job, cfg, stats);
+    if (r == ERR_OK)
+        r = gifOut ? encodeGIF(job.frames, job.delays, job.count, out, outSize)
+                   : encodeBWImage(fmt, &job.frames[0], cfg, out, outSize, NULL);
+    endAnimation(&job, r, stats);
+    return r;
+}
@@ -0,0 +1,73 @@
+/*
+ * File: bw_autotune.c
+ * ---------------------------
+ * Description:
+ *   Measures this machine with libbwconvert's own kernels and writes the
+ *   host profile the library takes its defaults from (see bw_autotune() in
+ *   bw_converter.h). Run it once per machine, and again after a hardware
+ *   or library upgrade.
+ *
+ * Author: Bahey Shalash
+ * Version: 2.1.2
+ * Date: 19/04/2025
+ *
+ * Compilation:
+ *   gcc -O3 bw_autotune.c -L. -lbwconvert -pthread -o bw_autotune
+ *
+ * Usage:
+ *   ./bw_autotune [options]
+ *
+ * Options:
+ *   -o PATH   write the profile to PATH instead of $BW_PROFILE or
+ *             ~/.config/bwconvert/profile
+ *   -q        print nothing but errors
+ *   -h        show this message
+ */
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bw_converter.h"
+
+static void showUsage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "Options:\n"
+            "  -o PATH  write the profile to PATH (default: $BW_PROFILE or\n"
+            "           ~/.config/bwconvert/profile)\n"
+            "  -q       print nothing but errors\n"
+            "  -h       show this message\n",
+            prog);
+}
+
+int main(int argc, char **argv) {
+    const char *path = NULL;
+    int quiet = 0, opt;
+    while ((opt = getopt(argc, argv, "o:qh")) != -1) {
+        switch (opt) {
+            case 'o':
+                path = optarg;
+                break;
+            case 'q':
+                quiet = 1;
+                break;
+            case 'h':
+                showUsage(argv[0]);
+                return 0;
+            default:
+                showUsage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind != argc) {
+        showUsage(argv[0]);
+        return 1;
+    }
+
+    int r = bw_autotune(path, !quiet);
+    if (r == ERR_CONFIG)
+        fprintf(stderr, "BW_PROFILE=none: give the profile's path with -o\n");
+    else if (r != ERR_OK)
+        fprintf(stderr, "Could not write the profile (error %d)\n", r);
+    return r == ERR_OK ? 0 : 1;
+}
@@ -0,0 +1,588 @@
+/*
+ * File: bw_batch.c
+ * ---------------------------
+ * Description:
+ *   Batch conversion: many files in one process. A failed item is recorded
+ *   and the batch carries on.
+ *
+ *   Decoding, dithering and encoding run as three stages with their own
+ *   threads, connected by bounded lock-free queues (bw_queue.c): file N+1
+ *   decodes while N dithers and N-1 is encoded, so throughput is set by the
+ *   slowest stage rather than the sum of all three. With a single job the
+ *   stages run back to back on the caller's thread.
+ *
+ *   Items that read the same input form a group, which is decoded once.
+ *   Groups are started largest first (pixels from stbi_info times outputs),
+ *   so a big image never starts last and stretches the tail of the run.
+ *
+ *   Every stage thread owns a BWWorkspace, so gray planes, error buffers and
+ *   PNG buffers of one file are reused for the next. Packed bitmaps travel
+ *   from the dither to the encode stage and come back through a spare queue
+ *   to be reused.
+ *
+ *   File I/O goes through bw_io.c: the inputs of the next groups are read
+ *   while the current one decodes, and the encode stage encodes to memory
+ *   and leaves the write to the I/O layer, so neither stage waits on the
+ *   disk. An item is finished, and reported, once its output is written.
+ *   With an output cache open (bw_cache.c), a group's input is hashed
+ *   before decoding; items whose output is in the cache are copied from it,
+ *   and the group is decoded only if some item still has to be converted.
+ *
+ * Author: Bahey Shalash
+ * Version: 2.1.2
+ * Date: 19/04/2025
+ */
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bw_internal.h"
+#include "stb_image.h"
+
+#define MAX_WORKERS 64
+#define MIN_PREFETCH 4
+
+/* Batch.reads entry whose read is being started by another thread. */
+static char readPendingMark;
+#define READ_PENDING ((IOOp *)&readPendingMark)
+
+typedef struct {
+    int first, count; /* range of Batch.order */
+    double cost;
+} ItemGroup;
+
+/* One decoded input, shared by the items of its group. */
+typedef struct {
+    unsigned char *rgb;
+    int w, h;
+    atomic_int users; /* items that still have to dither from `rgb` */
+} Decoded;
+
+typedef struct Batch Batch;
+
+/* One item on its way through the stages. */
+typedef struct {
+    Batch *batch;
+    BWBatchItem *item;
+    Decoded *src; /* NULL: the input is converted whole (readsInputItself) */
+    BWConfig cfg;
+    BWFormat fmt;
+    BWBitmap bm;
+    ScratchBuf bits; /* owns bm.bits from the dither to the encode stage */
+    ErrorCode result;
+    uint64_t key; /* output cache entry, when `keyed` */
+    bool keyed;
+    bool cached; /* the output came from the cache: nothing to dither or encode */
+} PipeJob;
+
+struct Batch {
+    BWBatchItem *items;
+    int *order; /* item indices, grouped by input */
+    ItemGroup *groups;
+    int groupCount;
+    Decoded *decoded; /* one per group */
+    PipeJob *jobs;    /* one per item, in `order` order */
+    BWConfig cfg;
+    int threads[STAGE_COUNT];
+    bool serial; /* all stages on the caller's thread */
+    BWQueue toDither, toEncode;
+    BWQueue spare; /* encoded jobs whose bitmap buffers can be reused */
+    atomic_int nextGroup;
+    atomic_int running[STAGE_COUNT];
+    atomic_int failed;
+    double busyMs[STAGE_COUNT];
+    BWBatchCallback done;
+    void *user;
+    pthread_mutex_t lock; /* serialises `done` and busyMs */
+    BWIO *io;                /* NULL: every stage does its own file I/O */
+    BWIOMode ioMode;         /* the backend of `io`, for the stats */
+    _Atomic(IOOp *) *reads;  /* per group: its input read ahead, or NULL */
+    atomic_int nextRead;     /* first group not read ahead yet */
+    int prefetch;            /* groups read ahead of the one decoding */
+};
+
+typedef struct {
+    Batch *batch;
+    Stage stage;
+} StageArg;
+
+static double nowMs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec * 1e-6;
+}
+
+typedef struct {
+    const char *input;
+    int index;
+} InputKey;
+
+static int compareInput(const void *a, const void *b) {
+    const InputKey *x = a, *y = b;
+    int r = strcmp(x->input, y->input);
+    return r ? r : x->index - y->index;
+}
+
+static int compareCost(const void *a, const void *b) {
+    const ItemGroup *x = a, *y = b;
+    if (x->cost != y->cost)
+        return x->cost > y->cost ? -1 : 1;
+    return x->first - y->first;
+}
+
+/* Group items by input (stable within a group) and order groups by cost. */
+static ErrorCode planBatch(Batch *b, int count) {
+    b->order = malloc(count * sizeof(*b->order));
+    b->groups = malloc(count * sizeof(*b->groups));
+    if (!b->order || !b->groups)
+        return ERR_MEMORY;
+    InputKey *keys = malloc(count * sizeof(*keys));
+    if (!keys)
+        return ERR_MEMORY;
+    for (int i = 0; i < count; i++)
+        keys[i] = (InputKey){b->items[i].input, i};
+    qsort(keys, count, sizeof(*keys), compareInput);
+    for (int i = 0; i < count; i++)
+        b->order[i] = keys[i].index;
+    free(keys);
+
+    b->groupCount = 0;
+    for (int i = 0; i < count;) {
+        int j = i + 1;
+        const char *in = b->items[b->order[i]].input;
+        while (j < count && !strcmp(b->items[b->order[j]].input, in))
+            j++;
+        int w = 0, h = 0, comp;
+        double pixels = stbi_info(in, &w, &h, &comp) ? (double)w * h : 0.0;
+        b->groups[b->groupCount++] = (ItemGroup){i, j - i, pixels * (j - i)};
+        i = j;
+    }
+    qsort(b->groups, b->groupCount, sizeof(*b->groups), compareCost);
+    return ERR_OK;
+}
+
+/* A job for the next stage; the NULLs that stop a stage are not counted. */
+static void enqueue(BWQueue *q, MetricQueue gauge, PipeJob *job) {
+    metricQueue(gauge, 1);
+    queuePush(q, job);
+}
+
+static void finishJob(Batch *b, PipeJob *job) {
+    BWBatchItem *item = job->item;
+    item->result = job->result;
+    metricResult(item->result);
+    if (item->result != ERR_OK)
+        atomic_fetch_add(&b->failed, 1);
+    if (b->done) {
+        pthread_mutex_lock(&b->lock);
+        b->done(item, b->user);
+        pthread_mutex_unlock(&b->lock);
+    }
+}
+
+static void writeDone(void *user, ErrorCode result, size_t bytes, double ms) {
+    PipeJob *job = user;
+    if (result == ERR_OK) {
+        metricStage(METRIC_WRITE, ms);
+        metricBytes(0, bytes);
+    }
+    job->item->encodeMs += ms;
+    job->result = result;
+    finishJob(job->batch, job);
+}
+
+static void encodeJob(Batch *b, PipeJob *job, BWWorkspace *ws) {
+    BWBatchItem *item = job->item;
+    double t0 = nowMs();
+    unsigned char *data = NULL;
+    size_t size = 0;
+    bool encode = job->result == ERR_OK && job->src && !job->cached;
+    if (encode && b->io && !isStdioPath(item->output)) {
+        job->result = encodeBWImage(job->fmt, &job->bm, &job->cfg, &data, &size, ws);
+        if (data && job->keyed)
+            cacheStoreData(job->key, data, size);
+    } else if (encode) {
+        job->result = saveBWImage(item->output, job->fmt, &job->bm, &job->cfg, ws);
+        if (job->result == ERR_OK && job->keyed)
+            cacheStore(job->key, item->output);
+    }
+    item->encodeMs = encode ? nowMs() - t0 : 0.0;
+    if (job->bits.data) {
+        if (b->serial)
+            scratchGive(ws, SCRATCH_BITS, job->bits);
+        else if (!queueTryPush(&b->spare, job))
+            free(job->bits.data);
+        job->bm.bits = NULL;
+    }
+    if (data)
+        ioWrite(b->io, item->output, data, size, writeDone, job);
+    else
+        finishJob(b, job);
+}
+
+static void ditherJob(Batch *b, PipeJob *job, BWWorkspace *ws) {
+    BWBatchItem *item = job->item;
+    PipeJob *reuse;
+    if (!b->serial && queueTryPop(&b->spare, (void **)&reuse))
+        scratchGive(ws, SCRATCH_BITS, reuse->bits);
+
+    double t0 = nowMs();
+    Decoded *src = job->src;
+    if (!src) {
+        job->result = convertToBW(item->input, item->output, &job->cfg, NULL, ws);
+    } else if (job->result == ERR_OK && !job->cached) {
+        job->result = ditherForOutput(src->rgb, src->w, src->h, item->output, &job->cfg,
+                                      item->decodeMs, &job->fmt, &job->bm, NULL, ws);
+        if (job->result == ERR_OK)
+            job->bits = scratchTake(ws, job->bm.bits, (size_t)job->bm.stride * job->bm.h);
+    }
+    item->ditherMs = nowMs() - t0;
+    memset(ws->stageMs, 0, sizeof(ws->stageMs));
+    if (src && atomic_fetch_sub(&src->users, 1) == 1) {
+        stbi_image_free(src->rgb);
+        src->rgb = NULL;
+    }
+    if (b->serial)
+        encodeJob(b, job, ws);
+    else
+        enqueue(&b->toEncode, QUEUE_PIPELINE_ENCODE, job);
+}
+
+static bool groupDecodes(const Batch *b, int g) {
+    const ItemGroup *grp = &b->groups[g];
+    for (int k = 0; k < grp->count; k++) {
+        const BWBatchItem *item = &b->items[b->order[grp->first + k]];
+        if (!readsInputItself(item->input, item->config ? item->config : &b->cfg))
+            return true;
+    }
+    return false;
+}
+
+/* Start reading the inputs of every group up to `last` not yet started. */
+static void prefetchGroups(Batch *b, int last) {
+    if (last >= b->groupCount)
+        last = b->groupCount - 1;
+    for (int g = atomic_load(&b->nextRead); g <= last;) {
+        if (!atomic_compare_exchange_weak(&b->nextRead, &g, g + 1))
+            continue;
+        const char *in = b->items[b->order[b->groups[g].first]].input;
+        atomic_store(&b->reads[g], groupDecodes(b, g) ? ioRead(b->io, in) : NULL);
+        g++;
+    }
+}
+
+/* Group g's input as read ahead, or NULL to read it in place. */
+static unsigned char *takeInput(Batch *b, int g, size_t *size) {
+    IOOp *read = NULL;
+    if (b->reads) {
+        prefetchGroups(b, g + b->prefetch);
+        while ((read = atomic_load(&b->reads[g])) == READ_PENDING)
+            sched_yield();
+    }
+    return read ? ioReadWait(b->io, read, size) : NULL;
+}
+
+/* Copy what the output cache holds for the group's items instead of
+ * converting them; returns how many it held. */
+static int fetchCached(PipeJob *jobs, int count, const char *in,
+                       const unsigned char *data, size_t size) {
+    uint64_t input;
+    if (data)
+        input = cacheHash(data, size, 0);
+    else if (!cacheHashFile(in, &input))
+        return 0;
+    int hits = 0;
+    for (int k = 0; k < count; k++) {
+        PipeJob *job = &jobs[k];
+        const char *out = job->item->output;
+        if (!job->src || isStdioPath(out) || job->cfg.deadlineMs > 0)
+            continue;
+        job->key = cacheKey(input, &job->cfg, resolveFormat(out, &job->cfg));
+        job->keyed = true;
+        job->cached = cacheFetch(job->key, out);
+        hits += job->cached;
+    }
+    return hits;
+}
+
+/* Decode a group's input once and pass its items on. */
+static double decodeGroup(Batch *b, int g, BWWorkspace *ws) {
+    const ItemGroup *grp = &b->groups[g];
+    Decoded *src = &b->decoded[g];
+    PipeJob *jobs = &b->jobs[grp->first];
+    int users = 0;
+    for (int k = 0; k < grp->count; k++) {
+        PipeJob *job = &jobs[k];
+        job->batch = b;
+        job->item = &b->items[b->order[grp->first + k]];
+        job->cfg = job->item->config ? *job->item->config : b->cfg;
+        if (b->threads[STAGE_DITHER] > 1)
+            job->cfg.threads = 1; /* files are the parallelism; avoid oversubscription */
+        job->src = readsInputItself(job->item->input, &job->cfg) ? NULL : src;
+        job->keyed = job->cached = false;
+        job->item->decodeMs = 0.0;
+        users += job->src != NULL;
+    }
+    atomic_init(&src->users, users);
+
+    double t0 = nowMs(), busy = 0.0;
+    ErrorCode decoded = ERR_OK;
+    if (users) {
+        const char *in = jobs[0].item->input;
+        size_t size = 0;
+        unsigned char *data = takeInput(b, g, &size);
+        int hits = cacheEnabled() ? fetchCached(jobs, grp->count, in, data, size) : 0;
+        if (hits < users) {
+            src->rgb = data ? loadRGBMemory(data, size, in, &src->w, &src->h, &b->cfg)
+                            : loadRGBImage(in, &src->w, &src->h, &b->cfg);
+            decoded = src->rgb ? ERR_OK : ERR_LOAD;
+        }
+        free(data);
+        busy = nowMs() - t0;
+    }
+    bool charged = false;
+    for (int k = 0; k < grp->count; k++) {
+        PipeJob *job = &jobs[k];
+        job->result = job->src && !job->cached ? decoded : ERR_OK;
+        if (job->src && !job->cached && !charged) {
+            job->item->decodeMs = busy; /* charged to the first user */
+            charged = true;
+        }
+        if (b->serial)
+            ditherJob(b, job, ws);
+        else
+            enqueue(&b->toDither, QUEUE_PIPELINE_DITHER, job);
+    }
+    return busy;
+}
+
+/* Drop `n` threads from `stage`; when none remain, every thread of the next
+ * stage is told to stop. */
+static void leaveStage(Batch *b, Stage stage, int n) {
+    if (atomic_fetch_sub(&b->running[stage], n) != n || stage == STAGE_ENCODE)
+        return;
+    BWQueue *next = stage == STAGE_DECODE ? &b->toDither : &b->toEncode;
+    for (int i = 0; i < b->threads[stage + 1]; i++)
+        queuePush(next, NULL);
+}
+
+static void *stageWorker(void *arg) {
+    Batch *b = ((StageArg *)arg)->batch;
+    Stage stage = ((StageArg *)arg)->stage;
+    BWWorkspace ws = {0};
+    double busy = 0.0;
+    if (stage == STAGE_DECODE) {
+        for (int g; (g = atomic_fetch_add(&b->nextGroup, 1)) < b->groupCount;)
+            busy += decodeGroup(b, g, &ws);
+    } else {
+        PipeJob *job;
+        while ((job = queuePop(stage == STAGE_DITHER ? &b->toDither : &b->toEncode))) {
+            metricQueue(stage == STAGE_DITHER ? QUEUE_PIPELINE_DITHER : QUEUE_PIPELINE_ENCODE,
+                        -1);
+            double t0 = nowMs();
+            if (stage == STAGE_DITHER)
+                ditherJob(b, job, &ws);
+            else
+                encodeJob(b, job, &ws);
+            busy += nowMs() - t0;
+        }
+    }
+    workspaceFree(&ws);
+    pthread_mutex_lock(&b->lock);
+    b->busyMs[stage] += busy;
+    pthread_mutex_unlock(&b->lock);
+    if (!b->serial)
+        leaveStage(b, stage, 1);
+    return NULL;
+}
+
+/* Threads for `stage` out of n in proportion to its cost per pixel on this
+ * host (the bw_autotune profile), at least one and at most `room`. */
+static int costShare(const double *ns, long n, Stage stage, int room) {
+    double sum = ns[STAGE_DECODE] + ns[STAGE_DITHER] + ns[STAGE_ENCODE];
+    int k = (int)(n * ns[stage] / sum + 0.5);
+    return k < 1 ? 1 : k < room ? k : room;
+}
+
+/* Stage thread counts: explicit ones as given, the rest split from `jobs`,
+ * by the profile's stage costs or with half or more of the threads dithering. */
+static void planThreads(Batch *b, const BWPipelineConfig *pipe) {
+    long n = pipe->jobs > 0 ? pipe->jobs : sysconf(_SC_NPROCESSORS_ONLN);
+    n = n < 1 ? 1 : n > MAX_WORKERS ? MAX_WORKERS : n;
+    int given[STAGE_COUNT] = {pipe->decodeThreads, pipe->ditherThreads, pipe->encodeThreads};
+    b->serial = n == 1 && !given[0] && !given[1] && !given[2];
+    int quarter = n / 4 > 1 ? (int)n / 4 : 1;
+    int side = quarter, enc = quarter;
+    const double *ns = tuning()->stageNs;
+    if (ns[STAGE_DECODE] > 0.0 && ns[STAGE_ENCODE] > 0.0 && n >= STAGE_COUNT) {
+        side = costShare(ns, n, STAGE_DECODE,
+                         b->groupCount < n - 2 ? b->groupCount : (int)n - 2);
+        enc = costShare(ns, n, STAGE_ENCODE, (int)n - 1 - side);
+    }
+    side = given[STAGE_DECODE] > 0 ? given[STAGE_DECODE] : side;
+    enc = given[STAGE_ENCODE] > 0 ? given[STAGE_ENCODE] : enc;
+    int dith = given[STAGE_DITHER] > 0 ? given[STAGE_DITHER] : (int)n - side - enc;
+    b->threads[STAGE_DECODE] = side < MAX_WORKERS ? side : MAX_WORKERS;
+    b->threads[STAGE_DITHER] = dith < 1 ? 1 : dith < MAX_WORKERS ? dith : MAX_WORKERS;
+    b->threads[STAGE_ENCODE] = enc < MAX_WORKERS ? enc : MAX_WORKERS;
+    if (b->threads[STAGE_DECODE] > b->groupCount)
+        b->threads[STAGE_DECODE] = b->groupCount;
+    if (b->serial)
+        b->threads[STAGE_DECODE] = b->threads[STAGE_DITHER] = b->threads[STAGE_ENCODE] = 1;
+}
+
+static void fillStats(const Batch *b, double wallMs, BWPipelineStats *st) {
+    memset(st, 0, sizeof(*st));
+    st->wallMs = wallMs;
+    for (int s = 0; s < STAGE_COUNT; s++) {
+        st->threads[s] = b->threads[s];
+        st->busyMs[s] = b->busyMs[s];
+        st->utilisation[s] = wallMs > 0 ? b->busyMs[s] / (b->threads[s] * wallMs) : 0.0;
+    }
+    const BWQueue *queues[2] = {&b->toDither, &b->toEncode};
+    st->io = b->ioMode;
+    for (int i = 0; i < 2 && !b->serial; i++) {
+        unsigned long long pushes = atomic_load(&queues[i]->pushes);
+        st->queueCapacity[i] = (int)queues[i]->mask + 1;
+        st->meanDepth[i] = pushes ? (double)atomic_load(&queues[i]->depthSum) / pushes : 0.0;
+        st->maxDepth[i] = atomic_load(&queues[i]->depthMax);
+    }
+}
+
+static ErrorCode startQueues(Batch *b, int depth) {
+    int dither = depth > 0 ? depth : 2 * b->threads[STAGE_DITHER];
+    int encode = depth > 0 ? depth : 2 * b->threads[STAGE_ENCODE];
+    if (queueInit(&b->toDither, dither) != ERR_OK)
+        return ERR_MEMORY;
+    if (queueInit(&b->toEncode, encode) != ERR_OK)
+        return ERR_MEMORY;
+    return queueInit(&b->spare, encode + b->threads[STAGE_DITHER]);
+}
+
+/* The I/O layer, and a read-ahead window of `prefetch` groups (by default
+ * two per decode thread, at least MIN_PREFETCH). */
+static ErrorCode startIO(Batch *b, const BWPipelineConfig *pipe) {
+    atomic_init(&b->nextRead, 0);
+    b->io = ioStart(pipe->io, pipe->dropCache);
+    b->ioMode = ioMode(b->io);
+    if (!b->io || pipe->prefetch < 0)
+        return ERR_OK;
+    b->prefetch = pipe->prefetch ? pipe->prefetch : 2 * b->threads[STAGE_DECODE];
+    if (!pipe->prefetch && b->prefetch < MIN_PREFETCH)
+        b->prefetch = MIN_PREFETCH;
+    b->reads = malloc(b->groupCount * sizeof(*b->reads));
+    if (!b->reads)
+        return ERR_MEMORY;
+    for (int g = 0; g < b->groupCount; g++)
+        atomic_init(&b->reads[g], READ_PENDING);
+    return ERR_OK;
+}
+
+/* Start the stages downstream first. Returns false, with nothing left
+ * running, if the dither or encode stage got no thread at all. */
+static bool runStages(Batch *b) {
+    pthread_t threads[3 * MAX_WORKERS];
+    StageArg args[STAGE_COUNT];
+    int n = 0;
+    for (int s = STAGE_COUNT - 1; s >= 0; s--) {
+        args[s] = (StageArg){b, (Stage)s};
+        /* one extra count held here, so an early finisher cannot close the stage */
+        atomic_init(&b->running[s], b->threads[s] + 1);
+        int started = 0;
+        for (int i = 0; i < b->threads[s]; i++)
+            if (pthread_create(&threads[n], NULL, stageWorker, &args[s]) == 0)
+                n++, started++;
+        if (!started && s != STAGE_DECODE) {
+            if (s == STAGE_DITHER)
+                for (int i = 0; i < b->threads[STAGE_ENCODE]; i++)
+                    queuePush(&b->toEncode, NULL);
+            for (int i = 0; i < n; i++)
+                pthread_join(threads[i], NULL);
+            return false;
+        }
+        int missing = b->threads[s] - started;
+        if (!started) {
+            stageWorker(&args[s]); /* decode on this thread */
+            missing--;
+        }
+        b->threads[s] = started ? started : 1;
+        leaveStage(b, (Stage)s, missing + 1);
+    }
+    for (int i = 0; i < n; i++)
+        pthread_join(threads[i], NULL);
+    return true;
+}
+
+int convert_pipeline_bw(BWBatchItem *items, int count, const BWConfig *config,
+                        const BWPipelineConfig *pipeline, BWBatchCallback done, void *user,
+                        BWPipelineStats *stats) {
+    BWPipelineConfig defaults = {0};
+    Batch b = {.items = items, .cfg = *config, .done = done, .user = user};
+    if (stats)
+        memset(stats, 0, sizeof(*stats));
+    if (count <= 0)
+        return 0;
+    double t0 = nowMs();
+    ErrorCode r = planBatch(&b, count);
+    if (r == ERR_OK) {
+        b.decoded = calloc(b.groupCount, sizeof(*b.decoded));
+        b.jobs = calloc(count, sizeof(*b.jobs));
+        r = b.decoded && b.jobs ? ERR_OK : ERR_MEMORY;
+    }
+    if (!pipeline)
+        pipeline = &defaults;
+    if (r == ERR_OK) {
+        planThreads(&b, pipeline);
+        if (!b.serial)
+            r = startQueues(&b, pipeline->queueDepth);
+    }
+    if (r == ERR_OK)
+        r = startIO(&b, pipeline);
+    atomic_init(&b.nextGroup, 0);
+    atomic_init(&b.failed, 0);
+    pthread_mutex_init(&b.lock, NULL);
+
+    if (r != ERR_OK) {
+        for (int i = 0; i < count; i++)
+            items[i].result = ERR_MEMORY;
+        atomic_store(&b.failed, count);
+    } else {
+        if (b.serial || !runStages(&b)) {
+            b.serial = true;
+            b.threads[STAGE_DECODE] = b.threads[STAGE_DITHER] = b.threads[STAGE_ENCODE] = 1;
+            StageArg arg = {&b, STAGE_DECODE};
+            stageWorker(&arg);
+            for (int i = 0; i < count; i++) {
+                b.busyMs[STAGE_DITHER] += items[i].ditherMs;
+                b.busyMs[STAGE_ENCODE] += items[i].encodeMs;
+            }
+        }
+        PipeJob *job;
+        while (b.spare.cells && queueTryPop(&b.spare, (void **)&job))
+            free(job->bits.data);
+    }
+    ioFinish(b.io); /* the last items finish with their writes */
+    if (stats && r == ERR_OK)
+        fillStats(&b, nowMs() - t0, stats);
+
+    pthread_mutex_destroy(&b.lock);
+    queueFree(&b.toDither);
+    queueFree(&b.toEncode);
+    queueFree(&b.spare);
+    free(b.reads);
+    free(b.decoded);
+    free(b.jobs);
+    free(b.order);
+    free(b.groups);
+    return atomic_load(&b.failed);
+}
+
+int convert_batch_bw(BWBatchItem *items, int count, const BWConfig *config, int jobs,
+                     BWBatchCallback done, void *user) {
+    BWPipelineConfig pipe = {.jobs = jobs};
+    return convert_pipeline_bw(items, count, config, &pipe, done, user, NULL);
+}
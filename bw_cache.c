@@ -0,0 +1,389 @@
+/*
+ * File: bw_cache.c
+ * ---------------------------
+ * Description:
+ *   Content-addressed cache of converted outputs. The key is an XXH64 hash
+ *   of the input file's bytes, combined with every setting that changes the
+ *   output, the output format and the library version. On a hit, the stored
+ *   output is copied to the destination, and the input is never decoded.
+ *
+ *   Entries are plain files, DIR/xx/<key>. An entry is written to a
+ *   temporary name and renamed into place, so concurrent processes sharing
+ *   DIR only ever see complete entries. Hits are copied rather than
+ *   hardlinked, because a later write to the output would otherwise
+ *   truncate the cached entry through the shared inode. A hit refreshes the
+ *   entry's mtime, which is the LRU clock. When the size tracked by this
+ *   process passes the bound, the directory is rescanned under an flock()
+ *   and the least recently used entries are removed down to 90% of it;
+ *   each process also rescans after adding a sixteenth of the bound, which
+ *   keeps the overshoot small when several fill the cache at once.
+ *
+ *   64-bit keys are ample for files a pipeline converts itself; the cache
+ *   is not meant to hold inputs from untrusted sources.
+ *
+ * Author: Bahey Shalash
+ * Version: 2.1.2
+ * Date: 19/04/2025
+ */
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bw_internal.h"
+
+#define CACHE_LAYOUT 1 /* bump when keys or entries change meaning */
+#define CACHE_VERSION "2.1.2"
+#define DEFAULT_CACHE_BYTES (1ull << 30)
+#define STALE_TEMP_SECONDS 3600 /* a temporary left by a process that died */
+#define COPY_CHUNK (1 << 16)
+
+static struct {
+    char *dir; /* NULL: no cache */
+    unsigned long long maxBytes;
+    pthread_mutex_t lock;  /* guards the counts below */
+    unsigned long long size;  /* at the last scan, plus what was added since */
+    unsigned long long added; /* since the last scan */
+    atomic_uint temps;
+} cache = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+/* ---- XXH64 ---- */
+
+#define P1 0x9E3779B185EBCA87ull
+#define P2 0xC2B2AE3D27D4EB4Full
+#define P3 0x165667B19E3779F9ull
+#define P4 0x85EBCA77C2B2AE63ull
+#define P5 0x27D4EB2F165667C5ull
+
+static uint64_t rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t read64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static uint64_t mixRound(uint64_t acc, uint64_t in) {
+    return rotl(acc + in * P2, 31) * P1;
+}
+
+static uint64_t mergeRound(uint64_t h, uint64_t v) {
+    return (h ^ mixRound(0, v)) * P1 + P4;
+}
+
+uint64_t cacheHash(const void *data, size_t size, uint64_t seed) {
+    const unsigned char *p = data, *end = p + size;
+    uint64_t h;
+    if (size >= 32) {
+        uint64_t v[4] = {seed + P1 + P2, seed + P2, seed, seed - P1};
+        for (; p + 32 <= end; p += 32)
+            for (int i = 0; i < 4; i++)
+                v[i] = mixRound(v[i], read64(p + 8 * i));
+        h = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18);
+        for (int i = 0; i < 4; i++)
+            h = mergeRound(h, v[i]);
+    } else {
+        h = seed + P5;
+    }
+    h += size;
+    for (; p + 8 <= end; p += 8)
+        h = rotl(h ^ mixRound(0, read64(p)), 27) * P1 + P4;
+    if (p + 4 <= end) {
+        uint32_t w;
+        memcpy(&w, p, 4);
+        h = rotl(h ^ (w * P1), 23) * P2 + P3;
+        p += 4;
+    }
+    for (; p < end; p++)
+        h = rotl(h ^ (*p * P5), 11) * P1;
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    return h ^ (h >> 32);
+}
+
+bool cacheHashFile(const char *path, uint64_t *hash) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0)
+        map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+    *hash = cacheHash(map, (size_t)st.st_size, 0);
+    munmap(map, (size_t)st.st_size);
+    return true;
+}
+
+/* ---- Keys ---- */
+
+static void putField(unsigned char *buf, size_t *n, const void *v, size_t size) {
+    memcpy(buf + *n, v, size);
+    *n += size;
+}
+
+/* Settings that do not change the output bytes (verbosity, statistics
+ * tiles, threads, priority) are left out, so they do not split the cache. */
+uint64_t cacheKey(uint64_t input, const BWConfig *cfg, BWFormat fmt) {
+    unsigned char buf[256 + sizeof(cfg->levelValues) + sizeof(cfg->palette)];
+    size_t n = 0;
+    int layout = CACHE_LAYOUT;
+    int flags = cfg->invertOutput | cfg->customLevels << 1 | cfg->separateCMYK << 2 |
+                cfg->temporalDither << 3;
+    putField(buf, &n, &layout, sizeof(layout));
+    putField(buf, &n, CACHE_VERSION, sizeof(CACHE_VERSION));
+    putField(buf, &n, &input, sizeof(input));
+    putField(buf, &n, &fmt, sizeof(fmt));
+    putField(buf, &n, &flags, sizeof(flags));
+    putField(buf, &n, &cfg->brightnessThreshold, sizeof(cfg->brightnessThreshold));
+    putField(buf, &n, &cfg->dpi, sizeof(cfg->dpi));
+    putField(buf, &n, &cfg->levels, sizeof(cfg->levels));
+    if (cfg->customLevels)
+        putField(buf, &n, cfg->levelValues, sizeof(cfg->levelValues));
+    putField(buf, &n, &cfg->paletteSize, sizeof(cfg->paletteSize));
+    if (cfg->paletteSize > 0 && cfg->paletteSize <= BW_MAX_PALETTE)
+        putField(buf, &n, cfg->palette, 3 * cfg->paletteSize);
+    putField(buf, &n, &cfg->diffusionKernel, sizeof(cfg->diffusionKernel));
+    putField(buf, &n, &cfg->blackGeneration, sizeof(cfg->blackGeneration));
+    putField(buf, &n, &cfg->underColorRemoval, sizeof(cfg->underColorRemoval));
+    putField(buf, &n, &cfg->algorithm, sizeof(cfg->algorithm));
+    putField(buf, &n, &cfg->screenLpi, sizeof(cfg->screenLpi));
+    putField(buf, &n, &cfg->screenAngle, sizeof(cfg->screenAngle));
+    putField(buf, &n, &cfg->dotShape, sizeof(cfg->dotShape));
+    putField(buf, &n, &cfg->temporalTolerance, sizeof(cfg->temporalTolerance));
+    return cacheHash(buf, n, 0);
+}
+
+/* ---- Entries ---- */
+
+static bool entryPath(char *dst, size_t size, uint64_t key) {
+    int n = snprintf(dst, size, "%s/%02x/%016llx", cache.dir, (unsigned)(key >> 56),
+                     (unsigned long long)key);
+    return n > 0 && (size_t)n < size;
+}
+
+/* copy_file_range where the kernel can (it may share extents), else read
+ * and write. */
+static bool copyData(int src, int dst) {
+    bool fallback = false;
+    for (;;) {
+        ssize_t n = copy_file_range(src, NULL, dst, NULL, 1 << 30, 0);
+        if (n == 0)
+            return true;
+        if (n < 0) {
+            fallback = errno == EXDEV || errno == ENOSYS || errno == EINVAL ||
+                       errno == EOPNOTSUPP;
+            break;
+        }
+    }
+    if (!fallback)
+        return false;
+    static _Thread_local unsigned char buf[COPY_CHUNK];
+    ssize_t n;
+    while ((n = read(src, buf, sizeof(buf))) > 0)
+        for (ssize_t done = 0, w; done < n; done += w)
+            if ((w = write(dst, buf + done, n - done)) < 0)
+                return false;
+    return n == 0;
+}
+
+bool cacheEnabled(void) {
+    return cache.dir != NULL;
+}
+
+bool cacheFetch(uint64_t key, const char *out) {
+    char path[PATH_MAX];
+    if (!cache.dir || isStdioPath(out) || !entryPath(path, sizeof(path), key))
+        return false;
+    int src = open(path, O_RDONLY | O_CLOEXEC);
+    if (src < 0)
+        return false;
+    int dst = open(out, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    bool ok = dst >= 0 && copyData(src, dst);
+    if (dst >= 0 && close(dst) != 0)
+        ok = false;
+    if (ok)
+        futimens(src, NULL); /* most recently used */
+    close(src);
+    return ok; /* on failure the conversion runs and rewrites `out` */
+}
+
+typedef struct {
+    time_t used;
+    off_t size;
+    char name[24]; /* "xx/<key>" */
+} Entry;
+
+static int compareUse(const void *a, const void *b) {
+    const Entry *x = a, *y = b;
+    return (x->used > y->used) - (x->used < y->used);
+}
+
+/* Total the entries and drop the least recently used ones above the bound,
+ * under an exclusive lock; returns without doing anything if another
+ * process holds it, since that process is doing the same. */
+static void trimCache(void) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/lock", cache.dir);
+    int lock = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (lock < 0)
+        return;
+    if (flock(lock, LOCK_EX | LOCK_NB) != 0) {
+        close(lock);
+        return;
+    }
+    Entry *entries = NULL;
+    size_t count = 0, cap = 0;
+    unsigned long long total = 0;
+    time_t now = time(NULL);
+    DIR *top = opendir(cache.dir);
+    struct dirent *d;
+    while (top && (d = readdir(top))) {
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", cache.dir, d->d_name);
+        if (!strncmp(d->d_name, "tmp.", 4)) {
+            if (!stat(path, &st) && now - st.st_mtime > STALE_TEMP_SECONDS)
+                unlink(path);
+            continue;
+        }
+        if (strlen(d->d_name) != 2 || d->d_name[0] == '.')
+            continue;
+        DIR *sub = opendir(path);
+        struct dirent *e;
+        while (sub && (e = readdir(sub))) {
+            Entry entry;
+            int n = snprintf(entry.name, sizeof(entry.name), "%s/%s", d->d_name, e->d_name);
+            if (e->d_name[0] == '.' || n < 0 || (size_t)n >= sizeof(entry.name) ||
+                fstatat(dirfd(sub), e->d_name, &st, 0) || !S_ISREG(st.st_mode))
+                continue;
+            if (count == cap) {
+                size_t grown = cap ? 2 * cap : 256;
+                Entry *more = realloc(entries, grown * sizeof(*entries));
+                if (!more)
+                    break;
+                entries = more;
+                cap = grown;
+            }
+            entry.used = st.st_mtime;
+            entry.size = st.st_size;
+            entries[count++] = entry;
+            total += st.st_size;
+        }
+        if (sub)
+            closedir(sub);
+    }
+    if (top)
+        closedir(top);
+
+    if (total > cache.maxBytes) {
+        qsort(entries, count, sizeof(*entries), compareUse);
+        unsigned long long target = cache.maxBytes / 10 * 9;
+        for (size_t i = 0; i < count && total > target; i++) {
+            snprintf(path, sizeof(path), "%s/%s", cache.dir, entries[i].name);
+            if (!unlink(path))
+                total -= entries[i].size;
+        }
+    }
+    free(entries);
+    pthread_mutex_lock(&cache.lock);
+    cache.size = total;
+    cache.added = 0;
+    pthread_mutex_unlock(&cache.lock);
+    close(lock); /* releases the flock */
+}
+
+static void noteAdded(off_t size) {
+    pthread_mutex_lock(&cache.lock);
+    cache.size += size;
+    cache.added += size;
+    bool trim = cache.size > cache.maxBytes || cache.added > cache.maxBytes / 16;
+    pthread_mutex_unlock(&cache.lock);
+    if (trim)
+        trimCache();
+}
+
+/* Write an entry through a temporary file: `data`, or a copy of `from`. */
+static void storeEntry(uint64_t key, const unsigned char *data, size_t size, int from) {
+    char path[PATH_MAX], temp[PATH_MAX];
+    if (!entryPath(path, sizeof(path), key))
+        return;
+    int n = snprintf(temp, sizeof(temp), "%s/tmp.%ld.%u", cache.dir, (long)getpid(),
+                     atomic_fetch_add(&cache.temps, 1));
+    if (n < 0 || (size_t)n >= sizeof(temp))
+        return;
+    char *slash = strrchr(path, '/');
+    *slash = '\0';
+    mkdir(path, 0777);
+    *slash = '/';
+    int fd = open(temp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (fd < 0)
+        return;
+    bool ok = true;
+    if (data) {
+        for (size_t done = 0; ok && done < size;) {
+            ssize_t w = write(fd, data + done, size - done);
+            ok = w > 0;
+            done += ok ? (size_t)w : 0;
+        }
+    } else {
+        ok = copyData(from, fd);
+    }
+    struct stat st;
+    ok = !fstat(fd, &st) && close(fd) == 0 && ok;
+    if (ok && rename(temp, path) == 0)
+        noteAdded(st.st_size);
+    else
+        unlink(temp);
+}
+
+void cacheStore(uint64_t key, const char *out) {
+    if (!cache.dir || isStdioPath(out))
+        return;
+    int fd = open(out, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    storeEntry(key, NULL, 0, fd);
+    close(fd);
+}
+
+void cacheStoreData(uint64_t key, const unsigned char *data, size_t size) {
+    if (cache.dir)
+        storeEntry(key, data, size, -1);
+}
+
+int bw_cache_open(const char *dir, unsigned long long max_bytes) {
+    bw_cache_close();
+    if (!dir)
+        return ERR_OK;
+    if ((mkdir(dir, 0777) != 0 && errno != EEXIST) || access(dir, W_OK | X_OK) != 0)
+        return ERR_WRITE;
+    cache.dir = strdup(dir);
+    if (!cache.dir)
+        return ERR_MEMORY;
+    cache.maxBytes = max_bytes ? max_bytes : DEFAULT_CACHE_BYTES;
+    trimCache(); /* learn the current size, and apply a smaller bound */
+    return ERR_OK;
+}
+
+void bw_cache_close(void) {
+    free(cache.dir);
+    cache.dir = NULL;
+    cache.size = cache.added = 0;
+}
@@ -0,0 +1,360 @@
+/*
+ * File: bw_client.c
+ * ---------------------------
+ * Description:
+ *   Client for a conversion server (image_bw_converter --serve), and a load
+ *   generator for measuring one.
+ *
+ * Author: Bahey Shalash
+ * Version: 2.1.2
+ * Date: 19/04/2025
+ *
+ * Compilation:
+ *   gcc -O3 bw_client.c -L. -lbwconvert -pthread -o bw_client
+ *
+ * Usage:
+ *   ./bw_client [options] SOCKET <input> <output>
+ *   ./bw_client --bench N [-c C] [options] SOCKET <input>
+ *
+ * Options:
+ *   -o OPTIONS     server options, e.g. "threshold=100 algorithm=am format=svg";
+ *                  with deadline=MS the algorithm and scale chosen are printed
+ *   -d MS          fail with "deadline exceeded" if not started within MS
+ *   -m             send the input bytes and receive the output bytes instead
+ *                  of letting the server open the paths ("-" for stdin/stdout)
+ *   -s, --shm      like -m, but through shared memory: only control messages
+ *                  cross the socket
+ *   -r, --raw      with --shm: send the pixels of a binary PPM input and get
+ *                  packed 1-bit rows back, written as PBM; the server neither
+ *                  decodes nor encodes
+ *   --bench N      send N requests of <input> (inline or shared, output
+ *                  returned) and report throughput and latency percentiles
+ *   -c C           --bench: concurrent connections (default: 4)
+ *   -h             show this message
+ */
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bw_converter.h"
+
+#define MIN_OUTPUT_ROOM (16u << 20)
+
+typedef struct {
+    const char *socketPath;
+    BWRequest req;
+    bool shared;
+    int requests;
+    atomic_int next;
+    double *latencyMs; /* per request, in completion order */
+    atomic_int completed, busy, expired, failed;
+} Bench;
+
+static void showUsage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options] SOCKET <input> <output>\n"
+            "       %s --bench N [-c C] [options] SOCKET <input>\n"
+            "Options:\n"
+            "  -o OPTIONS  server options, e.g. \"threshold=100 algorithm=am\"\n"
+            "  -d MS       deadline: fail if not started within MS\n"
+            "  -m          send and receive the image bytes (paths may be -)\n"
+            "  -s, --shm   like -m, through shared memory\n"
+            "  -r, --raw   with --shm: PPM pixels in, 1-bit rows out as PBM\n"
+            "  --bench N   send N requests and report throughput and latency\n"
+            "  -c C        --bench: concurrent connections (default:4)\n"
+            "  -h          show this message\n",
+            prog, prog);
+}
+
+static double nowMs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static unsigned char *readFile(const char *path, size_t *size) {
+    FILE *fp = strcmp(path, "-") ? fopen(path, "rb") : stdin;
+    if (!fp)
+        return NULL;
+    size_t cap = 1 << 16, len = 0;
+    unsigned char *buf = malloc(cap);
+    for (size_t n; buf && (n = fread(buf + len, 1, cap - len, fp)) > 0;) {
+        len += n;
+        if (len == cap) {
+            unsigned char *grown = realloc(buf, cap *= 2);
+            if (!grown)
+                free(buf);
+            buf = grown;
+        }
+    }
+    if (fp != stdin)
+        fclose(fp);
+    *size = len;
+    return buf;
+}
+
+static bool writeFile(const char *path, const unsigned char *data, size_t size) {
+    FILE *fp = strcmp(path, "-") ? fopen(path, "wb") : stdout;
+    if (!fp)
+        return false;
+    bool ok = fwrite(data, 1, size, fp) == size;
+    return (fp == stdout ? fflush(fp) == 0 : fclose(fp) == 0) && ok;
+}
+
+/* The pixels of a binary PPM with maxval 255, or NULL. */
+static const unsigned char *ppmPixels(const unsigned char *data, size_t size, int *w,
+                                      int *h) {
+    long v[3];
+    size_t i = 2;
+    if (size < 2 || memcmp(data, "P6", 2))
+        return NULL;
+    for (int k = 0; k < 3; k++) {
+        for (;;) {
+            while (i < size && strchr(" \t\r\n", data[i]))
+                i++;
+            if (i >= size || data[i] != '#')
+                break;
+            while (i < size && data[i] != '\n')
+                i++;
+        }
+        for (v[k] = 0; i < size && data[i] >= '0' && data[i] <= '9' && v[k] < 1 << 20; i++)
+            v[k] = v[k] * 10 + (data[i] - '0');
+    }
+    if (v[0] < 1 || v[1] < 1 || v[0] > 65535 || v[1] > 65535 || v[2] != 255 ||
+        size - i <= (size_t)v[0] * v[1] * 3)
+        return NULL;
+    *w = (int)v[0];
+    *h = (int)v[1];
+    return data + i + 1;
+}
+
+/* Copy the input of `base` into new shared memory followed by room for the
+ * output, attach it to `fd`, and point `req` at both. */
+static bool shareInput(int fd, const BWRequest *base, BWShm *shm, BWRequest *req) {
+    size_t room = base->packed_output ? (size_t)(base->width + 7) / 8 * base->height
+                  : base->input_size > MIN_OUTPUT_ROOM / 4 ? 4 * base->input_size
+                                                           : MIN_OUTPUT_ROOM;
+    if (bw_shm_create(shm, base->input_size + room) != ERR_OK)
+        return false;
+    memcpy(shm->base, base->input, base->input_size);
+    *req = *base;
+    req->input = NULL;
+    req->shm_input = true;
+    req->input_offset = 0;
+    req->shm_output = true;
+    req->output_offset = base->input_size;
+    req->output_capacity = room;
+    return bw_attach_shm(fd, shm) == ERR_OK;
+}
+
+/* PBM uses 1 for black, packed rows 1 for white. */
+static bool writePBM(const char *path, const BWReply *reply, const unsigned char *bits) {
+    FILE *fp = strcmp(path, "-") ? fopen(path, "wb") : stdout;
+    if (!fp)
+        return false;
+    bool ok = fprintf(fp, "P4\n%d %d\n", reply->width, reply->height) > 0;
+    for (size_t i = 0; ok && i < reply->output_size; i++)
+        ok = putc(~bits[i] & 0xFF, fp) != EOF;
+    return (fp == stdout ? fflush(fp) == 0 : fclose(fp) == 0) && ok;
+}
+
+static void *benchClient(void *arg) {
+    Bench *b = arg;
+    int fd = bw_connect(b->socketPath);
+    BWShm shm = {.fd = -1};
+    BWRequest req = b->req;
+    if (fd >= 0 && b->shared && !shareInput(fd, &b->req, &shm, &req)) {
+        close(fd);
+        fd = -1;
+    }
+    while (atomic_fetch_add(&b->next, 1) < b->requests) {
+        BWReply reply;
+        double t0 = nowMs();
+        int rc = fd < 0 ? -1 : bw_request(fd, &req, &reply);
+        double ms = nowMs() - t0;
+        if (rc == 0) {
+            free(reply.output);
+            b->latencyMs[atomic_fetch_add(&b->completed, 1)] = ms;
+        } else if (rc == ERR_BUSY) {
+            atomic_fetch_add(&b->busy, 1);
+        } else if (rc == ERR_DEADLINE) {
+            atomic_fetch_add(&b->expired, 1);
+        } else {
+            atomic_fetch_add(&b->failed, 1);
+        }
+    }
+    if (fd >= 0)
+        close(fd);
+    bw_shm_destroy(&shm);
+    return NULL;
+}
+
+static int compareMs(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static int runBench(Bench *b, int clients) {
+    b->latencyMs = malloc(b->requests * sizeof(*b->latencyMs));
+    pthread_t *threads = malloc(clients * sizeof(*threads));
+    if (!b->latencyMs || !threads)
+        return EXIT_FAILURE;
+    double t0 = nowMs();
+    int started = 0;
+    while (started < clients && pthread_create(&threads[started], NULL, benchClient, b) == 0)
+        started++;
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    double wallMs = nowMs() - t0;
+
+    int ok = atomic_load(&b->completed);
+    qsort(b->latencyMs, ok, sizeof(*b->latencyMs), compareMs);
+    printf("%d requests over %d connection%s in %.1f ms: %.1f req/s\n", b->requests,
+           started, started == 1 ? "" : "s", wallMs, ok * 1e3 / wallMs);
+    printf("ok %d, busy %d, deadline %d, failed %d\n", ok, atomic_load(&b->busy),
+           atomic_load(&b->expired), atomic_load(&b->failed));
+    if (ok) {
+        static const double pct[] = {50, 90, 99, 100};
+        printf("latency ms:");
+        for (int i = 0; i < 4; i++) {
+            int k = (int)(pct[i] / 100.0 * (ok - 1) + 0.5);
+            printf(" p%g %.2f", pct[i], b->latencyMs[k]);
+        }
+        printf("\n");
+    }
+    free(threads);
+    free(b->latencyMs);
+    return ok == b->requests ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int main(int argc, char *argv[]) {
+    BWRequest req = {0};
+    bool inlineData = false, shared = false, raw = false;
+    int benchRequests = 0, clients = 4;
+
+    struct option longOpts[] = {{"bench", required_argument, 0, 'b'},
+                                {"shm", no_argument, 0, 's'},
+                                {"raw", no_argument, 0, 'r'},
+                                {0, 0, 0, 0}};
+    int opt;
+    while ((opt = getopt_long(argc, argv, "o:d:msrc:h", longOpts, NULL)) != -1) {
+        switch (opt) {
+            case 'o':
+                req.options = optarg;
+                break;
+            case 'd':
+                req.deadline_ms = (unsigned)atoi(optarg);
+                break;
+            case 'm':
+                inlineData = true;
+                break;
+            case 's':
+                shared = true;
+                break;
+            case 'r':
+                raw = true;
+                break;
+            case 'b':
+                benchRequests = atoi(optarg);
+                break;
+            case 'c':
+                clients = atoi(optarg);
+                break;
+            default:
+                showUsage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    int paths = benchRequests > 0 ? 2 : 3;
+    if (argc - optind != paths || clients < 1 || (raw && !shared)) {
+        showUsage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    const char *socketPath = argv[optind], *in = argv[optind + 1];
+    const char *out = paths == 3 ? argv[optind + 2] : NULL;
+
+    unsigned char *data = NULL;
+    char inReal[PATH_MAX], outReal[PATH_MAX];
+    if (inlineData || shared || benchRequests > 0) {
+        if (!(data = readFile(in, &req.input_size))) {
+            fprintf(stderr, "Cannot read '%s'\n", in);
+            return EXIT_FAILURE;
+        }
+        req.input = data;
+        if (raw && !(req.input = ppmPixels(data, req.input_size, &req.width, &req.height))) {
+            fprintf(stderr, "'%s' is not a binary PPM\n", in);
+            free(data);
+            return EXIT_FAILURE;
+        }
+        if (raw) {
+            req.input_size = (size_t)req.width * req.height * 3;
+            req.packed_output = true;
+        }
+    } else {
+        /* the server resolves relative paths against its own directory */
+        if (!realpath(in, inReal)) {
+            fprintf(stderr, "Cannot find '%s'\n", in);
+            return EXIT_FAILURE;
+        }
+        req.input_path = inReal;
+        req.output_path = out;
+        if (out[0] != '/' && getcwd(outReal, sizeof(outReal)) &&
+            strlen(outReal) + strlen(out) + 2 <= sizeof(outReal)) {
+            strcat(outReal, "/");
+            strcat(outReal, out);
+            req.output_path = outReal;
+        }
+    }
+
+    if (benchRequests > 0) {
+        Bench b = {.socketPath = socketPath, .req = req, .shared = shared,
+                   .requests = benchRequests};
+        int rc = runBench(&b, clients);
+        free(data);
+        return rc;
+    }
+
+    int fd = bw_connect(socketPath);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot connect to '%s'\n", socketPath);
+        free(data);
+        return EXIT_FAILURE;
+    }
+    BWShm shm = {.fd = -1};
+    BWRequest sent = req;
+    BWReply reply = {0};
+    int rc = shared && !shareInput(fd, &req, &shm, &sent) ? -1 : bw_request(fd, &sent, &reply);
+    close(fd);
+    free(data);
+    if (rc != 0) {
+        fprintf(stderr, "%s: %s\n", in, rc < 0 ? "connection failed" : bw_error_string(rc));
+        bw_shm_destroy(&shm);
+        return EXIT_FAILURE;
+    }
+    if (req.options && strstr(req.options, "deadline=")) {
+        static const char *const algos[] = {"diffusion", "am", "ordered", "threshold",
+                                            "bluenoise"};
+        fprintf(stderr, "%s: %s at 1/%d size, %.2f ms\n", in,
+                (unsigned)reply.algorithm < 5 ? algos[reply.algorithm] : "?", reply.scale,
+                reply.elapsed_ms);
+    }
+    const unsigned char *result = shared ? shm.base + sent.output_offset : reply.output;
+    bool written = true; /* by the server, without -m or --shm */
+    if (raw)
+        written = writePBM(out, &reply, result);
+    else if (inlineData || shared)
+        written = writeFile(out, result, reply.output_size);
+    free(reply.output);
+    bw_shm_destroy(&shm);
+    if (!written) {
+        fprintf(stderr, "Cannot write '%s'\n", out);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -15,63 +15,169 @@
  *   - stb_image_write.h (https://github.com/nothings/stb)
  *
  * Compilation (as shared lib):
- *   gcc -O3 -fPIC -shared -o libbwconvert.so bw_converter.c
+ *   gcc -O3 -fPIC -shared -o libbwconvert.so bw_converter.c -lm
  *
  * Usage:
  *   Used via CLI or GUI by calling:
  *     int convert_image_bw(input_path, output_path, threshold, invert, verbose);
  */
 #include "bw_converter.h"
+#include "bw_internal.h"
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 #define STB_IMAGE_WRITE_IMPLEMENTATION
+#include <limits.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <time.h>
 
 #include "stb_image_write.h"
 
-#define DEFAULT_DPI 300
 #define FS_RIGHT (7.0f / 16.0f)
 #define FS_BOTTOM (5.0f / 16.0f)
 #define FS_BOTTOM_L (3.0f / 16.0f)
 #define FS_BOTTOM_R (1.0f / 16.0f)
 
-typedef enum { ERR_OK = 0, ERR_LOAD, ERR_MEMORY, ERR_WRITE } ErrorCode;
-typedef struct {
-    int brightnessThreshold;
-    bool invertOutput;
-    bool verboseMode;
-} BWConfig;
+/* ---- "-" as stdin / stdout ---- */
 
-static ErrorCode loadGrayImage(const char *path, unsigned char **gray, int *w, int *h,
-                               const BWConfig *cfg) {
-    int channels;
-    unsigned char *rgb = stbi_load(path, w, h, &channels, 3);
+bool isStdioPath(const char *path) {
+    return path[0] == '-' && path[1] == '\0';
+}
+
+static int stdinRead(void *user, char *data, int size) {
+    return (int)fread(data, 1, size, (FILE *)user);
+}
+
+/* Pipes cannot seek, so skipping means reading and discarding. */
+static void stdinSkip(void *user, int n) {
+    char buf[4096];
+    while (n > 0) {
+        size_t got = fread(buf, 1, n < (int)sizeof(buf) ? (size_t)n : sizeof(buf), user);
+        if (!got)
+            break;
+        n -= (int)got;
+    }
+}
+
+static int stdinEof(void *user) {
+    return feof((FILE *)user) || ferror((FILE *)user);
+}
+
+static const stbi_io_callbacks STDIN_CALLBACKS = {stdinRead, stdinSkip, stdinEof};
+
+FILE *openOutput(const char *path) {
+    return isStdioPath(path) ? stdout : fopen(path, "wb");
+}
+
+bool closeOutput(FILE *fp) {
+    if (fp == stdout)
+        return fflush(fp) == 0 && !ferror(fp);
+    return fclose(fp) == 0;
+}
+
+static double nowMs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec * 1e-6;
+}
+
+static unsigned char *loaded(unsigned char *rgb, const char *path, uint64_t bytes,
+                             double t0, int w, int h, const BWConfig *cfg) {
     if (!rgb)
-        return ERR_LOAD;
+        return NULL;
+    metricStage(METRIC_DECODE, nowMs() - t0);
+    metricBytes(bytes, 0);
+    if (cfg->verboseMode)
+        fprintf(stderr, "Loaded '%s' (%dx%d)\n", path, w, h);
+    return rgb;
+}
 
-    int total = (*w) * (*h);
-    *gray = malloc(total);
-    if (!*gray) {
-        stbi_image_free(rgb);
-        return ERR_MEMORY;
+unsigned char *loadRGBImage(const char *path, int *w, int *h, const BWConfig *cfg) {
+    double t0 = nowMs();
+    int channels;
+    /* stbi_load() itself, keeping the file to see how much was read */
+    FILE *fp = isStdioPath(path) ? stdin : fopen(path, "rb");
+    if (!fp)
+        return NULL;
+    long start = ftell(fp);
+    unsigned char *rgb = fp == stdin ? stbi_load_from_callbacks(&STDIN_CALLBACKS, fp, w, h,
+                                                               &channels, 3)
+                                     : stbi_load_from_file(fp, w, h, &channels, 3);
+    long end = ftell(fp);
+    if (fp != stdin)
+        fclose(fp);
+    return loaded(rgb, path, start >= 0 && end > start ? (uint64_t)(end - start) : 0, t0,
+                  *w, *h, cfg);
+}
+
+unsigned char *loadRGBMemory(const unsigned char *data, size_t size, const char *name,
+                             int *w, int *h, const BWConfig *cfg) {
+    double t0 = nowMs();
+    int channels;
+    unsigned char *rgb =
+        size <= INT_MAX ? stbi_load_from_memory(data, (int)size, w, h, &channels, 3) : NULL;
+    return loaded(rgb, name, size, t0, *w, *h, cfg);
+}
+
+/* ---- Scratch buffers reused across files by batch workers ---- */
+
+void *scratchGet(BWWorkspace *ws, ScratchSlot slot, size_t size) {
+    if (!ws)
+        return malloc(size);
+    ScratchBuf *b = &ws->buf[slot];
+    if (b->cap < size) {
+        free(b->data);
+        b->data = malloc(size);
+        b->cap = b->data ? size : 0;
     }
+    return b->data;
+}
+
+void scratchRelease(BWWorkspace *ws, void *p) {
+    for (int i = 0; ws && i < SCRATCH_COUNT; i++)
+        if (ws->buf[i].data == p)
+            return;
+    free(p);
+}
 
-    for (int i = 0; i < total; i++) {
-        unsigned char r = rgb[3 * i], g = rgb[3 * i + 1], b = rgb[3 * i + 2];
-        (*gray)[i] = (unsigned char)(0.2126f * r + 0.7152f * g + 0.0722f * b);
+ScratchBuf scratchTake(BWWorkspace *ws, void *p, size_t size) {
+    for (int i = 0; ws && i < SCRATCH_COUNT; i++) {
+        if (ws->buf[i].data == p) {
+            ScratchBuf b = ws->buf[i];
+            ws->buf[i] = (ScratchBuf){NULL, 0};
+            return b;
+        }
     }
-    stbi_image_free(rgb);
+    return (ScratchBuf){p, size};
+}
 
-    if (cfg->verboseMode)
-        fprintf(stderr, "Loaded '%s' (%dx%d)\n", path, *w, *h);
-    return ERR_OK;
+void scratchGive(BWWorkspace *ws, ScratchSlot slot, ScratchBuf b) {
+    ScratchBuf *own = &ws->buf[slot];
+    if (own->cap >= b.cap) {
+        free(b.data);
+        return;
+    }
+    free(own->data);
+    *own = b;
 }
 
-static float *createErrorBuffer(const unsigned char *gray, int total) {
-    float *err = malloc(total * sizeof(float));
+void workspaceFree(BWWorkspace *ws) {
+    for (int i = 0; i < SCRATCH_COUNT; i++) {
+        free(ws->buf[i].data);
+        ws->buf[i].data = NULL;
+        ws->buf[i].cap = 0;
+    }
+}
+
+static float *createErrorBuffer(const unsigned char *gray, int total, BWWorkspace *ws) {
+    float *err = scratchGet(ws, SCRATCH_ERROR, total * sizeof(float));
     if (!err)
         return NULL;
     for (int i = 0; i < total; i++)
@@ -79,6 +185,74 @@ static float *createErrorBuffer(const unsigned char *gray, int total) {
     return err;
 }
 
+/* Taps of the alternative diffusion kernels, weights over `divisor`. */
+typedef struct {
+    int dx, dy, weight;
+} KernelTap;
+
+typedef struct {
+    int taps, divisor;
+    KernelTap tap[12];
+} DiffusionKernel;
+
+static const DiffusionKernel KERNELS[] = {
+    [BW_KERNEL_FS] = {4, 16, {{1, 0, 7}, {-1, 1, 3}, {0, 1, 5}, {1, 1, 1}}},
+    [BW_KERNEL_JJN] = {12,
+                       48,
+                       {{1, 0, 7},
+                        {2, 0, 5},
+                        {-2, 1, 3},
+                        {-1, 1, 5},
+                        {0, 1, 7},
+                        {1, 1, 5},
+                        {2, 1, 3},
+                        {-2, 2, 1},
+                        {-1, 2, 3},
+                        {0, 2, 5},
+                        {1, 2, 3},
+                        {2, 2, 1}}},
+    [BW_KERNEL_STUCKI] = {12,
+                          42,
+                          {{1, 0, 8},
+                           {2, 0, 4},
+                           {-2, 1, 2},
+                           {-1, 1, 4},
+                           {0, 1, 8},
+                           {1, 1, 4},
+                           {2, 1, 2},
+                           {-2, 2, 1},
+                           {-1, 2, 2},
+                           {0, 2, 4},
+                           {1, 2, 2},
+                           {2, 2, 1}}},
+    [BW_KERNEL_SIERRA] = {10,
+                          32,
+                          {{1, 0, 5},
+                           {2, 0, 3},
+                           {-2, 1, 2},
+                           {-1, 1, 4},
+                           {0, 1, 5},
+                           {1, 1, 4},
+                           {2, 1, 2},
+                           {-1, 2, 2},
+                           {0, 2, 3},
+                           {1, 2, 2}}},
+    /* Atkinson deliberately drops 2/8 of the error for higher contrast. */
+    [BW_KERNEL_ATKINSON] =
+        {6, 8, {{1, 0, 1}, {2, 0, 1}, {-1, 1, 1}, {0, 1, 1}, {1, 1, 1}, {0, 2, 1}}},
+};
+
+static void disperseKernel(float *err, int idx, float e, int w, int h,
+                           const DiffusionKernel *k) {
+    int row = idx / w, col = idx % w;
+    float unit = e / k->divisor;
+    for (int t = 0; t < k->taps; t++) {
+        int x = col + k->tap[t].dx, y = row + k->tap[t].dy;
+        if (x >= 0 && x < w && y < h)
+            err[idx + k->tap[t].dy * w + k->tap[t].dx] += unit * k->tap[t].weight;
+    }
+}
+
 static void disperseError(float *err, int idx, float e, int w, int h) {
     int row = idx / w, col = idx % w;
     if (col + 1 < w)
@@ -92,60 +266,855 @@ static void disperseError(float *err, int idx, float e, int w, int h) {
     }
 }
 
+/* Output levels of the quantiser; `index` maps a rounded value, shifted by the
+ * threshold bias, to the nearest level. */
+typedef struct {
+    int levels;
+    float value[BW_MAX_LEVELS];
+    unsigned char index[256];
+    int bias;
+} Quantizer;
+
+static bool isBilevel(const BWConfig *cfg) {
+    return cfg->levels <= 2 && !cfg->customLevels;
+}
+
+static ErrorCode initQuantizer(Quantizer *q, const BWConfig *cfg) {
+    int n = cfg->levels;
+    if (n < 2 || n > BW_MAX_LEVELS)
+        return ERR_CONFIG;
+    q->levels = n;
+    q->bias = cfg->brightnessThreshold - 128;
+    for (int k = 0; k < n; k++) {
+        if (cfg->customLevels) {
+            if (k > 0 && cfg->levelValues[k] <= cfg->levelValues[k - 1])
+                return ERR_CONFIG;
+            q->value[k] = cfg->levelValues[k];
+        } else {
+            q->value[k] = 255.0f * k / (n - 1);
+        }
+    }
+    int k = 0;
+    for (int v = 0; v < 256; v++) {
+        while (k + 1 < n && v >= (q->value[k] + q->value[k + 1]) * 0.5f)
+            k++;
+        q->index[v] = (unsigned char)k;
+    }
+    return ERR_OK;
+}
+
+/* Writes 0/255 per pixel for bilevel output, the level index otherwise. Where
+ * `hold` is 0 or 255 that output is kept and only its error is diffused. */
 static void diffuseImage(unsigned char *out, float *err, int w, int h,
-                         const BWConfig *cfg) {
-    int total = w * h;
-    for (int i = 0; i < total; i++) {
-        float old = err[i];
-        float neu = old < cfg->brightnessThreshold ? 0.0f : 255.0f;
-        out[i] = (unsigned char)neu;
-        disperseError(err, i, old - neu, w, h);
-        if (cfg->verboseMode && i % w == 0 && (i / w) % 50 == 0)
-            fprintf(stderr, "Row %d/%d\n", i / w, h);
+                         const BWConfig *cfg, const Quantizer *q,
+                         const unsigned char *hold) {
+    bool bilevel = isBilevel(cfg);
+    const DiffusionKernel *kernel =
+        cfg->diffusionKernel > BW_KERNEL_FS && cfg->diffusionKernel <= BW_KERNEL_ATKINSON
+            ? &KERNELS[cfg->diffusionKernel]
+            : NULL;
+    for (int y = 0, i = 0; y < h; y++) {
+        if (y % SCHED_ROWS == 0)
+            schedulePoint();
+        if (cfg->verboseMode && y % 50 == 0)
+            fprintf(stderr, "Row %d/%d\n", y, h);
+        for (int x = 0; x < w; x++, i++) {
+            float old = err[i], neu;
+            if (hold && hold[i] != HOLD_FREE) {
+                neu = hold[i];
+                out[i] = hold[i];
+            } else if (bilevel) {
+                neu = old < cfg->brightnessThreshold ? 0.0f : 255.0f;
+                out[i] = (unsigned char)neu;
+            } else {
+                int v = (old < 0.0f ? 0 : (int)(old + 0.5f)) - q->bias;
+                int k = q->index[v < 0 ? 0 : v > 255 ? 255 : v];
+                neu = q->value[k];
+                out[i] = (unsigned char)k;
+            }
+            if (kernel)
+                disperseKernel(err, i, old - neu, w, h, kernel);
+            else
+                disperseError(err, i, old - neu, w, h);
+        }
+    }
+}
+
+/* ---- Packed output and coverage statistics ---- */
+
+void packLevelRow(unsigned char *dst, const unsigned char *src, int w, int bpp, int top) {
+    int perByte = 8 / bpp;
+    int stride = (w * bpp + 7) / 8;
+    memset(dst, 0, stride);
+    for (int x = 0; x < w; x++) {
+        int k = top > 0 ? top - src[x] : src[x];
+        dst[x / perByte] |= (unsigned char)(k << (8 - bpp * (x % perByte + 1)));
+    }
+}
+
+/* 64 pixels starting at `x` (a multiple of 64), pixel x in bit 63; past-the-end
+ * pixels read as white. */
+static uint64_t loadPixelWord(const unsigned char *row, int x, int w) {
+    int avail = (w - x + 7) / 8;
+    uint64_t word = 0;
+    for (int i = 0; i < 8; i++)
+        word = (word << 8) | (i < avail ? row[x / 8 + i] : 0xFF);
+    if (w - x < 64)
+        word |= ~0ULL >> (w - x);
+    return word;
+}
+
+int scanBlackRuns(const unsigned char *row, int w, BWRun *runs) {
+    int n = 0, start = -1;
+    for (int base = 0; base < w; base += 64) {
+        uint64_t black = ~loadPixelWord(row, base, w);
+        int pos = 0;
+        while (pos < 64) {
+            uint64_t rest = black << pos;
+            if (start < 0) {
+                if (!rest)
+                    break;
+                pos += __builtin_clzll(rest);
+                start = base + pos;
+            } else {
+                uint64_t white = ~rest;
+                if (!white)
+                    break;
+                pos += __builtin_clzll(white);
+                if (pos >= 64)
+                    break;
+                runs[n].x0 = start;
+                runs[n++].x1 = base + pos;
+                start = -1;
+            }
+        }
+    }
+    if (start >= 0) {
+        runs[n].x0 = start;
+        runs[n++].x1 = w;
+    }
+    return n;
+}
+
+ErrorCode statsBegin(BWStats *st, int w, int h, const BWConfig *cfg) {
+    memset(st, 0, sizeof(*st));
+    st->width = w;
+    st->height = h;
+    st->frames = 1;
+    st->algorithm = cfg->algorithm;
+    st->scale = 1;
+    st->tileSize = cfg->statsTileSize > 0 ? cfg->statsTileSize : BW_DEFAULT_TILE;
+    st->tilesX = (w + st->tileSize - 1) / st->tileSize;
+    st->tilesY = (h + st->tileSize - 1) / st->tileSize;
+    st->rowBlack = calloc(h, sizeof(*st->rowBlack));
+    st->tileBlack = calloc((size_t)st->tilesX * st->tilesY, sizeof(*st->tileBlack));
+    if (!st->rowBlack || !st->tileBlack) {
+        bw_stats_free(st);
+        return ERR_MEMORY;
+    }
+    return ERR_OK;
+}
+
+ErrorCode statsAccumInit(StatsAccum *acc, int w) {
+    memset(acc, 0, sizeof(*acc));
+    acc->runs = malloc((w / 2 + 1) * sizeof(*acc->runs));
+    return acc->runs ? ERR_OK : ERR_MEMORY;
+}
+
+void statsAddRow(BWStats *st, StatsAccum *acc, const unsigned char *row, int y) {
+    int w = st->width, ts = st->tileSize;
+    unsigned int *tiles = st->tileBlack + (size_t)(y / ts) * st->tilesX;
+    unsigned int rowTotal = 0;
+    for (int tx = 0; tx < st->tilesX; tx++) {
+        int x1 = (tx + 1) * ts < w ? (tx + 1) * ts : w;
+        unsigned int black = countBlack(row, tx * ts, x1);
+        tiles[tx] += black;
+        rowTotal += black;
+    }
+    st->rowBlack[y] += rowTotal;
+    acc->black += rowTotal;
+
+    if (!rowTotal)
+        return;
+    int n = scanBlackRuns(row, w, acc->runs);
+    for (int i = 0; i < n; i++) {
+        int len = acc->runs[i].x1 - acc->runs[i].x0;
+        acc->hist[31 - __builtin_clz((unsigned int)len)]++;
+    }
+}
+
+void statsMerge(BWStats *st, StatsAccum *acc) {
+    st->blackPixels += acc->black;
+    for (int k = 0; k < BW_RUN_BINS; k++)
+        st->runHistogram[k] += acc->hist[k];
+    double area = (double)st->width * st->height;
+    st->blackFraction = area > 0 ? (double)st->blackPixels / area : 0.0;
+    free(acc->runs);
+    acc->runs = NULL;
+}
+
+/* Output stage: pack the dithered bytes and gather statistics on the way. */
+static ErrorCode packLevels(const unsigned char *idx, int w, int h,
+                            const BWConfig *cfg, const Quantizer *q, BWBitmap *bm,
+                            BWStats *stats, BWWorkspace *ws) {
+    int n = q->levels;
+    bm->bpp = n <= 2 ? 1 : n <= 4 ? 2 : 4;
+    bm->stride = (w * bm->bpp + 7) / 8;
+    bool gray = !cfg->customLevels && n == 1 << bm->bpp;
+    bm->paletteSize = gray ? 0 : n;
+    for (int k = 0; k < bm->paletteSize; k++) {
+        int v = (int)q->value[k];
+        v = cfg->invertOutput ? 255 - v : v;
+        memset(bm->palette + 3 * k, v, 3);
+    }
+    bm->bits = scratchGet(ws, SCRATCH_BITS, (size_t)bm->stride * h);
+    if (!bm->bits)
+        return ERR_MEMORY;
+    int top = gray && cfg->invertOutput ? n - 1 : 0;
+    for (int y = 0; y < h; y++)
+        packLevelRow(bm->bits + (size_t)y * bm->stride, idx + (size_t)y * w, w,
+                     bm->bpp, top);
+    if (stats) {
+        memset(stats, 0, sizeof(*stats));
+        stats->width = w;
+        stats->height = h;
     }
+    return ERR_OK;
 }
 
-static ErrorCode saveBWImage(const char *path, unsigned char *buf, int w, int h,
-                             const BWConfig *cfg) {
+static ErrorCode packOutput(const unsigned char *gray, int w, int h,
+                            const BWConfig *cfg, const Quantizer *q, BWBitmap *bm,
+                            BWStats *stats, BWWorkspace *ws) {
+    bm->w = w;
+    bm->h = h;
+    bm->bpp = 1;
+    bm->paletteSize = 0;
+    if (!isBilevel(cfg))
+        return packLevels(gray, w, h, cfg, q, bm, stats, ws);
+
+    bm->stride = (w + 7) / 8;
+    bm->bits = scratchGet(ws, SCRATCH_BITS, (size_t)bm->stride * h);
+    if (!bm->bits)
+        return ERR_MEMORY;
+
+    StatsAccum acc;
+    if (stats) {
+        if (statsAccumInit(&acc, w) != ERR_OK || statsBegin(stats, w, h, cfg) != ERR_OK) {
+            free(acc.runs);
+            scratchRelease(ws, bm->bits);
+            return ERR_MEMORY;
+        }
+    }
+
+    for (int y = 0; y < h; y++) {
+        unsigned char *row = bm->bits + (size_t)y * bm->stride;
+        packRow(row, gray + (size_t)y * w, w, cfg->invertOutput);
+        if (stats)
+            statsAddRow(stats, &acc, row, y);
+    }
+
+    if (stats)
+        statsMerge(stats, &acc);
+    return ERR_OK;
+}
+
+/* ---- PNG encoding from packed rows ---- */
+
+static unsigned char *putU32(unsigned char *o, uint32_t v) {
+    o[0] = (unsigned char)(v >> 24);
+    o[1] = (unsigned char)(v >> 16);
+    o[2] = (unsigned char)(v >> 8);
+    o[3] = (unsigned char)v;
+    return o + 4;
+}
+
+static unsigned char *putChunk(unsigned char *o, const char *tag,
+                               const unsigned char *data, uint32_t len) {
+    o = putU32(o, len);
+    memcpy(o, tag, 4);
+    if (len)
+        memcpy(o + 4, data, len);
+    uint32_t crc = crc32Update(0, o, len + 4);
+    return putU32(o + 4 + len, crc);
+}
+
+/* Encode the packed rows of `bm` (grayscale or indexed) as a PNG in memory. */
+static unsigned char *encodePackedPNG(const BWBitmap *bm, int *outLen, BWWorkspace *ws) {
+    const unsigned char *rows = bm->bits;
+    int h = bm->h, stride = bm->stride;
+    size_t rawLen = (size_t)(stride + 1) * h;
+    unsigned char *raw = scratchGet(ws, SCRATCH_RAW, rawLen);
+    if (!raw)
+        return NULL;
+    for (int y = 0; y < h; y++) {
+        raw[(size_t)y * (stride + 1)] = 0; /* filter: none */
+        memcpy(raw + (size_t)y * (stride + 1) + 1, rows + (size_t)y * stride, stride);
+    }
+    int zlen;
+    unsigned char *z =
+        stbi_zlib_compress(raw, (int)rawLen, &zlen, stbi_write_png_compression_level);
+    scratchRelease(ws, raw);
+    if (!z)
+        return NULL;
+
+    unsigned char ihdr[13];
+    putU32(ihdr, (uint32_t)bm->w);
+    putU32(ihdr + 4, (uint32_t)h);
+    ihdr[8] = (unsigned char)bm->bpp;
+    ihdr[9] = bm->paletteSize ? 3 : 0; /* indexed or grayscale */
+    ihdr[10] = ihdr[11] = ihdr[12] = 0;
+
+    static const unsigned char sig[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+    int plte = bm->paletteSize ? 12 + 3 * bm->paletteSize : 0;
+    *outLen = 8 + (12 + 13) + plte + (12 + zlen) + 12;
+    unsigned char *png = scratchGet(ws, SCRATCH_PNG, *outLen);
+    if (png) {
+        unsigned char *o = png;
+        memcpy(o, sig, 8);
+        o = putChunk(o + 8, "IHDR", ihdr, 13);
+        if (plte)
+            o = putChunk(o, "PLTE", bm->palette, 3 * bm->paletteSize);
+        o = putChunk(o, "IDAT", z, (uint32_t)zlen);
+        putChunk(o, "IEND", NULL, 0);
+    }
+    free(z);
+    return png;
+}
+
+static ErrorCode savePNGImage(const char *path, const BWBitmap *bm, const BWConfig *cfg,
+                             BWWorkspace *ws) {
+    int w = bm->w, h = bm->h;
     if (cfg->verboseMode) {
         fprintf(stderr, "Writing '%s'\n", path);
-        float mmw = (w / (float)DEFAULT_DPI) * 25.4f;
-        float mmh = (h / (float)DEFAULT_DPI) * 25.4f;
+        float mmw = (w / (float)cfg->dpi) * 25.4f;
+        float mmh = (h / (float)cfg->dpi) * 25.4f;
         fprintf(stderr, "Output: %d×%d px (~%.2f×%.2f mm)\n", w, h, mmw, mmh);
     }
-    return stbi_write_png(path, w, h, 1, buf, w) ? ERR_OK : ERR_WRITE;
+    int len;
+    double t0 = nowMs();
+    unsigned char *png = encodePackedPNG(bm, &len, ws);
+    if (!png)
+        return ERR_MEMORY;
+    double t1 = nowMs();
+    metricStage(METRIC_ENCODE, t1 - t0);
+    /* One fwrite of the whole encoded file, so pipes see large writes. */
+    FILE *fp = openOutput(path);
+    ErrorCode r = ERR_WRITE;
+    if (fp) {
+        if (fwrite(png, 1, len, fp) == (size_t)len)
+            r = ERR_OK;
+        if (!closeOutput(fp))
+            r = ERR_WRITE;
+    }
+    scratchRelease(ws, png);
+    if (r == ERR_OK) {
+        metricStage(METRIC_WRITE, nowMs() - t1);
+        metricBytes(0, (uint64_t)len);
+    }
+    return r;
 }
 
-static ErrorCode convertToBW(const char *in, const char *out, const BWConfig *cfg) {
-    unsigned char *gray = NULL;
-    int w, h;
-    ErrorCode r = loadGrayImage(in, &gray, &w, &h, cfg);
-    if (r != ERR_OK)
+bool suffixedPath(char *dst, size_t size, const char *path, const char *suffix) {
+    const char *slash = strrchr(path, '/');
+    const char *dot = strrchr(path, '.');
+    if (!dot || (slash && dot < slash))
+        dot = path + strlen(path);
+    int n = snprintf(dst, size, "%.*s%s%s", (int)(dot - path), path, suffix, dot);
+    return n > 0 && (size_t)n < size;
+}
+
+BWFormat resolveFormat(const char *path, const BWConfig *cfg) {
+    if (cfg->outputFormat != BW_FORMAT_AUTO)
+        return cfg->outputFormat;
+    if (!path)
+        return BW_FORMAT_PNG;
+    const char *ext = strrchr(path, '.');
+    if (ext && !strcasecmp(ext, ".svg"))
+        return BW_FORMAT_SVG;
+    if (ext && (!strcasecmp(ext, ".gbr") || !strcasecmp(ext, ".ger") ||
+                !strcasecmp(ext, ".gto") || !strcasecmp(ext, ".gbo")))
+        return BW_FORMAT_GERBER;
+    if (ext && !strcasecmp(ext, ".gif"))
+        return BW_FORMAT_GIF;
+    return BW_FORMAT_PNG;
+}
+
+ErrorCode ditherGrayPlane(unsigned char *gray, int w, int h, const BWConfig *cfg,
+                          const unsigned char *hold, BWBitmap *bm, BWStats *stats,
+                          BWWorkspace *ws) {
+    if (cfg->algorithm != BW_ALGO_DIFFUSION) {
+        BWScreen scr;
+        ErrorCode r = buildScreen(&scr, cfg, cfg->screenAngle);
+        if (r != ERR_OK)
+            return r;
+        r = screenImage(gray, w, h, &scr, cfg, bm, stats);
+        freeScreen(&scr);
+        return r;
+    }
+
+    Quantizer q;
+    if (initQuantizer(&q, cfg) != ERR_OK)
+        return ERR_CONFIG;
+    float *err = createErrorBuffer(gray, w * h, ws);
+    if (!err)
+        return ERR_MEMORY;
+    diffuseImage(gray, err, w, h, cfg, &q, isBilevel(cfg) ? hold : NULL);
+    scratchRelease(ws, err);
+    return packOutput(gray, w, h, cfg, &q, bm, stats, ws);
+}
+
+/* ditherGrayPlane after fitting cfg->deadlineMs; the plan goes to `stats`
+ * and `ws`. */
+static ErrorCode ditherWithDeadline(unsigned char *gray, int w, int h,
+                                    const BWConfig *cfg, BWFormat fmt, double spentMs,
+                                    BWBitmap *bm, BWStats *stats, BWWorkspace *ws) {
+    BWConfig use;
+    DeadlinePlan plan;
+    fitDeadline(gray, &w, &h, cfg, fmt, spentMs, &use, &plan);
+    ErrorCode r = ditherGrayPlane(gray, w, h, &use, NULL, bm, stats, ws);
+    if (r == ERR_OK && stats)
+        stats->scale = plan.scale;
+    if (ws)
+        ws->plan = plan;
+    return r;
+}
+
+/* Gray conversion or palette dithering of an already decoded image. */
+static ErrorCode ditherDecoded(const unsigned char *rgb, int w, int h,
+                               const BWConfig *cfg, BWFormat fmt, double spentMs,
+                               BWBitmap *bm, BWStats *stats, BWWorkspace *ws) {
+    if (cfg->paletteSize > 0) {
+        if (stats) {
+            memset(stats, 0, sizeof(*stats));
+            stats->width = w;
+            stats->height = h;
+            stats->scale = 1;
+        }
+        double t0 = nowMs();
+        ErrorCode r = ditherPalette(rgb, w, h, cfg, bm);
+        if (r == ERR_OK) {
+            metricStage(METRIC_DIFFUSE, nowMs() - t0);
+            metricPixels((uint64_t)w * h);
+        }
+        return r;
+    }
+    unsigned char *gray = scratchGet(ws, SCRATCH_GRAY, (size_t)w * h);
+    if (!gray)
+        return ERR_MEMORY;
+    double t0 = nowMs();
+    rgbToGray(rgb, gray, w * h);
+    double t1 = nowMs();
+    ErrorCode r = ditherWithDeadline(gray, w, h, cfg, fmt, spentMs + (t1 - t0), bm, stats,
+                                     ws);
+    scratchRelease(ws, gray);
+    if (r == ERR_OK) {
+        metricStage(METRIC_LUMA, t1 - t0);
+        metricStage(METRIC_DIFFUSE, nowMs() - t1);
+        metricPixels((uint64_t)w * h);
+    }
+    return r;
+}
+
+ErrorCode saveBWImage(const char *path, BWFormat fmt, const BWBitmap *bm,
+                      const BWConfig *cfg, BWWorkspace *ws) {
+    double t0 = nowMs();
+    ErrorCode r;
+    switch (fmt) {
+        case BW_FORMAT_SVG:
+            r = saveVectorImage(path, bm, VECTOR_SVG, cfg);
+            break;
+        case BW_FORMAT_GERBER:
+            r = saveVectorImage(path, bm, VECTOR_GERBER, cfg);
+            break;
+        case BW_FORMAT_GIF:
+            r = saveGIF(path, bm, NULL, 1, cfg);
+            break;
+        default:
+            return savePNGImage(path, bm, cfg, ws); /* times its own stages */
+    }
+    struct stat st;
+    if (r == ERR_OK) {
+        metricStage(METRIC_ENCODE, nowMs() - t0);
+        metricBytes(0, !isStdioPath(path) && !stat(path, &st) ? (uint64_t)st.st_size : 0);
+    }
+    return r;
+}
+
+ErrorCode encodeBWImage(BWFormat fmt, const BWBitmap *bm, const BWConfig *cfg,
+                        unsigned char **out, size_t *outSize, BWWorkspace *ws) {
+    *out = NULL;
+    *outSize = 0;
+    if (fmt != BW_FORMAT_SVG && fmt != BW_FORMAT_GERBER && fmt != BW_FORMAT_GIF) {
+        double t0 = nowMs();
+        int len;
+        unsigned char *png = encodePackedPNG(bm, &len, ws);
+        if (!png)
+            return ERR_MEMORY;
+        metricStage(METRIC_ENCODE, nowMs() - t0);
+        *out = scratchTake(ws, png, len).data;
+        *outSize = len;
+        return ERR_OK;
+    }
+    if (fmt == BW_FORMAT_GIF)
+        return encodeGIF(bm, NULL, 1, out, outSize);
+    /* the vector formats write as they encode: let them write to memory */
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *mem = open_memstream(&buf, &len);
+    if (!mem)
+        return ERR_MEMORY;
+    ErrorCode r =
+        writeVectorImage(mem, bm, fmt == BW_FORMAT_SVG ? VECTOR_SVG : VECTOR_GERBER, cfg);
+    if (fclose(mem) != 0 && r == ERR_OK)
+        r = ERR_WRITE;
+    if (r == ERR_OK) {
+        *out = (unsigned char *)buf;
+        *outSize = len;
+    } else {
+        free(buf);
+    }
+    return r;
+}
+
+static ErrorCode checkConfig(const BWConfig *cfg, BWFormat fmt) {
+    Quantizer q;
+    bool palette = cfg->paletteSize > 0;
+    bool special = palette || cfg->separateCMYK || cfg->algorithm != BW_ALGO_DIFFUSION;
+    if (initQuantizer(&q, cfg) != ERR_OK ||
+        (fmt != BW_FORMAT_PNG && (palette || !isBilevel(cfg))) ||
+        (special && !isBilevel(cfg)) || (palette && cfg->separateCMYK) ||
+        (palette && cfg->algorithm != BW_ALGO_DIFFUSION) ||
+        (cfg->separateCMYK && cfg->algorithm == BW_ALGO_THRESHOLD) ||
+        cfg->paletteSize > BW_MAX_PALETTE || cfg->blackGeneration < 0 ||
+        cfg->blackGeneration > 100 || cfg->underColorRemoval < 0 ||
+        cfg->underColorRemoval > 100)
+        return ERR_CONFIG;
+    return ERR_OK;
+}
+
+bool readsInputItself(const char *in, const BWConfig *cfg) {
+    return cfg->separateCMYK || (cfg->paletteSize == 0 && isGIFFile(in));
+}
+
+ErrorCode ditherForOutput(const unsigned char *rgb, int w, int h, const char *out,
+                          const BWConfig *cfg, double spentMs, BWFormat *fmt, BWBitmap *bm,
+                          BWStats *stats, BWWorkspace *ws) {
+    *fmt = resolveFormat(out, cfg);
+    if (checkConfig(cfg, *fmt) != ERR_OK)
+        return ERR_CONFIG;
+    int previous = schedEnter(cfg->priority);
+    ErrorCode r = ditherDecoded(rgb, w, h, cfg, *fmt, spentMs, bm, stats, ws);
+    schedLeave(previous);
+    return r;
+}
+
+ErrorCode convertDecoded(const unsigned char *rgb, int w, int h, const char *out,
+                         const BWConfig *cfg, double spentMs, BWStats *stats,
+                         BWWorkspace *ws) {
+    double t0 = nowMs();
+    BWFormat fmt;
+    BWBitmap bm;
+    ErrorCode r = ditherForOutput(rgb, w, h, out, cfg, spentMs, &fmt, &bm, stats, ws);
+    if (r == ERR_CONFIG)
         return r;
+    double t1 = nowMs();
+    if (r == ERR_OK) {
+        r = saveBWImage(out, fmt, &bm, cfg, ws);
+        scratchRelease(ws, bm.bits);
+    }
+    if (ws) {
+        ws->stageMs[STAGE_DITHER] += t1 - t0;
+        ws->stageMs[STAGE_ENCODE] += nowMs() - t1;
+    }
+    return r;
+}
 
-    int total = w * h;
-    float *err = createErrorBuffer(gray, total);
-    if (!err) {
-        free(gray);
+/* convertFile for gray output with a luma sidecar: the mapped plane when it
+ * matches the input, else a decode that leaves a sidecar for next time. */
+static ErrorCode convertWithSidecar(const char *in, const char *out, BWFormat fmt,
+                                    const BWConfig *cfg, BWStats *stats,
+                                    BWWorkspace *ws) {
+    double t0 = nowMs();
+    LumaSidecar sc;
+    int w, h;
+    unsigned char *gray = NULL;
+    if (lumaOpen(in, &sc)) {
+        w = sc.w;
+        h = sc.h;
+        gray = scratchGet(ws, SCRATCH_GRAY, (size_t)w * h);
+        if (gray)
+            memcpy(gray, sc.plane, (size_t)w * h); /* dithering overwrites it */
+        lumaClose(&sc);
+        if (gray)
+            metricStage(METRIC_DECODE, nowMs() - t0);
+        if (gray && cfg->verboseMode)
+            fprintf(stderr, "Loaded '%s' (%dx%d) from its luma sidecar\n", in, w, h);
+    } else {
+        unsigned char *rgb = loadRGBImage(in, &w, &h, cfg);
+        if (!rgb)
+            return ERR_LOAD;
+        double t1 = nowMs();
+        gray = scratchGet(ws, SCRATCH_GRAY, (size_t)w * h);
+        if (gray) {
+            rgbToGray(rgb, gray, w * h);
+            metricStage(METRIC_LUMA, nowMs() - t1);
+            lumaSave(in, &sc, gray, w, h);
+        }
+        stbi_image_free(rgb);
+    }
+    if (!gray)
         return ERR_MEMORY;
+
+    double t1 = nowMs();
+    BWBitmap bm;
+    ErrorCode r = ditherWithDeadline(gray, w, h, cfg, fmt, t1 - t0, &bm, stats, ws);
+    scratchRelease(ws, gray);
+    double t2 = nowMs();
+    if (r == ERR_OK) {
+        metricStage(METRIC_DIFFUSE, t2 - t1);
+        metricPixels((uint64_t)w * h);
+        r = saveBWImage(out, fmt, &bm, cfg, ws);
+        scratchRelease(ws, bm.bits);
     }
+    if (ws) {
+        ws->stageMs[STAGE_DECODE] += t1 - t0;
+        ws->stageMs[STAGE_DITHER] += t2 - t1;
+        ws->stageMs[STAGE_ENCODE] += nowMs() - t2;
+    }
+    return r;
+}
 
-    diffuseImage(gray, err, w, h, cfg);
-    free(err);
+/* Read `in`, or with `data` the `size` encoded bytes there (`in` then only
+ * names them in logs). */
+static ErrorCode convertFile(const char *in, const unsigned char *data, size_t size,
+                             const char *out, const BWConfig *cfg, BWStats *stats,
+                             BWWorkspace *ws) {
+    BWFormat fmt = resolveFormat(out, cfg);
+    if (checkConfig(cfg, fmt) != ERR_OK)
+        return ERR_CONFIG;
 
-    if (cfg->invertOutput)
-        for (int i = 0; i < total; i++)
-            gray[i] = 255 - gray[i];
+    if (cfg->separateCMYK)
+        return convertSeparations(in, data, size, out, fmt, cfg, stats);
+    if (cfg->paletteSize == 0 && (data ? isGIFData(data, size) : isGIFFile(in)))
+        return convertAnimation(in, data, size, out, fmt, cfg, stats);
+    if (cfg->lumaSidecar && cfg->paletteSize == 0 && !data && !isStdioPath(in))
+        return convertWithSidecar(in, out, fmt, cfg, stats, ws);
 
-    r = saveBWImage(out, gray, w, h, cfg);
-    free(gray);
+    double t0 = nowMs();
+    int w, h;
+    unsigned char *rgb =
+        data ? loadRGBMemory(data, size, in, &w, &h, cfg) : loadRGBImage(in, &w, &h, cfg);
+    if (!rgb)
+        return ERR_LOAD;
+    double spent = nowMs() - t0;
+    if (ws)
+        ws->stageMs[STAGE_DECODE] += spent;
+    ErrorCode r = convertDecoded(rgb, w, h, out, cfg, spent, stats, ws);
+    stbi_image_free(rgb);
     return r;
 }
 
+ErrorCode convertToBW(const char *in, const char *out, const BWConfig *cfg,
+                      BWStats *stats, BWWorkspace *ws) {
+    uint64_t input, key = 0;
+    bool cached = cacheEnabled() && !stats && cfg->deadlineMs <= 0 && !isStdioPath(in) &&
+                  !isStdioPath(out) && !readsInputItself(in, cfg) &&
+                  cacheHashFile(in, &input);
+    if (cached) {
+        key = cacheKey(input, cfg, resolveFormat(out, cfg));
+        if (cacheFetch(key, out)) {
+            if (cfg->verboseMode)
+                fprintf(stderr, "Copied '%s' from the cache\n", out);
+            return ERR_OK;
+        }
+    }
+    int previous = schedEnter(cfg->priority);
+    ErrorCode r = convertFile(in, NULL, 0, out, cfg, stats, ws);
+    schedLeave(previous);
+    if (cached && r == ERR_OK)
+        cacheStore(key, out);
+    return r;
+}
+
+void bw_config_init(BWConfig *config) {
+    config->brightnessThreshold = 128;
+    config->invertOutput = false;
+    config->verboseMode = false;
+    config->statsTileSize = BW_DEFAULT_TILE;
+    config->outputFormat = BW_FORMAT_AUTO;
+    config->dpi = BW_DEFAULT_DPI;
+    config->levels = 2;
+    config->customLevels = false;
+    memset(config->levelValues, 0, sizeof(config->levelValues));
+    config->paletteSize = 0;
+    memset(config->palette, 0, sizeof(config->palette));
+    config->diffusionKernel = BW_KERNEL_FS;
+    config->separateCMYK = false;
+    config->blackGeneration = 100;
+    config->underColorRemoval = 100;
+    config->algorithm = BW_ALGO_DIFFUSION;
+    config->screenLpi = BW_DEFAULT_LPI;
+    config->screenAngle = BW_DEFAULT_ANGLE;
+    config->dotShape = BW_DOT_ROUND;
+    config->threads = 0;
+    config->temporalDither = false;
+    config->temporalTolerance = 4;
+    config->priority = BW_PRIORITY_INTERACTIVE;
+    config->lumaSidecar = false;
+    config->deadlineMs = 0;
+}
+
+static int lookupName(const char *s, const char *const *names, int count) {
+    for (int i = 0; i < count; i++)
+        if (!strcasecmp(s, names[i]))
+            return i;
+    return -1;
+}
+
+ErrorCode applyJobOption(BWConfig *cfg, const char *key, const char *value) {
+    static const char *const algos[] = {"diffusion", "am", "ordered", "threshold",
+                                        "bluenoise"};
+    static const char *const formats[] = {"auto", "png", "svg", "gerber", "gif"};
+    static const char *const kernels[] = {"fs", "jjn", "stucki", "sierra", "atkinson"};
+    static const char *const dots[] = {"round", "ellipse", "line", "square"};
+    static const char *const classes[] = {"interactive", "batch"};
+    static const char *const yes[] = {"true", "1", "yes"};
+    static const char *const no[] = {"false", "0", "no"};
+    char *end;
+    long n = strtol(value, &end, 10);
+    bool isInt = *value && !*end;
+    double x = strtod(value, &end);
+    bool isReal = *value && !*end;
+    int k;
+    if (!strcmp(key, "threshold") && isInt && n >= 0 && n <= 255)
+        cfg->brightnessThreshold = (int)n;
+    else if (!strcmp(key, "invert") && lookupName(value, yes, 3) >= 0)
+        cfg->invertOutput = true;
+    else if (!strcmp(key, "invert") && lookupName(value, no, 3) >= 0)
+        cfg->invertOutput = false;
+    else if (!strcmp(key, "algorithm") && (k = lookupName(value, algos, 5)) >= 0)
+        cfg->algorithm = (BWAlgorithm)k;
+    else if (!strcmp(key, "format") && !strcasecmp(value, "gbr"))
+        cfg->outputFormat = BW_FORMAT_GERBER;
+    else if (!strcmp(key, "format") && (k = lookupName(value, formats, 5)) >= 0)
+        cfg->outputFormat = (BWFormat)k;
+    else if (!strcmp(key, "kernel") && (k = lookupName(value, kernels, 5)) >= 0)
+        cfg->diffusionKernel = (BWKernel)k;
+    else if (!strcmp(key, "dot") && (k = lookupName(value, dots, 4)) >= 0)
+        cfg->dotShape = (BWDotShape)k;
+    else if (!strcmp(key, "priority") && (k = lookupName(value, classes, 2)) >= 0)
+        cfg->priority = (BWPriority)k;
+    else if (!strcmp(key, "levels") && isInt && n >= 2 && n <= BW_MAX_LEVELS)
+        cfg->levels = (int)n;
+    else if (!strcmp(key, "dpi") && isInt && n > 0 && n <= 100000)
+        cfg->dpi = (int)n;
+    else if (!strcmp(key, "lpi") && isReal && x > 0)
+        cfg->screenLpi = x;
+    else if (!strcmp(key, "angle") && isReal)
+        cfg->screenAngle = x;
+    else if (!strcmp(key, "deadline") && isInt && n >= 0 && n <= INT_MAX)
+        cfg->deadlineMs = (int)n;
+    else
+        return ERR_CONFIG;
+    return ERR_OK;
+}
+
+const char *bw_error_string(int code) {
+    static const char *const text[] = {
+        [ERR_OK] = "ok",
+        [ERR_LOAD] = "cannot load input",
+        [ERR_MEMORY] = "out of memory",
+        [ERR_WRITE] = "cannot write output",
+        [ERR_CONFIG] = "invalid configuration",
+        [ERR_BUSY] = "server busy, retry later",
+        [ERR_DEADLINE] = "deadline exceeded",
+    };
+    return code >= 0 && code <= ERR_DEADLINE ? text[code] : "unknown error";
+}
+
+void bw_stats_free(BWStats *stats) {
+    if (!stats)
+        return;
+    free(stats->rowBlack);
+    free(stats->tileBlack);
+    stats->rowBlack = NULL;
+    stats->tileBlack = NULL;
+}
+
 int convert_image_bw(const char *input_path, const char *output_path, int threshold,
                      int invert, int verbose) {
-    BWConfig cfg = {.brightnessThreshold = threshold,
-                    .invertOutput = (invert != 0),
-                    .verboseMode = (verbose != 0)};
-    return convertToBW(input_path, output_path, &cfg);
-}
\ No newline at end of file
+    BWConfig cfg;
+    bw_config_init(&cfg);
+    cfg.brightnessThreshold = threshold;
+    cfg.invertOutput = (invert != 0);
+    cfg.verboseMode = (verbose != 0);
+    return convertToBW(input_path, output_path, &cfg, NULL, NULL);
+}
+
+int convert_image_bw_ex(const char *input_path, const char *output_path,
+                        const BWConfig *config, BWStats *stats) {
+    return convertToBW(input_path, output_path, config, stats, NULL);
+}
+
+ErrorCode convertBuffer(const unsigned char *data, size_t size, const char *out,
+                        const BWConfig *cfg, BWStats *stats, BWWorkspace *ws) {
+    if (!size)
+        return ERR_LOAD;
+    int previous = schedEnter(cfg->priority);
+    ErrorCode r = convertFile("memory", data, size, out, cfg, stats, ws);
+    schedLeave(previous);
+    return r;
+}
+
+ErrorCode encodeDecoded(const unsigned char *rgb, int w, int h, const BWConfig *cfg,
+                        double spentMs, unsigned char **out, size_t *outSize,
+                        BWStats *stats, BWWorkspace *ws) {
+    double t0 = nowMs();
+    BWFormat fmt;
+    BWBitmap bm;
+    ErrorCode r = ditherForOutput(rgb, w, h, NULL, cfg, spentMs, &fmt, &bm, stats, ws);
+    if (r != ERR_OK)
+        return r;
+    double t1 = nowMs();
+    r = encodeBWImage(fmt, &bm, cfg, out, outSize, ws);
+    scratchRelease(ws, bm.bits);
+    if (ws) {
+        ws->stageMs[STAGE_DITHER] += t1 - t0;
+        ws->stageMs[STAGE_ENCODE] += nowMs() - t1;
+    }
+    return r;
+}
+
+ErrorCode convertMemory(const unsigned char *data, size_t size, const BWConfig *cfg,
+                        unsigned char **out, size_t *outSize, BWStats *stats,
+                        BWWorkspace *ws) {
+    *out = NULL;
+    *outSize = 0;
+    if (!size)
+        return ERR_LOAD;
+    BWFormat fmt = resolveFormat(NULL, cfg);
+    if (checkConfig(cfg, fmt) != ERR_OK || cfg->separateCMYK)
+        return ERR_CONFIG; /* four planes cannot share one buffer */
+    if (cfg->paletteSize == 0 && isGIFData(data, size)) {
+        int previous = schedEnter(cfg->priority);
+        ErrorCode r = encodeAnimation(data, size, fmt, cfg, out, outSize, stats);
+        schedLeave(previous);
+        return r;
+    }
+    double t0 = nowMs();
+    int w, h;
+    unsigned char *rgb = loadRGBMemory(data, size, "memory", &w, &h, cfg);
+    if (!rgb)
+        return ERR_LOAD;
+    double spent = nowMs() - t0;
+    if (ws)
+        ws->stageMs[STAGE_DECODE] += spent;
+    ErrorCode r = encodeDecoded(rgb, w, h, cfg, spent, out, outSize, stats, ws);
+    stbi_image_free(rgb);
+    return r;
+}
+
+int convert_image_bw_mem(const unsigned char *data, size_t size, const BWConfig *config,
+                         unsigned char **output, size_t *output_size, BWStats *stats) {
+    return convertMemory(data, size, config, output, output_size, stats, NULL);
+}
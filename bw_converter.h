@@ -3,26 +3,219 @@
  * ---------------------------
  * Description:
  *   Header file for the image-to-black-and-white converter library.
- *   Exposes a single C API for use in CLI or Python GUI frontends.
+ *   Exposes a small C API for use in CLI or Python GUI frontends.
  *
  * Author: Bahey Shalash
  * Version: 1.0
  * Date: 19/04/2025
  *
- * Function:
+ * Functions:
  *   int convert_image_bw(const char *input_path,
  *                        const char *output_path,
  *                        int threshold,
  *                        int invert,
  *                        int verbose);
+ *   int convert_image_bw_ex(const char *input_path,
+ *                           const char *output_path,
+ *                           const BWConfig *config,
+ *                           BWStats *stats);
+ *   int convert_image_bw_mem(const unsigned char *data, size_t size,
+ *                            const BWConfig *config,
+ *                            unsigned char **output,
+ *                            size_t *output_size, BWStats *stats);
+ *   int convert_y4m_bw(FILE *input, FILE *output,
+ *                      const BWConfig *config,
+ *                      BWStats *stats);
+ *   int convert_batch_bw(BWBatchItem *items, int count,
+ *                        const BWConfig *config, int jobs,
+ *                        BWBatchCallback done, void *user);
+ *   int convert_pipeline_bw(BWBatchItem *items, int count,
+ *                           const BWConfig *config,
+ *                           const BWPipelineConfig *pipeline,
+ *                           BWBatchCallback done, void *user,
+ *                           BWPipelineStats *stats);
+ *   int convert_watch_bw(const char *in_dir, const char *out_dir,
+ *                        const BWConfig *config, int jobs,
+ *                        int debounce_ms, BWBatchCallback done,
+ *                        void *user,
+ *                        const volatile sig_atomic_t *stop);
+ *   void bw_set_threads(int threads);
+ *   void bw_set_executor(const BWExecutor *executor);
+ *   void bw_shutdown(void);
+ *   const char *bw_isa(void);
+ *   void bw_queue_latency(BWLatency latency[BW_PRIORITY_COUNT],
+ *                         int reset);
+ *   int convert_manifest_bw(const char *manifest_path,
+ *                           const char *results_path,
+ *                           const BWConfig *defaults,
+ *                           const BWPipelineConfig *pipeline,
+ *                           int *failed, BWPipelineStats *stats);
+ *   int convert_shard_bw(const char *manifest_path,
+ *                        const char *work_dir,
+ *                        const char *results_path,
+ *                        const BWConfig *defaults,
+ *                        const BWPipelineConfig *pipeline,
+ *                        int lease_seconds, int *failed,
+ *                        const volatile sig_atomic_t *stop);
+ *   int convert_serve_bw(const char *socket_path,
+ *                        const BWConfig *defaults, int jobs,
+ *                        int queue_depth,
+ *                        const volatile sig_atomic_t *stop,
+ *                        BWLatency latency[BW_PRIORITY_COUNT]);
+ *   int bw_connect(const char *socket_path);
+ *   int bw_shm_create(BWShm *shm, size_t size);
+ *   void bw_shm_destroy(BWShm *shm);
+ *   int bw_attach_shm(int fd, const BWShm *shm);
+ *   int bw_request(int fd, const BWRequest *request, BWReply *reply);
+ *   int bw_metrics_write(FILE *fp);
+ *   int bw_metrics_serve(int port);
+ *   int bw_metrics_dump(const char *path, int interval_ms);
+ *   void bw_metrics_stop(void);
+ *   int bw_cache_open(const char *dir,
+ *                     unsigned long long max_bytes);
+ *   void bw_cache_close(void);
+ *   int bw_autotune(const char *path, int verbose);
  */
 #ifndef BW_CONVERTER_H
 #define BW_CONVERTER_H
 
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* Number of run-length histogram bins; bin k counts runs of length [2^k, 2^(k+1)). */
+#define BW_RUN_BINS 32
+#define BW_DEFAULT_TILE 64
+#define BW_DEFAULT_DPI 300
+#define BW_MAX_LEVELS 16
+#define BW_MAX_PALETTE 256
+#define BW_DEFAULT_LPI 50.0
+#define BW_DEFAULT_ANGLE 45.0
+
+/* ERR_CONFIG: invalid settings or a combination the output cannot represent.
+ * ERR_BUSY and ERR_DEADLINE only come from a conversion server. */
+typedef enum {
+    ERR_OK = 0,
+    ERR_LOAD,
+    ERR_MEMORY,
+    ERR_WRITE,
+    ERR_CONFIG,
+    ERR_BUSY,     /* the server's job queue is full */
+    ERR_DEADLINE, /* the request's deadline passed before it could run */
+} ErrorCode;
+
+/* Output file format; BW_FORMAT_AUTO picks one from the output extension. */
+typedef enum {
+    BW_FORMAT_AUTO = 0,
+    BW_FORMAT_PNG,
+    BW_FORMAT_SVG,    /* black pixels as merged rectangles */
+    BW_FORMAT_GERBER, /* RS-274X regions, one per merged rectangle */
+    BW_FORMAT_GIF,    /* two-colour GIF, animated for multi-frame input */
+} BWFormat;
+
+/* Error diffusion kernel; palette mode always uses Floyd–Steinberg. With
+ * CMYK separations each plane uses its own kernel. */
+typedef enum {
+    BW_KERNEL_FS = 0,
+    BW_KERNEL_JJN, /* Jarvis–Judice–Ninke */
+    BW_KERNEL_STUCKI,
+    BW_KERNEL_SIERRA,
+    BW_KERNEL_ATKINSON,
+} BWKernel;
+
+/* How gray is turned into dots. */
+typedef enum {
+    BW_ALGO_DIFFUSION = 0, /* error diffusion with diffusionKernel */
+    BW_ALGO_AM,            /* clustered-dot halftone screen */
+    BW_ALGO_ORDERED,       /* 8x8 Bayer ordered dither, fastest patterned mode */
+    BW_ALGO_THRESHOLD,     /* plain brightnessThreshold cut, no dithering; not
+                              with separateCMYK, whose planes would print dot-on-dot */
+    BW_ALGO_BLUE_NOISE,    /* 64x64 blue-noise threshold tile: no visible pattern,
+                              as cheap as ordered */
+} BWAlgorithm;
+
+typedef enum { BW_DOT_ROUND = 0, BW_DOT_ELLIPSE, BW_DOT_LINE, BW_DOT_SQUARE } BWDotShape;
+
+/* Scheduling class. Batch conversions give way to interactive ones at row-band
+ * boundaries, and only run on cores interactive work leaves idle. */
+typedef enum {
+    BW_PRIORITY_INTERACTIVE = 0,
+    BW_PRIORITY_BATCH,
+    BW_PRIORITY_COUNT
+} BWPriority;
+
+typedef struct {
+    int brightnessThreshold;
+    bool invertOutput;
+    bool verboseMode;
+    int statsTileSize; /* edge of the square tiles used for per-tile counts */
+    BWFormat outputFormat;
+    int dpi;    /* physical pixel pitch for vector output */
+    int levels; /* output gray levels, 2..BW_MAX_LEVELS */
+    bool customLevels; /* use levelValues instead of evenly spaced levels */
+    unsigned char levelValues[BW_MAX_LEVELS]; /* ascending, `levels` entries */
+    int paletteSize; /* > 0: dither RGB to `palette`, write an indexed PNG */
+    unsigned char palette[3 * BW_MAX_PALETTE]; /* RGB triplets */
+    BWKernel diffusionKernel;
+    bool separateCMYK;     /* write _c/_m/_y/_k planes instead of one image */
+    int blackGeneration;   /* % (0-100) of the common CMY gray replaced by K (GCR) */
+    int underColorRemoval; /* % (0-100) of the generated K removed from CMY (UCR) */
+    BWAlgorithm algorithm;
+    double screenLpi;   /* AM screen frequency in lines per inch at `dpi` */
+    double screenAngle; /* AM screen angle in degrees (K plane with CMYK); picks the
+                           tile phase for ordered and blue noise */
+    BWDotShape dotShape;
+    int threads; /* pool threads one conversion may use, 0 = all (bw_set_threads) */
+    bool temporalDither;   /* animations: keep output where the frame is static */
+    int temporalTolerance; /* max luma change still considered static */
+    BWPriority priority;
+    bool lumaSidecar; /* keep the gray plane next to the input and reuse it */
+    int deadlineMs; /* > 0: still images step down from `algorithm` (diffusion,
+                       blue noise, ordered, threshold) and then to a smaller
+                       preview until the estimated time fits; see BWStats */
+} BWConfig;
+
+/**
+ * Ink-coverage statistics of the final 1-bit output (after inversion).
+ * Only bilevel output is measured; for levels or palettes the counts stay zero.
+ * With separateCMYK the per-row/tile counts describe the K plane; for
+ * animations they are summed over all frames.
+ * Filled as a by-product of packing the output rows; arrays are owned by
+ * the struct and released with bw_stats_free().
+ */
+typedef struct {
+    int width, height;
+    int frames; /* frames summed into the counts (1 for still images) */
+    unsigned long long blackPixels;
+    double blackFraction;
+    unsigned int *rowBlack; /* black pixels per row, `height` entries */
+    int tileSize, tilesX, tilesY;
+    unsigned int *tileBlack; /* black pixels per tile, row-major tilesX*tilesY */
+    unsigned long long runHistogram[BW_RUN_BINS]; /* horizontal black runs */
+    double separationCoverage[4]; /* C, M, Y, K ink fraction with separateCMYK */
+    BWAlgorithm algorithm; /* the one used; deadlineMs may pick a cheaper one */
+    int scale; /* 1, or N when deadlineMs shrank the output to 1/N per side */
+} BWStats;
+
+/** Fill `config` with the defaults used by convert_image_bw(). */
+void bw_config_init(BWConfig *config);
+
+/**
+ * Load a built-in palette ("rgb8", "ega16", "gray4") into `config`.
+ * @return 0 on success, ERR_CONFIG for an unknown name
+ */
+int bw_palette_preset(const char *name, BWConfig *config);
+
+/** Short description of an ErrorCode, e.g. "cannot load input". */
+const char *bw_error_string(int code);
+
+/** Release the arrays held by `stats` (the struct itself is not freed). */
+void bw_stats_free(BWStats *stats);
+
 /**
  * Convert a color image to 1‑bit black-and-white PNG using
  * Floyd–Steinberg dithering.
@@ -37,8 +230,401 @@ extern "C" {
 int convert_image_bw(const char *input_path, const char *output_path, int threshold,
                      int invert, int verbose);
 
+/**
+ * Same as convert_image_bw() but driven by a full configuration.
+ *
+ * @param config  conversion settings (see bw_config_init)
+ * @param stats   if non-NULL, receives ink-coverage statistics
+ * @return ERR_OK on success, another ErrorCode on failure
+ */
+int convert_image_bw_ex(const char *input_path, const char *output_path,
+                        const BWConfig *config, BWStats *stats);
+
+/**
+ * Convert an encoded image held in memory to an encoded output in memory,
+ * in config->outputFormat (PNG for BW_FORMAT_AUTO). Animated GIFs work;
+ * CMYK separations and image sequences need files (ERR_CONFIG).
+ *
+ * @param output  receives a malloc'd buffer the caller frees
+ * @return ERR_OK on success, another ErrorCode on failure
+ */
+int convert_image_bw_mem(const unsigned char *data, size_t size, const BWConfig *config,
+                         unsigned char **output, size_t *output_size, BWStats *stats);
+
+/**
+ * Dither a YUV4MPEG2 (Y4M) video frame by frame. Only the 8-bit Y plane is
+ * used. Each frame is written to `output` as `height` rows of (width + 7) / 8
+ * bytes, MSB-first, 1 = white, with no header or padding between frames.
+ * Frames are read, dithered and written in a pipeline across threads; the
+ * screen-based algorithms (ordered, threshold) are the fastest. The streams
+ * are used as given: a caller that wants large stdio buffers sets them with
+ * setvbuf before the first read or write.
+ *
+ * @param config  bilevel settings only (no levels, palette or CMYK)
+ * @param stats   if non-NULL, receives coverage summed over all frames
+ * @return ERR_OK on success, another ErrorCode on failure
+ */
+int convert_y4m_bw(FILE *input, FILE *output, const BWConfig *config, BWStats *stats);
+
+/** One file of a batch; `result` (an ErrorCode) and the timings are filled in. */
+typedef struct {
+    const char *input;
+    const char *output;
+    const BWConfig *config; /* per-item settings, NULL for the batch's */
+    int result;
+    double decodeMs; /* 0 when the decode was shared with an earlier item */
+    double ditherMs;
+    double encodeMs; /* PNG/vector encoding and writing */
+} BWBatchItem;
+
+/** Called once per finished item; calls are serialised, never concurrent. */
+typedef void (*BWBatchCallback)(const BWBatchItem *item, void *user);
+
+/**
+ * Convert many files in one process on `jobs` threads (0 = all cores).
+ * This is convert_pipeline_bw with the stage threads split automatically.
+ *
+ * @param done  optional progress callback
+ * @return the number of items that failed
+ */
+int convert_batch_bw(BWBatchItem *items, int count, const BWConfig *config, int jobs,
+                     BWBatchCallback done, void *user);
+
+/* How a batch reads its inputs and writes its outputs. */
+typedef enum {
+    BW_IO_AUTO = 0, /* io_uring where the kernel allows it, else I/O threads */
+    BW_IO_URING,    /* reported only; as a setting it means BW_IO_AUTO */
+    BW_IO_THREADS,  /* pread()/pwrite() on a few I/O threads */
+    BW_IO_SYNC,     /* each stage reads or writes its own files, no read-ahead */
+} BWIOMode;
+
+/* Threads of the decode, dither and encode stages of a batch; 0 = automatic. */
+typedef struct {
+    int jobs;          /* total threads to split among automatic stages (0 = all cores) */
+    int decodeThreads;
+    int ditherThreads;
+    int encodeThreads;
+    int queueDepth;    /* slots per stage queue (0 = twice the consumer threads) */
+    BWIOMode io;
+    int prefetch;      /* inputs read ahead of the decoders (0 = automatic, < 0 = none) */
+    bool dropCache;    /* evict files from the page cache once read or written */
+} BWPipelineConfig;
+
+/* Where a batch spent its time; arrays are in stage order decode, dither,
+ * encode, and queue arrays are decode->dither, dither->encode. */
+typedef struct {
+    int threads[3];
+    double busyMs[3];      /* summed over the stage's threads */
+    double utilisation[3]; /* busyMs / (threads * wallMs) */
+    int queueCapacity[2];  /* 0 when the batch ran on one thread */
+    double meanDepth[2];   /* items queued, sampled at every push */
+    int maxDepth[2];
+    double wallMs;
+    BWIOMode io; /* the backend that did the file I/O */
+} BWPipelineStats;
+
+/**
+ * Convert many files with decoding, dithering and encoding as separate
+ * stages joined by bounded queues, so file N+1 decodes while N dithers and
+ * N-1 is encoded. A failure is recorded in its item and does not stop the
+ * batch. Items with the same input are decoded once, and the largest
+ * inputs are started first. With a single job everything runs on the
+ * calling thread.
+ *
+ * @param pipeline  stage threads and queue depth (NULL = all automatic)
+ * @param done      optional progress callback
+ * @param stats     if non-NULL, receives stage utilisation and queue depths
+ * @return the number of items that failed
+ */
+int convert_pipeline_bw(BWBatchItem *items, int count, const BWConfig *config,
+                        const BWPipelineConfig *pipeline, BWBatchCallback done, void *user,
+                        BWPipelineStats *stats);
+
+/**
+ * Run the jobs listed in a manifest through convert_pipeline_bw. The manifest is
+ * CSV (optional header; columns input, output, threshold, invert, algorithm,
+ * format) or JSON Lines with the same keys; empty fields take `defaults`.
+ * A malformed record fails on its own. One result per record, in manifest
+ * order, goes to `results_path`: JSON Lines when it ends in .jsonl/.json,
+ * CSV otherwise, "-" for stdout. It holds the status and stage timings.
+ *
+ * @param failed  if non-NULL, receives the number of records that failed
+ * @param stats   optional, as for convert_pipeline_bw
+ * @return ERR_LOAD if the manifest cannot be read, ERR_WRITE if the results
+ *         cannot be written, otherwise ERR_OK (item failures are in *failed)
+ */
+int convert_manifest_bw(const char *manifest_path, const char *results_path,
+                        const BWConfig *defaults, const BWPipelineConfig *pipeline,
+                        int *failed, BWPipelineStats *stats);
+
+/**
+ * Run a manifest as one of any number of workers, on one machine or many,
+ * that share `work_dir` (e.g. over NFS) and nothing else. Workers claim
+ * chunks of records with lease files, renew them while converting, and
+ * take over the chunks of a worker whose lease stops being renewed. Each
+ * worker returns when every chunk is done, after writing the results of
+ * the whole manifest to `results_path` as convert_manifest_bw does;
+ * several workers writing the same file each replace it whole. Start every
+ * worker with the same manifest, results format and lease length.
+ *
+ * @param work_dir       created if missing; use a fresh one per job
+ * @param lease_seconds  how long a lease survives without renewal
+ *                       (0 = 60); longer than any stall of a live worker
+ * @param failed         if non-NULL, receives the number of records this
+ *                       worker converted that failed
+ * @param stop           optional; once non-zero, no further chunks are
+ *                       claimed and no results are written
+ * @return ERR_OK, ERR_LOAD if the manifest cannot be read, ERR_CONFIG if
+ *         `work_dir` belongs to a different job, ERR_WRITE if it or the
+ *         results cannot be written
+ */
+int convert_shard_bw(const char *manifest_path, const char *work_dir,
+                     const char *results_path, const BWConfig *defaults,
+                     const BWPipelineConfig *pipeline, int lease_seconds, int *failed,
+                     const volatile sig_atomic_t *stop);
+
+/**
+ * Hot folder: convert every file that appears in or changes in `in_dir`
+ * into `out_dir` (as the whole name plus the format's extension, so a.png
+ * and a.jpg give a.png.png and a.jpg.png), until *stop becomes non-zero,
+ * e.g. from a signal handler. A file is converted
+ * once it has been closed and left alone for `debounce_ms`, and only if its
+ * content hash differs from the last conversion. Existing files with a
+ * missing or older output are converted at start. Linux (inotify) only.
+ *
+ * @param jobs  persistent worker threads (0 = all cores)
+ * @param done  called after every conversion, serialised
+ * @return ERR_OK once stopped, ERR_LOAD if `in_dir` cannot be watched,
+ *         ERR_CONFIG where inotify is unavailable
+ */
+int convert_watch_bw(const char *in_dir, const char *out_dir, const BWConfig *config,
+                     int jobs, int debounce_ms, BWBatchCallback done, void *user,
+                     const volatile sig_atomic_t *stop);
+
+/* Runs the library's parallel work on the host application's threads. */
+typedef struct {
+    /* Run fn(arg) on some thread, now or later; fn never blocks for long. */
+    void (*submit)(void (*fn)(void *arg), void *arg, void *context);
+    void *context;
+    int threads; /* parallelism to use, the submitting thread included */
+} BWExecutor;
+
+/**
+ * Size the library's shared thread pool (0 = all cores). AM bands, CMYK
+ * planes and GIF frames all draw from it, nested or not, so they never run
+ * more threads than this in total. BWConfig.threads can only narrow a
+ * single conversion further. Call while no conversion is running.
+ */
+void bw_set_threads(int threads);
+
+/**
+ * Hand the parallel work to `executor` instead of the built-in pool, whose
+ * threads are stopped; NULL restores the pool. Call while no conversion is
+ * running.
+ */
+void bw_set_executor(const BWExecutor *executor);
+
+/** Stop the pool threads; the next conversion starts them again. */
+void bw_shutdown(void);
+
+/**
+ * The instruction set of the per-pixel kernels in use: "scalar", "sse2",
+ * "avx2", "avx512" or "neon". The best one the CPU runs is picked when the
+ * library is loaded; BW_ISA set to one of these names forces it, if the CPU
+ * runs it. Every variant produces the same output.
+ */
+const char *bw_isa(void);
+
+/* Queueing latency of one scheduling class: how long work waited for a thread. */
+typedef struct {
+    unsigned long long count;
+    double meanMs, p50Ms, p99Ms, maxMs; /* percentiles within about 10% */
+} BWLatency;
+
+/**
+ * Queueing latency per class (indexed by BWPriority) of the pool's tasks:
+ * the time from a parallel stage handing out work until another thread
+ * picks it up. Counts since start-up or the last call with `reset`.
+ */
+void bw_queue_latency(BWLatency latency[BW_PRIORITY_COUNT], int reset);
+
+/**
+ * Conversion server: answer requests on the Unix socket `socket_path`
+ * (created, and removed on return) until *stop becomes non-zero. Requests
+ * carry an input path or the encoded input itself, options as
+ * "key=value ..." text (threshold, invert, algorithm, format, kernel, dot,
+ * priority, levels, dpi, lpi, angle, deadline) applied over `defaults`, an
+ * optional deadline, and an output path or none to get the output back (PNG
+ * unless a format is given). Paths are opened by the server, relative to its
+ * directory. The priority option picks the class: interactive requests go
+ * first, with one worker of their own, and batch requests only use idle
+ * cores. The deadline option is a latency budget (BWConfig.deadlineMs)
+ * counted from receipt; the reply says which algorithm and scale it chose.
+ *
+ * @param jobs         worker threads, each with its own warm buffers
+ *                     (0 = all cores), plus one for interactive requests only
+ * @param queue_depth  requests of each class that may wait for a worker
+ *                     (0 = 4 per worker); beyond it requests fail at once
+ *                     with ERR_BUSY
+ * @param latency      optional, receives the queueing latency per class
+ *                     (receipt until a worker starts the request)
+ * @return ERR_OK once stopped, ERR_CONFIG if `socket_path` exists and is not
+ *         a socket left by a server that has exited, ERR_LOAD if the socket
+ *         cannot be created
+ */
+int convert_serve_bw(const char *socket_path, const BWConfig *defaults, int jobs,
+                     int queue_depth, const volatile sig_atomic_t *stop,
+                     BWLatency latency[BW_PRIORITY_COUNT]);
+
+/* One request to a conversion server. The input is a path, bytes sent along,
+ * or a range of attached shared memory; so is the output, or it comes back. */
+typedef struct {
+    const char *input_path;     /* read by the server; NULL: send `input` */
+    const unsigned char *input; /* encoded image, `input_size` bytes */
+    size_t input_size;
+    const char *output_path;    /* written by the server; NULL: returned */
+    const char *options;        /* "threshold=100 algorithm=am", or NULL */
+    unsigned int deadline_ms;   /* fail with ERR_DEADLINE if not started
+                                   within this long; 0 = no deadline */
+    /* shared memory from bw_attach_shm(), instead of the above */
+    bool shm_input;             /* input_size bytes at input_offset */
+    size_t input_offset;
+    int width, height;          /* > 0: the input is raw RGB, 3 bytes a pixel */
+    bool shm_output;            /* write at most output_capacity bytes at
+                                   output_offset */
+    size_t output_offset, output_capacity;
+    bool packed_output;         /* 1-bit rows, (width + 7) / 8 bytes each,
+                                   MSB first, 1 = white; no file format */
+} BWRequest;
+
+/* The answer to a request. */
+typedef struct {
+    unsigned char *output; /* malloc'd output bytes unless written to a path
+                              or shared memory (the caller frees it) */
+    size_t output_size;    /* bytes returned or written to shared memory */
+    int width, height;     /* packed output only */
+    double elapsed_ms;     /* receipt until answered, on the server */
+    BWAlgorithm algorithm; /* how it was dithered (option deadline= may step down) */
+    int scale;             /* 1, or N when a deadline shrank the output to 1/N */
+} BWReply;
+
+/* A memfd mapped by the client, to share with a server. */
+typedef struct {
+    int fd;
+    unsigned char *base;
+    size_t size;
+} BWShm;
+
+/** Connect to a server; returns the socket descriptor, or -1. */
+int bw_connect(const char *socket_path);
+
+/**
+ * Create `size` bytes of shared memory, sealed so it can no longer shrink.
+ * @return ERR_OK, or ERR_MEMORY
+ */
+int bw_shm_create(BWShm *shm, size_t size);
+
+/** Unmap and close shared memory from bw_shm_create(). */
+void bw_shm_destroy(BWShm *shm);
+
+/**
+ * Let the server map `shm` for the requests that follow on this connection,
+ * replacing any memory attached before. Image data then stays out of the
+ * socket: requests name ranges of the memory to read from and write to.
+ *
+ * @return ERR_OK, ERR_CONFIG if the server refuses the memory, or -1 if the
+ *         connection failed
+ */
+int bw_attach_shm(int fd, const BWShm *shm);
+
+/**
+ * Send one request on a connection from bw_connect() and wait for the
+ * answer. A connection can be reused for any number of requests.
+ *
+ * @param reply  optional, receives the output and its size
+ * @return the server's ErrorCode (ERR_BUSY when its queue is full, ERR_WRITE
+ *         when the output does not fit in shared memory), or -1 if the
+ *         connection failed
+ */
+int bw_request(int fd, const BWRequest *request, BWReply *reply);
+
+/**
+ * Write the library's metrics in the Prometheus text format: per-image
+ * stage latency histograms (decode, luma, diffuse, encode, write), pixels
+ * and bytes processed in total and per second since the previous report,
+ * job outcomes by ErrorCode, queue depths of the server, batch pipeline
+ * and watcher, and peak resident memory. Counters are per thread, so
+ * recording them costs no locks or shared cache lines.
+ *
+ * @return ERR_OK, or ERR_WRITE
+ */
+int bw_metrics_write(FILE *fp);
+
+/**
+ * Answer HTTP GET /metrics on 127.0.0.1:`port` from a background thread
+ * until bw_metrics_stop().
+ *
+ * @return ERR_OK, ERR_LOAD if the port cannot be bound, ERR_CONFIG if
+ *         already serving
+ */
+int bw_metrics_serve(int port);
+
+/**
+ * Rewrite `path` with the metrics every `interval_ms` (0 = 10 s) from a
+ * background thread until bw_metrics_stop(), which writes it a last time.
+ * Each write replaces the file whole.
+ *
+ * @return ERR_OK, ERR_WRITE if `path` cannot be written, ERR_CONFIG if
+ *         already dumping
+ */
+int bw_metrics_dump(const char *path, int interval_ms);
+
+/** Stop the exporters started by bw_metrics_serve() and bw_metrics_dump(). */
+void bw_metrics_stop(void);
+
+/**
+ * Keep converted outputs in `dir`, keyed by a hash of the input bytes, the
+ * settings that affect the output, the output format and the library
+ * version. A later file-to-file conversion with the same key (single,
+ * batch, manifest, watch or server) copies the stored output and skips
+ * decoding. Conversions that return statistics, read standard input,
+ * write standard output or produce several files (CMYK separations,
+ * animated GIF input) bypass the cache. Entries beyond `max_bytes`
+ * (0 = 1 GiB) are evicted least recently used first. Any number of
+ * processes may share `dir`. Call while no conversion is running.
+ *
+ * @param dir  created if missing; NULL closes the cache
+ * @return ERR_OK, or ERR_WRITE if `dir` cannot be created or written
+ */
+int bw_cache_open(const char *dir, unsigned long long max_bytes);
+
+/** Stop using the cache; its directory is left as it is. */
+void bw_cache_close(void);
+
+/**
+ * Measure this host and write its profile: the pool size past which more
+ * threads stop paying, the least height of a screening band, the cost of
+ * each batch stage (which splits batch threads between them) and the
+ * deadline cost profile, all timed on synthetic images in a few seconds.
+ *
+ * The library reads a profile the first time it needs one of these
+ * defaults: $BW_PROFILE, else $XDG_CONFIG_HOME/bwconvert/profile (by
+ * default ~/.config/bwconvert/profile), else /etc/bwconvert/profile;
+ * BW_PROFILE=none reads none. A profile is used only on the CPU model and
+ * core count it was measured on; elsewhere, or without one, the static
+ * defaults apply. bw_set_threads() and explicit pipeline thread counts
+ * still win. The new profile is read by processes started afterwards.
+ * Call while no conversion is running; bw_set_threads() is left at 0.
+ *
+ * @param path     where to write; NULL for the first of the paths above
+ * @param verbose  report each measurement on stderr
+ * @return ERR_OK, ERR_WRITE if `path` cannot be written, ERR_CONFIG for
+ *         NULL with BW_PROFILE=none
+ */
+int bw_autotune(const char *path, int verbose);
+
 #ifdef __cplusplus
 }
 #endif
 
-#endif /* BW_CONVERTER_H */
\ No newline at end of file
+#endif /* BW_CONVERTER_H */
@@ -0,0 +1,271 @@
+/*
+ * File: bw_deadline.c
+ * ---------------------------
+ * Description:
+ *   Deadline-driven choice of algorithm (BWConfig.deadlineMs). Once a still
+ *   image is decoded to gray, the rest of the work is estimated as pixels
+ *   times a per-host cost for the algorithm, the kernel and the output
+ *   format. The best algorithm that fits what is left of the budget is used:
+ *   the configured one, then the cheaper ones after it in order of quality,
+ *   error diffusion, blue noise, ordered and threshold (AM steps down to
+ *   threshold). When not even the cheapest fits, the gray plane is
+ *   box-filtered to 1/2, 1/4 or 1/8 per side first: a smaller preview
+ *   rather than a late one.
+ *
+ *   Costs are measured once per process, the first time a deadline is used,
+ *   by dithering a synthetic 256-pixel-wide plane with every algorithm and
+ *   kernel, and encoding the results the first time each format is asked
+ *   for (some 30 ms with PNG, which the server spends at start-up), unless
+ *   the host's bw_autotune profile already holds them. Estimates are padded
+ *   by a quarter, since real images vary around the calibration.
+ *
+ * Author: Bahey Shalash
+ * Version: 2.1.2
+ * Date: 19/04/2025
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bw_internal.h"
+
+#define CAL_SIZE 256
+#define CAL_ROWS (4 * CAL_SIZE) /* screens: tall enough that tile set-up is noise */
+#define CAL_RUNS 2
+#define SAFETY 1.25
+#define MAX_SCALE 8
+#define MIN_SIDE 16 /* no preview is shrunk below this */
+
+static const char *const ALGO_NAME[ALGO_COUNT] = {"diffusion", "am", "ordered",
+                                                  "threshold", "blue noise"};
+
+static DeadlineCosts profile;
+static pthread_once_t profileOnce = PTHREAD_ONCE_INIT;
+/* encoders are timed the first time their format is used */
+static BWBitmap sample[ALGO_COUNT]; /* each algorithm's calibration output */
+static bool encodeKnown[FORMAT_COUNT];
+static pthread_mutex_t encodeLock = PTHREAD_MUTEX_INITIALIZER;
+
+static double nowMs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec * 1e-6;
+}
+
+/* Average `scale` x `scale` blocks. Block (x, y) only reads pixels at or
+ * after its own index, so the plane can shrink in place. */
+static void shrinkPlane(unsigned char *gray, int w, int h, int scale, int *nw, int *nh) {
+    *nw = w / scale > 0 ? w / scale : 1;
+    *nh = h / scale > 0 ? h / scale : 1;
+    int bw = w < scale ? w : scale, bh = h < scale ? h : scale, area = bw * bh;
+    for (int y = 0; y < *nh; y++) {
+        for (int x = 0; x < *nw; x++) {
+            const unsigned char *src = gray + (size_t)y * bh * w + (size_t)x * bw;
+            int sum = 0;
+            for (int j = 0; j < bh; j++)
+                for (int i = 0; i < bw; i++)
+                    sum += src[(size_t)j * w + i];
+            gray[(size_t)y * *nw + x] = (unsigned char)((sum + area / 2) / area);
+        }
+    }
+}
+
+/* ns per pixel of the fastest of CAL_RUNS ditherings of the top `rows`;
+ * the output of the last is left in *bm (NULL: freed). */
+static double timeDither(const unsigned char *plane, unsigned char *work, int rows,
+                         const BWConfig *cfg, BWBitmap *bm) {
+    double best = 0.0;
+    for (int run = 0; run < CAL_RUNS; run++) {
+        BWBitmap out;
+        memcpy(work, plane, (size_t)CAL_SIZE * rows);
+        double t0 = nowMs();
+        if (ditherGrayPlane(work, CAL_SIZE, rows, cfg, NULL, &out, NULL, NULL) != ERR_OK)
+            return 0.0;
+        double ms = nowMs() - t0;
+        best = run == 0 || ms < best ? ms : best;
+        if (bm && run == CAL_RUNS - 1)
+            *bm = out;
+        else
+            free(out.bits);
+    }
+    return best * 1e6 / ((double)CAL_SIZE * rows);
+}
+
+/* Costs of every algorithm and kernel into *c; each algorithm's output is
+ * left in out[] for timing the encoders. */
+static void measureDither(DeadlineCosts *c, BWBitmap *out) {
+    unsigned char *plane = malloc(CAL_SIZE * CAL_ROWS);
+    unsigned char *work = malloc(CAL_SIZE * CAL_ROWS);
+    if (!plane || !work) {
+        free(plane);
+        free(work);
+        return; /* all costs stay 0: everything fits */
+    }
+    /* a gradient under light noise, somewhere between a flat graphic and a
+     * grainy photo */
+    uint32_t seed = 1;
+    for (int i = 0; i < CAL_SIZE * CAL_ROWS; i++) {
+        seed = seed * 1664525u + 1013904223u;
+        int v = (i % CAL_SIZE) * 256 / CAL_SIZE + (int)(seed >> 29) - 4;
+        plane[i] = (unsigned char)(v < 0 ? 0 : v > 255 ? 255 : v);
+    }
+
+    BWConfig cfg;
+    bw_config_init(&cfg);
+    for (int a = BW_ALGO_AM; a < ALGO_COUNT; a++) {
+        cfg.algorithm = (BWAlgorithm)a;
+        c->screenNs[a] = timeDither(plane, work, CAL_ROWS, &cfg, &out[a]);
+    }
+    /* the other kernels cost a fixed multiple of Floyd–Steinberg: a strip will do */
+    cfg.algorithm = BW_ALGO_DIFFUSION;
+    for (int k = BW_KERNEL_JJN; k < KERNEL_COUNT; k++) {
+        cfg.diffusionKernel = (BWKernel)k;
+        c->kernelNs[k] = timeDither(plane, work, CAL_SIZE / 4, &cfg, NULL);
+    }
+    cfg.diffusionKernel = BW_KERNEL_FS;
+    c->kernelNs[BW_KERNEL_FS] =
+        timeDither(plane, work, CAL_ROWS, &cfg, &out[BW_ALGO_DIFFUSION]);
+
+    memcpy(work, plane, CAL_SIZE * CAL_SIZE);
+    int nw, nh;
+    double t0 = nowMs();
+    shrinkPlane(work, CAL_SIZE, CAL_SIZE, 2, &nw, &nh);
+    c->shrinkNs = (nowMs() - t0) * 1e6 / (CAL_SIZE * CAL_SIZE);
+    free(plane);
+    free(work);
+}
+
+/* Encoding a sixteenth and a quarter of each sample splits the time into a
+ * fixed part and a part per pixel. */
+static void measureEncoder(DeadlineCosts *c, const BWBitmap *samples, BWFormat fmt) {
+    BWConfig cfg;
+    bw_config_init(&cfg);
+    for (int a = 0; a < ALGO_COUNT; a++) {
+        if (!samples[a].bits)
+            continue;
+        int rows[2] = {CAL_ROWS / 16, CAL_ROWS / 4};
+        double ms[2];
+        for (int part = 0; part < 2; part++) {
+            BWBitmap view = samples[a];
+            view.h = rows[part];
+            double t0 = nowMs();
+            saveBWImage("/dev/null", fmt, &view, &cfg, NULL);
+            ms[part] = nowMs() - t0;
+        }
+        double perPixel = (ms[1] - ms[0]) / ((double)CAL_SIZE * (rows[1] - rows[0]));
+        perPixel = perPixel > 0.0 ? perPixel : 0.0;
+        double fixed = ms[0] - perPixel * CAL_SIZE * rows[0];
+        c->encodeNs[a][fmt] = perPixel * 1e6;
+        c->encodeFixedMs[a][fmt] = fixed > 0.0 ? fixed : 0.0;
+    }
+}
+
+/* A profile from bw_autotune saves measuring in every process. */
+static void calibrate(void) {
+    const Tuning *t = tuning();
+    if (!t->haveCosts) {
+        measureDither(&profile, sample);
+        return;
+    }
+    profile = t->costs;
+    for (int f = 0; f < FORMAT_COUNT; f++)
+        encodeKnown[f] = true;
+}
+
+static void calibrateEncoder(BWFormat fmt) {
+    pthread_mutex_lock(&encodeLock);
+    if (!encodeKnown[fmt])
+        measureEncoder(&profile, sample, fmt);
+    encodeKnown[fmt] = true;
+    pthread_mutex_unlock(&encodeLock);
+}
+
+void measureDeadline(DeadlineCosts *costs) {
+    BWBitmap own[ALGO_COUNT];
+    memset(costs, 0, sizeof(*costs));
+    memset(own, 0, sizeof(own));
+    measureDither(costs, own);
+    for (int f = BW_FORMAT_PNG; f < FORMAT_COUNT; f++)
+        measureEncoder(costs, own, (BWFormat)f);
+    for (int a = 0; a < ALGO_COUNT; a++)
+        free(own[a].bits);
+}
+
+void warmDeadline(void) {
+    pthread_once(&profileOnce, calibrate);
+    calibrateEncoder(BW_FORMAT_PNG);
+}
+
+/* cfg's algorithm, then the cheaper ones after it in order of quality;
+ * screens need bilevel output, so levels only get smaller previews. */
+static int ladderFrom(const BWConfig *cfg, BWAlgorithm *ladder) {
+    static const BWAlgorithm QUALITY[] = {BW_ALGO_DIFFUSION, BW_ALGO_BLUE_NOISE,
+                                          BW_ALGO_ORDERED, BW_ALGO_THRESHOLD};
+    int n = 0, from = 2; /* AM: only threshold is cheaper */
+    ladder[n++] = cfg->algorithm;
+    if (cfg->levels > 2 || cfg->customLevels)
+        return n;
+    for (int i = 0; i < 4; i++)
+        if (QUALITY[i] == cfg->algorithm)
+            from = i;
+    for (int i = from + 1; i < 4; i++)
+        ladder[n++] = QUALITY[i];
+    return n;
+}
+
+static double pixelCost(const BWConfig *cfg, BWAlgorithm algo, BWFormat fmt) {
+    if (algo == BW_ALGO_DIFFUSION)
+        return profile.kernelNs[cfg->diffusionKernel] + profile.encodeNs[algo][fmt];
+    /* screens ran on the whole pool when calibrated */
+    double share = 1.0;
+    if (cfg->threads > 0 && cfg->threads < poolThreads())
+        share = (double)poolThreads() / cfg->threads;
+    return profile.screenNs[algo] * share + profile.encodeNs[algo][fmt];
+}
+
+void fitDeadline(unsigned char *gray, int *w, int *h, const BWConfig *cfg, BWFormat fmt,
+                 double spentMs, BWConfig *use, DeadlinePlan *plan) {
+    *use = *cfg;
+    *plan = (DeadlinePlan){.algorithm = cfg->algorithm, .scale = 1};
+    if (cfg->deadlineMs <= 0 || (unsigned)cfg->algorithm >= ALGO_COUNT ||
+        (unsigned)cfg->diffusionKernel >= KERNEL_COUNT || (unsigned)fmt >= FORMAT_COUNT)
+        return;
+    fmt = fmt == BW_FORMAT_AUTO ? BW_FORMAT_PNG : fmt;
+    double t0 = nowMs();
+    pthread_once(&profileOnce, calibrate);
+    calibrateEncoder(fmt);
+    spentMs += nowMs() - t0;
+
+    BWAlgorithm ladder[ALGO_COUNT];
+    int steps = ladderFrom(cfg, ladder);
+    double left = cfg->deadlineMs - spentMs;
+    double input = (double)*w * *h;
+    for (int scale = 1;; scale *= 2) {
+        int sw = *w / scale > 0 ? *w / scale : 1, sh = *h / scale > 0 ? *h / scale : 1;
+        double shrink = scale > 1 ? input * profile.shrinkNs : 0.0;
+        bool last = scale * 2 > MAX_SCALE || *w / (scale * 2) < MIN_SIDE ||
+                    *h / (scale * 2) < MIN_SIDE;
+        int pick = -1;
+        for (int i = 0; i < steps && pick < 0; i++) {
+            double ns = shrink + (double)sw * sh * pixelCost(cfg, ladder[i], fmt);
+            plan->estimateMs = (ns / 1e6 + profile.encodeFixedMs[ladder[i]][fmt]) * SAFETY;
+            if (plan->estimateMs <= left || (last && i == steps - 1))
+                pick = i;
+        }
+        if (pick >= 0) {
+            plan->algorithm = ladder[pick];
+            plan->scale = scale;
+            break;
+        }
+    }
+
+    use->algorithm = plan->algorithm;
+    if (plan->scale > 1)
+        shrinkPlane(gray, *w, *h, plan->scale, w, h);
+    if (cfg->verboseMode)
+        fprintf(stderr, "Deadline %d ms, %.1f ms spent: %s at %dx%d (1/%d), about %.1f ms\n",
+                cfg->deadlineMs, spentMs, ALGO_NAME[plan->algorithm], *w, *h, plan->scale,
+                plan->estimateMs);
+}
@@ -0,0 +1,404 @@
+/*
+ * File: bw_internal.h
+ * ---------------------------
+ * Description:
+ *   Declarations shared between the translation units of libbwconvert.
+ *   Not installed and not part of the public API (see bw_converter.h).
+ */
+#ifndef BW_INTERNAL_H
+#define BW_INTERNAL_H
+
+#include "bw_converter.h"
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define BW_HIDDEN __attribute__((visibility("hidden")))
+
+/* `hold` value of a pixel that is dithered normally (see ditherGrayPlane). */
+#define HOLD_FREE 1
+
+/* Output rows packed MSB-first as stored in a PNG. With bpp == 1 and no
+ * palette, 1 = white; otherwise samples are gray levels or palette indices. */
+typedef struct {
+    int w, h, stride;
+    int bpp;         /* 1, 2, 4 or 8 bits per pixel */
+    int paletteSize; /* 0 for grayscale */
+    unsigned char palette[3 * 256];
+    unsigned char *bits;
+} BWBitmap;
+
+typedef struct {
+    int x0, x1; /* half-open pixel span */
+} BWRun;
+
+/* Partial coverage counts of one worker; rowBlack/tileBlack are written in
+ * place, so concurrent workers must own disjoint rows of whole tiles. */
+typedef struct {
+    unsigned long long black;
+    unsigned long long hist[BW_RUN_BINS];
+    BWRun *runs;
+} StatsAccum;
+
+/* Periodic threshold tile: a pixel is white when gray >= thr[y % size][x % size]. */
+typedef struct {
+    int size;
+    unsigned char *thr;
+} BWScreen;
+
+typedef enum { VECTOR_SVG, VECTOR_GERBER } VectorKind;
+
+/* Grow-only per-worker buffers, so a batch does not reallocate the large
+ * per-image planes for every file. Each slot has one user at a time. */
+typedef enum {
+    SCRATCH_GRAY,
+    SCRATCH_ERROR,
+    SCRATCH_BITS,
+    SCRATCH_RAW, /* filtered PNG rows */
+    SCRATCH_PNG,
+    SCRATCH_COUNT
+} ScratchSlot;
+
+typedef struct {
+    void *data;
+    size_t cap;
+} ScratchBuf;
+
+typedef enum { STAGE_DECODE, STAGE_DITHER, STAGE_ENCODE, STAGE_COUNT } Stage;
+
+/* What cfg->deadlineMs chose for a conversion (see bw_deadline.c). */
+typedef struct {
+    BWAlgorithm algorithm;
+    int scale;         /* the output is 1/scale of the input per side */
+    double estimateMs; /* predicted dither and encode time */
+} DeadlinePlan;
+
+#define ALGO_COUNT (BW_ALGO_BLUE_NOISE + 1)
+#define KERNEL_COUNT (BW_KERNEL_ATKINSON + 1)
+#define FORMAT_COUNT (BW_FORMAT_GIF + 1)
+
+/* ns per output pixel, or per input pixel for shrinkNs. Encoding is timed
+ * on each algorithm's own output: a screen's repeating tile deflates far
+ * faster than diffusion noise. */
+typedef struct {
+    double screenNs[ALGO_COUNT];
+    double kernelNs[KERNEL_COUNT];
+    double encodeNs[ALGO_COUNT][FORMAT_COUNT];
+    double encodeFixedMs[ALGO_COUNT][FORMAT_COUNT]; /* set-up, whatever the size */
+    double shrinkNs;
+} DeadlineCosts;
+
+/* bw_tune.c: this host's defaults, from the profile bw_autotune writes. A
+ * field left 0 (no profile, or none for this host) keeps the static default. */
+typedef struct {
+    int threads;                 /* pool size unless bw_set_threads() */
+    int bandRows;                /* least rows per screening band */
+    double stageNs[STAGE_COUNT]; /* per pixel: splits batch threads between stages */
+    bool haveCosts;              /* `costs` replace the deadline calibration */
+    DeadlineCosts costs;
+} Tuning;
+
+BW_HIDDEN const Tuning *tuning(void);
+
+typedef struct {
+    ScratchBuf buf[SCRATCH_COUNT];
+    double stageMs[STAGE_COUNT]; /* accumulated by conversions using this workspace */
+    DeadlinePlan plan;           /* set by the last conversion with a deadline */
+} BWWorkspace;
+
+/* With ws == NULL these are plain malloc/free. */
+BW_HIDDEN void *scratchGet(BWWorkspace *ws, ScratchSlot slot, size_t size);
+BW_HIDDEN void scratchRelease(BWWorkspace *ws, void *p);
+BW_HIDDEN void workspaceFree(BWWorkspace *ws);
+/* Hand a buffer from scratchGet (or plain malloc) to another owner: the
+ * workspace forgets it and the caller frees it or gives it to another
+ * workspace, which keeps the larger of it and its own buffer. */
+BW_HIDDEN ScratchBuf scratchTake(BWWorkspace *ws, void *p, size_t size);
+BW_HIDDEN void scratchGive(BWWorkspace *ws, ScratchSlot slot, ScratchBuf b);
+
+BW_HIDDEN ErrorCode statsBegin(BWStats *st, int w, int h, const BWConfig *cfg);
+BW_HIDDEN ErrorCode statsAccumInit(StatsAccum *acc, int w);
+BW_HIDDEN void statsAddRow(BWStats *st, StatsAccum *acc, const unsigned char *row,
+                           int y);
+/* Fold `acc` into `st`, refresh blackFraction and release the accumulator. */
+BW_HIDDEN void statsMerge(BWStats *st, StatsAccum *acc);
+
+/* Collect the black runs of a packed row into `runs` (capacity w/2 + 1). */
+BW_HIDDEN int scanBlackRuns(const unsigned char *row, int w, BWRun *runs);
+
+/* bw_converter.c: "-" names stdin for input and stdout for output. */
+BW_HIDDEN bool isStdioPath(const char *path);
+BW_HIDDEN FILE *openOutput(const char *path);
+/* fclose, or only fflush for stdout; false on any write error. */
+BW_HIDDEN bool closeOutput(FILE *fp);
+/* Set one per-job option by name (threshold, invert, algorithm, format,
+ * kernel, dot, priority, levels, dpi, lpi, angle) from its text value, as in
+ * manifests and server requests. ERR_CONFIG for unknown names or values. */
+BW_HIDDEN ErrorCode applyJobOption(BWConfig *cfg, const char *key, const char *value);
+/* convert_image_bw_mem with a workspace. */
+BW_HIDDEN ErrorCode convertMemory(const unsigned char *data, size_t size,
+                                  const BWConfig *cfg, unsigned char **out,
+                                  size_t *outSize, BWStats *stats, BWWorkspace *ws);
+/* convertToBW from `size` encoded bytes at `data` instead of an input file. */
+BW_HIDDEN ErrorCode convertBuffer(const unsigned char *data, size_t size, const char *out,
+                                  const BWConfig *cfg, BWStats *stats, BWWorkspace *ws);
+
+/* bw_converter.c: pipeline stages shared with the other modes. */
+BW_HIDDEN unsigned char *loadRGBImage(const char *path, int *w, int *h,
+                                      const BWConfig *cfg);
+/* loadRGBImage from the bytes of a file already read; `name` is for logs. */
+BW_HIDDEN unsigned char *loadRGBMemory(const unsigned char *data, size_t size,
+                                       const char *name, int *w, int *h,
+                                       const BWConfig *cfg);
+/* Dither `gray` (overwritten) with cfg's algorithm and levels, then pack it.
+ * `hold` (optional, bilevel diffusion only) pins pixels to 0 or 255. */
+BW_HIDDEN ErrorCode ditherGrayPlane(unsigned char *gray, int w, int h,
+                                    const BWConfig *cfg, const unsigned char *hold,
+                                    BWBitmap *bm, BWStats *stats, BWWorkspace *ws);
+/* "dir/name.png" + "_k" -> "dir/name_k.png" */
+BW_HIDDEN bool suffixedPath(char *dst, size_t size, const char *path,
+                            const char *suffix);
+BW_HIDDEN ErrorCode saveBWImage(const char *path, BWFormat fmt, const BWBitmap *bm,
+                                const BWConfig *cfg, BWWorkspace *ws);
+/* saveBWImage into a malloc'd buffer, for a write done elsewhere. */
+BW_HIDDEN ErrorCode encodeBWImage(BWFormat fmt, const BWBitmap *bm, const BWConfig *cfg,
+                                  unsigned char **out, size_t *outSize, BWWorkspace *ws);
+/* One whole conversion; bitmaps come from `ws` (optional) and are released
+ * with scratchRelease. */
+BW_HIDDEN ErrorCode convertToBW(const char *in, const char *out, const BWConfig *cfg,
+                                BWStats *stats, BWWorkspace *ws);
+/* The dither half of convertDecoded: check `cfg` against the format of
+ * `out` (NULL: a buffer) and dither into `bm`; saveBWImage is the other
+ * half. `spentMs` of cfg->deadlineMs went on decoding. */
+BW_HIDDEN ErrorCode ditherForOutput(const unsigned char *rgb, int w, int h,
+                                    const char *out, const BWConfig *cfg, double spentMs,
+                                    BWFormat *fmt, BWBitmap *bm, BWStats *stats,
+                                    BWWorkspace *ws);
+/* The part of convertToBW after decoding, so one decode can feed several
+ * outputs. Not for inputs where readsInputItself() (CMYK, animated GIF). */
+BW_HIDDEN ErrorCode convertDecoded(const unsigned char *rgb, int w, int h,
+                                   const char *out, const BWConfig *cfg, double spentMs,
+                                   BWStats *stats, BWWorkspace *ws);
+/* convertDecoded into a buffer from encodeBWImage instead of a file. */
+BW_HIDDEN ErrorCode encodeDecoded(const unsigned char *rgb, int w, int h,
+                                  const BWConfig *cfg, double spentMs, unsigned char **out,
+                                  size_t *outSize, BWStats *stats, BWWorkspace *ws);
+BW_HIDDEN bool readsInputItself(const char *in, const BWConfig *cfg);
+/* The format `out` gets: cfg->outputFormat, else from its extension (PNG
+ * for a NULL `out`, output to memory). */
+BW_HIDDEN BWFormat resolveFormat(const char *out, const BWConfig *cfg);
+
+/* Pack per-pixel indices at `bpp` bits per pixel; `top` > 0 mirrors them. */
+BW_HIDDEN void packLevelRow(unsigned char *dst, const unsigned char *src, int w,
+                            int bpp, int top);
+
+/* bw_palette.c: RGB error diffusion to cfg->palette, packed as indexed rows. */
+BW_HIDDEN ErrorCode ditherPalette(const unsigned char *rgb, int w, int h,
+                                  const BWConfig *cfg, BWBitmap *bm);
+
+/* bw_simd.c: per-pixel kernels, in the best instruction-set variant the CPU
+ * runs (or BW_ISA's), chosen once at load time. */
+BW_HIDDEN void rgbToGray(const unsigned char *rgb, unsigned char *gray, int total);
+/* White (1) where gray >= thr, packed MSB-first. */
+BW_HIDDEN void screenRow(unsigned char *dst, const unsigned char *gray,
+                         const unsigned char *thr, int w, unsigned char flip);
+/* The top bit of each byte of `src` (0 or 255 per pixel), packed MSB-first. */
+BW_HIDDEN void packRow(unsigned char *dst, const unsigned char *src, int w, bool invert);
+BW_HIDDEN uint32_t crc32Update(uint32_t crc, const unsigned char *p, size_t len);
+/* Black pixels (zero bits) in [x0, x1) of a packed row. */
+BW_HIDDEN unsigned int countBlack(const unsigned char *row, int x0, int x1);
+
+/* bw_screen.c: threshold-tile screening, parallel over row bands. */
+BW_HIDDEN ErrorCode buildAMScreen(BWScreen *scr, const BWConfig *cfg, double angleDeg);
+/* The tile for cfg->algorithm (AM, ordered, blue noise or threshold). */
+BW_HIDDEN ErrorCode buildScreen(BWScreen *scr, const BWConfig *cfg, double angleDeg);
+BW_HIDDEN void freeScreen(BWScreen *scr);
+/* Tile rows repeated to `w` plus SIMD slack, threshold bias applied; row y
+ * of the image uses rows + (y % scr->size) * rowLen. */
+BW_HIDDEN unsigned char *expandScreen(const BWScreen *scr, int w, const BWConfig *cfg,
+                                      size_t *rowLen);
+BW_HIDDEN ErrorCode screenImage(const unsigned char *gray, int w, int h,
+                                const BWScreen *scr, const BWConfig *cfg, BWBitmap *bm,
+                                BWStats *stats);
+
+/* bw_separate.c: four C/M/Y/K 1-bit planes written next to `out`, from
+ * `in` or, when `data` is set, the `size` encoded bytes there. */
+BW_HIDDEN ErrorCode convertSeparations(const char *in, const unsigned char *data,
+                                       size_t size, const char *out, BWFormat fmt,
+                                       const BWConfig *cfg, BWStats *stats);
+
+/* bw_anim.c: multi-frame GIF input, dithered frame-parallel (or in order
+ * with temporalDither) into a PNG sequence or an animated 1-bit GIF. */
+BW_HIDDEN bool isGIFFile(const char *path);
+BW_HIDDEN bool isGIFData(const unsigned char *data, size_t size);
+/* From `in` or, when `data` is set, the `size` bytes there. */
+BW_HIDDEN ErrorCode convertAnimation(const char *in, const unsigned char *data,
+                                     size_t size, const char *out, BWFormat fmt,
+                                     const BWConfig *cfg, BWStats *stats);
+/* convertAnimation into a malloc'd buffer: a GIF, or a single frame in `fmt`. */
+BW_HIDDEN ErrorCode encodeAnimation(const unsigned char *data, size_t size, BWFormat fmt,
+                                    const BWConfig *cfg, unsigned char **out,
+                                    size_t *outSize, BWStats *stats);
+/* Two-colour GIF of `count` frames; `delaysMs` may be NULL for a still. */
+BW_HIDDEN ErrorCode writeGIF(FILE *fp, const BWBitmap *frames, const int *delaysMs,
+                             int count);
+BW_HIDDEN ErrorCode saveGIF(const char *path, const BWBitmap *frames,
+                            const int *delaysMs, int count, const BWConfig *cfg);
+BW_HIDDEN ErrorCode encodeGIF(const BWBitmap *frames, const int *delaysMs, int count,
+                              unsigned char **out, size_t *outSize);
+
+/* bw_queue.c: bounded lock-free multi-producer / multi-consumer queue of
+ * pointers (a ring of sequence-numbered cells). Push and pop spin, then
+ * yield, then sleep briefly while the queue is full or empty. */
+typedef struct {
+    atomic_size_t seq;
+    void *value;
+} QueueCell;
+
+typedef struct {
+    QueueCell *cells;
+    size_t mask;
+    _Alignas(64) atomic_size_t head; /* next push */
+    _Alignas(64) atomic_size_t tail; /* next pop */
+    _Alignas(64) atomic_ullong depthSum; /* depth after each push */
+    atomic_ullong pushes;
+    atomic_int depthMax;
+} BWQueue;
+
+/* `capacity` is rounded up to a power of two. */
+BW_HIDDEN ErrorCode queueInit(BWQueue *q, int capacity);
+BW_HIDDEN void queueFree(BWQueue *q);
+BW_HIDDEN bool queueTryPush(BWQueue *q, void *value);
+BW_HIDDEN bool queueTryPop(BWQueue *q, void **value);
+BW_HIDDEN void queuePush(BWQueue *q, void *value);
+BW_HIDDEN void *queuePop(BWQueue *q);
+
+/* bw_io.c: whole-file reads and writes in the background, on io_uring or
+ * I/O threads. Files are opened on the caller's thread. */
+typedef struct BWIO BWIO;
+typedef struct IOOp IOOp;
+/* A finished write: its result, the bytes written and the time it took. */
+typedef void (*IOWriteDone)(void *user, ErrorCode result, size_t bytes, double ms);
+
+/* NULL for BW_IO_SYNC or when no backend could start. */
+BW_HIDDEN BWIO *ioStart(BWIOMode mode, bool dropCache);
+/* The backend in use: BW_IO_URING, BW_IO_THREADS or (NULL) BW_IO_SYNC. */
+BW_HIDDEN BWIOMode ioMode(const BWIO *io);
+/* Wait for every write, then stop. Reads must all have been waited for. */
+BW_HIDDEN void ioFinish(BWIO *io);
+/* Start reading a whole regular file. NULL when it cannot be read ahead
+ * (standard input, not a regular file, cannot be opened): read it in place. */
+BW_HIDDEN IOOp *ioRead(BWIO *io, const char *path);
+/* Wait for a read and free `op`: the file's bytes (free()) or NULL. */
+BW_HIDDEN unsigned char *ioReadWait(BWIO *io, IOOp *op, size_t *size);
+/* Create `path` and write `data` (malloc'd, taken over) to it; `done` runs
+ * on an I/O thread, or on this one if the file cannot be created. */
+BW_HIDDEN void ioWrite(BWIO *io, const char *path, unsigned char *data, size_t size,
+                       IOWriteDone done, void *user);
+
+/* bw_cache.c: outputs stored under a key of input bytes and settings (see
+ * bw_cache_open). Everything here is a no-op while no cache is open. */
+BW_HIDDEN bool cacheEnabled(void);
+BW_HIDDEN uint64_t cacheHash(const void *data, size_t size, uint64_t seed); /* XXH64 */
+BW_HIDDEN bool cacheHashFile(const char *path, uint64_t *hash);
+/* Key of an input with hash `input` converted with `cfg` into `fmt`. */
+BW_HIDDEN uint64_t cacheKey(uint64_t input, const BWConfig *cfg, BWFormat fmt);
+/* True if `out` was written from the cache entry `key`. */
+BW_HIDDEN bool cacheFetch(uint64_t key, const char *out);
+/* Store the converted file `out`, or its bytes, as entry `key`. */
+BW_HIDDEN void cacheStore(uint64_t key, const char *out);
+BW_HIDDEN void cacheStoreData(uint64_t key, const unsigned char *data, size_t size);
+
+/* bw_luma.c: an input's gray plane kept next to it (cfg->lumaSidecar). */
+typedef struct {
+    bool known; /* the input's identity below was read */
+    uint64_t inputSize;
+    int64_t mtimeSec, mtimeNsec;
+    void *map;
+    size_t mapSize;
+    const unsigned char *plane; /* w * h luma bytes, while open */
+    int w, h;
+} LumaSidecar;
+
+/* True if `in` has a sidecar that still matches it, mapped into sc->plane
+ * until lumaClose. Otherwise `sc` keeps what lumaSave needs. */
+BW_HIDDEN bool lumaOpen(const char *in, LumaSidecar *sc);
+BW_HIDDEN void lumaClose(LumaSidecar *sc);
+/* Write the sidecar of `in` from the plane decoded after lumaOpen. */
+BW_HIDDEN void lumaSave(const char *in, const LumaSidecar *sc, const unsigned char *gray,
+                        int w, int h);
+
+/* bw_deadline.c: fit a still image's dithering and encoding into what is
+ * left of cfg->deadlineMs after `spentMs`. Picks the algorithm and scale,
+ * shrinks `gray` in place to *w x *h, and returns cfg with the algorithm in
+ * *use. Leaves everything as it is without a deadline. */
+BW_HIDDEN void fitDeadline(unsigned char *gray, int *w, int *h, const BWConfig *cfg,
+                           BWFormat fmt, double spentMs, BWConfig *use, DeadlinePlan *plan);
+/* Measure the cost profile now instead of in the first deadline conversion. */
+BW_HIDDEN void warmDeadline(void);
+/* Measure every cost afresh, whatever the profile says (for bw_autotune). */
+BW_HIDDEN void measureDeadline(DeadlineCosts *costs);
+
+/* bw_pool.c: the shared work-stealing pool. */
+typedef void (*BWTaskFn)(void *arg, int index);
+/* Run fn(arg, i) for every i in [0, count) and wait. At most `width` run at
+ * once (0 = pool size), the caller included; safe to nest. */
+BW_HIDDEN void parallelFor(int count, int width, BWTaskFn fn, void *arg);
+/* Threads of the pool or external executor, the caller's included. */
+BW_HIDDEN int poolThreads(void);
+/* Run the calling thread in class `p` (a conversion's cfg->priority) until
+ * schedLeave() with the returned value; nests. Parallel work started
+ * meanwhile is queued in that class. */
+BW_HIDDEN int schedEnter(BWPriority p);
+BW_HIDDEN void schedLeave(int previous);
+/* Rows of serial work between schedule points. */
+#define SCHED_ROWS 32
+/* A row-band boundary of long serial work. In the batch class this runs
+ * queued interactive tasks, then waits while interactive work needs the
+ * cores; otherwise it returns at once. */
+BW_HIDDEN void schedulePoint(void);
+
+/* Log-binned latency histogram, updated without locks. */
+#define LATENCY_BINS 256
+typedef struct {
+    atomic_ullong bin[LATENCY_BINS];
+    atomic_ullong count, sumUs, maxUs;
+} LatencyHist;
+
+BW_HIDDEN void latencyRecord(LatencyHist *h, double ms);
+BW_HIDDEN void latencyRead(LatencyHist *h, BWLatency *out, bool reset);
+
+/* bw_metrics.c: per-thread counters, summed when reported. */
+typedef enum {
+    METRIC_DECODE,
+    METRIC_LUMA,
+    METRIC_DIFFUSE, /* dithering proper, whatever the algorithm */
+    METRIC_ENCODE,
+    METRIC_WRITE,   /* PNG, or any format a batch writes in the background */
+    METRIC_STAGES
+} MetricStage;
+
+typedef enum {
+    QUEUE_SERVE_INTERACTIVE,
+    QUEUE_SERVE_BATCH,
+    QUEUE_PIPELINE_DITHER,
+    QUEUE_PIPELINE_ENCODE,
+    QUEUE_WATCH,
+    METRIC_QUEUES
+} MetricQueue;
+
+BW_HIDDEN void metricStage(MetricStage stage, double ms);
+BW_HIDDEN void metricPixels(uint64_t pixels);
+BW_HIDDEN void metricBytes(uint64_t in, uint64_t out);
+BW_HIDDEN void metricResult(int result); /* one finished job, by ErrorCode */
+BW_HIDDEN void metricQueue(MetricQueue queue, int delta);
+
+/* bw_vector.c: black pixels as vertically merged rectangles. */
+BW_HIDDEN ErrorCode writeVectorImage(FILE *fp, const BWBitmap *bm, VectorKind kind,
+                                     const BWConfig *cfg);
+BW_HIDDEN ErrorCode saveVectorImage(const char *path, const BWBitmap *bm,
+                                    VectorKind kind, const BWConfig *cfg);
+
+#endif /* BW_INTERNAL_H */
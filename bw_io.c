@@ -0,0 +1,452 @@
+/*
+ * File: bw_io.c
+ * ---------------------------
+ * Description:
+ *   Asynchronous whole-file reads and writes for batch runs, so a decode
+ *   thread finds the next inputs already in memory and an encode thread
+ *   hands its output off instead of waiting for the write.
+ *
+ *   On Linux the transfers go through io_uring, driven by raw system calls
+ *   so no liburing is needed: submitters share the submission ring under a
+ *   mutex, and one reaper thread takes completions and resubmits the rest of
+ *   any short transfer. Where the kernel has no io_uring, or it is disabled
+ *   by policy, a few threads doing pread()/pwrite() take its place.
+ *
+ *   Opening a file stays synchronous on the caller's thread, so errors such
+ *   as a missing input or an unwritable output appear exactly as before.
+ *   With dropCache, files are evicted from the page cache once read or
+ *   written (writes are flushed first), so a run over more data than memory
+ *   does not push everything else out of the cache.
+ *
+ * Author: Bahey Shalash
+ * Version: 2.1.2
+ * Date: 19/04/2025
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_URING 1
+#endif
+
+#include "bw_internal.h"
+
+#define RING_ENTRIES 64
+#define IO_THREADS 4
+
+struct IOOp {
+    int fd;
+    bool write;
+    unsigned char *buf;
+    size_t size, done;
+    struct iovec iov; /* the io_uring request in flight */
+    ErrorCode result;
+    bool finished; /* reads, under BWIO.lock */
+    double startMs;
+    IOWriteDone callback;
+    void *user;
+    IOOp *next; /* thread backend queue */
+};
+
+#ifdef HAVE_URING
+typedef struct {
+    int fd;
+    unsigned entries, inFlight;
+    void *sq, *cq;
+    size_t sqSize, cqSize;
+    struct io_uring_sqe *sqes;
+    unsigned *sqTail, *sqMask, *sqArray;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_cqe *cqes;
+    pthread_t reaper;
+} Ring;
+#endif
+
+struct BWIO {
+    BWIOMode mode; /* BW_IO_URING or BW_IO_THREADS */
+    bool dropCache;
+    pthread_mutex_t lock;
+    pthread_cond_t changed; /* an operation finished */
+    int pending;            /* operations started and not finished */
+    bool stopping;
+#ifdef HAVE_URING
+    Ring ring;
+#endif
+    IOOp *head, *tail; /* waiting for a thread */
+    pthread_cond_t work;
+    pthread_t threads[IO_THREADS];
+    int threadCount;
+};
+
+static double nowMs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec * 1e-6;
+}
+
+static void opFinish(BWIO *io, IOOp *op) {
+    bool write = op->write;
+    if (io->dropCache) {
+        /* dirty pages cannot be dropped, so write them back first */
+        if (write && op->result == ERR_OK)
+            sync_file_range(op->fd, 0, 0,
+                            SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                                SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(op->fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    if (close(op->fd) != 0 && write)
+        op->result = ERR_WRITE;
+
+    if (write) {
+        op->callback(op->user, op->result, op->done, nowMs() - op->startMs);
+        free(op->buf);
+        free(op);
+    }
+    pthread_mutex_lock(&io->lock);
+    if (!write)
+        op->finished = true; /* the reader frees it */
+    io->pending--;
+    pthread_cond_broadcast(&io->changed);
+    pthread_mutex_unlock(&io->lock);
+}
+
+/* ---- io_uring backend ---- */
+
+#ifdef HAVE_URING
+static int ringEnter(Ring *r, unsigned submit, unsigned wait) {
+    return (int)syscall(__NR_io_uring_enter, r->fd, submit, wait,
+                        wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+/* Queue the rest of `op` (NULL: a no-op that stops the reaper) and submit it,
+ * with io->lock held. Only `wait` callers block for a free slot; the reaper
+ * cannot, since it is the one that frees them, and the completion ring has
+ * room for twice the entries. */
+static bool ringPush(BWIO *io, IOOp *op, bool wait) {
+    Ring *r = &io->ring;
+    while (wait && r->inFlight >= r->entries)
+        pthread_cond_wait(&io->changed, &io->lock);
+    unsigned tail = *r->sqTail;
+    unsigned idx = tail & *r->sqMask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_NOP;
+    if (op) {
+        /* readv/writev rather than read/write: they date back to 5.1 */
+        op->iov = (struct iovec){op->buf + op->done, op->size - op->done};
+        sqe->opcode = op->write ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->fd = op->fd;
+        sqe->addr = (uintptr_t)&op->iov;
+        sqe->len = 1;
+        sqe->off = op->done;
+    }
+    sqe->user_data = (uintptr_t)op;
+    r->sqArray[idx] = idx;
+    __atomic_store_n(r->sqTail, tail + 1, __ATOMIC_RELEASE);
+    int n;
+    while ((n = ringEnter(r, 1, 0)) < 0 && (errno == EINTR || errno == EAGAIN ||
+                                            errno == EBUSY))
+        sched_yield();
+    if (n != 1) {
+        *r->sqTail = tail; /* not consumed, so it can be taken back */
+        return false;
+    }
+    r->inFlight++;
+    return true;
+}
+
+static bool opSubmit(BWIO *io, IOOp *op, bool wait);
+
+/* Account for the `res` bytes (or -errno) `op` moved; short transfers go
+ * round again. */
+static void opProgress(BWIO *io, IOOp *op, int res) {
+    if (res > 0)
+        op->done += res;
+    bool again = res == -EINTR || res == -EAGAIN || (res > 0 && op->done < op->size);
+    if (again) {
+        if (opSubmit(io, op, false))
+            return;
+        res = -EIO;
+    }
+    /* a read that stops early met the end of a file that shrank */
+    if (res < 0 || (res == 0 && op->write))
+        op->result = op->write ? ERR_WRITE : ERR_LOAD;
+    opFinish(io, op);
+}
+
+static void *reapRing(void *arg) {
+    BWIO *io = arg;
+    Ring *r = &io->ring;
+    for (;;) {
+        if (ringEnter(r, 0, 1) < 0 && errno != EINTR) {
+            struct timespec pause = {0, 1000000};
+            nanosleep(&pause, NULL);
+        }
+        unsigned head = *r->cqHead;
+        unsigned tail = __atomic_load_n(r->cqTail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            const struct io_uring_cqe *cqe = &r->cqes[head & *r->cqMask];
+            IOOp *op = (IOOp *)(uintptr_t)cqe->user_data;
+            int res = cqe->res;
+            __atomic_store_n(r->cqHead, head + 1, __ATOMIC_RELEASE);
+            pthread_mutex_lock(&io->lock);
+            r->inFlight--;
+            pthread_cond_broadcast(&io->changed);
+            pthread_mutex_unlock(&io->lock);
+            if (!op)
+                return NULL;
+            opProgress(io, op, res);
+        }
+    }
+}
+
+static void ringStop(Ring *r) {
+    if (r->sqes && r->sqes != MAP_FAILED)
+        munmap(r->sqes, r->entries * sizeof(*r->sqes));
+    if (r->cq && r->cq != MAP_FAILED && r->cq != r->sq)
+        munmap(r->cq, r->cqSize);
+    if (r->sq && r->sq != MAP_FAILED)
+        munmap(r->sq, r->sqSize);
+    close(r->fd);
+}
+
+/* False when the kernel has no io_uring or refuses it (seccomp, sysctl). */
+static bool ringStart(BWIO *io) {
+    Ring *r = &io->ring;
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    r->fd = (int)syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+    if (r->fd < 0)
+        return false;
+    r->entries = p.sq_entries;
+    r->sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cqSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single)
+        r->sqSize = r->cqSize = r->sqSize > r->cqSize ? r->sqSize : r->cqSize;
+    r->sq = mmap(NULL, r->sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+                 IORING_OFF_SQ_RING);
+    r->cq = single ? r->sq
+                   : mmap(NULL, r->cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          r->fd, IORING_OFF_CQ_RING);
+    r->sqes = mmap(NULL, r->entries * sizeof(*r->sqes), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sq == MAP_FAILED || r->cq == MAP_FAILED || r->sqes == MAP_FAILED) {
+        ringStop(r);
+        return false;
+    }
+    unsigned char *sq = r->sq, *cq = r->cq;
+    r->sqTail = (unsigned *)(sq + p.sq_off.tail);
+    r->sqMask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sqArray = (unsigned *)(sq + p.sq_off.array);
+    r->cqHead = (unsigned *)(cq + p.cq_off.head);
+    r->cqTail = (unsigned *)(cq + p.cq_off.tail);
+    r->cqMask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    if (pthread_create(&r->reaper, NULL, reapRing, io) != 0) {
+        ringStop(r);
+        return false;
+    }
+    return true;
+}
+#endif
+
+/* ---- Thread backend ---- */
+
+static void *ioWorker(void *arg) {
+    BWIO *io = arg;
+    pthread_mutex_lock(&io->lock);
+    for (;;) {
+        while (!io->head && !io->stopping)
+            pthread_cond_wait(&io->work, &io->lock);
+        IOOp *op = io->head;
+        if (!op)
+            break;
+        io->head = op->next;
+        if (!io->head)
+            io->tail = NULL;
+        pthread_mutex_unlock(&io->lock);
+
+        ssize_t n = 1;
+        while (op->done < op->size && n > 0) {
+            size_t left = op->size - op->done;
+            n = op->write ? pwrite(op->fd, op->buf + op->done, left, (off_t)op->done)
+                          : pread(op->fd, op->buf + op->done, left, (off_t)op->done);
+            if (n > 0)
+                op->done += n;
+            else if (n < 0 && errno == EINTR)
+                n = 1;
+        }
+        if (n < 0 || (op->write && op->done < op->size))
+            op->result = op->write ? ERR_WRITE : ERR_LOAD;
+        opFinish(io, op);
+        pthread_mutex_lock(&io->lock);
+    }
+    pthread_mutex_unlock(&io->lock);
+    return NULL;
+}
+
+static bool threadsStart(BWIO *io) {
+    while (io->threadCount < IO_THREADS &&
+           pthread_create(&io->threads[io->threadCount], NULL, ioWorker, io) == 0)
+        io->threadCount++;
+    return io->threadCount > 0;
+}
+
+/* ---- Operations ---- */
+
+static bool opSubmit(BWIO *io, IOOp *op, bool wait) {
+    bool ok = true;
+    pthread_mutex_lock(&io->lock);
+#ifdef HAVE_URING
+    if (io->mode == BW_IO_URING)
+        ok = ringPush(io, op, wait);
+#endif
+    if (io->mode == BW_IO_THREADS) {
+        op->next = NULL;
+        if (io->tail)
+            io->tail->next = op;
+        else
+            io->head = op;
+        io->tail = op;
+        pthread_cond_signal(&io->work);
+    }
+    pthread_mutex_unlock(&io->lock);
+    (void)wait;
+    return ok;
+}
+
+static void opStart(BWIO *io, IOOp *op) {
+    pthread_mutex_lock(&io->lock);
+    io->pending++;
+    pthread_mutex_unlock(&io->lock);
+    op->startMs = nowMs();
+    if (!op->size) {
+        opFinish(io, op);
+    } else if (!opSubmit(io, op, true)) {
+        op->result = op->write ? ERR_WRITE : ERR_LOAD;
+        opFinish(io, op);
+    }
+}
+
+BWIO *ioStart(BWIOMode mode, bool dropCache) {
+    if (mode == BW_IO_SYNC)
+        return NULL;
+    BWIO *io = calloc(1, sizeof(*io));
+    if (!io)
+        return NULL;
+    io->dropCache = dropCache;
+    pthread_mutex_init(&io->lock, NULL);
+    pthread_cond_init(&io->changed, NULL);
+    pthread_cond_init(&io->work, NULL);
+    io->mode = BW_IO_THREADS;
+#ifdef HAVE_URING
+    if (mode != BW_IO_THREADS && ringStart(io))
+        io->mode = BW_IO_URING;
+#endif
+    if (io->mode == BW_IO_THREADS && !threadsStart(io)) {
+        ioFinish(io);
+        return NULL;
+    }
+    return io;
+}
+
+BWIOMode ioMode(const BWIO *io) {
+    return io ? io->mode : BW_IO_SYNC;
+}
+
+void ioFinish(BWIO *io) {
+    if (!io)
+        return;
+    pthread_mutex_lock(&io->lock);
+    while (io->pending)
+        pthread_cond_wait(&io->changed, &io->lock);
+    io->stopping = true;
+    pthread_cond_broadcast(&io->work);
+#ifdef HAVE_URING
+    bool reaping = io->mode == BW_IO_URING && ringPush(io, NULL, true);
+#endif
+    pthread_mutex_unlock(&io->lock);
+    for (int i = 0; i < io->threadCount; i++)
+        pthread_join(io->threads[i], NULL);
+#ifdef HAVE_URING
+    if (io->mode == BW_IO_URING) {
+        if (reaping) {
+            pthread_join(io->ring.reaper, NULL);
+            ringStop(&io->ring);
+        } else {
+            pthread_detach(io->ring.reaper); /* still blocked on the ring */
+        }
+    }
+#endif
+    pthread_cond_destroy(&io->work);
+    pthread_cond_destroy(&io->changed);
+    pthread_mutex_destroy(&io->lock);
+    free(io);
+}
+
+IOOp *ioRead(BWIO *io, const char *path) {
+    if (isStdioPath(path))
+        return NULL;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    IOOp *op = NULL;
+    if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0 &&
+        (op = calloc(1, sizeof(*op))))
+        op->buf = malloc((size_t)st.st_size);
+    if (!op || !op->buf) {
+        free(op);
+        close(fd);
+        return NULL;
+    }
+    op->fd = fd;
+    op->size = (size_t)st.st_size;
+    opStart(io, op);
+    return op;
+}
+
+unsigned char *ioReadWait(BWIO *io, IOOp *op, size_t *size) {
+    pthread_mutex_lock(&io->lock);
+    while (!op->finished)
+        pthread_cond_wait(&io->changed, &io->lock);
+    pthread_mutex_unlock(&io->lock);
+    unsigned char *buf = op->buf;
+    *size = op->done;
+    if (op->result != ERR_OK) {
+        free(buf);
+        buf = NULL;
+    }
+    free(op);
+    return buf;
+}
+
+void ioWrite(BWIO *io, const char *path, unsigned char *data, size_t size,
+             IOWriteDone done, void *user) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    IOOp *op = fd >= 0 ? calloc(1, sizeof(*op)) : NULL;
+    if (!op) {
+        if (fd >= 0)
+            close(fd);
+        free(data);
+        done(user, fd >= 0 ? ERR_MEMORY : ERR_WRITE, 0, 0.0);
+        return;
+    }
+    *op = (IOOp){.fd = fd, .write = true, .buf = data, .size = size, .callback = done,
+                 .user = user};
+    opStart(io, op);
+}
@@ -0,0 +1,140 @@
+/*
+ * File: bw_luma.c
+ * ---------------------------
+ * Description:
+ *   Luma sidecars: the gray plane of an input, kept next to it as
+ *   ".NAME.bwluma", so converting the same image again (a new threshold,
+ *   algorithm or format) maps the plane instead of decoding the file and
+ *   converting RGB to luma.
+ *
+ *   A sidecar is a 64-byte header and the raw 8-bit plane. The header holds
+ *   a version, the plane size, and the input's size, mtime and XXH64 hash
+ *   when the plane was made. A sidecar is used only if the size and mtime
+ *   still match and the input still hashes the same; hashing reads the file
+ *   but costs far less than decoding it. Sidecars are written under a
+ *   temporary name and renamed into place. A directory that cannot be
+ *   written to simply gets no sidecar. The dot prefix keeps them out of
+ *   directory listings and out of --watch.
+ *
+ * Author: Bahey Shalash
+ * Version: 2.1.2
+ * Date: 19/04/2025
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bw_internal.h"
+
+#define LUMA_MAGIC "BWLUMA\r\n"
+#define LUMA_VERSION 1
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t bits; /* 8: the library dithers 8-bit luma */
+    uint32_t width, height;
+    uint64_t inputSize;
+    int64_t mtimeSec, mtimeNsec;
+    uint64_t inputHash;
+    unsigned char reserved[8];
+} LumaHeader;
+
+_Static_assert(sizeof(LumaHeader) == 64, "sidecar header is 64 bytes");
+
+/* "dir/name.png" -> "dir/.name.png.bwluma", plus `suffix` */
+static bool sidecarPath(char *dst, size_t size, const char *in, const char *suffix) {
+    const char *slash = strrchr(in, '/');
+    const char *base = slash ? slash + 1 : in;
+    int n = snprintf(dst, size, "%.*s.%s.bwluma%s", (int)(base - in), in, base, suffix);
+    return n > 0 && (size_t)n < size;
+}
+
+static bool sameIdentity(const LumaHeader *hd, const struct stat *st) {
+    return hd->inputSize == (uint64_t)st->st_size && hd->mtimeSec == st->st_mtim.tv_sec &&
+           hd->mtimeNsec == st->st_mtim.tv_nsec;
+}
+
+bool lumaOpen(const char *in, LumaSidecar *sc) {
+    memset(sc, 0, sizeof(*sc));
+    struct stat st;
+    char path[PATH_MAX];
+    if (stat(in, &st) != 0 || !S_ISREG(st.st_mode) || !sidecarPath(path, sizeof(path), in, ""))
+        return false;
+    sc->inputSize = (uint64_t)st.st_size;
+    sc->mtimeSec = st.st_mtim.tv_sec;
+    sc->mtimeNsec = st.st_mtim.tv_nsec;
+    sc->known = true;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    LumaHeader hd;
+    struct stat side;
+    bool ok = pread(fd, &hd, sizeof(hd), 0) == (ssize_t)sizeof(hd) && !fstat(fd, &side) &&
+              !memcmp(hd.magic, LUMA_MAGIC, 8) && hd.version == LUMA_VERSION &&
+              hd.bits == 8 && hd.width > 0 && hd.height > 0 &&
+              (uint64_t)hd.width * hd.height <= INT_MAX &&
+              (uint64_t)side.st_size == sizeof(hd) + (uint64_t)hd.width * hd.height &&
+              sameIdentity(&hd, &st);
+    uint64_t hash;
+    ok = ok && cacheHashFile(in, &hash) && hash == hd.inputHash;
+    if (ok) {
+        sc->map = mmap(NULL, (size_t)side.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ok = sc->map != MAP_FAILED;
+        if (!ok)
+            sc->map = NULL;
+    }
+    close(fd);
+    if (!ok)
+        return false;
+    sc->mapSize = (size_t)side.st_size;
+    sc->plane = (const unsigned char *)sc->map + sizeof(hd);
+    sc->w = (int)hd.width;
+    sc->h = (int)hd.height;
+    return true;
+}
+
+void lumaClose(LumaSidecar *sc) {
+    if (sc->map)
+        munmap(sc->map, sc->mapSize);
+    sc->map = NULL;
+    sc->plane = NULL;
+}
+
+void lumaSave(const char *in, const LumaSidecar *sc, const unsigned char *gray, int w,
+              int h) {
+    struct stat st;
+    char path[PATH_MAX], temp[PATH_MAX], pid[24];
+    snprintf(pid, sizeof(pid), ".%ld", (long)getpid());
+    if (!sc->known || stat(in, &st) != 0 || !sidecarPath(path, sizeof(path), in, "") ||
+        !sidecarPath(temp, sizeof(temp), in, pid))
+        return;
+    LumaHeader hd = {.version = LUMA_VERSION, .bits = 8, .width = (uint32_t)w,
+                     .height = (uint32_t)h, .inputSize = sc->inputSize,
+                     .mtimeSec = sc->mtimeSec, .mtimeNsec = sc->mtimeNsec};
+    memcpy(hd.magic, LUMA_MAGIC, 8);
+    /* unchanged since it was decoded, as far as it can be told */
+    if (!sameIdentity(&hd, &st) || !cacheHashFile(in, &hd.inputHash))
+        return;
+
+    int fd = open(temp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (fd < 0)
+        return;
+    size_t size = (size_t)w * h;
+    bool ok = write(fd, &hd, sizeof(hd)) == (ssize_t)sizeof(hd);
+    for (size_t done = 0; ok && done < size;) {
+        ssize_t n = write(fd, gray + done, size - done);
+        ok = n > 0;
+        done += ok ? (size_t)n : 0;
+    }
+    if (close(fd) != 0 || !ok || rename(temp, path) != 0)
+        unlink(temp);
+}
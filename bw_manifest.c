@@ -0,0 +1,965 @@
+/*
+ * File: bw_manifest.c
+ * ---------------------------
+ * Description:
+ *   Manifest-driven batches. Each record of a CSV or JSON Lines file names an
+ *   input and an output, plus optional threshold, invert, algorithm and format
+ *   overrides of the run's defaults (parsed as server options are, see
+ *   applyJobOption). All records go through the batch engine
+ *   (bw_batch.c), and a results file reports per-item status and stage
+ *   timings in manifest order.
+ *
+ *   CSV: one record per line, fields may be "quoted" with "" as an escaped
+ *   quote. A first line starting with the field name `input` is a header,
+ *   and its column order is used. Otherwise the order is input, output,
+ *   threshold, invert, algorithm, format. Blank lines and lines starting
+ *   with # are skipped.
+ *
+ *   JSON Lines: one flat object per line with the same keys, e.g.
+ *   {"input": "a.jpg", "output": "a.png", "threshold": 110, "invert": true}
+ *
+ *   Sharding spreads one manifest over workers on several machines that
+ *   share only a directory (NFS). Records are taken in chunks of
+ *   SHARD_CHUNK, up to SHARD_CLAIM chunks at a time converted in one
+ *   pipeline run, each published as soon as its last record finishes. In
+ *   the directory, for chunk N:
+ *     N.lease  created with O_EXCL by the worker converting it, holding its
+ *              host and pid; its mtime is renewed every third of the lease
+ *     N.done   the chunk's result rows, renamed into place when complete
+ *   and `job` records the manifest's size and hash, the defaults and the
+ *   result format, so a worker started with a different manifest or
+ *   different settings is refused with ERR_CONFIG. A lease whose mtime has
+ *   not changed for a whole lease period, timed by the observer's own
+ *   clock, belongs to a dead worker: it is renamed away (only one worker
+ *   can win) and the chunk claimed again. A worker that finds its lease
+ *   gone when done drops its results. Outputs depend only on the inputs,
+ *   so converting a chunk twice is harmless, and every worker that sees all
+ *   chunks done merges the rows into the same results file.
+ *
+ * Author: Bahey Shalash
+ * Version: 2.1.2
+ * Date: 19/04/2025
+ */
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bw_internal.h"
+
+enum { COL_INPUT, COL_OUTPUT, COL_THRESHOLD, COL_INVERT, COL_ALGORITHM, COL_FORMAT, COLS };
+
+static const char *const COLUMN_NAME[COLS] = {"input",  "output",    "threshold",
+                                              "invert", "algorithm", "format"};
+
+typedef struct {
+    int line;
+    char *field[COLS];
+    int configIndex;
+    ErrorCode parse;
+} Record;
+
+typedef struct {
+    Record *rec;
+    int count, cap;
+    BWConfig *configs; /* distinct settings; records with equal ones share */
+    int configCount, configCap;
+    int column[COLS]; /* CSV column of each field, -1 if absent */
+} Manifest;
+
+/* ---- Field values ---- */
+
+static int lookupName(const char *s, const char *const *names, int count) {
+    for (int i = 0; i < count; i++)
+        if (!strcasecmp(s, names[i]))
+            return i;
+    return -1;
+}
+
+static ErrorCode checkRecord(const Record *r) {
+    if (!r->field[COL_INPUT] || !*r->field[COL_INPUT] || !r->field[COL_OUTPUT] ||
+        !*r->field[COL_OUTPUT])
+        return ERR_CONFIG;
+    return ERR_OK;
+}
+
+/* The defaults with the record's options applied, as an index into
+ * m->configs; -1 with *err set on a bad option or no memory. */
+static int recordConfig(Manifest *m, const Record *r, const BWConfig *defaults,
+                        ErrorCode *err) {
+    BWConfig cfg = *defaults;
+    for (int c = COL_THRESHOLD; c < COLS; c++)
+        if (r->field[c] && *r->field[c] &&
+            (*err = applyJobOption(&cfg, COLUMN_NAME[c], r->field[c])) != ERR_OK)
+            return -1;
+    for (int i = 0; i < m->configCount; i++)
+        if (!memcmp(&m->configs[i], &cfg, sizeof(cfg)))
+            return i;
+    if (m->configCount == m->configCap) {
+        int cap = m->configCap ? 2 * m->configCap : 8;
+        BWConfig *grown = realloc(m->configs, cap * sizeof(*grown));
+        if (!grown) {
+            *err = ERR_MEMORY;
+            return -1;
+        }
+        m->configs = grown;
+        m->configCap = cap;
+    }
+    m->configs[m->configCount] = cfg;
+    return m->configCount++;
+}
+
+/* ---- CSV ---- */
+
+/* Split one line in place; returns the number of fields. */
+static int splitCSV(char *line, char **fields, int max) {
+    int n = 0;
+    char *p = line;
+    for (;;) {
+        char *out = p, *start = p;
+        if (*p == '"') {
+            for (p++;; p++) {
+                if (*p == '"' && p[1] == '"')
+                    *out++ = *++p;
+                else if (*p == '"' || !*p)
+                    break;
+                else
+                    *out++ = *p;
+            }
+            if (*p == '"')
+                p++;
+            while (*p && *p != ',')
+                p++;
+        } else {
+            while (*p && *p != ',')
+                p++;
+            out = p;
+        }
+        bool last = !*p;
+        *out = '\0';
+        if (n < max)
+            fields[n++] = start;
+        if (last)
+            return n;
+        p++;
+    }
+}
+
+static ErrorCode parseCSVLine(Manifest *m, char *line, Record *r, bool first) {
+    char *cols[16];
+    int n = splitCSV(line, cols, 16);
+    if (first && !strcasecmp(cols[0], "input")) {
+        for (int c = 0; c < COLS; c++)
+            m->column[c] = -1;
+        for (int i = 0; i < n; i++) {
+            int c = lookupName(cols[i], COLUMN_NAME, COLS);
+            if (c >= 0)
+                m->column[c] = i;
+        }
+        return ERR_OK; /* header, no record */
+    }
+    for (int c = 0; c < COLS; c++) {
+        int i = m->column[c];
+        if (i >= 0 && i < n && !(r->field[c] = strdup(cols[i])))
+            return ERR_MEMORY;
+    }
+    return checkRecord(r);
+}
+
+/* ---- JSON Lines: flat objects of strings, numbers and booleans ---- */
+
+static const char *skipSpace(const char *p) {
+    while (isspace((unsigned char)*p))
+        p++;
+    return p;
+}
+
+static void putUTF8(char **o, unsigned cp) {
+    if (cp < 0x80) {
+        *(*o)++ = (char)cp;
+    } else if (cp < 0x800) {
+        *(*o)++ = (char)(0xC0 | cp >> 6);
+        *(*o)++ = (char)(0x80 | (cp & 0x3F));
+    } else if (cp < 0x10000) {
+        *(*o)++ = (char)(0xE0 | cp >> 12);
+        *(*o)++ = (char)(0x80 | (cp >> 6 & 0x3F));
+        *(*o)++ = (char)(0x80 | (cp & 0x3F));
+    } else {
+        *(*o)++ = (char)(0xF0 | cp >> 18);
+        *(*o)++ = (char)(0x80 | (cp >> 12 & 0x3F));
+        *(*o)++ = (char)(0x80 | (cp >> 6 & 0x3F));
+        *(*o)++ = (char)(0x80 | (cp & 0x3F));
+    }
+}
+
+/* Decode a JSON string starting at the opening quote into a new buffer. */
+static char *jsonString(const char **pp) {
+    const char *p = *pp + 1;
+    char *buf = malloc(strlen(p) + 1), *o = buf;
+    if (!buf)
+        return NULL;
+    while (*p && *p != '"') {
+        if (*p != '\\') {
+            *o++ = *p++;
+            continue;
+        }
+        p++;
+        char c = *p++;
+        switch (c) {
+            case 'b': *o++ = '\b'; break;
+            case 'f': *o++ = '\f'; break;
+            case 'n': *o++ = '\n'; break;
+            case 'r': *o++ = '\r'; break;
+            case 't': *o++ = '\t'; break;
+            case 'u': {
+                unsigned cp;
+                if (sscanf(p, "%4x", &cp) != 1)
+                    goto bad;
+                p += 4;
+                unsigned lo;
+                if (cp >= 0xD800 && cp < 0xDC00 && p[0] == '\\' && p[1] == 'u' &&
+                    sscanf(p + 2, "%4x", &lo) == 1 && lo >= 0xDC00 && lo < 0xE000) {
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                    p += 6;
+                }
+                putUTF8(&o, cp);
+                break;
+            }
+            case '"': case '\\': case '/': *o++ = c; break;
+            default: goto bad;
+        }
+    }
+    if (*p != '"')
+        goto bad;
+    *o = '\0';
+    *pp = p + 1;
+    return buf;
+bad:
+    free(buf);
+    return NULL;
+}
+
+static ErrorCode parseJSONLine(const char *p, Record *r) {
+    p = skipSpace(p);
+    if (*p++ != '{')
+        return ERR_CONFIG;
+    p = skipSpace(p);
+    while (*p == '"') {
+        char *key = jsonString(&p);
+        if (!key)
+            return ERR_CONFIG;
+        p = skipSpace(p);
+        char *value = NULL;
+        if (*p == ':') {
+            p = skipSpace(p + 1);
+            if (*p == '"') {
+                value = jsonString(&p);
+            } else {
+                /* number, true, false or null: keep the literal text */
+                const char *end = p;
+                while (*end && *end != ',' && *end != '}' && !isspace((unsigned char)*end))
+                    end++;
+                if (end > p && strncmp(p, "null", 4))
+                    value = strndup(p, end - p);
+                else if (end > p)
+                    value = strdup("");
+                p = end;
+            }
+        }
+        int c = lookupName(key, COLUMN_NAME, COLS);
+        free(key);
+        if (!value)
+            return ERR_CONFIG;
+        if (c >= 0) {
+            free(r->field[c]);
+            r->field[c] = value;
+        } else {
+            free(value);
+        }
+        p = skipSpace(p);
+        if (*p == ',')
+            p = skipSpace(p + 1);
+    }
+    if (*p != '}')
+        return ERR_CONFIG;
+    return checkRecord(r);
+}
+
+/* ---- Loading and running ---- */
+
+static bool hasExtension(const char *path, const char *const *exts, int count) {
+    const char *dot = strrchr(path, '.');
+    return dot && lookupName(dot, exts, count) >= 0;
+}
+
+static ErrorCode loadManifest(Manifest *m, const char *path) {
+    FILE *fp = isStdioPath(path) ? stdin : fopen(path, "r");
+    if (!fp)
+        return ERR_LOAD;
+    static const char *const jsonExt[] = {".jsonl", ".ndjson", ".json"};
+    int json = hasExtension(path, jsonExt, 3) ? 1 : -1; /* -1: decide on first record */
+    for (int c = 0; c < COLS; c++)
+        m->column[c] = c;
+
+    char *line = NULL;
+    size_t lineCap = 0;
+    ssize_t len;
+    ErrorCode r = ERR_OK;
+    bool first = true;
+    for (int lineNo = 1; r == ERR_OK && (len = getline(&line, &lineCap, fp)) >= 0; lineNo++) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+        const char *text = skipSpace(line);
+        if (!*text || *text == '#')
+            continue;
+        if (json < 0)
+            json = *text == '{';
+        if (m->count == m->cap) {
+            int cap = m->cap ? 2 * m->cap : 256;
+            Record *grown = realloc(m->rec, cap * sizeof(*grown));
+            if (!grown) {
+                r = ERR_MEMORY;
+                break;
+            }
+            m->rec = grown;
+            m->cap = cap;
+        }
+        Record *rec = &m->rec[m->count];
+        memset(rec, 0, sizeof(*rec));
+        rec->line = lineNo;
+        rec->parse = json ? parseJSONLine(text, rec) : parseCSVLine(m, line, rec, first);
+        first = false;
+        bool header = !json && !rec->field[COL_INPUT] && rec->parse == ERR_OK;
+        if (header)
+            continue;
+        if (rec->parse == ERR_MEMORY)
+            r = ERR_MEMORY;
+        m->count++;
+    }
+    free(line);
+    if (fp != stdin)
+        fclose(fp);
+    return r;
+}
+
+static void freeManifest(Manifest *m) {
+    for (int i = 0; i < m->count; i++)
+        for (int c = 0; c < COLS; c++)
+            free(m->rec[i].field[c]);
+    free(m->rec);
+    free(m->configs);
+}
+
+static void putCSVField(FILE *fp, const char *s) {
+    if (!strpbrk(s, ",\"\n\r")) {
+        fputs(s, fp);
+        return;
+    }
+    fputc('"', fp);
+    for (; *s; s++) {
+        if (*s == '"')
+            fputc('"', fp);
+        fputc(*s, fp);
+    }
+    fputc('"', fp);
+}
+
+static void putJSONString(FILE *fp, const char *s) {
+    fputc('"', fp);
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\')
+            fprintf(fp, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(fp, "\\u%04x", c);
+        else
+            fputc(c, fp);
+    }
+    fputc('"', fp);
+}
+
+static bool jsonResults(const char *path) {
+    static const char *const jsonExt[] = {".jsonl", ".ndjson", ".json"};
+    return hasExtension(path, jsonExt, 3);
+}
+
+static const char RESULTS_HEADER[] =
+    "line,input,output,status,error,decode_ms,dither_ms,encode_ms\n";
+
+/* The results of records [first, end). */
+static void writeRows(FILE *fp, const Manifest *m, const BWBatchItem *items, int first,
+                      int end, bool json) {
+    for (int i = first; i < end; i++) {
+        const Record *rec = &m->rec[i];
+        const BWBatchItem *it = &items[i];
+        const char *in = rec->field[COL_INPUT] ? rec->field[COL_INPUT] : "";
+        const char *out = rec->field[COL_OUTPUT] ? rec->field[COL_OUTPUT] : "";
+        const char *status = it->result == ERR_OK ? "ok" : "error";
+        if (json) {
+            fprintf(fp, "{\"line\":%d,\"input\":", rec->line);
+            putJSONString(fp, in);
+            fputs(",\"output\":", fp);
+            putJSONString(fp, out);
+            fprintf(fp, ",\"status\":\"%s\",\"error\":", status);
+            if (it->result == ERR_OK)
+                fputs("null", fp);
+            else
+                putJSONString(fp, bw_error_string(it->result));
+            fprintf(fp, ",\"decode_ms\":%.3f,\"dither_ms\":%.3f,\"encode_ms\":%.3f}\n",
+                    it->decodeMs, it->ditherMs, it->encodeMs);
+        } else {
+            fprintf(fp, "%d,", rec->line);
+            putCSVField(fp, in);
+            fputc(',', fp);
+            putCSVField(fp, out);
+            fprintf(fp, ",%s,%s,%.3f,%.3f,%.3f\n", status,
+                    it->result == ERR_OK ? "" : bw_error_string(it->result), it->decodeMs,
+                    it->ditherMs, it->encodeMs);
+        }
+    }
+}
+
+static ErrorCode writeResults(const char *path, const Manifest *m, const BWBatchItem *items) {
+    FILE *fp = openOutput(path);
+    if (!fp)
+        return ERR_WRITE;
+    bool json = jsonResults(path);
+    if (!json)
+        fputs(RESULTS_HEADER, fp);
+    writeRows(fp, m, items, 0, m->count, json);
+    return ferror(fp) | !closeOutput(fp) ? ERR_WRITE : ERR_OK;
+}
+
+/* Settings of every record; a bad record keeps its error in rec->parse. */
+static ErrorCode prepareRecords(Manifest *m, const BWConfig *defaults) {
+    for (int i = 0; i < m->count; i++) {
+        Record *rec = &m->rec[i];
+        rec->configIndex = -1;
+        if (rec->parse == ERR_OK)
+            rec->configIndex = recordConfig(m, rec, defaults, &rec->parse);
+        if (rec->parse == ERR_MEMORY)
+            return ERR_MEMORY;
+    }
+    return ERR_OK;
+}
+
+/* Convert records [first, end) into items[first, end); *failed counts the
+ * records that failed, malformed ones included. */
+static ErrorCode runRecords(Manifest *m, BWBatchItem *items, int first, int end,
+                            const BWConfig *defaults, const BWPipelineConfig *pipeline,
+                            int *failed, BWPipelineStats *stats) {
+    int n = end - first;
+    BWBatchItem *run = calloc(n ? n : 1, sizeof(*run));
+    int *runIndex = malloc((n ? n : 1) * sizeof(*runIndex));
+    if (!run || !runIndex) {
+        free(run);
+        free(runIndex);
+        return ERR_MEMORY;
+    }
+    int runCount = 0, bad = 0;
+    for (int i = first; i < end; i++) {
+        Record *rec = &m->rec[i];
+        items[i] = (BWBatchItem){.result = rec->parse};
+        if (rec->parse != ERR_OK) {
+            metricResult(rec->parse);
+            bad++;
+            continue;
+        }
+        runIndex[runCount] = i;
+        run[runCount++] = (BWBatchItem){.input = rec->field[COL_INPUT],
+                                        .output = rec->field[COL_OUTPUT],
+                                        .config = &m->configs[rec->configIndex]};
+    }
+    bad += convert_pipeline_bw(run, runCount, defaults, pipeline, NULL, NULL, stats);
+    for (int k = 0; k < runCount; k++)
+        items[runIndex[k]] = run[k];
+    *failed = bad;
+    free(run);
+    free(runIndex);
+    return ERR_OK;
+}
+
+int convert_manifest_bw(const char *manifest_path, const char *results_path,
+                        const BWConfig *defaults, const BWPipelineConfig *pipeline,
+                        int *failed, BWPipelineStats *stats) {
+    Manifest m = {0};
+    ErrorCode r = loadManifest(&m, manifest_path);
+    BWBatchItem *items = calloc(m.count ? m.count : 1, sizeof(*items));
+    if (r == ERR_OK && !items)
+        r = ERR_MEMORY;
+    if (r == ERR_OK)
+        r = prepareRecords(&m, defaults);
+
+    int bad = 0;
+    if (r == ERR_OK) {
+        if (defaults->verboseMode)
+            fprintf(stderr, "Manifest '%s': %d item%s, %d distinct setting%s\n",
+                    manifest_path, m.count, m.count == 1 ? "" : "s", m.configCount,
+                    m.configCount == 1 ? "" : "s");
+        r = runRecords(&m, items, 0, m.count, defaults, pipeline, &bad, stats);
+    }
+    if (r == ERR_OK)
+        r = writeResults(results_path, &m, items);
+    if (failed)
+        *failed = bad;
+    free(items);
+    freeManifest(&m);
+    return r;
+}
+
+/* ---- Sharding over a shared directory ---- */
+
+#define SHARD_CHUNK 16     /* records per lease */
+#define SHARD_CLAIM 8      /* leases converted by one pipeline run */
+#define SHARD_POLL_MS 1000 /* between sweeps while others hold the rest */
+
+typedef struct {
+    const char *dir;
+    char owner[96]; /* host and pid, unique among the workers */
+    int leaseSeconds;
+    bool verbose;
+    /* the renewer touches the leases in `leaseFd` (-1: none) until told to stop */
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int leaseFd[SHARD_CLAIM];
+    bool stopRenewing;
+} Shard;
+
+/* A chunk claimed for the current run. */
+typedef struct {
+    int chunk, fd;
+    int left;   /* records still converting */
+    int failed; /* records that failed, malformed ones included */
+} Claim;
+
+/* One pipeline run over the records of several claimed chunks. */
+typedef struct {
+    Shard *sh;
+    const Manifest *m;
+    BWBatchItem *items;
+    bool json;
+    Claim *claims;
+    int claimCount;
+    const BWBatchItem *run; /* the items handed to the pipeline */
+    const int *runIndex;    /* the record of each */
+    int *failed;
+    ErrorCode result;
+} ShardRun;
+
+/* A lease held by someone else, as last seen: unchanged for a full lease
+ * period on our own clock means its holder is gone. Clocks never compare
+ * across machines. */
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    double seenAt; /* 0: not seen yet */
+} LeaseSeen;
+
+static double nowSeconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool shardPath(char *dst, const Shard *sh, int chunk, const char *ext,
+                      const char *owner) {
+    int n = chunk < 0 ? snprintf(dst, PATH_MAX, "%s/%s%s%s", sh->dir, ext,
+                                 owner ? "." : "", owner ? owner : "")
+                      : snprintf(dst, PATH_MAX, "%s/%06d.%s%s%s", sh->dir, chunk, ext,
+                                 owner ? "." : "", owner ? owner : "");
+    return n > 0 && n < PATH_MAX;
+}
+
+/* Write `len` bytes to a new file at `tmp`, then move it to `path`; with
+ * `keep` only if `path` does not exist yet. Readers never see a partial file. */
+static ErrorCode publishFile(const char *tmp, const char *path, const char *data,
+                             size_t len, bool keep) {
+    FILE *fp = fopen(tmp, "w");
+    if (!fp)
+        return ERR_WRITE;
+    bool ok = fwrite(data, 1, len, fp) == len;
+    ok = fclose(fp) == 0 && ok;
+    if (ok && keep)
+        ok = !link(tmp, path) || errno == EEXIST;
+    else if (ok)
+        ok = !rename(tmp, path);
+    if (keep || !ok)
+        unlink(tmp);
+    return ok ? ERR_OK : ERR_WRITE;
+}
+
+/* Hash of every record as parsed (line, fields), so a manifest read from a
+ * pipe identifies the same as from its file. */
+static uint64_t manifestHash(const Manifest *m) {
+    uint64_t h = 0;
+    for (int i = 0; i < m->count; i++) {
+        const Record *rec = &m->rec[i];
+        h = cacheHash(&rec->line, sizeof(rec->line), h);
+        for (int c = 0; c < COLS; c++) {
+            const char *f = rec->field[c] ? rec->field[c] : "";
+            h = cacheHash(f, strlen(f) + 1, h); /* the NUL separates fields */
+        }
+    }
+    return h;
+}
+
+/* All workers of a job must agree on its manifest, defaults, chunking and
+ * result format; the first to arrive records them. */
+static ErrorCode checkJob(const Shard *sh, const Manifest *m, const BWConfig *defaults,
+                          bool json) {
+    char want[192], got[192] = "", path[PATH_MAX], tmp[PATH_MAX];
+    int n = snprintf(want, sizeof(want),
+                     "bw-shard items %d chunk %d results %s manifest %016llx settings "
+                     "%016llx\n",
+                     m->count, SHARD_CHUNK, json ? "jsonl" : "csv",
+                     (unsigned long long)manifestHash(m),
+                     (unsigned long long)cacheKey(0, defaults, defaults->outputFormat));
+    if (!shardPath(path, sh, -1, "job", NULL) || !shardPath(tmp, sh, -1, "job", sh->owner) ||
+        publishFile(tmp, path, want, n, true) != ERR_OK)
+        return ERR_WRITE;
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return ERR_LOAD;
+    if (!fgets(got, sizeof(got), fp))
+        got[0] = '\0';
+    fclose(fp);
+    return strcmp(want, got) ? ERR_CONFIG : ERR_OK;
+}
+
+static bool chunkDone(const Shard *sh, int chunk) {
+    char path[PATH_MAX];
+    return shardPath(path, sh, chunk, "done", NULL) && !access(path, F_OK);
+}
+
+/* A new lease on `chunk`, or -1 with errno EEXIST while someone holds it. */
+static int claimChunk(const Shard *sh, int chunk) {
+    char path[PATH_MAX], line[128];
+    if (!shardPath(path, sh, chunk, "lease", NULL))
+        return -1;
+    int fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd >= 0) {
+        int n = snprintf(line, sizeof(line), "%s\n", sh->owner);
+        if (write(fd, line, n) != n) {
+            unlink(path);
+            close(fd);
+            fd = -1;
+        }
+    }
+    return fd;
+}
+
+/* Whether the lease on `chunk` has gone unrenewed for a lease period;
+ * true as well when it has just disappeared. */
+static bool leaseStale(const Shard *sh, int chunk, LeaseSeen *seen) {
+    char path[PATH_MAX];
+    struct stat st;
+    if (!shardPath(path, sh, chunk, "lease", NULL))
+        return false;
+    if (stat(path, &st))
+        return errno == ENOENT;
+    double now = nowSeconds();
+    if (!seen->seenAt || st.st_dev != seen->dev || st.st_ino != seen->ino ||
+        st.st_mtim.tv_sec != seen->mtime.tv_sec || st.st_mtim.tv_nsec != seen->mtime.tv_nsec) {
+        *seen = (LeaseSeen){st.st_dev, st.st_ino, st.st_mtim, now};
+        return false;
+    }
+    return now - seen->seenAt > sh->leaseSeconds;
+}
+
+/* Take over a stale lease. Renaming it away succeeds for one worker only;
+ * if what it moved is not the lease judged stale (its holder was replaced
+ * meanwhile), it is put back. */
+static int stealChunk(const Shard *sh, int chunk, const LeaseSeen *seen) {
+    char path[PATH_MAX], moved[PATH_MAX];
+    struct stat st;
+    if (!shardPath(path, sh, chunk, "lease", NULL) ||
+        !shardPath(moved, sh, chunk, "stale", sh->owner))
+        return -1;
+    if (rename(path, moved))
+        return errno == ENOENT ? claimChunk(sh, chunk) : -1;
+    bool same = !stat(moved, &st) && st.st_dev == seen->dev && st.st_ino == seen->ino;
+    if (!same && link(moved, path) && errno == EEXIST)
+        same = false; /* someone claimed it already; its holder finds out at the end */
+    unlink(moved);
+    return same ? claimChunk(sh, chunk) : -1;
+}
+
+static void releaseLease(const Shard *sh, int chunk) {
+    char path[PATH_MAX];
+    if (shardPath(path, sh, chunk, "lease", NULL))
+        unlink(path);
+}
+
+/* Whether `fd` is still the lease of `chunk`, i.e. nobody took it over. */
+static bool holdsLease(const Shard *sh, int chunk, int fd) {
+    char path[PATH_MAX];
+    struct stat a, b;
+    return shardPath(path, sh, chunk, "lease", NULL) && !stat(path, &a) && !fstat(fd, &b) &&
+           a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+}
+
+static void *renewLeases(void *arg) {
+    Shard *sh = arg;
+    pthread_mutex_lock(&sh->lock);
+    while (!sh->stopRenewing) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += sh->leaseSeconds / 3 > 0 ? sh->leaseSeconds / 3 : 1;
+        pthread_cond_timedwait(&sh->wake, &sh->lock, &until);
+        for (int k = 0; k < SHARD_CLAIM; k++)
+            if (sh->leaseFd[k] >= 0)
+                futimens(sh->leaseFd[k], NULL); /* the new mtime is the renewal */
+    }
+    pthread_mutex_unlock(&sh->lock);
+    return NULL;
+}
+
+static void setRenewed(Shard *sh, int slot, int fd) {
+    pthread_mutex_lock(&sh->lock);
+    sh->leaseFd[slot] = fd;
+    pthread_mutex_unlock(&sh->lock);
+}
+
+/* Publish the results of a claimed chunk whose records have all finished,
+ * unless the lease was lost meanwhile; then the new holder publishes its
+ * own. */
+static void publishChunk(ShardRun *sr, Claim *cl) {
+    Shard *sh = sr->sh;
+    int first = cl->chunk * SHARD_CHUNK;
+    int end = first + SHARD_CHUNK < sr->m->count ? first + SHARD_CHUNK : sr->m->count;
+    setRenewed(sh, (int)(cl - sr->claims), -1);
+    char path[PATH_MAX], tmp[PATH_MAX];
+    char *rows = NULL;
+    size_t len = 0;
+    FILE *mem = open_memstream(&rows, &len);
+    ErrorCode r = mem ? ERR_OK : ERR_MEMORY;
+    if (mem) {
+        writeRows(mem, sr->m, sr->items, first, end, sr->json);
+        r = fclose(mem) ? ERR_MEMORY : ERR_OK;
+    }
+    if (r == ERR_OK && !holdsLease(sh, cl->chunk, cl->fd)) {
+        if (sh->verbose)
+            fprintf(stderr, "Shard %d: lease lost, results dropped\n", cl->chunk);
+    } else if (r == ERR_OK) {
+        if (!shardPath(path, sh, cl->chunk, "done", NULL) ||
+            !shardPath(tmp, sh, cl->chunk, "done", sh->owner))
+            r = ERR_WRITE;
+        else
+            r = publishFile(tmp, path, rows, len, false);
+        releaseLease(sh, cl->chunk);
+        *sr->failed += cl->failed;
+        if (sh->verbose)
+            fprintf(stderr, "Shard %d: records %d-%d, %d failed\n", cl->chunk, first + 1,
+                    end, cl->failed);
+    }
+    free(rows);
+    if (r != ERR_OK && sr->result == ERR_OK)
+        sr->result = r;
+}
+
+static Claim *claimOf(ShardRun *sr, int record) {
+    for (int k = 0; k < sr->claimCount; k++)
+        if (sr->claims[k].chunk == record / SHARD_CHUNK)
+            return &sr->claims[k];
+    return NULL;
+}
+
+/* Pipeline callback: a chunk is published as soon as its last record is. */
+static void shardItemDone(const BWBatchItem *item, void *user) {
+    ShardRun *sr = user;
+    int i = sr->runIndex[item - sr->run];
+    Claim *cl = claimOf(sr, i);
+    sr->items[i] = *item;
+    cl->failed += item->result != ERR_OK;
+    if (--cl->left == 0)
+        publishChunk(sr, cl);
+}
+
+/* Convert the records of all claimed chunks in one pipeline run, so its
+ * threads and I/O ring start once and longest-first ordering spans them
+ * all. */
+static ErrorCode runClaims(Shard *sh, Manifest *m, BWBatchItem *items, Claim *claims,
+                           int claimCount, const BWConfig *defaults,
+                           const BWPipelineConfig *pipeline, bool json, int *failed) {
+    int n = claimCount * SHARD_CHUNK;
+    BWBatchItem *run = calloc(n, sizeof(*run));
+    int *runIndex = malloc(n * sizeof(*runIndex));
+    if (!run || !runIndex) {
+        free(run);
+        free(runIndex);
+        return ERR_MEMORY;
+    }
+    ShardRun sr = {sh, m, items, json, claims, claimCount, run, runIndex, failed, ERR_OK};
+    int runCount = 0;
+    for (int k = 0; k < claimCount; k++) {
+        Claim *cl = &claims[k];
+        int first = cl->chunk * SHARD_CHUNK;
+        int end = first + SHARD_CHUNK < m->count ? first + SHARD_CHUNK : m->count;
+        cl->left = cl->failed = 0;
+        for (int i = first; i < end; i++) {
+            Record *rec = &m->rec[i];
+            items[i] = (BWBatchItem){.result = rec->parse};
+            if (rec->parse != ERR_OK) {
+                metricResult(rec->parse);
+                cl->failed++;
+                continue;
+            }
+            cl->left++;
+            runIndex[runCount] = i;
+            run[runCount++] = (BWBatchItem){.input = rec->field[COL_INPUT],
+                                            .output = rec->field[COL_OUTPUT],
+                                            .config = &m->configs[rec->configIndex]};
+        }
+        setRenewed(sh, k, cl->fd);
+    }
+    for (int k = 0; k < claimCount; k++)
+        if (!claims[k].left)
+            publishChunk(&sr, &claims[k]); /* nothing but malformed records */
+    convert_pipeline_bw(run, runCount, defaults, pipeline, shardItemDone, &sr, NULL);
+    for (int k = 0; k < claimCount; k++)
+        setRenewed(sh, k, -1); /* also for chunks left unpublished */
+    free(run);
+    free(runIndex);
+    return sr.result;
+}
+
+/* Once every chunk is done: the results of all of them, in manifest order. */
+static ErrorCode mergeResults(const Shard *sh, const char *results_path, int chunks,
+                              bool json) {
+    char path[PATH_MAX], tmp[PATH_MAX];
+    bool stdio = isStdioPath(results_path);
+    if (!stdio && snprintf(tmp, sizeof(tmp), "%s.%s", results_path, sh->owner) >= PATH_MAX)
+        return ERR_WRITE;
+    FILE *fp = stdio ? stdout : fopen(tmp, "w");
+    if (!fp)
+        return ERR_WRITE;
+    if (!json)
+        fputs(RESULTS_HEADER, fp);
+    ErrorCode r = ERR_OK;
+    char buf[1 << 16];
+    for (int c = 0; r == ERR_OK && c < chunks; c++) {
+        FILE *in = shardPath(path, sh, c, "done", NULL) ? fopen(path, "r") : NULL;
+        if (!in) {
+            r = ERR_LOAD;
+            break;
+        }
+        for (size_t n; (n = fread(buf, 1, sizeof(buf), in)) > 0;)
+            fwrite(buf, 1, n, fp);
+        fclose(in);
+    }
+    if ((ferror(fp) | !closeOutput(fp)) && r == ERR_OK)
+        r = ERR_WRITE;
+    /* every worker merges; each replaces the file whole */
+    if (!stdio && (r != ERR_OK || rename(tmp, results_path))) {
+        unlink(tmp);
+        r = r == ERR_OK ? ERR_WRITE : r;
+    }
+    return r;
+}
+
+int convert_shard_bw(const char *manifest_path, const char *work_dir,
+                     const char *results_path, const BWConfig *defaults,
+                     const BWPipelineConfig *pipeline, int lease_seconds, int *failed,
+                     const volatile sig_atomic_t *stop) {
+    Shard sh = {.dir = work_dir,
+                .leaseSeconds = lease_seconds > 0 ? lease_seconds : 60,
+                .verbose = defaults->verboseMode,
+                .lock = PTHREAD_MUTEX_INITIALIZER,
+                .wake = PTHREAD_COND_INITIALIZER};
+    for (int k = 0; k < SHARD_CLAIM; k++)
+        sh.leaseFd[k] = -1;
+    char host[64] = "host";
+    gethostname(host, sizeof(host) - 1);
+    snprintf(sh.owner, sizeof(sh.owner), "%s.%ld", host, (long)getpid());
+    bool json = jsonResults(results_path);
+    if (failed)
+        *failed = 0;
+
+    Manifest m = {0};
+    ErrorCode r = loadManifest(&m, manifest_path);
+    int chunks = (m.count + SHARD_CHUNK - 1) / SHARD_CHUNK;
+    BWBatchItem *items = calloc(m.count ? m.count : 1, sizeof(*items));
+    LeaseSeen *seen = calloc(chunks ? chunks : 1, sizeof(*seen));
+    if (r == ERR_OK && (!items || !seen))
+        r = ERR_MEMORY;
+    if (r == ERR_OK)
+        r = prepareRecords(&m, defaults);
+    if (r == ERR_OK && mkdir(work_dir, 0777) && errno != EEXIST)
+        r = ERR_WRITE;
+    if (r == ERR_OK)
+        r = checkJob(&sh, &m, defaults, json);
+    pthread_t renewer;
+    bool renewing = r == ERR_OK && !pthread_create(&renewer, NULL, renewLeases, &sh);
+    if (r == ERR_OK && !renewing)
+        r = ERR_MEMORY;
+
+    /* Sweep the chunks, claiming up to SHARD_CLAIM free or stale ones and
+     * converting them together, until all are done. A worker with nothing
+     * left to claim keeps watching the others' leases, so it recovers the
+     * chunks of one that dies. */
+    int bad = 0, remaining = chunks;
+    while (r == ERR_OK && remaining && !(stop && *stop)) {
+        Claim claims[SHARD_CLAIM];
+        int claimed = 0;
+        remaining = 0;
+        for (int c = 0; c < chunks && !(stop && *stop); c++) {
+            if (chunkDone(&sh, c))
+                continue;
+            if (claimed == SHARD_CLAIM) {
+                remaining++;
+                continue;
+            }
+            int fd = claimChunk(&sh, c);
+            bool recovered = fd < 0 && errno == EEXIST && leaseStale(&sh, c, &seen[c]);
+            if (recovered)
+                fd = stealChunk(&sh, c, &seen[c]);
+            if (fd < 0) {
+                remaining++;
+                continue;
+            }
+            if (recovered && sh.verbose)
+                fprintf(stderr, "Shard %d: lease expired, taken over\n", c);
+            /* done by another worker between the check and the claim */
+            if (chunkDone(&sh, c)) {
+                releaseLease(&sh, c);
+                close(fd);
+                continue;
+            }
+            claims[claimed++] = (Claim){.chunk = c, .fd = fd};
+        }
+        if (claimed)
+            r = runClaims(&sh, &m, items, claims, claimed, defaults, pipeline, json, &bad);
+        for (int k = 0; k < claimed; k++) {
+            close(claims[k].fd);
+            if (!chunkDone(&sh, claims[k].chunk))
+                remaining++; /* the lease was lost */
+        }
+        if (r == ERR_OK && remaining && !claimed)
+            for (int waited = 0; waited < SHARD_POLL_MS && !(stop && *stop); waited += 100)
+                usleep(100 * 1000);
+    }
+    if (renewing) {
+        pthread_mutex_lock(&sh.lock);
+        sh.stopRenewing = true;
+        pthread_cond_signal(&sh.wake);
+        pthread_mutex_unlock(&sh.lock);
+        pthread_join(renewer, NULL);
+    }
+    if (r == ERR_OK && !remaining)
+        r = mergeResults(&sh, results_path, chunks, json);
+    if (failed)
+        *failed = bad;
+    free(items);
+    free(seen);
+    freeManifest(&m);
+    return r;
+}
@@ -0,0 +1,407 @@
+/*
+ * File: bw_metrics.c
+ * ---------------------------
+ * Description:
+ *   Counters for long-running modes, exported in the Prometheus text format
+ *   over HTTP on localhost or as a file rewritten periodically.
+ *
+ *   Every thread that records gets its own block of counters, so the hot
+ *   path never shares a cache line or takes a lock. A block has one writer,
+ *   which adds with a relaxed load and store instead of an atomic
+ *   read-modify-write. A report sums all blocks. When a thread exits, its
+ *   block goes back on the list for the next new thread, with its counts
+ *   kept, so short-lived batch threads do not make the list grow.
+ *
+ *   Recorded: per-image time of each stage (decode, luma, diffuse, encode,
+ *   write) as histograms, pixels dithered and bytes read and written, the
+ *   outcome of every job by ErrorCode, and queue depths as gauges. Reports
+ *   add rates since the previous report and the process's peak resident
+ *   memory.
+ *
+ * Author: Bahey Shalash
+ * Version: 2.1.2
+ * Date: 19/04/2025
+ */
+#include <arpa/inet.h>
+#include <errno.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bw_internal.h"
+
+#define METRIC_RESULTS (ERR_DEADLINE + 1)
+#define STOP_POLL_MS 200
+
+/* Upper bounds of the stage histogram buckets, in microseconds; one more
+ * bucket takes everything above. */
+static const uint64_t BUCKET_US[] = {500,    1000,   2500,   5000,    10000,   25000,  50000,
+                                     100000, 250000, 500000, 1000000, 2500000, 5000000};
+#define BUCKETS (sizeof(BUCKET_US) / sizeof(BUCKET_US[0]) + 1)
+
+static const char *const STAGE_NAME[METRIC_STAGES] = {"decode", "luma", "diffuse", "encode",
+                                                      "write"};
+static const char *const QUEUE_NAME[METRIC_QUEUES] = {
+    "serve_interactive", "serve_batch", "pipeline_dither", "pipeline_encode", "watch"};
+static const char *const RESULT_NAME[METRIC_RESULTS] = {"ok",     "load", "memory",  "write",
+                                                        "config", "busy", "deadline"};
+
+typedef _Atomic uint64_t Counter;
+
+typedef struct Block {
+    struct Block *next;
+    atomic_bool taken;
+    Counter bucket[METRIC_STAGES][BUCKETS];
+    Counter stageCount[METRIC_STAGES];
+    Counter stageSumUs[METRIC_STAGES];
+    Counter pixels, bytesIn, bytesOut;
+    Counter results[METRIC_RESULTS];
+} Block;
+
+static struct {
+    _Atomic(Block *) blocks;
+    pthread_once_t once;
+    pthread_key_t key; /* hands a thread's block back when it exits */
+    atomic_int queue[METRIC_QUEUES];
+    /* reports */
+    pthread_mutex_t lock;
+    double lastMs;
+    uint64_t last[3]; /* pixels, bytes in, bytes out at lastMs */
+    /* exporters */
+    pthread_t server, dumper;
+    bool serving, dumping;
+    atomic_bool stop;
+    int listenFd;
+    char *dumpPath;
+    int intervalMs;
+} metrics = {.once = PTHREAD_ONCE_INIT, .lock = PTHREAD_MUTEX_INITIALIZER, .listenFd = -1};
+
+static _Thread_local Block *mine;
+
+static double nowMs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec * 1e-6;
+}
+
+static void giveBack(void *block) {
+    atomic_store_explicit(&((Block *)block)->taken, false, memory_order_release);
+}
+
+static void makeKey(void) {
+    pthread_key_create(&metrics.key, giveBack);
+}
+
+/* The calling thread's block: a free one from the list, or a new one. */
+static Block *ownBlock(void) {
+    if (mine)
+        return mine;
+    pthread_once(&metrics.once, makeKey);
+    Block *b = atomic_load_explicit(&metrics.blocks, memory_order_acquire);
+    for (; b; b = b->next) {
+        bool idle = false;
+        if (atomic_compare_exchange_strong_explicit(&b->taken, &idle, true,
+                                                    memory_order_acquire, memory_order_relaxed))
+            break;
+    }
+    if (!b) {
+        b = aligned_alloc(64, (sizeof(Block) + 63) / 64 * 64);
+        if (!b)
+            return NULL;
+        memset(b, 0, sizeof(*b));
+        atomic_init(&b->taken, true);
+        b->next = atomic_load_explicit(&metrics.blocks, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(&metrics.blocks, &b->next, b,
+                                                      memory_order_release,
+                                                      memory_order_relaxed))
+            ;
+    }
+    pthread_setspecific(metrics.key, b);
+    return mine = b;
+}
+
+/* Only the owning thread writes a block, so no read-modify-write is needed. */
+static inline void bump(Counter *c, uint64_t v) {
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + v,
+                          memory_order_relaxed);
+}
+
+static inline uint64_t peek(Counter *c) {
+    return atomic_load_explicit(c, memory_order_relaxed);
+}
+
+void metricStage(MetricStage stage, double ms) {
+    Block *b = ownBlock();
+    if (!b)
+        return;
+    uint64_t us = ms > 0.0 ? (uint64_t)(ms * 1e3) : 0;
+    size_t k = 0;
+    while (k < BUCKETS - 1 && us > BUCKET_US[k])
+        k++;
+    bump(&b->bucket[stage][k], 1);
+    bump(&b->stageCount[stage], 1);
+    bump(&b->stageSumUs[stage], us);
+}
+
+void metricPixels(uint64_t pixels) {
+    Block *b = ownBlock();
+    if (b)
+        bump(&b->pixels, pixels);
+}
+
+void metricBytes(uint64_t in, uint64_t out) {
+    Block *b = ownBlock();
+    if (b) {
+        bump(&b->bytesIn, in);
+        bump(&b->bytesOut, out);
+    }
+}
+
+void metricResult(int result) {
+    Block *b = ownBlock();
+    if (b && result >= 0 && result < METRIC_RESULTS)
+        bump(&b->results[result], 1);
+}
+
+void metricQueue(MetricQueue queue, int delta) {
+    atomic_fetch_add_explicit(&metrics.queue[queue], delta, memory_order_relaxed);
+}
+
+/* ---- Reports ---- */
+
+typedef struct {
+    uint64_t bucket[METRIC_STAGES][BUCKETS];
+    uint64_t stageCount[METRIC_STAGES];
+    uint64_t stageSumUs[METRIC_STAGES];
+    uint64_t totals[3];
+    uint64_t results[METRIC_RESULTS];
+} Snapshot;
+
+static void takeSnapshot(Snapshot *s) {
+    memset(s, 0, sizeof(*s));
+    for (Block *b = atomic_load_explicit(&metrics.blocks, memory_order_acquire); b;
+         b = b->next) {
+        for (int st = 0; st < METRIC_STAGES; st++) {
+            for (size_t k = 0; k < BUCKETS; k++)
+                s->bucket[st][k] += peek(&b->bucket[st][k]);
+            s->stageCount[st] += peek(&b->stageCount[st]);
+            s->stageSumUs[st] += peek(&b->stageSumUs[st]);
+        }
+        s->totals[0] += peek(&b->pixels);
+        s->totals[1] += peek(&b->bytesIn);
+        s->totals[2] += peek(&b->bytesOut);
+        for (int r = 0; r < METRIC_RESULTS; r++)
+            s->results[r] += peek(&b->results[r]);
+    }
+}
+
+int bw_metrics_write(FILE *fp) {
+    Snapshot s;
+    takeSnapshot(&s);
+    double rate[3] = {0.0, 0.0, 0.0};
+    pthread_mutex_lock(&metrics.lock);
+    double now = nowMs();
+    for (int i = 0; i < 3; i++) {
+        if (metrics.lastMs > 0.0 && now > metrics.lastMs)
+            rate[i] = (s.totals[i] - metrics.last[i]) * 1e3 / (now - metrics.lastMs);
+        metrics.last[i] = s.totals[i];
+    }
+    metrics.lastMs = now;
+    pthread_mutex_unlock(&metrics.lock);
+
+    fputs("# HELP bw_stage_seconds Time per image spent in each conversion stage.\n"
+          "# TYPE bw_stage_seconds histogram\n",
+          fp);
+    for (int st = 0; st < METRIC_STAGES; st++) {
+        uint64_t cumulative = 0;
+        for (size_t k = 0; k < BUCKETS; k++) {
+            cumulative += s.bucket[st][k];
+            if (k < BUCKETS - 1)
+                fprintf(fp, "bw_stage_seconds_bucket{stage=\"%s\",le=\"%g\"} %llu\n",
+                        STAGE_NAME[st], BUCKET_US[k] / 1e6, (unsigned long long)cumulative);
+            else
+                fprintf(fp, "bw_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n",
+                        STAGE_NAME[st], (unsigned long long)cumulative);
+        }
+        fprintf(fp, "bw_stage_seconds_sum{stage=\"%s\"} %.6f\n", STAGE_NAME[st],
+                s.stageSumUs[st] / 1e6);
+        fprintf(fp, "bw_stage_seconds_count{stage=\"%s\"} %llu\n", STAGE_NAME[st],
+                (unsigned long long)s.stageCount[st]);
+    }
+
+    static const char *const total[3][2] = {
+        {"bw_pixels", "Pixels dithered"},
+        {"bw_input_bytes", "Encoded input bytes decoded"},
+        {"bw_output_bytes", "Output bytes written"},
+    };
+    for (int i = 0; i < 3; i++) {
+        fprintf(fp, "# HELP %s_total %s.\n# TYPE %s_total counter\n%s_total %llu\n",
+                total[i][0], total[i][1], total[i][0], total[i][0],
+                (unsigned long long)s.totals[i]);
+        fprintf(fp,
+                "# HELP %s_per_second %s per second since the previous report.\n"
+                "# TYPE %s_per_second gauge\n%s_per_second %.1f\n",
+                total[i][0], total[i][1], total[i][0], total[i][0], rate[i]);
+    }
+
+    fputs("# HELP bw_results_total Finished jobs by outcome (ErrorCode).\n"
+          "# TYPE bw_results_total counter\n",
+          fp);
+    for (int r = 0; r < METRIC_RESULTS; r++)
+        fprintf(fp, "bw_results_total{result=\"%s\"} %llu\n", RESULT_NAME[r],
+                (unsigned long long)s.results[r]);
+
+    fputs("# HELP bw_queue_depth Jobs waiting in each queue.\n"
+          "# TYPE bw_queue_depth gauge\n",
+          fp);
+    for (int q = 0; q < METRIC_QUEUES; q++)
+        fprintf(fp, "bw_queue_depth{queue=\"%s\"} %d\n", QUEUE_NAME[q],
+                atomic_load_explicit(&metrics.queue[q], memory_order_relaxed));
+
+    struct rusage ru;
+    long peakKb = getrusage(RUSAGE_SELF, &ru) ? 0 : ru.ru_maxrss;
+    fprintf(fp,
+            "# HELP bw_memory_high_water_bytes Peak resident memory of the process.\n"
+            "# TYPE bw_memory_high_water_bytes gauge\nbw_memory_high_water_bytes %lld\n",
+            (long long)peakKb * 1024);
+    return ferror(fp) ? ERR_WRITE : ERR_OK;
+}
+
+/* ---- Exporters ---- */
+
+static void answer(int fd) {
+    char req[1024];
+    ssize_t n = recv(fd, req, sizeof(req) - 1, 0);
+    if (n <= 0)
+        return;
+    req[n] = '\0';
+    bool found = !strncmp(req, "GET /metrics ", 13) || !strncmp(req, "GET / ", 6);
+    char *body = NULL;
+    size_t len = 0;
+    FILE *mem = found ? open_memstream(&body, &len) : NULL;
+    if (mem) {
+        bw_metrics_write(mem);
+        fclose(mem);
+    }
+    char head[160];
+    int h = snprintf(head, sizeof(head),
+                     "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                     "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+                     body ? "200 OK" : found ? "500 Internal Server Error" : "404 Not Found",
+                     len);
+    if (send(fd, head, h, MSG_NOSIGNAL) == h && len)
+        send(fd, body, len, MSG_NOSIGNAL);
+    free(body);
+}
+
+static void *serveMetrics(void *arg) {
+    (void)arg;
+    while (!atomic_load(&metrics.stop)) {
+        struct pollfd pfd = {metrics.listenFd, POLLIN, 0};
+        if (poll(&pfd, 1, STOP_POLL_MS) <= 0)
+            continue;
+        int fd = accept(metrics.listenFd, NULL, NULL);
+        if (fd < 0)
+            continue;
+        struct timeval tv = {1, 0}; /* a stalled scraper cannot hold the thread */
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        answer(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+/* Replace the dump file whole, so readers never see half a report. */
+static ErrorCode dumpOnce(const char *path) {
+    char tmp[PATH_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+        return ERR_WRITE;
+    FILE *fp = fopen(tmp, "w");
+    if (!fp)
+        return ERR_WRITE;
+    ErrorCode r = bw_metrics_write(fp);
+    if (fclose(fp) || r != ERR_OK || rename(tmp, path)) {
+        unlink(tmp);
+        return ERR_WRITE;
+    }
+    return ERR_OK;
+}
+
+static void *dumpMetrics(void *arg) {
+    (void)arg;
+    while (!atomic_load(&metrics.stop)) {
+        for (int waited = 0; waited < metrics.intervalMs && !atomic_load(&metrics.stop);
+             waited += STOP_POLL_MS)
+            usleep(STOP_POLL_MS * 1000);
+        dumpOnce(metrics.dumpPath); /* the last one after stopping, too */
+    }
+    return NULL;
+}
+
+int bw_metrics_serve(int port) {
+    if (metrics.serving || port <= 0 || port > 65535)
+        return ERR_CONFIG;
+    struct sockaddr_in addr = {.sin_family = AF_INET,
+                               .sin_port = htons((uint16_t)port),
+                               .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int on = 1;
+    if (fd >= 0)
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 16)) {
+        if (fd >= 0)
+            close(fd);
+        return ERR_LOAD;
+    }
+    metrics.listenFd = fd;
+    atomic_store(&metrics.stop, false);
+    if (pthread_create(&metrics.server, NULL, serveMetrics, NULL)) {
+        close(fd);
+        metrics.listenFd = -1;
+        return ERR_MEMORY;
+    }
+    metrics.serving = true;
+    return ERR_OK;
+}
+
+int bw_metrics_dump(const char *path, int interval_ms) {
+    if (metrics.dumping || !path)
+        return ERR_CONFIG;
+    if (dumpOnce(path) != ERR_OK)
+        return ERR_WRITE;
+    metrics.dumpPath = strdup(path);
+    metrics.intervalMs = interval_ms > 0 ? interval_ms : 10000;
+    atomic_store(&metrics.stop, false);
+    if (!metrics.dumpPath || pthread_create(&metrics.dumper, NULL, dumpMetrics, NULL)) {
+        free(metrics.dumpPath);
+        metrics.dumpPath = NULL;
+        return ERR_MEMORY;
+    }
+    metrics.dumping = true;
+    return ERR_OK;
+}
+
+void bw_metrics_stop(void) {
+    atomic_store(&metrics.stop, true);
+    if (metrics.serving) {
+        pthread_join(metrics.server, NULL);
+        close(metrics.listenFd);
+        metrics.listenFd = -1;
+        metrics.serving = false;
+    }
+    if (metrics.dumping) {
+        pthread_join(metrics.dumper, NULL);
+        free(metrics.dumpPath);
+        metrics.dumpPath = NULL;
+        metrics.dumping = false;
+    }
+}
@@ -0,0 +1,142 @@
+/*
+ * File: bw_palette.c
+ * ---------------------------
+ * Description:
+ *   Floyd–Steinberg error diffusion of RGB input straight to a small fixed
+ *   palette, for multi-colour silkscreen and indexed PNG output.
+ *
+ *   The nearest palette entry is read from a 32x32x32 lookup table built
+ *   once per conversion, so the per-pixel cost does not grow with the
+ *   palette size. Error is carried in two rolling rows of 4-float vectors
+ *   (RGB + pad) instead of a full-image buffer, which keeps the working
+ *   set in cache and lets the compiler use SIMD for the error updates.
+ *
+ * Author: Bahey Shalash
+ * Version: 2.1.2
+ * Date: 19/04/2025
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bw_internal.h"
+
+#define LUT_BITS 5
+#define LUT_SIDE (1 << LUT_BITS)
+#define LUT_SHIFT (8 - LUT_BITS)
+
+typedef float v4f __attribute__((vector_size(16)));
+
+typedef struct {
+    const char *name;
+    int size;
+    unsigned char rgb[3 * 16];
+} PalettePreset;
+
+static const PalettePreset PRESETS[] = {
+    {"rgb8", 8, {0,   0,   0,   255, 0,   0,   0,   255, 0,   255, 255, 0,
+                 0,   0,   255, 255, 0,   255, 0,   255, 255, 255, 255, 255}},
+    {"ega16", 16, {0,   0,   0,   0,   0,   170, 0,   170, 0,   0,   170, 170,
+                   170, 0,   0,   170, 0,   170, 170, 85,  0,   170, 170, 170,
+                   85,  85,  85,  85,  85,  255, 85,  255, 85,  85,  255, 255,
+                   255, 85,  85,  255, 85,  255, 255, 255, 85,  255, 255, 255}},
+    {"gray4", 4, {0, 0, 0, 85, 85, 85, 170, 170, 170, 255, 255, 255}},
+};
+
+int bw_palette_preset(const char *name, BWConfig *config) {
+    for (size_t i = 0; i < sizeof(PRESETS) / sizeof(PRESETS[0]); i++) {
+        if (!strcmp(PRESETS[i].name, name)) {
+            config->paletteSize = PRESETS[i].size;
+            memcpy(config->palette, PRESETS[i].rgb, 3 * PRESETS[i].size);
+            return ERR_OK;
+        }
+    }
+    return ERR_CONFIG;
+}
+
+/* Nearest entry for the centre of every LUT cell, weighted 3:4:2 for R:G:B. */
+static void buildLUT(unsigned char *lut, const unsigned char *pal, int n) {
+    for (int r = 0; r < LUT_SIDE; r++)
+        for (int g = 0; g < LUT_SIDE; g++)
+            for (int b = 0; b < LUT_SIDE; b++) {
+                int cr = (r << LUT_SHIFT) + (1 << (LUT_SHIFT - 1));
+                int cg = (g << LUT_SHIFT) + (1 << (LUT_SHIFT - 1));
+                int cb = (b << LUT_SHIFT) + (1 << (LUT_SHIFT - 1));
+                int best = 0, bestDist = 0x7FFFFFFF;
+                for (int k = 0; k < n; k++) {
+                    int dr = cr - pal[3 * k], dg = cg - pal[3 * k + 1],
+                        db = cb - pal[3 * k + 2];
+                    int d = 3 * dr * dr + 4 * dg * dg + 2 * db * db;
+                    if (d < bestDist) {
+                        bestDist = d;
+                        best = k;
+                    }
+                }
+                lut[(r << (2 * LUT_BITS)) | (g << LUT_BITS) | b] = (unsigned char)best;
+            }
+}
+
+static inline float clamp255(float v) {
+    return v < 0.0f ? 0.0f : v > 255.0f ? 255.0f : v;
+}
+
+ErrorCode ditherPalette(const unsigned char *rgb, int w, int h, const BWConfig *cfg,
+                        BWBitmap *bm) {
+    int n = cfg->paletteSize;
+    size_t rowLen = (size_t)w + 2; /* one pad vector either side */
+    unsigned char *lut = malloc(LUT_SIDE * LUT_SIDE * LUT_SIDE);
+    v4f *rows = aligned_alloc(sizeof(v4f), 2 * rowLen * sizeof(v4f));
+    unsigned char *idx = malloc(w);
+    bm->w = w;
+    bm->h = h;
+    bm->bpp = n <= 2 ? 1 : n <= 4 ? 2 : n <= 16 ? 4 : 8;
+    bm->stride = (w * bm->bpp + 7) / 8;
+    bm->bits = malloc((size_t)bm->stride * h);
+    if (!lut || !rows || !idx || !bm->bits) {
+        free(lut);
+        free(rows);
+        free(idx);
+        free(bm->bits);
+        return ERR_MEMORY;
+    }
+
+    bm->paletteSize = n;
+    for (int i = 0; i < 3 * n; i++)
+        bm->palette[i] = cfg->invertOutput ? 255 - cfg->palette[i] : cfg->palette[i];
+
+    v4f pal[BW_MAX_PALETTE];
+    for (int k = 0; k < n; k++)
+        pal[k] = (v4f){cfg->palette[3 * k], cfg->palette[3 * k + 1],
+                       cfg->palette[3 * k + 2], 0.0f};
+    buildLUT(lut, cfg->palette, n);
+
+    memset(rows, 0, 2 * rowLen * sizeof(v4f));
+    for (int y = 0; y < h; y++) {
+        if (y % SCHED_ROWS == 0)
+            schedulePoint();
+        v4f *cur = rows + (y & 1) * rowLen + 1;
+        v4f *next = rows + (~y & 1) * rowLen + 1;
+        memset(next - 1, 0, rowLen * sizeof(v4f));
+        const unsigned char *src = rgb + (size_t)3 * y * w;
+        for (int x = 0; x < w; x++) {
+            v4f v = (v4f){src[3 * x], src[3 * x + 1], src[3 * x + 2], 0.0f} + cur[x];
+            v = (v4f){clamp255(v[0]), clamp255(v[1]), clamp255(v[2]), 0.0f};
+            int k = lut[((int)v[0] >> LUT_SHIFT) << (2 * LUT_BITS) |
+                        ((int)v[1] >> LUT_SHIFT) << LUT_BITS | ((int)v[2] >> LUT_SHIFT)];
+            idx[x] = (unsigned char)k;
+            v4f e = v - pal[k];
+            cur[x + 1] += e * (7.0f / 16.0f);
+            next[x - 1] += e * (3.0f / 16.0f);
+            next[x] += e * (5.0f / 16.0f);
+            next[x + 1] += e * (1.0f / 16.0f);
+        }
+        packLevelRow(bm->bits + (size_t)y * bm->stride, idx, w, bm->bpp, 0);
+        if (cfg->verboseMode && y % 50 == 0)
+            fprintf(stderr, "Row %d/%d\n", y, h);
+    }
+
+    free(lut);
+    free(rows);
+    free(idx);
+    return ERR_OK;
+}
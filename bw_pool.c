@@ -0,0 +1,508 @@
+/*
+ * File: bw_pool.c
+ * ---------------------------
+ * Description:
+ *   The library's thread pool. AM bands, CMYK planes and GIF frames share
+ *   it through parallelFor(), so nested parallel work (bands inside planes
+ *   inside a batch item) never starts more threads than the pool has.
+ *
+ *   Each worker owns a Chase–Lev deque. It pushes and pops its own work
+ *   LIFO at the bottom, while idle threads steal FIFO from the top. Threads
+ *   outside the pool submit through a shared lock-free queue. A thread
+ *   waiting for its parallelFor to finish runs other queued work instead
+ *   of sleeping, so nesting cannot deadlock and no core idles.
+ *
+ *   The pool starts on first use with bw_set_threads() threads (default:
+ *   all cores), or is replaced entirely by an executor from
+ *   bw_set_executor().
+ *
+ *   Work has a class (BWPriority). Interactive tasks go on their own queue,
+ *   which every thread looks at first. Batch code calls schedulePoint() at
+ *   row-band boundaries: there it runs any queued interactive tasks, and it
+ *   parks while interactive threads plus running batch threads would exceed
+ *   the pool size. Batch work therefore only fills cores interactive work
+ *   leaves idle, and a preview waits at most one band for a core.
+ *
+ * Author: Bahey Shalash
+ * Version: 2.1.2
+ * Date: 19/04/2025
+ */
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bw_internal.h"
+
+#define MAX_POOL 64
+#define DEQUE_SIZE 256 /* power of two; a full deque runs work inline */
+#define INJECT_SIZE 1024
+#define IDLE_SPINS 64
+#define IDLE_WAIT_NS 10000000
+#define PARK_WAIT_NS 5000000 /* parked batch threads recheck this often */
+#define NO_CLASS (-1)
+
+/* One parallelFor. Helpers that start after the loop finished only drop
+ * their reference, so the job lives on the heap, not the caller's stack. */
+typedef struct {
+    BWTaskFn fn;
+    void *arg;
+    int count;
+    BWPriority priority;
+    double submittedMs;
+    atomic_int next;
+    atomic_int done;
+    atomic_int refs;
+} ForJob;
+
+typedef struct {
+    _Alignas(64) atomic_long top;    /* stolen from here */
+    _Alignas(64) atomic_long bottom; /* owner pushes and pops here */
+    _Atomic(ForJob *) slot[DEQUE_SIZE];
+} Deque;
+
+typedef struct {
+    Deque deque;
+    pthread_t thread;
+    int index;
+} Worker;
+
+typedef struct {
+    pthread_mutex_t lock; /* start/stop, configuration and sleeping */
+    pthread_cond_t wake;
+    int configured;       /* bw_set_threads(); 0 = all cores */
+    bool useExecutor;
+    BWExecutor executor;
+    Worker *workers;
+    int workerCount; /* deques to steal from; -1 = not started */
+    int running;     /* workers whose thread started */
+    BWQueue inject;  /* work submitted from outside the pool */
+    BWQueue urgent;  /* interactive work, from anywhere; kept across restarts */
+    atomic_bool urgentReady;
+    atomic_bool stop;
+    atomic_uint epoch; /* bumped after every submit */
+    atomic_int sleepers;
+    /* scheduling classes */
+    atomic_int active[BW_PRIORITY_COUNT]; /* threads running in each class */
+    atomic_int parked;
+    pthread_cond_t resume; /* an interactive thread left its class */
+    LatencyHist latency[BW_PRIORITY_COUNT];
+} Pool;
+
+static Pool pool = {.lock = PTHREAD_MUTEX_INITIALIZER,
+                    .wake = PTHREAD_COND_INITIALIZER,
+                    .resume = PTHREAD_COND_INITIALIZER,
+                    .workerCount = -1};
+static _Thread_local Worker *currentWorker;
+static _Thread_local int currentClass = NO_CLASS;
+
+static double nowMs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void deadlineIn(struct timespec *ts, long ns) {
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_nsec += ns;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+/* ---- Chase–Lev deque (fixed size) ---- */
+
+static bool dequePush(Deque *d, ForJob *job) {
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    long t = atomic_load_explicit(&d->top, memory_order_acquire);
+    if (b - t >= DEQUE_SIZE)
+        return false;
+    atomic_store_explicit(&d->slot[b & (DEQUE_SIZE - 1)], job, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    return true;
+}
+
+static ForJob *dequeTake(Deque *d) {
+    long b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long t = atomic_load_explicit(&d->top, memory_order_relaxed);
+    ForJob *job = NULL;
+    if (t <= b) {
+        job = atomic_load_explicit(&d->slot[b & (DEQUE_SIZE - 1)], memory_order_relaxed);
+        if (t == b) {
+            /* last item: race the thieves for it */
+            if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+                                                         memory_order_seq_cst,
+                                                         memory_order_relaxed))
+                job = NULL;
+            atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+        }
+    } else {
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    }
+    return job;
+}
+
+static ForJob *dequeSteal(Deque *d) {
+    long t = atomic_load_explicit(&d->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+    if (t >= b)
+        return NULL;
+    ForJob *job = atomic_load_explicit(&d->slot[t & (DEQUE_SIZE - 1)], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1, memory_order_seq_cst,
+                                                 memory_order_relaxed))
+        return NULL; /* another thief won; the caller looks elsewhere */
+    return job;
+}
+
+/* ---- Jobs ---- */
+
+static void releaseJob(ForJob *job) {
+    if (atomic_fetch_sub_explicit(&job->refs, 1, memory_order_acq_rel) == 1)
+        free(job);
+}
+
+static void runIndices(ForJob *job) {
+    for (int i; (i = atomic_fetch_add(&job->next, 1)) < job->count;) {
+        job->fn(job->arg, i);
+        atomic_fetch_add_explicit(&job->done, 1, memory_order_release);
+        if (job->priority == BW_PRIORITY_BATCH)
+            schedulePoint();
+    }
+}
+
+static void runHelper(void *arg) {
+    ForJob *job = arg;
+    latencyRecord(&pool.latency[job->priority], nowMs() - job->submittedMs);
+    int previous = schedEnter(job->priority);
+    runIndices(job);
+    schedLeave(previous);
+    releaseJob(job);
+}
+
+/* Interactive work first, then the own deque, then steal from the other
+ * workers, then outside work. */
+static ForJob *findWork(void) {
+    Worker *self = currentWorker;
+    void *injected;
+    if (atomic_load(&pool.urgentReady) && queueTryPop(&pool.urgent, &injected))
+        return injected;
+    ForJob *job = self ? dequeTake(&self->deque) : NULL;
+    int n = pool.workerCount;
+    int start = self ? self->index + 1 : 0;
+    for (int k = 0; !job && k < n; k++) {
+        Worker *victim = &pool.workers[(start + k) % n];
+        if (victim != self)
+            job = dequeSteal(&victim->deque);
+    }
+    if (!job && queueTryPop(&pool.inject, &injected))
+        job = injected;
+    return job;
+}
+
+static void *workerMain(void *arg) {
+    currentWorker = arg;
+    int idle = 0;
+    while (!atomic_load(&pool.stop)) {
+        unsigned epoch = atomic_load(&pool.epoch);
+        ForJob *job = findWork();
+        if (job) {
+            runHelper(job);
+            idle = 0;
+            continue;
+        }
+        if (++idle < IDLE_SPINS) {
+            sched_yield();
+            continue;
+        }
+        /* Sleep until the next submit; the epoch closes the lost-wakeup gap. */
+        pthread_mutex_lock(&pool.lock);
+        atomic_fetch_add(&pool.sleepers, 1);
+        if (atomic_load(&pool.epoch) == epoch && !atomic_load(&pool.stop)) {
+            struct timespec ts;
+            deadlineIn(&ts, IDLE_WAIT_NS);
+            pthread_cond_timedwait(&pool.wake, &pool.lock, &ts);
+        }
+        atomic_fetch_sub(&pool.sleepers, 1);
+        pthread_mutex_unlock(&pool.lock);
+        idle = 0;
+    }
+    currentWorker = NULL;
+    return NULL;
+}
+
+/* ---- Pool lifetime (callers hold pool.lock) ---- */
+
+static int configuredThreads(void) {
+    if (pool.useExecutor)
+        return pool.executor.threads > 0 ? pool.executor.threads : 1;
+    long n = pool.configured > 0    ? pool.configured
+             : tuning()->threads > 0 ? tuning()->threads
+                                     : sysconf(_SC_NPROCESSORS_ONLN);
+    return n < 1 ? 1 : n > MAX_POOL ? MAX_POOL : (int)n;
+}
+
+static void startPool(void) {
+    int n = configuredThreads() - 1; /* the calling thread takes part too */
+    pool.workerCount = pool.running = 0;
+    if (!atomic_load(&pool.urgentReady) && queueInit(&pool.urgent, INJECT_SIZE) == ERR_OK)
+        atomic_store(&pool.urgentReady, true);
+    if (n <= 0 || !atomic_load(&pool.urgentReady) ||
+        queueInit(&pool.inject, INJECT_SIZE) != ERR_OK)
+        return;
+    pool.workers = aligned_alloc(_Alignof(Worker), n * sizeof(*pool.workers));
+    if (!pool.workers) {
+        queueFree(&pool.inject);
+        return;
+    }
+    memset(pool.workers, 0, n * sizeof(*pool.workers));
+    atomic_store(&pool.stop, false);
+    for (int i = 0; i < n; i++)
+        pool.workers[i].index = i;
+    /* Fixed before any thread runs; a worker that fails to start leaves an
+     * empty deque behind, which thieves simply find empty. */
+    pool.workerCount = n;
+    for (int i = 0; i < n; i++)
+        if (pthread_create(&pool.workers[i].thread, NULL, workerMain, &pool.workers[i]) == 0)
+            pool.running++;
+}
+
+static void stopPool(void) {
+    if (pool.workerCount < 0)
+        return;
+    atomic_store(&pool.stop, true);
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock); /* sleeping workers need it to leave */
+    for (int i = 0; i < pool.running; i++)
+        pthread_join(pool.workers[i].thread, NULL);
+    pthread_mutex_lock(&pool.lock);
+    free(pool.workers);
+    pool.workers = NULL;
+    queueFree(&pool.inject);
+    pool.workerCount = -1;
+}
+
+/* ---- Public configuration ---- */
+
+void bw_set_threads(int threads) {
+    pthread_mutex_lock(&pool.lock);
+    stopPool();
+    pool.configured = threads > 0 ? threads : 0;
+    pthread_mutex_unlock(&pool.lock);
+}
+
+void bw_set_executor(const BWExecutor *executor) {
+    pthread_mutex_lock(&pool.lock);
+    stopPool();
+    pool.useExecutor = executor && executor->submit;
+    if (pool.useExecutor)
+        pool.executor = *executor;
+    pthread_mutex_unlock(&pool.lock);
+}
+
+void bw_shutdown(void) {
+    pthread_mutex_lock(&pool.lock);
+    stopPool();
+    pthread_mutex_unlock(&pool.lock);
+}
+
+void bw_queue_latency(BWLatency latency[BW_PRIORITY_COUNT], int reset) {
+    for (int c = 0; c < BW_PRIORITY_COUNT; c++)
+        latencyRead(&pool.latency[c], &latency[c], reset);
+}
+
+int poolThreads(void) {
+    pthread_mutex_lock(&pool.lock);
+    int n = configuredThreads();
+    pthread_mutex_unlock(&pool.lock);
+    return n;
+}
+
+/* ---- Latency histograms ---- */
+
+/* Microseconds below 8 get a bin each; above, eight bins per octave. */
+static int latencyBin(unsigned long long us) {
+    if (us < 8)
+        return (int)us;
+    int e = 63 - __builtin_clzll(us);
+    int bin = (e - 2) * 8 + (int)(us >> (e - 3) & 7);
+    return bin < LATENCY_BINS ? bin : LATENCY_BINS - 1;
+}
+
+static double binMidMs(int bin) {
+    if (bin < 8)
+        return bin / 1e3;
+    int e = bin / 8 + 2;
+    unsigned long long low = (unsigned long long)(8 + bin % 8) << (e - 3);
+    return (low + (1ull << (e - 3)) / 2.0) / 1e3;
+}
+
+void latencyRecord(LatencyHist *h, double ms) {
+    unsigned long long us = ms > 0.0 ? (unsigned long long)(ms * 1e3) : 0;
+    atomic_fetch_add_explicit(&h->bin[latencyBin(us)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sumUs, us, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+    unsigned long long max = atomic_load_explicit(&h->maxUs, memory_order_relaxed);
+    while (us > max && !atomic_compare_exchange_weak_explicit(
+                           &h->maxUs, &max, us, memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+void latencyRead(LatencyHist *h, BWLatency *out, bool reset) {
+    unsigned long long bins[LATENCY_BINS], n = 0;
+    for (int b = 0; b < LATENCY_BINS; b++) {
+        bins[b] = reset ? atomic_exchange(&h->bin[b], 0) : atomic_load(&h->bin[b]);
+        n += bins[b];
+    }
+    unsigned long long sum = reset ? atomic_exchange(&h->sumUs, 0) : atomic_load(&h->sumUs);
+    unsigned long long max = reset ? atomic_exchange(&h->maxUs, 0) : atomic_load(&h->maxUs);
+    if (reset)
+        atomic_store(&h->count, 0);
+    *out = (BWLatency){.count = n, .maxMs = max / 1e3, .meanMs = n ? sum / 1e3 / n : 0.0};
+    unsigned long long seen = 0, p50 = (n + 1) / 2, p99 = n - n / 100;
+    for (int b = 0; b < LATENCY_BINS && n; b++) {
+        if (seen < p50 && seen + bins[b] >= p50)
+            out->p50Ms = binMidMs(b);
+        if (seen < p99 && seen + bins[b] >= p99)
+            out->p99Ms = binMidMs(b);
+        seen += bins[b];
+    }
+    /* a bin's midpoint can lie past the largest sample */
+    out->p50Ms = out->p50Ms < out->maxMs ? out->p50Ms : out->maxMs;
+    out->p99Ms = out->p99Ms < out->maxMs ? out->p99Ms : out->maxMs;
+}
+
+/* ---- Scheduling classes ---- */
+
+int schedEnter(BWPriority p) {
+    int previous = currentClass;
+    if (previous != (int)p) {
+        if (previous != NO_CLASS)
+            atomic_fetch_sub(&pool.active[previous], 1);
+        atomic_fetch_add(&pool.active[p], 1);
+        currentClass = p;
+    }
+    return previous;
+}
+
+void schedLeave(int previous) {
+    int current = currentClass;
+    if (previous == current)
+        return;
+    atomic_fetch_sub(&pool.active[current], 1);
+    if (previous != NO_CLASS)
+        atomic_fetch_add(&pool.active[previous], 1);
+    currentClass = previous;
+    if (current == BW_PRIORITY_INTERACTIVE && atomic_load(&pool.parked) > 0) {
+        pthread_mutex_lock(&pool.lock);
+        pthread_cond_broadcast(&pool.resume);
+        pthread_mutex_unlock(&pool.lock);
+    }
+}
+
+static bool crowded(int limit) {
+    int interactive = atomic_load(&pool.active[BW_PRIORITY_INTERACTIVE]);
+    return interactive > 0 &&
+           interactive + atomic_load(&pool.active[BW_PRIORITY_BATCH]) > limit;
+}
+
+void schedulePoint(void) {
+    if (currentClass != BW_PRIORITY_BATCH)
+        return;
+    void *task;
+    while (atomic_load(&pool.urgentReady) && queueTryPop(&pool.urgent, &task))
+        runHelper(task);
+    if (!atomic_load(&pool.active[BW_PRIORITY_INTERACTIVE]))
+        return;
+    int limit = poolThreads();
+    if (!crowded(limit))
+        return;
+    /* Give the core to interactive work; not counted as running meanwhile. */
+    pthread_mutex_lock(&pool.lock);
+    atomic_fetch_sub(&pool.active[BW_PRIORITY_BATCH], 1);
+    atomic_fetch_add(&pool.parked, 1);
+    while (crowded(limit - 1)) {
+        struct timespec ts;
+        deadlineIn(&ts, PARK_WAIT_NS);
+        pthread_cond_timedwait(&pool.resume, &pool.lock, &ts);
+    }
+    atomic_fetch_sub(&pool.parked, 1);
+    atomic_fetch_add(&pool.active[BW_PRIORITY_BATCH], 1);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+/* ---- parallelFor ---- */
+
+static void submitInternal(ForJob *job) {
+    Worker *self = currentWorker;
+    bool queued = job->priority == BW_PRIORITY_INTERACTIVE
+                      ? queueTryPush(&pool.urgent, job)
+                  : self ? dequePush(&self->deque, job)
+                         : queueTryPush(&pool.inject, job);
+    if (!queued) {
+        releaseJob(job); /* the caller's own share covers it */
+        return;
+    }
+    atomic_fetch_add(&pool.epoch, 1);
+    if (atomic_load(&pool.sleepers) > 0) {
+        pthread_mutex_lock(&pool.lock);
+        pthread_cond_signal(&pool.wake);
+        pthread_mutex_unlock(&pool.lock);
+    }
+}
+
+void parallelFor(int count, int width, BWTaskFn fn, void *arg) {
+    pthread_mutex_lock(&pool.lock);
+    bool external = pool.useExecutor;
+    BWExecutor executor = pool.executor;
+    int limit = configuredThreads();
+    if (!external && pool.workerCount < 0)
+        startPool();
+    if (!external)
+        limit = pool.running + 1;
+    pthread_mutex_unlock(&pool.lock);
+
+    width = width > 0 && width < limit ? width : limit;
+    width = width < count ? width : count;
+    BWPriority priority = currentClass == BW_PRIORITY_BATCH ? BW_PRIORITY_BATCH
+                                                            : BW_PRIORITY_INTERACTIVE;
+    ForJob *job = width > 1 ? malloc(sizeof(*job)) : NULL;
+    if (!job) {
+        for (int i = 0; i < count; i++) {
+            fn(arg, i);
+            schedulePoint();
+        }
+        return;
+    }
+    job->fn = fn;
+    job->arg = arg;
+    job->count = count;
+    job->priority = priority;
+    job->submittedMs = nowMs();
+    atomic_init(&job->next, 0);
+    atomic_init(&job->done, 0);
+    atomic_init(&job->refs, width); /* the caller plus width - 1 helpers */
+    for (int i = 1; i < width; i++) {
+        if (external)
+            executor.submit(runHelper, job, executor.context);
+        else
+            submitInternal(job);
+    }
+
+    runIndices(job);
+    /* Indices still running elsewhere: help with other work meanwhile. */
+    while (atomic_load_explicit(&job->done, memory_order_acquire) < count) {
+        ForJob *other = external ? NULL : findWork();
+        if (other)
+            runHelper(other);
+        else
+            sched_yield();
+    }
+    releaseJob(job);
+}
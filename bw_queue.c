@@ -0,0 +1,132 @@
+/*
+ * File: bw_queue.c
+ * ---------------------------
+ * Description:
+ *   Bounded lock-free MPMC queue connecting the stages of a pipelined
+ *   batch. Every cell carries a sequence number. A producer claims a cell
+ *   whose sequence equals the head position, and a consumer claims one
+ *   whose sequence is one ahead of the tail, each with a single CAS. No
+ *   locks are taken, so a preempted thread never blocks the others.
+ *
+ * Author: Bahey Shalash
+ * Version: 2.1.2
+ * Date: 19/04/2025
+ */
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "bw_internal.h"
+
+#define SPIN_TRIES 64
+#define YIELD_TRIES 256
+#define SLEEP_NS 50000
+
+ErrorCode queueInit(BWQueue *q, int capacity) {
+    size_t n = 2;
+    while (n < (size_t)capacity)
+        n <<= 1;
+    q->cells = malloc(n * sizeof(*q->cells));
+    if (!q->cells)
+        return ERR_MEMORY;
+    for (size_t i = 0; i < n; i++)
+        atomic_init(&q->cells[i].seq, i);
+    q->mask = n - 1;
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    atomic_init(&q->depthSum, 0);
+    atomic_init(&q->pushes, 0);
+    atomic_init(&q->depthMax, 0);
+    return ERR_OK;
+}
+
+void queueFree(BWQueue *q) {
+    free(q->cells);
+    q->cells = NULL;
+}
+
+static void recordDepth(BWQueue *q, size_t pos) {
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    int depth = pos + 1 > tail ? (int)(pos + 1 - tail) : 0;
+    atomic_fetch_add_explicit(&q->depthSum, depth, memory_order_relaxed);
+    atomic_fetch_add_explicit(&q->pushes, 1, memory_order_relaxed);
+    int max = atomic_load_explicit(&q->depthMax, memory_order_relaxed);
+    while (depth > max && !atomic_compare_exchange_weak_explicit(
+                              &q->depthMax, &max, depth, memory_order_relaxed,
+                              memory_order_relaxed))
+        ;
+}
+
+bool queueTryPush(BWQueue *q, void *value) {
+    size_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+    QueueCell *cell;
+    for (;;) {
+        cell = &q->cells[pos & q->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->head, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            return false; /* full */
+        } else {
+            pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+        }
+    }
+    cell->value = value;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+    recordDepth(q, pos);
+    return true;
+}
+
+bool queueTryPop(BWQueue *q, void **value) {
+    size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    QueueCell *cell;
+    for (;;) {
+        cell = &q->cells[pos & q->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            return false; /* empty */
+        } else {
+            pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+        }
+    }
+    *value = cell->value;
+    atomic_store_explicit(&cell->seq, pos + q->mask + 1, memory_order_release);
+    return true;
+}
+
+/* Waiting is rare once the pipeline is primed, so it backs off rather than
+ * parking on a condition variable the fast path would have to signal. */
+static void backOff(int *tries) {
+    int n = (*tries)++;
+    if (n < SPIN_TRIES)
+        return;
+    if (n < YIELD_TRIES) {
+        sched_yield();
+        return;
+    }
+    struct timespec ts = {0, SLEEP_NS};
+    nanosleep(&ts, NULL);
+}
+
+void queuePush(BWQueue *q, void *value) {
+    for (int tries = 0; !queueTryPush(q, value);)
+        backOff(&tries);
+}
+
+void *queuePop(BWQueue *q) {
+    void *value;
+    for (int tries = 0; !queueTryPop(q, &value);)
+        backOff(&tries);
+    return value;
+}
@@ -0,0 +1,442 @@
+/*
+ * File: bw_screen.c
+ * ---------------------------
+ * Description:
+ *   Threshold-tile screening. An AM (clustered-dot) screen is described by
+ *   its line frequency, angle and dot shape; it is turned once into a small
+ *   periodic tile of thresholds, after which every pixel is a table lookup
+ *   and an unsigned compare. Rows are screened in independent bands on the
+ *   library pool, with the widest compare the CPU has (bw_simd.c).
+ *
+ *   The same machinery runs ordered (8x8 Bayer) dithering and plain
+ *   thresholding, the cheapest modes, used for video streams, and blue-noise
+ *   dithering: a 64x64 tile ranked by void-and-cluster, made once per
+ *   process, which costs the same as Bayer but shows no cross-hatch.
+ *
+ *   Rotated screens are made periodic with the rational-tangent method: the
+ *   cell vector (a, b) is rounded to integers, so the dot lattice repeats
+ *   after (a² + b²) / gcd(a, b) pixels in both directions.
+ *
+ * Author: Bahey Shalash
+ * Version: 2.1.2
+ * Date: 19/04/2025
+ */
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bw_internal.h"
+
+#define MAX_TILE 256
+#define MAX_THREADS 64
+#define BAND_ROWS 64 /* least rows per band without a profile */
+
+typedef struct {
+    int index;
+    float spot;
+} SpotCell;
+
+static int gcd(int a, int b) {
+    while (b) {
+        int t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+/* Higher values turn black first, so dots grow from the cell centre. */
+static float spotValue(BWDotShape shape, float fx, float fy) {
+    switch (shape) {
+        case BW_DOT_ELLIPSE:
+            return 1.0f - (fx * fx + fy * fy * 1.8f);
+        case BW_DOT_LINE:
+            return 1.0f - fabsf(fy);
+        case BW_DOT_SQUARE:
+            return 1.0f - fmaxf(fabsf(fx), fabsf(fy));
+        default:
+            return 1.0f - (fx * fx + fy * fy);
+    }
+}
+
+static int compareSpot(const void *a, const void *b) {
+    const SpotCell *x = a, *y = b;
+    if (x->spot != y->spot)
+        return x->spot < y->spot ? -1 : 1;
+    return x->index - y->index;
+}
+
+/* Integer cell vector closest to the requested screen whose tile fits MAX_TILE. */
+static void chooseCellVector(double cell, double angle, int *ra, int *rb, int *period) {
+    double ia = cell * cos(angle), ib = cell * sin(angle);
+    double bestErr = 1e30;
+    *ra = 1;
+    *rb = 0;
+    *period = 1;
+    for (int a = (int)floor(ia) - 3; a <= (int)ceil(ia) + 3; a++) {
+        for (int b = (int)floor(ib) - 3; b <= (int)ceil(ib) + 3; b++) {
+            if (a * a + b * b == 0)
+                continue;
+            int n = (a * a + b * b) / gcd(abs(a), abs(b));
+            double err = hypot(a - ia, b - ib) + (n > MAX_TILE ? 1e6 + n : 0.0);
+            if (err < bestErr) {
+                bestErr = err;
+                *ra = a;
+                *rb = b;
+                *period = n;
+            }
+        }
+    }
+}
+
+ErrorCode buildAMScreen(BWScreen *scr, const BWConfig *cfg, double angleDeg) {
+    int dpi = cfg->dpi > 0 ? cfg->dpi : BW_DEFAULT_DPI;
+    double lpi = cfg->screenLpi > 0 ? cfg->screenLpi : BW_DEFAULT_LPI;
+    double cell = dpi / lpi;
+    if (cell < 1.0)
+        return ERR_CONFIG;
+    int a, b, n;
+    chooseCellVector(cell, angleDeg * M_PI / 180.0, &a, &b, &n);
+    if (n > MAX_TILE)
+        return ERR_CONFIG;
+
+    SpotCell *cells = malloc((size_t)n * n * sizeof(*cells));
+    scr->thr = malloc((size_t)n * n);
+    if (!cells || !scr->thr) {
+        free(cells);
+        free(scr->thr);
+        return ERR_MEMORY;
+    }
+    scr->size = n;
+
+    double norm = (double)a * a + (double)b * b;
+    for (int y = 0; y < n; y++) {
+        for (int x = 0; x < n; x++) {
+            double px = x + 0.5, py = y + 0.5;
+            double s = (px * a + py * b) / norm, t = (py * a - px * b) / norm;
+            float fx = (float)(s - floor(s) - 0.5), fy = (float)(t - floor(t) - 0.5);
+            cells[y * n + x].index = y * n + x;
+            cells[y * n + x].spot = -spotValue(cfg->dotShape, fx, fy);
+        }
+    }
+    /* Rank order gives every gray level its exact share of black pixels. */
+    qsort(cells, (size_t)n * n, sizeof(*cells), compareSpot);
+    int count = n * n;
+    for (int r = 0; r < count; r++) {
+        int v = (int)((r + 0.5) * 256.0 / count);
+        scr->thr[cells[r].index] = (unsigned char)(v < 1 ? 1 : v > 255 ? 255 : v);
+    }
+    free(cells);
+
+    if (cfg->verboseMode)
+        fprintf(stderr, "AM screen: %.1f lpi at %.1f deg, %dx%d tile\n",
+                dpi / sqrt(norm), atan2(b, a) * 180.0 / M_PI, n, n);
+    return ERR_OK;
+}
+
+/* Bayer index: bit-reversed interleave of (x ^ y, y), so consecutive ranks
+ * are as far apart as possible. The tile is rolled by (dx, dy). */
+static ErrorCode buildBayerScreen(BWScreen *scr, int dx, int dy) {
+    enum { BAYER_BITS = 3, BAYER = 1 << BAYER_BITS };
+    scr->thr = malloc(BAYER * BAYER);
+    if (!scr->thr)
+        return ERR_MEMORY;
+    scr->size = BAYER;
+    for (int y = 0; y < BAYER; y++) {
+        int v = (y + dy) & (BAYER - 1);
+        for (int x = 0; x < BAYER; x++) {
+            int u = (x + dx) & (BAYER - 1), rank = 0;
+            for (int b = 0; b < BAYER_BITS; b++)
+                rank = (rank << 2) | (((u ^ v) >> b & 1) << 1) | (v >> b & 1);
+            scr->thr[y * BAYER + x] =
+                (unsigned char)((rank + 0.5) * 256.0 / (BAYER * BAYER));
+        }
+    }
+    return ERR_OK;
+}
+
+/* Void-and-cluster (Ulichney): each pixel's energy is a toroidal Gaussian
+ * sum over the set pixels near it. Starting from a random pattern relaxed
+ * until its tightest cluster is also its largest void, set pixels are
+ * ranked by removing tightest clusters and the rest by filling largest
+ * voids, so every prefix of the ranking is evenly spread. */
+enum { BLUE_BITS = 6, BLUE = 1 << BLUE_BITS, BLUE_AREA = BLUE * BLUE, BLUE_REACH = 6 };
+
+static unsigned char BLUE_NOISE[BLUE_AREA];
+static pthread_once_t blueOnce = PTHREAD_ONCE_INIT;
+
+/* Energy of set pixels in `cluster` and of free ones in `hole`, the other
+ * entries 1e30, so both searches are a plain minimum. */
+typedef struct {
+    float energy[BLUE_AREA];
+    float cluster[BLUE_AREA]; /* negated: the tightest cluster is the minimum */
+    float hole[BLUE_AREA];
+    bool set[BLUE_AREA];
+} BlueField;
+
+static void blueToggle(BlueField *f, int p, const float *gauss) {
+    f->set[p] = !f->set[p];
+    float sign = f->set[p] ? 1.0f : -1.0f;
+    int px = p % BLUE, py = p / BLUE, side = 2 * BLUE_REACH + 1;
+    for (int dy = -BLUE_REACH; dy <= BLUE_REACH; dy++) {
+        int row = ((py + dy) & (BLUE - 1)) * BLUE;
+        const float *g = gauss + (dy + BLUE_REACH) * side + BLUE_REACH;
+        for (int dx = -BLUE_REACH; dx <= BLUE_REACH; dx++) {
+            int q = row + ((px + dx) & (BLUE - 1));
+            f->energy[q] += sign * g[dx];
+            f->cluster[q] = f->set[q] ? -f->energy[q] : 1e30f;
+            f->hole[q] = f->set[q] ? 1e30f : f->energy[q];
+        }
+    }
+    f->cluster[p] = f->set[p] ? -f->energy[p] : 1e30f;
+    f->hole[p] = f->set[p] ? 1e30f : f->energy[p];
+}
+
+/* Eight independent running minima, so the scan is not one long chain of
+ * dependent compares; the first index wins ties. */
+static int blueMin(const float *key) {
+    float low[8];
+    int at[8];
+    for (int k = 0; k < 8; k++) {
+        low[k] = key[k];
+        at[k] = k;
+    }
+    for (int p = 8; p < BLUE_AREA; p += 8)
+        for (int k = 0; k < 8; k++)
+            if (key[p + k] < low[k]) {
+                low[k] = key[p + k];
+                at[k] = p + k;
+            }
+    int best = 0;
+    for (int k = 1; k < 8; k++)
+        if (low[k] < low[best] || (low[k] == low[best] && at[k] < at[best]))
+            best = k;
+    return at[best];
+}
+
+static void initBlueNoise(void) {
+    enum { SIDE = 2 * BLUE_REACH + 1 };
+    float gauss[SIDE * SIDE];
+    for (int dy = -BLUE_REACH; dy <= BLUE_REACH; dy++)
+        for (int dx = -BLUE_REACH; dx <= BLUE_REACH; dx++)
+            gauss[(dy + BLUE_REACH) * SIDE + dx + BLUE_REACH] =
+                expf(-(float)(dx * dx + dy * dy) / (2.0f * 1.5f * 1.5f));
+
+    static BlueField field, start; /* only ever used here, once */
+    static int rank[BLUE_AREA];
+    BlueField *f = &field;
+    for (int p = 0; p < BLUE_AREA; p++) {
+        f->cluster[p] = 1e30f;
+        f->hole[p] = 0.0f;
+    }
+
+    /* a fixed seed: the tile, and so every output, is the same each run */
+    uint32_t seed = 0x9E3779B9u;
+    int ones = 0;
+    while (ones < BLUE_AREA / 10) {
+        seed = seed * 1664525u + 1013904223u;
+        int p = (int)(seed >> 20) % BLUE_AREA;
+        if (!f->set[p]) {
+            blueToggle(f, p, gauss);
+            ones++;
+        }
+    }
+    for (int i = 0; i < BLUE_AREA; i++) {
+        int cluster = blueMin(f->cluster);
+        blueToggle(f, cluster, gauss);
+        int hole = blueMin(f->hole);
+        blueToggle(f, hole, gauss);
+        if (hole == cluster)
+            break;
+    }
+
+    start = *f;
+    for (int r = ones - 1; r >= 0; r--) {
+        int cluster = blueMin(f->cluster);
+        blueToggle(f, cluster, gauss);
+        rank[cluster] = r;
+    }
+    *f = start;
+    for (int r = ones; r < BLUE_AREA; r++) {
+        int hole = blueMin(f->hole);
+        blueToggle(f, hole, gauss);
+        rank[hole] = r;
+    }
+    /* low ranks are the first black pixels, so they get high thresholds */
+    for (int p = 0; p < BLUE_AREA; p++) {
+        int v = (int)((BLUE_AREA - rank[p] - 0.5) * 256.0 / BLUE_AREA);
+        BLUE_NOISE[p] = (unsigned char)(v < 1 ? 1 : v > 255 ? 255 : v);
+    }
+}
+
+/* The blue-noise tile rolled by (dx, dy). */
+static ErrorCode buildBlueNoiseScreen(BWScreen *scr, int dx, int dy) {
+    pthread_once(&blueOnce, initBlueNoise);
+    scr->thr = malloc(BLUE_AREA);
+    if (!scr->thr)
+        return ERR_MEMORY;
+    scr->size = BLUE;
+    for (int y = 0; y < BLUE; y++) {
+        const unsigned char *src = BLUE_NOISE + ((y + dy) & (BLUE - 1)) * BLUE;
+        unsigned char *dst = scr->thr + y * BLUE;
+        memcpy(dst, src + dx, BLUE - dx);
+        memcpy(dst + BLUE - dx, src, dx);
+    }
+    return ERR_OK;
+}
+
+/* Tiles cannot be rotated, so the angle picks a phase instead: one per 15°
+ * step from BW_DEFAULT_ANGLE, modulo 90°. The four CMYK plane angles always
+ * get distinct phases, and the Bayer ones put the planes on different 2x2
+ * cosets, so light tints of two inks print side by side, not dot-on-dot. */
+enum { TILE_PHASES = 6 };
+static const unsigned char BAYER_PHASE[TILE_PHASES][2] = {{0, 0}, {1, 0}, {3, 2},
+                                                          {1, 1}, {2, 3}, {0, 1}};
+static const unsigned char BLUE_PHASE[TILE_PHASES][2] = {{0, 0},   {21, 37}, {42, 10},
+                                                         {63, 47}, {20, 20}, {41, 57}};
+
+static int tilePhase(double angleDeg) {
+    double turn = fmod(angleDeg - BW_DEFAULT_ANGLE, 90.0);
+    int step = (int)lround((turn < 0 ? turn + 90.0 : turn) / 15.0);
+    return step % TILE_PHASES;
+}
+
+ErrorCode buildScreen(BWScreen *scr, const BWConfig *cfg, double angleDeg) {
+    int phase = tilePhase(angleDeg);
+    switch (cfg->algorithm) {
+        case BW_ALGO_ORDERED:
+            return buildBayerScreen(scr, BAYER_PHASE[phase][0], BAYER_PHASE[phase][1]);
+        case BW_ALGO_BLUE_NOISE:
+            return buildBlueNoiseScreen(scr, BLUE_PHASE[phase][0], BLUE_PHASE[phase][1]);
+        case BW_ALGO_THRESHOLD:
+            /* a 1x1 tile: the threshold bias then makes it brightnessThreshold */
+            scr->thr = malloc(1);
+            if (!scr->thr)
+                return ERR_MEMORY;
+            scr->size = 1;
+            scr->thr[0] = 128;
+            return ERR_OK;
+        default:
+            return buildAMScreen(scr, cfg, angleDeg);
+    }
+}
+
+void freeScreen(BWScreen *scr) {
+    free(scr->thr);
+    scr->thr = NULL;
+}
+
+/* ---- Screening ---- */
+
+unsigned char *expandScreen(const BWScreen *scr, int w, const BWConfig *cfg,
+                            size_t *rowLen) {
+    int n = scr->size;
+    *rowLen = (size_t)w + 16;
+    unsigned char *rows = malloc(*rowLen * n);
+    if (!rows)
+        return NULL;
+    int bias = cfg->brightnessThreshold - 128;
+    for (int ty = 0; ty < n; ty++) {
+        for (size_t x = 0; x < *rowLen; x++) {
+            int t = scr->thr[ty * n + x % n] + bias;
+            rows[ty * *rowLen + x] = (unsigned char)(t < 1 ? 1 : t > 255 ? 255 : t);
+        }
+    }
+    return rows;
+}
+
+typedef struct {
+    const unsigned char *gray;
+    const unsigned char *rows; /* tile rows repeated to the image width */
+    size_t rowLen;
+    int tile;
+    const BWConfig *cfg;
+    BWBitmap *bm;
+    BWStats *stats;
+    StatsAccum acc;
+    int y0, y1;
+} ScreenBand;
+
+static void screenBand(void *arg, int index) {
+    ScreenBand *band = (ScreenBand *)arg + index;
+    BWBitmap *bm = band->bm;
+    unsigned char flip = band->cfg->invertOutput ? 0xFF : 0x00;
+    for (int y = band->y0; y < band->y1; y++) {
+        if ((y - band->y0) % SCHED_ROWS == SCHED_ROWS - 1)
+            schedulePoint();
+        unsigned char *row = bm->bits + (size_t)y * bm->stride;
+        screenRow(row, band->gray + (size_t)y * bm->w,
+                  band->rows + (size_t)(y % band->tile) * band->rowLen, bm->w, flip);
+        if (band->stats)
+            statsAddRow(band->stats, &band->acc, row, y);
+    }
+}
+
+static int defaultThreads(const BWConfig *cfg) {
+    int n = cfg->threads > 0 ? cfg->threads : poolThreads();
+    return n < MAX_THREADS ? n : MAX_THREADS;
+}
+
+ErrorCode screenImage(const unsigned char *gray, int w, int h, const BWScreen *scr,
+                      const BWConfig *cfg, BWBitmap *bm, BWStats *stats) {
+    int n = scr->size;
+    size_t rowLen;
+    unsigned char *rows = expandScreen(scr, w, cfg, &rowLen);
+    bm->w = w;
+    bm->h = h;
+    bm->bpp = 1;
+    bm->paletteSize = 0;
+    bm->stride = (w + 7) / 8;
+    bm->bits = malloc((size_t)bm->stride * h);
+    if (!rows || !bm->bits) {
+        free(rows);
+        free(bm->bits);
+        return ERR_MEMORY;
+    }
+    if (stats && statsBegin(stats, w, h, cfg) != ERR_OK) {
+        free(rows);
+        free(bm->bits);
+        return ERR_MEMORY;
+    }
+
+    /* Bands cover whole stats tiles so workers never share a tile counter. */
+    int unit = tuning()->bandRows > 0 ? tuning()->bandRows : BAND_ROWS;
+    if (stats)
+        unit = (unit + stats->tileSize - 1) / stats->tileSize * stats->tileSize;
+    int units = (h + unit - 1) / unit;
+    int nb = defaultThreads(cfg);
+    nb = nb < units ? nb : units;
+    nb = nb < 1 ? 1 : nb;
+    ScreenBand bands[MAX_THREADS];
+    ErrorCode r = ERR_OK;
+    for (int i = 0; i < nb; i++) {
+        ScreenBand *band = &bands[i];
+        band->gray = gray;
+        band->rows = rows;
+        band->rowLen = rowLen;
+        band->tile = n;
+        band->cfg = cfg;
+        band->bm = bm;
+        band->stats = stats;
+        band->y0 = (int)((long long)units * i / nb) * unit;
+        band->y1 = (int)((long long)units * (i + 1) / nb) * unit;
+        band->y1 = band->y1 < h ? band->y1 : h;
+        if (stats && statsAccumInit(&band->acc, w) != ERR_OK)
+            r = ERR_MEMORY;
+    }
+    if (r == ERR_OK)
+        parallelFor(nb, nb, screenBand, bands);
+
+    for (int i = 0; i < nb && stats; i++)
+        statsMerge(stats, &bands[i].acc);
+    free(rows);
+    if (r != ERR_OK) {
+        free(bm->bits);
+        if (stats)
+            bw_stats_free(stats);
+    }
+    return r;
+}
@@ -0,0 +1,138 @@
+/*
+ * File: bw_separate.c
+ * ---------------------------
+ * Description:
+ *   CMYK separation mode. The input is decoded once, split into cyan,
+ *   magenta, yellow and black ink planes with gray component replacement
+ *   (GCR) and under-colour removal (UCR), and the four planes are dithered
+ *   and written concurrently on the library pool.
+ *
+ *   Every plane uses a different diffusion kernel, or with AM screening the
+ *   classic 30°-spaced screen angles, so the dot structures of the
+ *   separations do not line up and beat against each other (moiré).
+ *   Planes are written next to the requested output as name_c.png,
+ *   name_m.png, name_y.png and name_k.png; black pixels are ink.
+ *
+ * Author: Bahey Shalash
+ * Version: 2.1.2
+ * Date: 19/04/2025
+ */
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bw_internal.h"
+#include "stb_image.h"
+
+enum { PLANE_C, PLANE_M, PLANE_Y, PLANE_K, PLANES };
+
+static const char *const PLANE_SUFFIX[PLANES] = {"_c", "_m", "_y", "_k"};
+static const BWKernel PLANE_KERNEL[PLANES] = {BW_KERNEL_JJN, BW_KERNEL_STUCKI,
+                                              BW_KERNEL_SIERRA, BW_KERNEL_FS};
+/* Offsets from the configured (K) angle: C 15°, M 75°, Y 0°, K 45° by default. */
+static const double PLANE_ANGLE[PLANES] = {-30.0, 30.0, -45.0, 0.0};
+
+typedef struct {
+    unsigned char *plane; /* 255 - ink, overwritten by the dither */
+    int w, h;
+    BWConfig cfg;
+    BWFormat fmt;
+    char path[PATH_MAX];
+    bool wantStats;
+    BWStats stats;
+    ErrorCode result;
+} PlaneJob;
+
+static void splitCMYK(const unsigned char *rgb, int total, const BWConfig *cfg,
+                      unsigned char *planes[PLANES]) {
+    int gcr = cfg->blackGeneration, ucr = cfg->underColorRemoval;
+    for (int i = 0; i < total; i++) {
+        int c = 255 - rgb[3 * i], m = 255 - rgb[3 * i + 1], y = 255 - rgb[3 * i + 2];
+        int gray = c < m ? (c < y ? c : y) : (m < y ? m : y);
+        int k = gray * gcr / 100;
+        int removed = k * ucr / 100;
+        planes[PLANE_C][i] = (unsigned char)(255 - (c - removed));
+        planes[PLANE_M][i] = (unsigned char)(255 - (m - removed));
+        planes[PLANE_Y][i] = (unsigned char)(255 - (y - removed));
+        planes[PLANE_K][i] = (unsigned char)(255 - k);
+    }
+}
+
+static void ditherPlaneTask(void *arg, int index) {
+    PlaneJob *job = (PlaneJob *)arg + index;
+    BWBitmap bm;
+    job->result = ditherGrayPlane(job->plane, job->w, job->h, &job->cfg, NULL, &bm,
+                                  job->wantStats ? &job->stats : NULL, NULL);
+    if (job->result == ERR_OK) {
+        job->result = saveBWImage(job->path, job->fmt, &bm, &job->cfg, NULL);
+        free(bm.bits);
+    }
+}
+
+ErrorCode convertSeparations(const char *in, const unsigned char *data, size_t size,
+                             const char *out, BWFormat fmt, const BWConfig *cfg,
+                             BWStats *stats) {
+    if (isStdioPath(out))
+        return ERR_CONFIG; /* four files cannot share stdout */
+    PlaneJob jobs[PLANES];
+    for (int p = 0; p < PLANES; p++) {
+        if (!suffixedPath(jobs[p].path, PATH_MAX, out, PLANE_SUFFIX[p]))
+            return ERR_WRITE;
+    }
+
+    int w, h;
+    unsigned char *rgb =
+        data ? loadRGBMemory(data, size, in, &w, &h, cfg) : loadRGBImage(in, &w, &h, cfg);
+    if (!rgb)
+        return ERR_LOAD;
+    int total = w * h;
+    unsigned char *planes[PLANES];
+    unsigned char *block = malloc((size_t)PLANES * total);
+    if (!block) {
+        stbi_image_free(rgb);
+        return ERR_MEMORY;
+    }
+    for (int p = 0; p < PLANES; p++)
+        planes[p] = block + (size_t)p * total;
+    splitCMYK(rgb, total, cfg, planes);
+    stbi_image_free(rgb);
+
+    for (int p = 0; p < PLANES; p++) {
+        PlaneJob *job = &jobs[p];
+        job->plane = planes[p];
+        job->w = w;
+        job->h = h;
+        job->cfg = *cfg;
+        job->cfg.diffusionKernel = PLANE_KERNEL[p];
+        job->cfg.screenAngle = cfg->screenAngle + PLANE_ANGLE[p];
+        job->cfg.verboseMode = false; /* rows of four planes would interleave */
+        job->fmt = fmt;
+        job->wantStats = stats != NULL;
+        memset(&job->stats, 0, sizeof(job->stats));
+    }
+    /* Planes and, with AM screens, their bands share the pool. */
+    parallelFor(PLANES, cfg->threads, ditherPlaneTask, jobs);
+
+    ErrorCode r = ERR_OK;
+    for (int p = 0; p < PLANES; p++) {
+        if (jobs[p].result != ERR_OK && r == ERR_OK)
+            r = jobs[p].result;
+        if (cfg->verboseMode && jobs[p].result == ERR_OK)
+            fprintf(stderr, "Wrote separation '%s'\n", jobs[p].path);
+    }
+    free(block);
+
+    if (stats) {
+        *stats = jobs[PLANE_K].stats;
+        for (int p = 0; p < PLANES; p++) {
+            stats->separationCoverage[p] =
+                jobs[p].result == ERR_OK ? jobs[p].stats.blackFraction : 0.0;
+            if (p != PLANE_K)
+                bw_stats_free(&jobs[p].stats);
+        }
+        if (r != ERR_OK)
+            bw_stats_free(stats);
+    }
+    return r;
+}
@@ -0,0 +1,969 @@
+/*
+ * File: bw_server.c
+ * ---------------------------
+ * Description:
+ *   A persistent conversion server on a Unix-domain socket, and the client
+ *   calls that talk to it. Start-up costs (threads, buffers, the pool) are
+ *   paid once, so small conversions cost little more than the dithering.
+ *
+ *   The main thread accepts connections and reads requests. Each complete
+ *   request goes on a bounded job queue. When the queue is full the request
+ *   is answered with ERR_BUSY at once, so an overloaded server pushes back
+ *   on its clients instead of queueing without limit. Worker threads keep a
+ *   BWWorkspace warmed at start-up, run the conversion, answer on the
+ *   connection and hand it back to the main thread. A connection has at
+ *   most one request in flight; further requests wait in its socket. The
+ *   main thread never blocks on a client: its own replies (rejections and
+ *   attach results) are queued on the connection and sent as the socket
+ *   takes them, so one client that does not read stalls nobody else.
+ *
+ *   Requests are interactive or batch (option priority=). Each class has its
+ *   own queue and depth, so a flood of batch work never makes a preview
+ *   busy. Workers take interactive requests first, and one extra worker
+ *   only takes interactive ones, so a preview never waits for a long batch
+ *   conversion to finish. Batch conversions yield their cores to it at
+ *   row-band boundaries (see schedulePoint in bw_pool.c).
+ *
+ *   Protocol, integers little-endian, u32 unless noted:
+ *     request:  "BWQ1" flags deadline_ms
+ *               len options   ("threshold=100 invert=1 algorithm=am ...")
+ *               len input     (a path, the encoded image with REQ_INLINE, or
+ *                              with REQ_SHM_INPUT u64 offset, u64 size,
+ *                              width, height; width 0 = encoded)
+ *               len output    (a path, empty: the output comes back, or
+ *                              with REQ_SHM_OUTPUT u64 offset, u64 capacity)
+ *     attach:   "BWA1" u64 size, with a memfd as SCM_RIGHTS
+ *     response: "BWR2" status elapsed_us len width height algorithm scale,
+ *               then `len` output bytes unless they went to shared memory
+ *   A request whose deadline has passed by the time a worker takes it is
+ *   answered with ERR_DEADLINE without converting.
+ *
+ *   Shared memory keeps image data off the socket. A client attaches a
+ *   memfd sealed against shrinking, so it cannot fault the server by
+ *   truncating it. Requests then name byte ranges of it: an encoded image
+ *   or raw RGB pixels to read, and room for the encoded file or the packed
+ *   1-bit rows (REQ_PACKED_OUTPUT) to write. Raw pixels are dithered where
+ *   they lie, and only the control messages cross the socket.
+ *
+ * Author: Bahey Shalash
+ * Version: 2.1.2
+ * Date: 19/04/2025
+ */
+#define _GNU_SOURCE /* memfd_create, file seals */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bw_internal.h"
+
+#define MAX_WORKERS 64
+#define MAX_CONNS 1024
+#define MAX_REQUEST (256u << 20)
+#define MAX_OPTIONS 4096
+#define STOP_POLL_MS 200
+#define SEND_TIMEOUT_S 5
+#define WARM_PIXELS (2048 * 2048) /* workspace size reserved per worker */
+#define REQUEST_HEAD 12           /* magic, flags, deadline */
+#define ATTACH_SIZE 12            /* magic, u64 size */
+#define RESPONSE_HEAD 32
+#define REPLY_BACKLOG 32          /* main-thread replies queued per connection */
+#define SHM_INPUT_FIELD 24
+#define SHM_OUTPUT_FIELD 16
+#define MAX_SIDE 65535
+
+enum {
+    REQ_INLINE = 1,         /* the input field holds the encoded image */
+    REQ_SHM_INPUT = 2,      /* the input is a range of the shared memory */
+    REQ_SHM_OUTPUT = 4,     /* the output goes to a range of it */
+    REQ_PACKED_OUTPUT = 8,  /* 1-bit rows instead of an encoded file */
+};
+
+typedef struct {
+    int fd;
+    unsigned char *buf; /* bytes read and not yet consumed */
+    size_t len, cap;
+    size_t used; /* length of the request being served */
+    bool busy;   /* owned by a worker */
+    bool dead;   /* a write failed: close when handed back */
+    unsigned char reply[REPLY_BACKLOG * RESPONSE_HEAD]; /* unsent main-thread replies */
+    size_t replyLen, replySent;
+    int attachFd;       /* received with SCM_RIGHTS, for the next "BWA1" */
+    unsigned char *shm; /* the client's shared memory, or NULL */
+    size_t shmSize;
+    /* the request being served, pointing into buf or shm */
+    BWConfig cfg;
+    uint32_t flags;
+    const unsigned char *input;
+    size_t inputSize;
+    int width, height; /* raw RGB input when > 0; packed output size */
+    unsigned char *shmOut;
+    size_t shmOutCap;
+    char path[2][PATH_MAX]; /* input path unless inline, output path or "" */
+    double receivedMs, deadlineMs; /* deadline 0: none */
+} Conn;
+
+typedef struct {
+    BWConfig defaults;
+    int depth;                         /* per class */
+    BWQueue jobs[BW_PRIORITY_COUNT];   /* Conn * */
+    atomic_int waiting[BW_PRIORITY_COUNT];
+    sem_t any;      /* one post per job */
+    sem_t urgent;   /* one post per interactive job */
+    atomic_bool stopping;
+    BWQueue done;   /* connections handed back to the main thread */
+    int wake[2];    /* pipe: a worker handed a connection back */
+    atomic_int served, rejected, expired;
+    LatencyHist wait[BW_PRIORITY_COUNT]; /* receipt to a worker taking it */
+} Server;
+
+typedef struct {
+    Server *server;
+    bool interactiveOnly;
+} WorkerArg;
+
+static double nowMs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static uint32_t getU32(const unsigned char *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t getU64(const unsigned char *p) {
+    return getU32(p) | (uint64_t)getU32(p + 4) << 32;
+}
+
+static void putU32(unsigned char *p, uint32_t v) {
+    p[0] = v & 0xFF;
+    p[1] = v >> 8 & 0xFF;
+    p[2] = v >> 16 & 0xFF;
+    p[3] = v >> 24;
+}
+
+static void putU64(unsigned char *p, uint64_t v) {
+    putU32(p, (uint32_t)v);
+    putU32(p + 4, (uint32_t)(v >> 32));
+}
+
+/* Client sockets are non-blocking; a worker waits up to SEND_TIMEOUT_S for
+ * each chunk the client does not read. */
+static bool sendAll(int fd, const void *data, size_t len) {
+    for (const char *p = data; len;) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN) {
+            struct pollfd pfd = {fd, POLLOUT, 0};
+            if (poll(&pfd, 1, SEND_TIMEOUT_S * 1000) > 0)
+                continue;
+            return false;
+        }
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool recvAll(int fd, void *data, size_t len) {
+    for (char *p = data; len;) {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+/* `plan` is NULL when nothing was converted. */
+static void putResponseHead(unsigned char *head, ErrorCode status, double elapsedMs,
+                            size_t len, int w, int h, const DeadlinePlan *plan) {
+    memcpy(head, "BWR2", 4);
+    putU32(head + 4, status);
+    putU32(head + 8, (uint32_t)(elapsedMs * 1e3));
+    putU32(head + 12, (uint32_t)len);
+    putU32(head + 16, (uint32_t)w);
+    putU32(head + 20, (uint32_t)h);
+    putU32(head + 24, plan ? (uint32_t)plan->algorithm : 0);
+    putU32(head + 28, plan ? (uint32_t)plan->scale : 0);
+}
+
+/* `data` NULL with `len` > 0: the output is in shared memory. */
+static bool sendResponse(int fd, ErrorCode status, double elapsedMs,
+                         const unsigned char *data, size_t len, int w, int h,
+                         const DeadlinePlan *plan) {
+    unsigned char head[RESPONSE_HEAD];
+    putResponseHead(head, status, elapsedMs, len, w, h, plan);
+    return sendAll(fd, head, sizeof(head)) && (!data || !len || sendAll(fd, data, len));
+}
+
+/* ---- Requests ---- */
+
+/* Bytes of the complete request at the start of `buf`, 0 if more are
+ * needed, -1 if it is malformed. */
+static long requestLength(const unsigned char *buf, size_t len) {
+    if (len >= 4 && !memcmp(buf, "BWA1", 4))
+        return len >= ATTACH_SIZE ? ATTACH_SIZE : 0;
+    if (len >= 4 && memcmp(buf, "BWQ1", 4))
+        return -1;
+    size_t pos = REQUEST_HEAD;
+    for (int field = 0; field < 3; field++) {
+        if (len < pos + 4)
+            return 0;
+        uint32_t n = getU32(buf + pos);
+        if (n > MAX_REQUEST || (field == 0 && n > MAX_OPTIONS))
+            return -1;
+        pos += 4 + n;
+        if (pos > MAX_REQUEST)
+            return -1;
+    }
+    return len >= pos ? (long)pos : 0;
+}
+
+static ErrorCode applyOptions(BWConfig *cfg, const char *text, size_t len) {
+    char opts[MAX_OPTIONS + 1];
+    memcpy(opts, text, len);
+    opts[len] = '\0';
+    char *save;
+    for (char *tok = strtok_r(opts, " \t\n", &save); tok;
+         tok = strtok_r(NULL, " \t\n", &save)) {
+        char *eq = strchr(tok, '=');
+        if (!eq)
+            return ERR_CONFIG;
+        *eq = '\0';
+        ErrorCode r = applyJobOption(cfg, tok, eq + 1);
+        if (r != ERR_OK)
+            return r;
+    }
+    return ERR_OK;
+}
+
+static ErrorCode copyPath(char *dst, const unsigned char *src, size_t len) {
+    if (len >= PATH_MAX || memchr(src, '\0', len))
+        return ERR_CONFIG;
+    memcpy(dst, src, len);
+    dst[len] = '\0';
+    /* "-" would be the server's own stdin or stdout */
+    return isStdioPath(dst) ? ERR_CONFIG : ERR_OK;
+}
+
+/* The range [offset, offset + size) of the attached memory, or NULL. */
+static unsigned char *shmRange(const Conn *c, uint64_t offset, uint64_t size) {
+    if (!c->shm || !size || offset > c->shmSize || size > c->shmSize - offset)
+        return NULL;
+    return c->shm + offset;
+}
+
+static ErrorCode parseShmInput(Conn *c, const unsigned char *p, uint32_t n) {
+    if (n != SHM_INPUT_FIELD || (c->flags & REQ_INLINE))
+        return ERR_CONFIG;
+    uint64_t size = getU64(p + 8);
+    uint32_t w = getU32(p + 16), h = getU32(p + 20);
+    if (!(c->input = shmRange(c, getU64(p), size)))
+        return ERR_CONFIG;
+    c->inputSize = size;
+    if (w || h) {
+        if (!w || !h || w > MAX_SIDE || h > MAX_SIDE || size != (uint64_t)w * h * 3)
+            return ERR_CONFIG;
+        c->width = (int)w;
+        c->height = (int)h;
+    }
+    return ERR_OK;
+}
+
+/* Fill the request fields of `c` from the `c->used` bytes of c->buf. */
+static ErrorCode parseRequest(Conn *c, const BWConfig *defaults) {
+    const unsigned char *p = c->buf;
+    uint32_t deadline = getU32(p + 8);
+    c->flags = getU32(p + 4);
+    c->deadlineMs = deadline ? c->receivedMs + deadline : 0.0;
+    c->cfg = *defaults;
+    c->width = c->height = 0;
+    c->shmOut = NULL;
+    p += REQUEST_HEAD;
+    uint32_t n = getU32(p);
+    ErrorCode r = applyOptions(&c->cfg, (const char *)p + 4, n);
+    p += 4 + n;
+    n = getU32(p);
+    c->input = p + 4;
+    c->inputSize = n;
+    if (r == ERR_OK && (c->flags & REQ_SHM_INPUT))
+        r = parseShmInput(c, p + 4, n);
+    else if (r == ERR_OK && !(c->flags & REQ_INLINE))
+        r = n ? copyPath(c->path[0], p + 4, n) : ERR_CONFIG;
+    else if (r == ERR_OK && !n)
+        r = ERR_LOAD;
+    p += 4 + n;
+    n = getU32(p);
+    c->path[1][0] = '\0';
+    if (r == ERR_OK && (c->flags & REQ_SHM_OUTPUT)) {
+        c->shmOutCap = n == SHM_OUTPUT_FIELD ? getU64(p + 12) : 0;
+        c->shmOut = n == SHM_OUTPUT_FIELD ? shmRange(c, getU64(p + 4), c->shmOutCap) : NULL;
+        r = c->shmOut ? ERR_OK : ERR_CONFIG;
+    } else if (r == ERR_OK && n) {
+        r = copyPath(c->path[1], p + 4, n);
+    }
+    /* packed rows are 1-bit only */
+    if (r == ERR_OK && (c->flags & REQ_PACKED_OUTPUT) &&
+        (c->cfg.levels != 2 || c->cfg.paletteSize || c->cfg.separateCMYK || c->path[1][0]))
+        r = ERR_CONFIG;
+    return r;
+}
+
+/* Map the memfd that came with an attach message, replacing any earlier one. */
+static ErrorCode attachShm(Conn *c, uint64_t size) {
+    int fd = c->attachFd;
+    c->attachFd = -1;
+    if (fd < 0)
+        return ERR_CONFIG;
+    struct stat st;
+    int seals = fcntl(fd, F_GET_SEALS);
+    ErrorCode r = ERR_OK;
+    if (!size || size > SIZE_MAX || fstat(fd, &st) || (uint64_t)st.st_size < size ||
+        seals < 0 || !(seals & F_SEAL_SHRINK))
+        r = ERR_CONFIG;
+    void *p = r == ERR_OK ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+                          : MAP_FAILED;
+    close(fd);
+    if (p == MAP_FAILED)
+        return r == ERR_OK ? ERR_MEMORY : r;
+    if (c->shm)
+        munmap(c->shm, c->shmSize);
+    c->shm = p;
+    c->shmSize = size;
+    return ERR_OK;
+}
+
+/* ---- Workers ---- */
+
+/* Grow the workspace to a typical image so first requests do not pay for
+ * allocating and faulting in their buffers, nor the first deadline= request
+ * for measuring costs. */
+static void prewarm(BWWorkspace *ws) {
+    static const size_t size[SCRATCH_COUNT] = {
+        [SCRATCH_GRAY] = WARM_PIXELS,
+        [SCRATCH_ERROR] = WARM_PIXELS * sizeof(float),
+        [SCRATCH_BITS] = WARM_PIXELS / 8,
+        [SCRATCH_RAW] = WARM_PIXELS / 8 + 2048,
+        [SCRATCH_PNG] = WARM_PIXELS / 8 + 2048,
+    };
+    for (int s = 0; s < SCRATCH_COUNT; s++) {
+        void *p = scratchGet(ws, (ScratchSlot)s, size[s]);
+        if (p)
+            memset(p, 0, size[s]);
+    }
+    warmDeadline();
+}
+
+/* Dither `rgb` into 1-bit rows: in shared memory, or a new buffer in *out.
+ * A deadline may make the rows smaller than `w` x `h`. */
+static ErrorCode packRows(Conn *c, const unsigned char *rgb, int w, int h, double spentMs,
+                          BWWorkspace *ws, unsigned char **out, size_t *outLen) {
+    BWConfig cfg = c->cfg;
+    cfg.outputFormat = BW_FORMAT_PNG;
+    BWFormat fmt;
+    BWBitmap bm;
+    ErrorCode r = ditherForOutput(rgb, w, h, "-", &cfg, spentMs, &fmt, &bm, NULL, ws);
+    if (r != ERR_OK)
+        return r;
+    size_t size = (size_t)bm.stride * bm.h;
+    unsigned char *dst = !c->shmOut ? malloc(size) : size <= c->shmOutCap ? c->shmOut : NULL;
+    if (dst) {
+        memcpy(dst, bm.bits, size);
+        *outLen = size;
+        c->width = bm.w;
+        c->height = bm.h;
+        if (!c->shmOut)
+            *out = dst;
+    }
+    scratchRelease(ws, bm.bits);
+    return dst ? ERR_OK : c->shmOut ? ERR_WRITE : ERR_MEMORY;
+}
+
+/* A file input with the reply in memory: mapped rather than read. */
+static ErrorCode convertMapped(const char *path, const BWConfig *cfg, unsigned char **out,
+                               size_t *outLen, BWWorkspace *ws) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return ERR_LOAD;
+    struct stat st;
+    void *p = !fstat(fd, &st) && st.st_size > 0
+                  ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)
+                  : MAP_FAILED;
+    close(fd);
+    if (p == MAP_FAILED)
+        return ERR_LOAD;
+    ErrorCode r = convertMemory(p, st.st_size, cfg, out, outLen, NULL, ws);
+    munmap(p, st.st_size);
+    return r;
+}
+
+/* Run the request in `c`. Output bytes land in shared memory, in a new
+ * buffer in *out, or in the requested file; *outLen counts them. */
+static ErrorCode serve(Conn *c, BWWorkspace *ws, unsigned char **out, size_t *outLen) {
+    *out = NULL;
+    *outLen = 0;
+    bool packed = c->flags & REQ_PACKED_OUTPUT;
+    const unsigned char *rgb = c->width ? c->input : NULL;
+    const unsigned char *encoded =
+        !rgb && (c->flags & (REQ_INLINE | REQ_SHM_INPUT)) ? c->input : NULL;
+    if (c->cfg.deadlineMs > 0) {
+        /* the budget counts from receipt, so queueing spends it too */
+        int left = c->cfg.deadlineMs - (int)(nowMs() - c->receivedMs);
+        c->cfg.deadlineMs = left > 1 ? left : 1;
+    }
+    ws->plan = (DeadlinePlan){.algorithm = c->cfg.algorithm, .scale = 1};
+
+    if (packed) {
+        int w = c->width, h = c->height;
+        double t0 = nowMs();
+        unsigned char *decoded =
+            rgb       ? NULL
+            : encoded ? loadRGBMemory(encoded, c->inputSize, "request", &w, &h, &c->cfg)
+                      : loadRGBImage(c->path[0], &w, &h, &c->cfg);
+        if (!rgb && !decoded)
+            return ERR_LOAD;
+        ErrorCode r = packRows(c, rgb ? rgb : decoded, w, h, nowMs() - t0, ws, out, outLen);
+        free(decoded);
+        return r;
+    }
+    if (!c->shmOut && c->path[1][0]) {
+        if (rgb)
+            return convertDecoded(rgb, c->width, c->height, c->path[1], &c->cfg, 0.0, NULL,
+                                  ws);
+        if (encoded)
+            return convertBuffer(encoded, c->inputSize, c->path[1], &c->cfg, NULL, ws);
+        return convertToBW(c->path[0], c->path[1], &c->cfg, NULL, ws);
+    }
+
+    /* encoded straight from the decoded pixels, no stdio streams */
+    ErrorCode r =
+        rgb       ? encodeDecoded(rgb, c->width, c->height, &c->cfg, 0.0, out, outLen, NULL,
+                                  ws)
+        : encoded ? convertMemory(encoded, c->inputSize, &c->cfg, out, outLen, NULL, ws)
+                  : convertMapped(c->path[0], &c->cfg, out, outLen, ws);
+    if (r == ERR_OK && c->shmOut) {
+        if (*outLen <= c->shmOutCap)
+            memcpy(c->shmOut, *out, *outLen);
+        else
+            r = ERR_WRITE;
+        free(*out);
+        *out = NULL;
+    }
+    if (r != ERR_OK) {
+        free(*out);
+        *out = NULL;
+        *outLen = 0;
+    }
+    return r;
+}
+
+/* Wait for a job: interactive first unless `interactiveOnly`. A post may find
+ * its job taken by the other kind of worker; the loop then waits again.
+ * NULL once stopping and nothing is left. */
+static Conn *takeJob(Server *s, bool interactiveOnly) {
+    for (;;) {
+        while (sem_wait(interactiveOnly ? &s->urgent : &s->any) && errno == EINTR)
+            ;
+        void *c;
+        for (int k = 0; k < (interactiveOnly ? 1 : BW_PRIORITY_COUNT); k++) {
+            if (queueTryPop(&s->jobs[k], &c)) {
+                atomic_fetch_sub(&s->waiting[k], 1);
+                metricQueue(QUEUE_SERVE_INTERACTIVE + k, -1);
+                return c;
+            }
+        }
+        if (atomic_load(&s->stopping))
+            return NULL;
+    }
+}
+
+static void *serverWorker(void *arg) {
+    WorkerArg *wa = arg;
+    Server *s = wa->server;
+    BWWorkspace ws = {0};
+    prewarm(&ws);
+    Conn *c;
+    while ((c = takeJob(s, wa->interactiveOnly))) {
+        latencyRecord(&s->wait[c->cfg.priority], nowMs() - c->receivedMs);
+        unsigned char *out = NULL;
+        size_t outLen = 0;
+        ErrorCode r;
+        if (c->deadlineMs && nowMs() > c->deadlineMs) {
+            r = ERR_DEADLINE;
+            atomic_fetch_add(&s->expired, 1);
+        } else {
+            r = serve(c, &ws, &out, &outLen);
+            memset(ws.stageMs, 0, sizeof(ws.stageMs));
+        }
+        metricResult(r);
+        double elapsed = nowMs() - c->receivedMs;
+        bool packed = r == ERR_OK && (c->flags & REQ_PACKED_OUTPUT);
+        if (!sendResponse(c->fd, r, elapsed, c->shmOut ? NULL : out, outLen,
+                          packed ? c->width : 0, packed ? c->height : 0,
+                          r == ERR_OK ? &ws.plan : NULL))
+            c->dead = true;
+        if (s->defaults.verboseMode)
+            fprintf(stderr, "Served %s -> %s in %.2f ms: %s\n",
+                    c->flags & REQ_SHM_INPUT ? "(shared)"
+                    : c->flags & REQ_INLINE  ? "(inline)"
+                                             : c->path[0],
+                    c->shmOut ? "(shared)" : c->path[1][0] ? c->path[1] : "(reply)", elapsed,
+                    bw_error_string(r));
+        free(out);
+        atomic_fetch_add(&s->served, 1);
+        queuePush(&s->done, c);
+        char byte = 0;
+        while (write(s->wake[1], &byte, 1) < 0 && errno == EINTR)
+            ;
+    }
+    workspaceFree(&ws);
+    return NULL;
+}
+
+/* ---- Main thread ---- */
+
+static void closeConn(Conn *c) {
+    if (c->attachFd >= 0)
+        close(c->attachFd);
+    if (c->shm)
+        munmap(c->shm, c->shmSize);
+    close(c->fd);
+    free(c->buf);
+    free(c);
+}
+
+/* Send what the socket takes of the replies queued on `c`; false if the
+ * client is gone. */
+static bool flushReplies(Conn *c) {
+    while (c->replySent < c->replyLen) {
+        ssize_t n = send(c->fd, c->reply + c->replySent, c->replyLen - c->replySent,
+                         MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+            return true;
+        if (n <= 0)
+            return false;
+        c->replySent += n;
+    }
+    c->replyLen = c->replySent = 0;
+    return true;
+}
+
+/* A reply from the main thread, which never waits on a client: it goes out
+ * when the socket next takes it. */
+static void queueReply(Conn *c, ErrorCode status) {
+    if (c->replySent) {
+        memmove(c->reply, c->reply + c->replySent, c->replyLen - c->replySent);
+        c->replyLen -= c->replySent;
+        c->replySent = 0;
+    }
+    putResponseHead(c->reply + c->replyLen, status, nowMs() - c->receivedMs, 0, 0, 0, NULL);
+    c->replyLen += RESPONSE_HEAD;
+}
+
+/* Start every complete request buffered on an idle connection: to a worker,
+ * or answered here when it is malformed or the queue is full. Stops while
+ * REPLY_BACKLOG replies are unsent, and before handing a request to a
+ * worker while any are, so replies keep the order of the requests. */
+static bool dispatch(Server *s, Conn *c) {
+    while (!c->busy) {
+        if (!flushReplies(c))
+            return false;
+        if (c->used) {
+            memmove(c->buf, c->buf + c->used, c->len - c->used);
+            c->len -= c->used;
+            c->used = 0;
+        }
+        long n = requestLength(c->buf, c->len);
+        if (n < 0)
+            return false;
+        if (n == 0 || c->replyLen == sizeof(c->reply))
+            return true;
+        c->used = n;
+        c->receivedMs = nowMs();
+        if (!memcmp(c->buf, "BWA1", 4)) {
+            queueReply(c, attachShm(c, getU64(c->buf + 4)));
+            continue;
+        }
+        ErrorCode r = parseRequest(c, &s->defaults);
+        BWPriority k = c->cfg.priority;
+        if (r == ERR_OK && atomic_load(&s->waiting[k]) >= s->depth) {
+            r = ERR_BUSY;
+            atomic_fetch_add(&s->rejected, 1);
+        }
+        if (r != ERR_OK) {
+            metricResult(r);
+            queueReply(c, r);
+            continue;
+        }
+        if (c->replyLen) {
+            c->used = 0; /* taken again once the replies before it are out */
+            return true;
+        }
+        c->busy = true;
+        atomic_fetch_add(&s->waiting[k], 1);
+        metricQueue(QUEUE_SERVE_INTERACTIVE + k, 1);
+        queuePush(&s->jobs[k], c);
+        sem_post(&s->any);
+        if (k == BW_PRIORITY_INTERACTIVE)
+            sem_post(&s->urgent);
+    }
+    return true;
+}
+
+static bool readConn(Server *s, Conn *c) {
+    if (c->cap - c->len < 64 * 1024) {
+        size_t cap = c->cap ? 2 * c->cap : 128 * 1024;
+        if (cap > MAX_REQUEST + 64 * 1024)
+            return false;
+        unsigned char *grown = realloc(c->buf, cap);
+        if (!grown)
+            return false;
+        c->buf = grown;
+        c->cap = cap;
+    }
+    /* an attach message carries its memfd alongside the bytes */
+    struct iovec iov = {c->buf + c->len, c->cap - c->len};
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg = {.msg_iov = &iov,
+                         .msg_iovlen = 1,
+                         .msg_control = control.buf,
+                         .msg_controllen = sizeof(control.buf)};
+    ssize_t n = recvmsg(c->fd, &msg, MSG_CMSG_CLOEXEC);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN))
+        return true;
+    if (n <= 0)
+        return false;
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS &&
+            cm->cmsg_len == CMSG_LEN(sizeof(int))) {
+            if (c->attachFd >= 0)
+                close(c->attachFd);
+            memcpy(&c->attachFd, CMSG_DATA(cm), sizeof(int));
+        }
+    }
+    c->len += n;
+    return dispatch(s, c);
+}
+
+/* A listening socket at `path`, or -1 with *err set. Only a socket left
+ * behind by a server that is gone is replaced: anything else at `path`,
+ * or a socket a live server still answers on, is ERR_CONFIG. */
+static int listenOn(const char *path, ErrorCode *err) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    struct stat st;
+    *err = ERR_CONFIG;
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+    strcpy(addr.sun_path, path);
+    if (!lstat(path, &st)) {
+        if (!S_ISSOCK(st.st_mode))
+            return -1;
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        bool live = probe >= 0 && !connect(probe, (struct sockaddr *)&addr, sizeof(addr));
+        if (probe >= 0)
+            close(probe);
+        if (live)
+            return -1;
+        unlink(path);
+    }
+    *err = ERR_LOAD;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 128)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int convert_serve_bw(const char *socket_path, const BWConfig *defaults, int jobs,
+                     int queue_depth, const volatile sig_atomic_t *stop,
+                     BWLatency latency[BW_PRIORITY_COUNT]) {
+    long n = jobs > 0 ? jobs : sysconf(_SC_NPROCESSORS_ONLN);
+    n = n < 1 ? 1 : n > MAX_WORKERS ? MAX_WORKERS : n;
+    Server s = {.defaults = *defaults, .depth = queue_depth > 0 ? queue_depth : 4 * (int)n};
+    if (n > 1)
+        s.defaults.threads = 1; /* requests are the parallelism */
+    ErrorCode listenErr;
+    int lfd = listenOn(socket_path, &listenErr);
+    if (lfd < 0)
+        return listenErr;
+    if (pipe(s.wake) || queueInit(&s.jobs[0], s.depth) != ERR_OK ||
+        queueInit(&s.jobs[1], s.depth) != ERR_OK || queueInit(&s.done, MAX_CONNS) != ERR_OK) {
+        close(lfd);
+        unlink(socket_path);
+        return ERR_MEMORY;
+    }
+    fcntl(s.wake[0], F_SETFL, O_NONBLOCK);
+    sem_init(&s.any, 0, 0);
+    sem_init(&s.urgent, 0, 0);
+    /* worker 0 is the interactive-only one */
+    pthread_t threads[MAX_WORKERS + 1];
+    WorkerArg args[MAX_WORKERS + 1];
+    int started = 0;
+    for (; started <= n; started++) {
+        args[started] = (WorkerArg){&s, started == 0};
+        if (pthread_create(&threads[started], NULL, serverWorker, &args[started]))
+            break;
+    }
+    ErrorCode r = started > 1 ? ERR_OK : ERR_MEMORY;
+    if (r == ERR_OK && defaults->verboseMode)
+        fprintf(stderr, "Serving on '%s' with %d worker%s (+1 interactive), queue depth %d\n",
+                socket_path, started - 1, started == 2 ? "" : "s", s.depth);
+
+    Conn *conns[MAX_CONNS];
+    int connCount = 0;
+    struct pollfd pfd[MAX_CONNS + 2];
+    Conn *polled[MAX_CONNS];
+    while (r == ERR_OK && !*stop) {
+        pfd[0] = (struct pollfd){lfd, connCount < MAX_CONNS ? POLLIN : 0, 0};
+        pfd[1] = (struct pollfd){s.wake[0], POLLIN, 0};
+        int np = 0;
+        /* a connection with replies queued reads nothing until they are out */
+        for (int i = 0; i < connCount; i++)
+            if (!conns[i]->busy) {
+                polled[np] = conns[i];
+                pfd[2 + np++] = (struct pollfd){conns[i]->fd,
+                                                conns[i]->replyLen ? POLLOUT : POLLIN, 0};
+            }
+        int ready = poll(pfd, 2 + np, STOP_POLL_MS);
+        if (ready < 0 && errno != EINTR) {
+            r = ERR_LOAD;
+            break;
+        }
+        if (ready <= 0)
+            continue;
+        for (int i = 0; i < np; i++) {
+            Conn *c = polled[i];
+            if (pfd[2 + i].revents && !(c->replyLen ? dispatch(&s, c) : readConn(&s, c)))
+                c->dead = true;
+        }
+        if (pfd[1].revents) {
+            char drain[256];
+            while (read(s.wake[0], drain, sizeof(drain)) > 0)
+                ;
+            void *back;
+            while (queueTryPop(&s.done, &back)) {
+                Conn *c = back;
+                c->busy = false;
+                if (!c->dead && !dispatch(&s, c))
+                    c->dead = true;
+            }
+        }
+        for (int i = 0; i < connCount; i++)
+            if (!conns[i]->busy && conns[i]->dead) {
+                closeConn(conns[i]);
+                conns[i--] = conns[--connCount];
+            }
+        if (pfd[0].revents) {
+            int fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            Conn *c = fd >= 0 ? calloc(1, sizeof(*c)) : NULL;
+            if (c) {
+                c->fd = fd;
+                c->attachFd = -1;
+                conns[connCount++] = c;
+            } else if (fd >= 0) {
+                close(fd);
+            }
+        }
+    }
+
+    /* Queued requests are still answered before the workers exit. */
+    atomic_store(&s.stopping, true);
+    for (int i = 0; i < started; i++)
+        sem_post(&s.any);
+    sem_post(&s.urgent);
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    for (int i = 0; i < connCount; i++)
+        closeConn(conns[i]);
+    if (defaults->verboseMode)
+        fprintf(stderr, "Served %d request%s, %d rejected busy, %d past deadline\n",
+                atomic_load(&s.served), atomic_load(&s.served) == 1 ? "" : "s",
+                atomic_load(&s.rejected), atomic_load(&s.expired));
+    close(lfd);
+    unlink(socket_path);
+    close(s.wake[0]);
+    close(s.wake[1]);
+    sem_destroy(&s.any);
+    sem_destroy(&s.urgent);
+    for (int k = 0; k < BW_PRIORITY_COUNT; k++) {
+        if (latency)
+            latencyRead(&s.wait[k], &latency[k], false);
+        queueFree(&s.jobs[k]);
+    }
+    queueFree(&s.done);
+    return r;
+}
+
+/* ---- Client ---- */
+
+int bw_connect(const char *socket_path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+        return -1;
+    strcpy(addr.sun_path, socket_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+int bw_shm_create(BWShm *shm, size_t size) {
+    *shm = (BWShm){.fd = memfd_create("bw_shm", MFD_CLOEXEC | MFD_ALLOW_SEALING)};
+    if (shm->fd < 0 || !size || ftruncate(shm->fd, (off_t)size) ||
+        fcntl(shm->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL)) {
+        if (shm->fd >= 0)
+            close(shm->fd);
+        shm->fd = -1;
+        return ERR_MEMORY;
+    }
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, shm->fd, 0);
+    if (p == MAP_FAILED) {
+        close(shm->fd);
+        shm->fd = -1;
+        return ERR_MEMORY;
+    }
+    shm->base = p;
+    shm->size = size;
+    return ERR_OK;
+}
+
+void bw_shm_destroy(BWShm *shm) {
+    if (shm->base)
+        munmap(shm->base, shm->size);
+    if (shm->fd >= 0)
+        close(shm->fd);
+    *shm = (BWShm){.fd = -1};
+}
+
+/* Read a response head; the payload is left on the socket. */
+static int recvResponse(int fd, BWReply *reply) {
+    unsigned char resp[RESPONSE_HEAD];
+    if (!recvAll(fd, resp, sizeof(resp)) || memcmp(resp, "BWR2", 4))
+        return -1;
+    *reply = (BWReply){.output_size = getU32(resp + 12),
+                       .width = (int)getU32(resp + 16),
+                       .height = (int)getU32(resp + 20),
+                       .elapsed_ms = getU32(resp + 8) / 1e3,
+                       .algorithm = (BWAlgorithm)getU32(resp + 24),
+                       .scale = (int)getU32(resp + 28)};
+    return (int)getU32(resp + 4);
+}
+
+int bw_attach_shm(int fd, const BWShm *shm) {
+    unsigned char msg[ATTACH_SIZE];
+    memcpy(msg, "BWA1", 4);
+    putU64(msg + 4, shm->size);
+    struct iovec iov = {msg, sizeof(msg)};
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control = {0};
+    struct msghdr m = {.msg_iov = &iov,
+                       .msg_iovlen = 1,
+                       .msg_control = control.buf,
+                       .msg_controllen = sizeof(control.buf)};
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&m);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cm), &shm->fd, sizeof(int));
+    ssize_t n;
+    while ((n = sendmsg(fd, &m, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+        ;
+    BWReply reply;
+    return n == sizeof(msg) ? recvResponse(fd, &reply) : -1;
+}
+
+int bw_request(int fd, const BWRequest *request, BWReply *reply) {
+    BWReply ignored;
+    bool keep = reply;
+    if (!keep)
+        reply = &ignored;
+    *reply = (BWReply){0};
+    uint32_t flags = request->shm_input    ? REQ_SHM_INPUT
+                     : request->input_path ? 0
+                                           : REQ_INLINE;
+    if (request->shm_output)
+        flags |= REQ_SHM_OUTPUT;
+    if (request->packed_output)
+        flags |= REQ_PACKED_OUTPUT;
+    unsigned char shmIn[SHM_INPUT_FIELD], shmOut[SHM_OUTPUT_FIELD];
+    const char *opts = request->options ? request->options : "";
+    const char *out = request->output_path ? request->output_path : "";
+    size_t optLen = strlen(opts), outLen = strlen(out);
+    size_t inLen = request->input_path ? strlen(request->input_path) : request->input_size;
+    const void *in = request->input_path ? (const void *)request->input_path : request->input;
+    if (request->shm_input) {
+        putU64(shmIn, request->input_offset);
+        putU64(shmIn + 8, request->input_size);
+        putU32(shmIn + 16, request->width > 0 ? (uint32_t)request->width : 0);
+        putU32(shmIn + 20, request->height > 0 ? (uint32_t)request->height : 0);
+        in = shmIn;
+        inLen = sizeof(shmIn);
+    }
+    if (request->shm_output) {
+        putU64(shmOut, request->output_offset);
+        putU64(shmOut + 8, request->output_capacity);
+        out = (const char *)shmOut;
+        outLen = sizeof(shmOut);
+    }
+    if (optLen > MAX_OPTIONS || inLen > MAX_REQUEST || outLen >= PATH_MAX)
+        return ERR_CONFIG;
+
+    unsigned char head[REQUEST_HEAD + 4];
+    memcpy(head, "BWQ1", 4);
+    putU32(head + 4, flags);
+    putU32(head + 8, request->deadline_ms);
+    putU32(head + 12, (uint32_t)optLen);
+    unsigned char inHead[4], outHead[4];
+    putU32(inHead, (uint32_t)inLen);
+    putU32(outHead, (uint32_t)outLen);
+    if (!sendAll(fd, head, sizeof(head)) || !sendAll(fd, opts, optLen) ||
+        !sendAll(fd, inHead, 4) || !sendAll(fd, in, inLen) || !sendAll(fd, outHead, 4) ||
+        !sendAll(fd, out, outLen))
+        return -1;
+
+    int status = recvResponse(fd, reply);
+    size_t len = reply->output_size;
+    if (status < 0 || request->shm_output || !len)
+        return status;
+    unsigned char *data = malloc(len);
+    if (!data || !recvAll(fd, data, len)) {
+        free(data);
+        return -1;
+    }
+    if (keep)
+        reply->output = data;
+    else
+        free(data);
+    return status;
+}
@@ -0,0 +1,491 @@
+/*
+ * File: bw_simd.c
+ * ---------------------------
+ * Description:
+ *   The per-pixel kernels every conversion runs through: RGB to luma,
+ *   threshold screening (AM, ordered, blue noise and plain threshold),
+ *   packing dithered rows into bits, counting their black pixels for the
+ *   coverage statistics, and the CRC-32 of PNG chunks. Each is built in
+ *   several instruction-set variants inside the one library: scalar, SSE2
+ *   (with POPCNT where present), AVX2 and AVX-512 on x86-64, NEON (with the
+ *   ARMv8 CRC instructions where present) on AArch64. The makefile needs no
+ *   -march: the wider variants are compiled with target attributes, and the
+ *   best one the CPU runs is picked once, as the library is loaded, from
+ *   cpuid (or the ARM hwcaps). BW_ISA=scalar, sse2, avx2, avx512 or neon forces
+ *   one for testing; one the CPU cannot run is ignored. All variants give
+ *   the same bytes.
+ *
+ *   Error diffusion carries each pixel's error to the next one along the
+ *   row, so it stays scalar; the packing of its output runs here. PNG rows
+ *   are stored unfiltered, so there is no filter kernel, and deflate with
+ *   its Adler-32 is stb_image_write's.
+ *
+ * Author: Bahey Shalash
+ * Version: 2.1.2
+ * Date: 19/04/2025
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "bw_internal.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define TARGET_POPCNT __attribute__((target("popcnt")))
+#define TARGET_AVX2 __attribute__((target("avx2,pclmul,sse4.1,popcnt")))
+#define TARGET_AVX512 __attribute__((target("avx512f,avx512bw,avx2,popcnt")))
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#endif
+
+/* The scalar variants stay scalar: the compiler would otherwise vectorize
+ * them for the baseline ISA, and BW_ISA=scalar would test nothing. */
+#define SCALAR __attribute__((optimize("no-tree-vectorize")))
+#define INLINE static inline __attribute__((always_inline))
+
+typedef enum { ISA_SCALAR, ISA_SSE2, ISA_AVX2, ISA_AVX512, ISA_NEON, ISA_COUNT } Isa;
+
+static const char *const ISA_NAME[ISA_COUNT] = {"scalar", "sse2", "avx2", "avx512",
+                                                "neon"};
+
+typedef struct {
+    Isa isa;
+    void (*luma)(const unsigned char *rgb, unsigned char *gray, int total);
+    void (*screen)(unsigned char *dst, const unsigned char *gray,
+                   const unsigned char *thr, int w, unsigned char flip);
+    void (*pack)(unsigned char *dst, const unsigned char *src, int w, unsigned char flip);
+    uint32_t (*crc)(uint32_t crc, const unsigned char *p, size_t len);
+    unsigned int (*count)(const unsigned char *row, int x0, int x1);
+} Kernels;
+
+static Kernels kernels;
+static unsigned char REVERSED[256]; /* bit order of each byte reversed */
+static uint32_t CRC_TABLE[256];
+
+/* ---- Scalar ---- */
+
+INLINE void lumaLoop(const unsigned char *rgb, unsigned char *gray, int total) {
+    for (int i = 0; i < total; i++) {
+        unsigned char r = rgb[3 * i], g = rgb[3 * i + 1], b = rgb[3 * i + 2];
+        gray[i] = (unsigned char)(0.2126f * r + 0.7152f * g + 0.0722f * b);
+    }
+}
+
+SCALAR static void lumaScalar(const unsigned char *rgb, unsigned char *gray, int total) {
+    lumaLoop(rgb, gray, total);
+}
+
+/* White (1) where gray >= threshold, packed MSB-first, from pixel x (a
+ * multiple of 8) to the end of the row. */
+SCALAR static void screenTail(unsigned char *dst, const unsigned char *gray,
+                              const unsigned char *thr, int x, int w, unsigned char flip) {
+    for (; x < w; x += 8) {
+        unsigned char v = 0;
+        int n = w - x < 8 ? w - x : 8;
+        for (int i = 0; i < n; i++)
+            v |= (unsigned char)((gray[x + i] >= thr[x + i]) << (7 - i));
+        v ^= flip;
+        dst[x / 8] = n < 8 ? v & (unsigned char)(0xFF00 >> n) : v;
+    }
+}
+
+static void screenScalar(unsigned char *dst, const unsigned char *gray,
+                         const unsigned char *thr, int w, unsigned char flip) {
+    screenTail(dst, gray, thr, 0, w, flip);
+}
+
+/* The top bit of each byte, packed MSB-first, from pixel x (a multiple of 8). */
+SCALAR static void packTail(unsigned char *dst, const unsigned char *src, int x, int w,
+                            unsigned char flip) {
+    for (src += x; x + 8 <= w; x += 8, src += 8) {
+        unsigned char v = (unsigned char)((src[0] & 0x80) | (src[1] & 0x80) >> 1 |
+                                          (src[2] & 0x80) >> 2 | (src[3] & 0x80) >> 3 |
+                                          (src[4] & 0x80) >> 4 | (src[5] & 0x80) >> 5 |
+                                          (src[6] & 0x80) >> 6 | (src[7] & 0x80) >> 7);
+        dst[x / 8] = v ^ flip;
+    }
+    if (x < w) {
+        unsigned char v = 0;
+        for (int i = 0; i < w - x; i++)
+            v |= (unsigned char)((src[i] & 0x80) >> i);
+        v ^= flip;
+        dst[x / 8] = v & (unsigned char)(0xFF00 >> (w - x)); /* zero padding bits */
+    }
+}
+
+static void packScalar(unsigned char *dst, const unsigned char *src, int w,
+                       unsigned char flip) {
+    packTail(dst, src, 0, w, flip);
+}
+
+static uint32_t crcScalar(uint32_t crc, const unsigned char *p, size_t len) {
+    crc = ~crc;
+    while (len--)
+        crc = CRC_TABLE[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+/* Black pixels (zero bits) in [x0, x1) of a packed row. */
+INLINE unsigned int countLoop(const unsigned char *row, int x0, int x1) {
+    unsigned int white = 0;
+    int b0 = x0 >> 3, b1 = x1 >> 3;
+    if (b0 == b1) {
+        unsigned char m = (unsigned char)((0xFF >> (x0 & 7)) & (0xFF00 >> (x1 & 7)));
+        return (unsigned int)(x1 - x0) - __builtin_popcount(row[b0] & m);
+    }
+    if (x0 & 7) {
+        white += __builtin_popcount(row[b0] & (0xFF >> (x0 & 7)));
+        b0++;
+    }
+    for (; b0 + 8 <= b1; b0 += 8) {
+        uint64_t word;
+        memcpy(&word, row + b0, 8);
+        white += __builtin_popcountll(word);
+    }
+    for (; b0 < b1; b0++)
+        white += __builtin_popcount(row[b0]);
+    if (x1 & 7)
+        white += __builtin_popcount(row[b1] & (0xFF00 >> (x1 & 7)));
+    return (unsigned int)(x1 - x0) - white;
+}
+
+SCALAR static unsigned int countScalar(const unsigned char *row, int x0, int x1) {
+    return countLoop(row, x0, x1);
+}
+
+/* `bytes` bytes of a movemask (pixel 0 in bit 0) as MSB-first output bytes. */
+INLINE void putMask(unsigned char *dst, uint64_t m, int bytes, unsigned char flip) {
+    for (int i = 0; i < bytes; i++)
+        dst[i] = REVERSED[(m >> 8 * i) & 0xFF] ^ flip;
+}
+
+#if defined(__x86_64__)
+
+/* ---- SSE2 (the x86-64 baseline) ---- */
+
+static void lumaSse2(const unsigned char *rgb, unsigned char *gray, int total) {
+    lumaLoop(rgb, gray, total);
+}
+
+static void screenSse2(unsigned char *dst, const unsigned char *gray,
+                       const unsigned char *thr, int w, unsigned char flip) {
+    int x = 0;
+    for (; x + 16 <= w; x += 16) {
+        __m128i g = _mm_loadu_si128((const __m128i *)(gray + x));
+        __m128i t = _mm_loadu_si128((const __m128i *)(thr + x));
+        __m128i ge = _mm_cmpeq_epi8(_mm_max_epu8(g, t), g);
+        putMask(dst + x / 8, (unsigned)_mm_movemask_epi8(ge), 2, flip);
+    }
+    screenTail(dst, gray, thr, x, w, flip);
+}
+
+static void packSse2(unsigned char *dst, const unsigned char *src, int w,
+                     unsigned char flip) {
+    int x = 0;
+    for (; x + 16 <= w; x += 16)
+        putMask(dst + x / 8,
+                (unsigned)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(src + x))), 2,
+                flip);
+    packTail(dst, src, x, w, flip);
+}
+
+/* POPCNT is not in the x86-64 baseline; without it every popcount is a call
+ * into libgcc. */
+TARGET_POPCNT static unsigned int countPopcnt(const unsigned char *row, int x0, int x1) {
+    return countLoop(row, x0, x1);
+}
+
+/* ---- AVX2, with PCLMULQDQ for the CRC ---- */
+
+TARGET_AVX2 static void lumaAvx2(const unsigned char *rgb, unsigned char *gray,
+                                 int total) {
+    lumaLoop(rgb, gray, total);
+}
+
+/* Each group of eight bytes in reverse, so a movemask comes out MSB-first
+ * and needs no REVERSED lookups. */
+TARGET_AVX2 INLINE __m256i eightsReversed256(__m256i v) {
+    const __m256i order = _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10,
+                                           9, 8, 7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12,
+                                           11, 10, 9, 8);
+    return _mm256_shuffle_epi8(v, order);
+}
+
+TARGET_AVX2 static void screenAvx2(unsigned char *dst, const unsigned char *gray,
+                                   const unsigned char *thr, int w, unsigned char flip) {
+    uint32_t flips = flip * 0x01010101u;
+    int x = 0;
+    for (; x + 32 <= w; x += 32) {
+        __m256i g = _mm256_loadu_si256((const __m256i *)(gray + x));
+        __m256i t = _mm256_loadu_si256((const __m256i *)(thr + x));
+        __m256i ge = _mm256_cmpeq_epi8(_mm256_max_epu8(g, t), g);
+        uint32_t m = (uint32_t)_mm256_movemask_epi8(eightsReversed256(ge)) ^ flips;
+        memcpy(dst + x / 8, &m, 4);
+    }
+    screenTail(dst, gray, thr, x, w, flip);
+}
+
+TARGET_AVX2 static void packAvx2(unsigned char *dst, const unsigned char *src, int w,
+                                 unsigned char flip) {
+    uint32_t flips = flip * 0x01010101u;
+    int x = 0;
+    for (; x + 32 <= w; x += 32) {
+        __m256i v = eightsReversed256(_mm256_loadu_si256((const __m256i *)(src + x)));
+        uint32_t m = (uint32_t)_mm256_movemask_epi8(v) ^ flips;
+        memcpy(dst + x / 8, &m, 4);
+    }
+    packTail(dst, src, x, w, flip);
+}
+
+/* Four 128-bit lanes folded 64 bytes at a time, then into one lane and
+ * Barrett-reduced to 32 bits ("Fast CRC Computation for Generic Polynomials
+ * Using PCLMULQDQ", Intel, 2009, with the bit-reflected constants of the
+ * CRC-32 polynomial). Takes and returns the inverted CRC; len >= 64 and a
+ * multiple of 16. */
+TARGET_AVX2 static uint32_t crcFold(uint32_t crc, const unsigned char *p, size_t len) {
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+    const __m128i k5 = _mm_set_epi64x(0, 0x0163cd6124);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+    const __m128i low32 = _mm_setr_epi32(~0, 0, ~0, 0);
+    __m128i x[4];
+    for (int i = 0; i < 4; i++)
+        x[i] = _mm_loadu_si128((const __m128i *)(p + 16 * i));
+    x[0] = _mm_xor_si128(x[0], _mm_cvtsi32_si128((int)crc));
+    for (p += 64, len -= 64; len >= 64; p += 64, len -= 64) {
+        for (int i = 0; i < 4; i++) {
+            __m128i lo = _mm_clmulepi64_si128(x[i], k1k2, 0x00);
+            __m128i hi = _mm_clmulepi64_si128(x[i], k1k2, 0x11);
+            __m128i in = _mm_loadu_si128((const __m128i *)(p + 16 * i));
+            x[i] = _mm_xor_si128(_mm_xor_si128(lo, hi), in);
+        }
+    }
+    __m128i acc = x[0];
+    for (int i = 1; i < 4; i++) {
+        __m128i lo = _mm_clmulepi64_si128(acc, k3k4, 0x00);
+        __m128i hi = _mm_clmulepi64_si128(acc, k3k4, 0x11);
+        acc = _mm_xor_si128(_mm_xor_si128(lo, hi), x[i]);
+    }
+    for (; len >= 16; p += 16, len -= 16) {
+        __m128i lo = _mm_clmulepi64_si128(acc, k3k4, 0x00);
+        __m128i hi = _mm_clmulepi64_si128(acc, k3k4, 0x11);
+        acc = _mm_xor_si128(_mm_xor_si128(lo, hi), _mm_loadu_si128((const __m128i *)p));
+    }
+    /* 128 -> 64 bits */
+    __m128i t = _mm_clmulepi64_si128(acc, k3k4, 0x10);
+    acc = _mm_xor_si128(_mm_srli_si128(acc, 8), t);
+    t = _mm_srli_si128(acc, 4);
+    acc = _mm_clmulepi64_si128(_mm_and_si128(acc, low32), k5, 0x00);
+    acc = _mm_xor_si128(acc, t);
+    /* Barrett reduction to 32 bits */
+    t = _mm_clmulepi64_si128(_mm_and_si128(acc, low32), poly, 0x10);
+    t = _mm_clmulepi64_si128(_mm_and_si128(t, low32), poly, 0x00);
+    acc = _mm_xor_si128(acc, t);
+    return (uint32_t)_mm_extract_epi32(acc, 1);
+}
+
+static uint32_t crcPclmul(uint32_t crc, const unsigned char *p, size_t len) {
+    if (len >= 64) {
+        size_t fold = len & ~(size_t)15;
+        crc = ~crcFold(~crc, p, fold);
+        p += fold;
+        len -= fold;
+    }
+    return crcScalar(crc, p, len);
+}
+
+/* ---- AVX-512 (F and BW) ---- */
+
+TARGET_AVX512 static void lumaAvx512(const unsigned char *rgb, unsigned char *gray,
+                                     int total) {
+    lumaLoop(rgb, gray, total);
+}
+
+TARGET_AVX512 INLINE __m512i eightsReversed512(__m512i v) {
+    const __m512i order = _mm512_set4_epi32(0x08090a0b, 0x0c0d0e0f, 0x00010203, 0x04050607);
+    return _mm512_shuffle_epi8(v, order);
+}
+
+TARGET_AVX512 static void screenAvx512(unsigned char *dst, const unsigned char *gray,
+                                       const unsigned char *thr, int w,
+                                       unsigned char flip) {
+    uint64_t flips = flip * 0x0101010101010101ull;
+    int x = 0;
+    for (; x + 64 <= w; x += 64) {
+        __m512i g = eightsReversed512(_mm512_loadu_si512(gray + x));
+        __m512i t = eightsReversed512(_mm512_loadu_si512(thr + x));
+        uint64_t m = _mm512_cmpge_epu8_mask(g, t) ^ flips;
+        memcpy(dst + x / 8, &m, 8);
+    }
+    screenTail(dst, gray, thr, x, w, flip);
+}
+
+TARGET_AVX512 static void packAvx512(unsigned char *dst, const unsigned char *src, int w,
+                                     unsigned char flip) {
+    uint64_t flips = flip * 0x0101010101010101ull;
+    int x = 0;
+    for (; x + 64 <= w; x += 64) {
+        uint64_t m = _mm512_movepi8_mask(eightsReversed512(_mm512_loadu_si512(src + x)));
+        m ^= flips;
+        memcpy(dst + x / 8, &m, 8);
+    }
+    packTail(dst, src, x, w, flip);
+}
+
+static Isa bestIsa(void) {
+    __builtin_cpu_init();
+    bool avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("pclmul") &&
+                __builtin_cpu_supports("sse4.1") && __builtin_cpu_supports("popcnt");
+    if (avx2 && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+        return ISA_AVX512;
+    return avx2 ? ISA_AVX2 : ISA_SSE2;
+}
+
+#elif defined(__aarch64__)
+
+/* ---- NEON, with the ARMv8 CRC-32 instructions where present ---- */
+
+static const uint8_t BIT_WEIGHT[16] = {128, 64, 32, 16, 8, 4, 2, 1,
+                                       128, 64, 32, 16, 8, 4, 2, 1};
+
+/* 16 all-ones or all-zeros bytes as two MSB-first output bytes. */
+INLINE void putLanes(unsigned char *dst, uint8x16_t mask, unsigned char flip) {
+    uint8x16_t bits = vandq_u8(mask, vld1q_u8(BIT_WEIGHT));
+    dst[0] = vaddv_u8(vget_low_u8(bits)) ^ flip;
+    dst[1] = vaddv_u8(vget_high_u8(bits)) ^ flip;
+}
+
+static void lumaNeon(const unsigned char *rgb, unsigned char *gray, int total) {
+    lumaLoop(rgb, gray, total);
+}
+
+static void screenNeon(unsigned char *dst, const unsigned char *gray,
+                       const unsigned char *thr, int w, unsigned char flip) {
+    int x = 0;
+    for (; x + 16 <= w; x += 16)
+        putLanes(dst + x / 8, vcgeq_u8(vld1q_u8(gray + x), vld1q_u8(thr + x)), flip);
+    screenTail(dst, gray, thr, x, w, flip);
+}
+
+static void packNeon(unsigned char *dst, const unsigned char *src, int w,
+                     unsigned char flip) {
+    int x = 0;
+    for (; x + 16 <= w; x += 16) {
+        int8x16_t v = vreinterpretq_s8_u8(vld1q_u8(src + x));
+        putLanes(dst + x / 8, vreinterpretq_u8_s8(vshrq_n_s8(v, 7)), flip);
+    }
+    packTail(dst, src, x, w, flip);
+}
+
+__attribute__((target("+crc"))) static uint32_t crcArm(uint32_t crc, const unsigned char *p,
+                                                       size_t len) {
+    crc = ~crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        crc = __crc32d(crc, v);
+    }
+    while (len--)
+        crc = __crc32b(crc, *p++);
+    return ~crc;
+}
+
+static Isa bestIsa(void) {
+    return ISA_NEON; /* part of every AArch64 CPU */
+}
+
+#else
+
+static Isa bestIsa(void) {
+    return ISA_SCALAR;
+}
+
+#endif
+
+/* ---- Choice, once at load time ---- */
+
+/* BW_ISA's variant if this CPU runs it, else the best it has. */
+static Isa chooseIsa(void) {
+    int best = bestIsa();
+    const char *want = getenv("BW_ISA");
+    for (int i = 0; want && i < ISA_COUNT; i++) {
+        bool runs = i == ISA_SCALAR || i == best || (best != ISA_NEON && i <= best);
+        if (!strcmp(want, ISA_NAME[i]) && runs)
+            return (Isa)i;
+    }
+    return (Isa)best;
+}
+
+__attribute__((constructor)) static void pickKernels(void) {
+    for (int i = 0; i < 256; i++) {
+        unsigned char r = 0;
+        for (int b = 0; b < 8; b++)
+            r |= (unsigned char)(((i >> b) & 1) << (7 - b));
+        REVERSED[i] = r;
+        uint32_t c = (uint32_t)i;
+        for (int k = 0; k < 8; k++)
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        CRC_TABLE[i] = c;
+    }
+
+    kernels = (Kernels){ISA_SCALAR, lumaScalar, screenScalar, packScalar, crcScalar,
+                        countScalar};
+    switch (chooseIsa()) {
+#if defined(__x86_64__)
+        case ISA_AVX512:
+            kernels = (Kernels){ISA_AVX512, lumaAvx512, screenAvx512, packAvx512, crcPclmul,
+                                countPopcnt};
+            break;
+        case ISA_AVX2:
+            kernels = (Kernels){ISA_AVX2, lumaAvx2, screenAvx2, packAvx2, crcPclmul,
+                                countPopcnt};
+            break;
+        case ISA_SSE2:
+            kernels = (Kernels){ISA_SSE2, lumaSse2, screenSse2, packSse2, crcScalar,
+                                countScalar};
+            if (__builtin_cpu_supports("popcnt"))
+                kernels.count = countPopcnt;
+            break;
+#elif defined(__aarch64__)
+        case ISA_NEON:
+            kernels = (Kernels){ISA_NEON, lumaNeon, screenNeon, packNeon,
+                                getauxval(AT_HWCAP) & HWCAP_CRC32 ? crcArm : crcScalar,
+                                countScalar};
+            break;
+#endif
+        default:
+            break;
+    }
+}
+
+/* ---- Entry points ---- */
+
+void rgbToGray(const unsigned char *rgb, unsigned char *gray, int total) {
+    kernels.luma(rgb, gray, total);
+}
+
+void screenRow(unsigned char *dst, const unsigned char *gray, const unsigned char *thr,
+               int w, unsigned char flip) {
+    kernels.screen(dst, gray, thr, w, flip);
+}
+
+void packRow(unsigned char *dst, const unsigned char *src, int w, bool invert) {
+    kernels.pack(dst, src, w, invert ? 0xFF : 0x00);
+}
+
+uint32_t crc32Update(uint32_t crc, const unsigned char *p, size_t len) {
+    return kernels.crc(crc, p, len);
+}
+
+unsigned int countBlack(const unsigned char *row, int x0, int x1) {
+    return kernels.count(row, x0, x1);
+}
+
+const char *bw_isa(void) {
+    return ISA_NAME[kernels.isa];
+}
@@ -0,0 +1,362 @@
+/*
+ * File: bw_stream.c
+ * ---------------------------
+ * Description:
+ *   YUV4MPEG2 (Y4M) video dithering for e-paper and LED-matrix displays.
+ *
+ *   The Y plane of each frame is already luma, so it is dithered as read;
+ *   chroma is skipped. Output is a bare stream of packed 1-bit frames.
+ *
+ *   A reader thread parses frames into a small ring of slots, worker
+ *   threads dither whole frames, and the caller's thread writes them back
+ *   in order. Slot buffers are allocated once, so steady state does no
+ *   allocation; with the screen-based algorithms (ordered, threshold, AM)
+ *   a frame is one table-driven SIMD compare per pixel.
+ *
+ * Author: Bahey Shalash
+ * Version: 2.1.2
+ * Date: 19/04/2025
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bw_internal.h"
+
+#define MAX_WORKERS 64
+#define HEADER_MAX 1024
+
+typedef enum { SLOT_FREE, SLOT_LOADED, SLOT_BUSY, SLOT_DONE } SlotState;
+
+typedef struct {
+    unsigned char *luma; /* w*h Y samples */
+    unsigned char *bits; /* h*stride packed output */
+    long frame;
+    SlotState state;
+    ErrorCode result;
+} StreamSlot;
+
+typedef struct {
+    FILE *in;
+    const BWConfig *cfg;
+    int w, h, stride;
+    size_t chroma; /* bytes of U/V (and alpha) after each Y plane */
+    BWScreen screen;
+    unsigned char *screenRows; /* NULL for error diffusion */
+    size_t rowLen;
+
+    StreamSlot *slots;
+    int slotCount;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    long nextWork;
+    long frames; /* total frame count, known once `eof` is set */
+    bool eof;
+    ErrorCode result;
+} Stream;
+
+/* "W1920 H1080 F30:1 Ip A1:1 C420jpeg" after the magic. */
+static ErrorCode parseHeader(Stream *st) {
+    char line[HEADER_MAX];
+    if (!fgets(line, sizeof(line), st->in) || strncmp(line, "YUV4MPEG2", 9))
+        return ERR_LOAD;
+    const char *colour = "420";
+    for (char *tok = strtok(line + 9, " \n"); tok; tok = strtok(NULL, " \n")) {
+        if (tok[0] == 'W')
+            st->w = atoi(tok + 1);
+        else if (tok[0] == 'H')
+            st->h = atoi(tok + 1);
+        else if (tok[0] == 'C')
+            colour = tok + 1;
+    }
+    if (st->w <= 0 || st->h <= 0)
+        return ERR_LOAD;
+
+    size_t cw = (size_t)(st->w + 1) / 2, ch = (size_t)(st->h + 1) / 2;
+    size_t plane = (size_t)st->w * st->h;
+    const char *depth = strpbrk(colour, "0123456789");
+    while (depth && depth[0] >= '0' && depth[0] <= '9')
+        depth++;
+    if (depth && *depth == 'p' && depth[1] >= '0' && depth[1] <= '9')
+        return ERR_CONFIG; /* high bit depth, e.g. C420p10 */
+    if (!strncmp(colour, "mono", 4) && colour[4])
+        return ERR_CONFIG; /* mono16 */
+    if (!strncmp(colour, "420", 3))
+        st->chroma = 2 * cw * ch;
+    else if (!strncmp(colour, "422", 3))
+        st->chroma = 2 * cw * st->h;
+    else if (!strcmp(colour, "444alpha"))
+        st->chroma = 3 * plane;
+    else if (!strncmp(colour, "444", 3))
+        st->chroma = 2 * plane;
+    else if (!strncmp(colour, "411", 3))
+        st->chroma = 2 * ((size_t)(st->w + 3) / 4) * st->h;
+    else if (!strcmp(colour, "mono"))
+        st->chroma = 0;
+    else
+        return ERR_CONFIG;
+    st->stride = (st->w + 7) / 8;
+    return ERR_OK;
+}
+
+/* Read one "FRAME ..." record; returns false at a clean end of stream. */
+static bool readFrame(Stream *st, unsigned char *luma, unsigned char *skip,
+                      ErrorCode *err) {
+    char tag[6];
+    if (fread(tag, 1, 5, st->in) != 5)
+        return false;
+    int c;
+    while ((c = getc(st->in)) != '\n' && c != EOF)
+        ;
+    size_t plane = (size_t)st->w * st->h;
+    if (strncmp(tag, "FRAME", 5) || c == EOF || fread(luma, 1, plane, st->in) != plane) {
+        *err = ERR_LOAD;
+        return false;
+    }
+    for (size_t left = st->chroma; left > 0;) {
+        size_t n = left < plane ? left : plane;
+        if (fread(skip, 1, n, st->in) != n) {
+            *err = ERR_LOAD;
+            return false;
+        }
+        left -= n;
+    }
+    return true;
+}
+
+static void *readerThread(void *arg) {
+    Stream *st = arg;
+    unsigned char *skip = st->chroma ? malloc((size_t)st->w * st->h) : NULL;
+    ErrorCode err = st->chroma && !skip ? ERR_MEMORY : ERR_OK;
+    long n = 0;
+    for (; err == ERR_OK; n++) {
+        StreamSlot *slot = &st->slots[n % st->slotCount];
+        pthread_mutex_lock(&st->lock);
+        while (slot->state != SLOT_FREE && st->result == ERR_OK)
+            pthread_cond_wait(&st->changed, &st->lock);
+        bool stop = st->result != ERR_OK;
+        pthread_mutex_unlock(&st->lock);
+        if (stop || !readFrame(st, slot->luma, skip, &err))
+            break;
+        pthread_mutex_lock(&st->lock);
+        slot->frame = n;
+        slot->state = SLOT_LOADED;
+        pthread_cond_broadcast(&st->changed);
+        pthread_mutex_unlock(&st->lock);
+    }
+    free(skip);
+    pthread_mutex_lock(&st->lock);
+    st->frames = n;
+    st->eof = true;
+    if (err != ERR_OK && st->result == ERR_OK)
+        st->result = err;
+    pthread_cond_broadcast(&st->changed);
+    pthread_mutex_unlock(&st->lock);
+    return NULL;
+}
+
+static ErrorCode ditherFrame(const Stream *st, StreamSlot *slot, const BWConfig *cfg,
+                             BWWorkspace *ws) {
+    if (st->screenRows) {
+        unsigned char flip = cfg->invertOutput ? 0xFF : 0x00;
+        for (int y = 0; y < st->h; y++)
+            screenRow(slot->bits + (size_t)y * st->stride, slot->luma + (size_t)y * st->w,
+                      st->screenRows + (size_t)(y % st->screen.size) * st->rowLen, st->w,
+                      flip);
+        return ERR_OK;
+    }
+    BWBitmap bm;
+    ErrorCode r = ditherGrayPlane(slot->luma, st->w, st->h, cfg, NULL, &bm, NULL, ws);
+    if (r == ERR_OK) {
+        memcpy(slot->bits, bm.bits, (size_t)st->stride * st->h);
+        scratchRelease(ws, bm.bits);
+    }
+    return r;
+}
+
+static void *workerThread(void *arg) {
+    Stream *st = arg;
+    BWConfig cfg = *st->cfg;
+    cfg.threads = 1; /* frames, not rows, are the unit of parallelism */
+    cfg.verboseMode = false;
+    BWWorkspace ws = {0}; /* diffusion buffers, kept for the whole stream */
+    pthread_mutex_lock(&st->lock);
+    for (;;) {
+        StreamSlot *slot = &st->slots[st->nextWork % st->slotCount];
+        while (st->result == ERR_OK && !(st->eof && st->nextWork >= st->frames) &&
+               !(slot->state == SLOT_LOADED && slot->frame == st->nextWork)) {
+            pthread_cond_wait(&st->changed, &st->lock);
+            slot = &st->slots[st->nextWork % st->slotCount];
+        }
+        if (st->result != ERR_OK || (st->eof && st->nextWork >= st->frames))
+            break;
+        st->nextWork++;
+        slot->state = SLOT_BUSY;
+        pthread_mutex_unlock(&st->lock);
+
+        ErrorCode r = ditherFrame(st, slot, &cfg, &ws);
+
+        pthread_mutex_lock(&st->lock);
+        slot->result = r;
+        slot->state = SLOT_DONE;
+        pthread_cond_broadcast(&st->changed);
+    }
+    pthread_mutex_unlock(&st->lock);
+    workspaceFree(&ws);
+    return NULL;
+}
+
+/* Runs on the caller's thread: frames leave in input order. */
+static void writeFrames(Stream *st, FILE *out, BWStats *stats, StatsAccum *acc) {
+    size_t frameBytes = (size_t)st->stride * st->h;
+    for (long n = 0;; n++) {
+        StreamSlot *slot = &st->slots[n % st->slotCount];
+        pthread_mutex_lock(&st->lock);
+        while (st->result == ERR_OK && !(st->eof && n >= st->frames) &&
+               !(slot->state == SLOT_DONE && slot->frame == n))
+            pthread_cond_wait(&st->changed, &st->lock);
+        bool stop = st->result != ERR_OK || (st->eof && n >= st->frames);
+        ErrorCode r = stop ? ERR_OK : slot->result;
+        pthread_mutex_unlock(&st->lock);
+        if (stop)
+            return;
+
+        if (r == ERR_OK && fwrite(slot->bits, 1, frameBytes, out) != frameBytes)
+            r = ERR_WRITE;
+        if (r == ERR_OK && stats) {
+            for (int y = 0; y < st->h; y++)
+                statsAddRow(stats, acc, slot->bits + (size_t)y * st->stride, y);
+        }
+        if (st->cfg->verboseMode && n % 100 == 0)
+            fprintf(stderr, "Frame %ld\n", n);
+
+        pthread_mutex_lock(&st->lock);
+        if (r != ERR_OK && st->result == ERR_OK)
+            st->result = r;
+        slot->state = SLOT_FREE;
+        pthread_cond_broadcast(&st->changed);
+        pthread_mutex_unlock(&st->lock);
+    }
+}
+
+static int workerCount(const BWConfig *cfg) {
+    long n = cfg->threads > 0 ? cfg->threads : sysconf(_SC_NPROCESSORS_ONLN);
+    return n < 1 ? 1 : n > MAX_WORKERS ? MAX_WORKERS : (int)n;
+}
+
+static ErrorCode allocSlots(Stream *st, int count) {
+    st->slots = calloc(count, sizeof(*st->slots));
+    if (!st->slots)
+        return ERR_MEMORY;
+    st->slotCount = count;
+    for (int i = 0; i < count; i++) {
+        st->slots[i].luma = malloc((size_t)st->w * st->h);
+        st->slots[i].bits = malloc((size_t)st->stride * st->h);
+        if (!st->slots[i].luma || !st->slots[i].bits)
+            return ERR_MEMORY;
+    }
+    return ERR_OK;
+}
+
+static void freeStream(Stream *st) {
+    for (int i = 0; st->slots && i < st->slotCount; i++) {
+        free(st->slots[i].luma);
+        free(st->slots[i].bits);
+    }
+    free(st->slots);
+    free(st->screenRows);
+    if (st->screen.thr)
+        freeScreen(&st->screen);
+}
+
+int convert_y4m_bw(FILE *input, FILE *output, const BWConfig *config, BWStats *stats) {
+    if (config->levels != 2 || config->customLevels || config->paletteSize > 0 ||
+        config->separateCMYK)
+        return ERR_CONFIG;
+    Stream st = {.in = input, .cfg = config};
+    ErrorCode r = parseHeader(&st);
+    if (r != ERR_OK)
+        return r;
+
+    if (config->algorithm != BW_ALGO_DIFFUSION) {
+        r = buildScreen(&st.screen, config, config->screenAngle);
+        if (r == ERR_OK) {
+            st.screenRows = expandScreen(&st.screen, st.w, config, &st.rowLen);
+            r = st.screenRows ? ERR_OK : ERR_MEMORY;
+        }
+    }
+    int workers = workerCount(config);
+    StatsAccum acc = {0};
+    if (r == ERR_OK)
+        r = allocSlots(&st, workers + 2); /* one being read, one being written */
+    if (r == ERR_OK && stats) {
+        r = statsBegin(stats, st.w, st.h, config);
+        if (r == ERR_OK && statsAccumInit(&acc, st.w) != ERR_OK) {
+            bw_stats_free(stats);
+            r = ERR_MEMORY;
+        }
+    }
+    if (r != ERR_OK) {
+        freeStream(&st);
+        return r;
+    }
+    if (config->verboseMode)
+        fprintf(stderr, "Y4M %dx%d, %d worker%s\n", st.w, st.h, workers,
+                workers == 1 ? "" : "s");
+
+    pthread_mutex_init(&st.lock, NULL);
+    pthread_cond_init(&st.changed, NULL);
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    pthread_t reader, threads[MAX_WORKERS];
+    int started = 0;
+    if (pthread_create(&reader, NULL, readerThread, &st) != 0) {
+        r = ERR_MEMORY;
+    } else {
+        while (started < workers &&
+               pthread_create(&threads[started], NULL, workerThread, &st) == 0)
+            started++;
+        if (started == 0) {
+            pthread_mutex_lock(&st.lock);
+            st.result = ERR_MEMORY;
+            pthread_cond_broadcast(&st.changed);
+            pthread_mutex_unlock(&st.lock);
+        }
+        writeFrames(&st, output, stats, &acc);
+        /* On error wake everyone up so they see st.result and exit. */
+        pthread_mutex_lock(&st.lock);
+        pthread_cond_broadcast(&st.changed);
+        pthread_mutex_unlock(&st.lock);
+        pthread_join(reader, NULL);
+        for (int i = 0; i < started; i++)
+            pthread_join(threads[i], NULL);
+        r = st.result;
+    }
+    if (r == ERR_OK && fflush(output) != 0)
+        r = ERR_WRITE;
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if (config->verboseMode && r == ERR_OK) {
+        double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+        fprintf(stderr, "%ld frames in %.2f s (%.1f fps)\n", st.frames, secs,
+                secs > 0 ? st.frames / secs : 0.0);
+    }
+    if (stats) {
+        statsMerge(stats, &acc);
+        if (r == ERR_OK) {
+            stats->frames = (int)st.frames;
+            double area = (double)st.w * st.h * st.frames;
+            stats->blackFraction = area > 0 ? stats->blackPixels / area : 0.0;
+        } else {
+            bw_stats_free(stats);
+        }
+    }
+    pthread_cond_destroy(&st.changed);
+    pthread_mutex_destroy(&st.lock);
+    freeStream(&st);
+    return r;
+}
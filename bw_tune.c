@@ -0,0 +1,453 @@
+/*
+ * File: bw_tune.c
+ * ---------------------------
+ * Description:
+ *   Host profiles: defaults measured on the machine instead of guessed.
+ *   bw_autotune() times the library's own kernels on synthetic images and
+ *   writes what it finds as "key=value" lines: the pool size past which
+ *   more threads stop paying, the least height of a screening band, the
+ *   cost per pixel of each batch stage (decoding a JPEG and a PNG, error
+ *   diffusion, PNG encoding), which splits batch threads between the
+ *   stages, and the deadline cost profile, which then need not be measured
+ *   in every process.
+ *
+ *   The library reads the profile the first time it needs one of these
+ *   defaults: $BW_PROFILE, else $XDG_CONFIG_HOME/bwconvert/profile (by
+ *   default under ~/.config), else /etc/bwconvert/profile. BW_PROFILE=none
+ *   reads none. A profile records the CPU model and core count it was
+ *   measured on and is ignored anywhere else, so a home directory shared
+ *   between a workstation and a server cannot carry one's tuning to the
+ *   other. Without a usable profile, and for any key it lacks, the static
+ *   defaults apply.
+ *
+ * Author: Bahey Shalash
+ * Version: 2.1.2
+ * Date: 19/04/2025
+ */
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bw_internal.h"
+#include "stb_image_write.h"
+
+#define PROFILE_VERSION 1
+#define RUNS 3
+#define MIN_SPENT_MS 20.0 /* short kernels run more often, so noise averages out */
+#define MAX_RUNS 500
+#define MARGIN 1.05 /* a setting must beat the default by 5% to be kept */
+#define THREAD_SIDE 2048
+#define STAGE_SIDE 1024
+#define MAX_BAND_ROWS 4096
+
+static const char *const ALGO_KEY[ALGO_COUNT] = {"diffusion", "am", "ordered",
+                                                 "threshold", "bluenoise"};
+static const char *const KERNEL_KEY[KERNEL_COUNT] = {"fs", "jjn", "stucki", "sierra",
+                                                     "atkinson"};
+static const char *const FORMAT_KEY[FORMAT_COUNT] = {"auto", "png", "svg", "gerber",
+                                                     "gif"};
+static const int BAND_CHOICES[] = {16, 32, 64, 128, 256};
+
+/* every deadline.* key: screens past diffusion, kernels, encoders, shrink */
+#define COST_KEYS \
+    ((ALGO_COUNT - 1) + KERNEL_COUNT + ALGO_COUNT * (FORMAT_COUNT - 1) + 1)
+
+static Tuning tuned;
+static pthread_once_t tunedOnce = PTHREAD_ONCE_INIT;
+
+typedef struct {
+    unsigned char *data;
+    size_t size, cap;
+} Buffer;
+
+static double nowMs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec * 1e-6;
+}
+
+/* ---- Host identity ---- */
+
+static void hostCpu(char *dst, size_t size) {
+    snprintf(dst, size, "unknown");
+    FILE *fp = fopen("/proc/cpuinfo", "r");
+    if (!fp)
+        return;
+    char line[256];
+    while (fgets(line, sizeof(line), fp)) {
+        char *colon = strchr(line, ':');
+        if (strncmp(line, "model name", 10) || !colon)
+            continue;
+        colon += strspn(colon + 1, " \t") + 1;
+        colon[strcspn(colon, "\n")] = '\0';
+        snprintf(dst, size, "%s", colon);
+        break;
+    }
+    fclose(fp);
+}
+
+static int hostCores(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+/* The paths tried in order, the first also where bw_autotune writes by
+ * default; none with BW_PROFILE=none. */
+static int profilePaths(char paths[2][PATH_MAX]) {
+    const char *env = getenv("BW_PROFILE");
+    if (env)
+        return *env && strcmp(env, "none") &&
+               snprintf(paths[0], PATH_MAX, "%s", env) < PATH_MAX;
+    const char *xdg = getenv("XDG_CONFIG_HOME"), *home = getenv("HOME");
+    int n = 0;
+    if (xdg && *xdg)
+        n += snprintf(paths[n], PATH_MAX, "%s/bwconvert/profile", xdg) < PATH_MAX;
+    else if (home && *home)
+        n += snprintf(paths[n], PATH_MAX, "%s/.config/bwconvert/profile", home) < PATH_MAX;
+    snprintf(paths[n++], PATH_MAX, "/etc/bwconvert/profile");
+    return n;
+}
+
+/* ---- Reading ---- */
+
+static int lookupKey(const char *s, size_t len, const char *const *keys, int count) {
+    for (int i = 0; i < count; i++)
+        if (strlen(keys[i]) == len && !strncmp(s, keys[i], len))
+            return i;
+    return -1;
+}
+
+/* One "deadline.*" key; false if it is not one. */
+static bool parseCost(DeadlineCosts *c, const char *key, const char *value) {
+    int a, k, f;
+    double ns, ms;
+    const char *dot;
+    if (!strncmp(key, "screen.", 7) &&
+        (a = lookupKey(key + 7, strlen(key + 7), ALGO_KEY, ALGO_COUNT)) > BW_ALGO_DIFFUSION)
+        return sscanf(value, "%lf", &c->screenNs[a]) == 1;
+    if (!strncmp(key, "kernel.", 7) &&
+        (k = lookupKey(key + 7, strlen(key + 7), KERNEL_KEY, KERNEL_COUNT)) >= 0)
+        return sscanf(value, "%lf", &c->kernelNs[k]) == 1;
+    if (!strcmp(key, "shrink"))
+        return sscanf(value, "%lf", &c->shrinkNs) == 1;
+    if (strncmp(key, "encode.", 7) || !(dot = strchr(key + 7, '.')))
+        return false;
+    f = lookupKey(key + 7, (size_t)(dot - key - 7), FORMAT_KEY, FORMAT_COUNT);
+    a = lookupKey(dot + 1, strlen(dot + 1), ALGO_KEY, ALGO_COUNT);
+    if (f <= BW_FORMAT_AUTO || a < 0 || sscanf(value, "%lf %lf", &ns, &ms) != 2)
+        return false;
+    c->encodeNs[a][f] = ns;
+    c->encodeFixedMs[a][f] = ms;
+    return true;
+}
+
+/* Fill *t from a profile, or leave it all 0 if the profile was measured on
+ * another host or by another version. */
+static void readProfile(FILE *fp, Tuning *t) {
+    char cpu[256], line[512];
+    hostCpu(cpu, sizeof(cpu));
+    bool version = false, sameCpu = false, sameCores = false;
+    int costs = 0;
+    memset(t, 0, sizeof(*t));
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        char *value = strchr(line, '=');
+        if (line[0] == '#' || !value)
+            continue;
+        *value++ = '\0';
+        int n = atoi(value);
+        if (!strcmp(line, "version"))
+            version = n == PROFILE_VERSION;
+        else if (!strcmp(line, "cpu"))
+            sameCpu = !strcmp(value, cpu);
+        else if (!strcmp(line, "cores"))
+            sameCores = n == hostCores();
+        else if (!strcmp(line, "threads"))
+            t->threads = n > 0 ? n : 0;
+        else if (!strcmp(line, "band_rows"))
+            t->bandRows = n > 0 && n <= MAX_BAND_ROWS ? n : 0;
+        else if (!strcmp(line, "stage_ns") &&
+                 sscanf(value, "%lf %lf %lf", &t->stageNs[STAGE_DECODE],
+                        &t->stageNs[STAGE_DITHER], &t->stageNs[STAGE_ENCODE]) != 3)
+            memset(t->stageNs, 0, sizeof(t->stageNs));
+        else if (!strncmp(line, "deadline.", 9))
+            costs += parseCost(&t->costs, line + 9, value);
+    }
+    t->haveCosts = costs == COST_KEYS;
+    if (!version || !sameCpu || !sameCores)
+        memset(t, 0, sizeof(*t));
+}
+
+static void loadTuning(void) {
+    char paths[2][PATH_MAX];
+    int n = profilePaths(paths);
+    for (int i = 0; i < n; i++) {
+        FILE *fp = fopen(paths[i], "r");
+        if (!fp)
+            continue;
+        readProfile(fp, &tuned); /* the first that exists decides */
+        fclose(fp);
+        return;
+    }
+}
+
+const Tuning *tuning(void) {
+    pthread_once(&tunedOnce, loadTuning);
+    return &tuned;
+}
+
+/* ---- Measuring ---- */
+
+/* A smooth gradient under mild noise, like a photo more than a graphic. */
+static void fillPlane(unsigned char *p, int w, int h, int channels) {
+    uint32_t seed = 7;
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            for (int c = 0; c < channels; c++) {
+                seed = seed * 1664525u + 1013904223u;
+                int v = (x + y + c * 40) * 255 / (w + h) + (int)(seed >> 28) - 8;
+                v = v < 0 ? 0 : v > 255 ? 255 : v;
+                p[((size_t)y * w + x) * channels + c] = (unsigned char)v;
+            }
+        }
+    }
+}
+
+/* Best of RUNS or more ditherings of `plane` (left untouched) in ms, run
+ * until MIN_SPENT_MS have gone; the last output is kept in *keep. */
+static double timeDither(const unsigned char *plane, unsigned char *work, int w, int h,
+                         const BWConfig *cfg, BWBitmap *keep) {
+    double best = 0.0, spent = 0.0;
+    for (int run = 0; run < MAX_RUNS && (run < RUNS || spent < MIN_SPENT_MS); run++) {
+        BWBitmap bm;
+        memcpy(work, plane, (size_t)w * h);
+        double t0 = nowMs();
+        if (ditherGrayPlane(work, w, h, cfg, NULL, &bm, NULL, NULL) != ERR_OK)
+            return 0.0;
+        double ms = nowMs() - t0;
+        spent += ms;
+        best = run == 0 || ms < best ? ms : best;
+        if (keep) {
+            free(keep->bits);
+            *keep = bm;
+        } else {
+            free(bm.bits);
+        }
+    }
+    return best;
+}
+
+/* The fewest pool threads that screen within MARGIN of the fastest: past
+ * them, hyperthreads and memory bandwidth take back what cores add. */
+static int tuneThreads(const unsigned char *plane, unsigned char *work, bool verbose) {
+    BWConfig cfg;
+    bw_config_init(&cfg);
+    cfg.algorithm = BW_ALGO_AM;
+    int cores = hostCores(), counts[32], n = 0;
+    for (int c = 1; c < cores && n < 31; c *= 2)
+        counts[n++] = c;
+    counts[n++] = cores;
+    double ms[32], best = 0.0;
+    for (int i = 0; i < n; i++) {
+        bw_set_threads(counts[i]);
+        ms[i] = timeDither(plane, work, THREAD_SIDE, THREAD_SIDE, &cfg, NULL);
+        best = i == 0 || ms[i] < best ? ms[i] : best;
+        if (verbose)
+            fprintf(stderr, "Threads %d: %.1f ms\n", counts[i], ms[i]);
+    }
+    int pick = 0;
+    while (ms[pick] > best * MARGIN)
+        pick++;
+    bw_set_threads(counts[pick]);
+    return counts[pick];
+}
+
+/* Least band height for screens, over a short and a tall image: shorter
+ * bands spread a small image over more threads, taller ones cost less to
+ * start. */
+static int tuneBands(const unsigned char *plane, unsigned char *work, bool verbose) {
+    BWConfig cfg;
+    bw_config_init(&cfg);
+    cfg.algorithm = BW_ALGO_AM;
+    int count = (int)(sizeof(BAND_CHOICES) / sizeof(BAND_CHOICES[0]));
+    int keep = tuned.bandRows, pick = -1;
+    if (poolThreads() == 1)
+        return 64; /* one band whatever its least height */
+    double ms[8], byDefault = 0.0, best = 0.0;
+    for (int i = 0; i < count; i++) {
+        tuned.bandRows = BAND_CHOICES[i];
+        ms[i] = timeDither(plane, work, STAGE_SIDE, STAGE_SIDE / 4, &cfg, NULL) +
+                timeDither(plane, work, STAGE_SIDE, STAGE_SIDE, &cfg, NULL);
+        if (BAND_CHOICES[i] == 64)
+            byDefault = ms[i];
+        if (pick < 0 || ms[i] < best) {
+            best = ms[i];
+            pick = i;
+        }
+        if (verbose)
+            fprintf(stderr, "Band rows %d: %.2f ms\n", BAND_CHOICES[i], ms[i]);
+    }
+    tuned.bandRows = keep;
+    return best * MARGIN < byDefault ? BAND_CHOICES[pick] : 64;
+}
+
+static void appendBytes(void *context, void *data, int size) {
+    Buffer *b = context;
+    if (b->size + size > b->cap) {
+        size_t cap = (b->size + size) * 2;
+        unsigned char *grown = realloc(b->data, cap);
+        if (!grown)
+            return;
+        b->data = grown;
+        b->cap = cap;
+    }
+    memcpy(b->data + b->size, data, size);
+    b->size += size;
+}
+
+/* ns per pixel to decode `file` and take its luma, best of RUNS. */
+static double timeDecode(const Buffer *file, unsigned char *gray, const BWConfig *cfg) {
+    double best = 0.0;
+    int w = 0, h = 0;
+    for (int run = 0; run < RUNS && file->size; run++) {
+        double t0 = nowMs();
+        unsigned char *rgb = loadRGBMemory(file->data, file->size, "profile", &w, &h, cfg);
+        if (!rgb)
+            return 0.0;
+        rgbToGray(rgb, gray, w * h);
+        double ms = nowMs() - t0;
+        free(rgb);
+        best = run == 0 || ms < best ? ms : best;
+    }
+    return w > 0 ? best * 1e6 / ((double)w * h) : 0.0;
+}
+
+/* Per-pixel cost of each batch stage with the default settings; decoding
+ * is the mean of a JPEG photo and a PNG scan. */
+static bool tuneStages(const unsigned char *plane, unsigned char *work, double *ns,
+                       bool verbose) {
+    int side = STAGE_SIDE, pixels = side * side;
+    unsigned char *rgb = malloc((size_t)pixels * 3);
+    Buffer jpg = {0}, png = {0};
+    BWConfig cfg;
+    bw_config_init(&cfg);
+    BWBitmap bm = {0};
+    bool ok = rgb != NULL;
+    if (ok) {
+        fillPlane(rgb, side, side, 3);
+        ok = stbi_write_jpg_to_func(appendBytes, &jpg, side, side, 3, rgb, 90) &&
+             stbi_write_png_to_func(appendBytes, &png, side, side, 3, rgb, side * 3);
+    }
+    if (ok) {
+        ns[STAGE_DECODE] = (timeDecode(&jpg, work, &cfg) + timeDecode(&png, work, &cfg)) / 2;
+        ns[STAGE_DITHER] = timeDither(plane, work, side, side, &cfg, &bm) * 1e6 / pixels;
+        double best = 0.0;
+        for (int run = 0; run < RUNS && bm.bits; run++) {
+            double t0 = nowMs();
+            saveBWImage("/dev/null", BW_FORMAT_PNG, &bm, &cfg, NULL);
+            double ms = nowMs() - t0;
+            best = run == 0 || ms < best ? ms : best;
+        }
+        ns[STAGE_ENCODE] = best * 1e6 / pixels;
+        ok = ns[STAGE_DECODE] > 0.0 && ns[STAGE_DITHER] > 0.0 && ns[STAGE_ENCODE] > 0.0;
+    }
+    if (verbose && ok)
+        fprintf(stderr, "Stages: decode %.2f, dither %.2f, encode %.2f ns/pixel\n",
+                ns[STAGE_DECODE], ns[STAGE_DITHER], ns[STAGE_ENCODE]);
+    free(bm.bits);
+    free(jpg.data);
+    free(png.data);
+    free(rgb);
+    return ok;
+}
+
+/* ---- Writing ---- */
+
+/* Create the directories leading to `path`. */
+static void makeParents(const char *path) {
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", path);
+    for (char *p = strchr(dir + 1, '/'); p; p = strchr(p + 1, '/')) {
+        *p = '\0';
+        mkdir(dir, 0777);
+        *p = '/';
+    }
+}
+
+static void writeCosts(FILE *fp, const DeadlineCosts *c) {
+    for (int a = BW_ALGO_AM; a < ALGO_COUNT; a++)
+        fprintf(fp, "deadline.screen.%s=%.4g\n", ALGO_KEY[a], c->screenNs[a]);
+    for (int k = 0; k < KERNEL_COUNT; k++)
+        fprintf(fp, "deadline.kernel.%s=%.4g\n", KERNEL_KEY[k], c->kernelNs[k]);
+    for (int f = BW_FORMAT_PNG; f < FORMAT_COUNT; f++)
+        for (int a = 0; a < ALGO_COUNT; a++)
+            fprintf(fp, "deadline.encode.%s.%s=%.4g %.4g\n", FORMAT_KEY[f], ALGO_KEY[a],
+                    c->encodeNs[a][f], c->encodeFixedMs[a][f]);
+    fprintf(fp, "deadline.shrink=%.4g\n", c->shrinkNs);
+}
+
+/* Replace the profile whole, so a process starting meanwhile never reads
+ * half of one. */
+static ErrorCode writeProfile(const char *path, const Tuning *t) {
+    char tmp[PATH_MAX], cpu[256];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+        return ERR_WRITE;
+    makeParents(path);
+    FILE *fp = fopen(tmp, "w");
+    if (!fp)
+        return ERR_WRITE;
+    hostCpu(cpu, sizeof(cpu));
+    fprintf(fp, "# libbwconvert host profile, written by bw_autotune. Delete it to go\n"
+                "# back to the static defaults.\n");
+    fprintf(fp, "version=%d\ncpu=%s\ncores=%d\n", PROFILE_VERSION, cpu, hostCores());
+    fprintf(fp, "threads=%d\nband_rows=%d\n", t->threads, t->bandRows);
+    if (t->stageNs[STAGE_DITHER] > 0.0)
+        fprintf(fp, "stage_ns=%.4g %.4g %.4g\n", t->stageNs[STAGE_DECODE],
+                t->stageNs[STAGE_DITHER], t->stageNs[STAGE_ENCODE]);
+    writeCosts(fp, &t->costs);
+    if (fclose(fp) || rename(tmp, path)) {
+        unlink(tmp);
+        return ERR_WRITE;
+    }
+    return ERR_OK;
+}
+
+int bw_autotune(const char *path, int verbose) {
+    char paths[2][PATH_MAX];
+    if (!path && !profilePaths(paths))
+        return ERR_CONFIG;
+    path = path ? path : paths[0];
+    tuning(); /* loaded first, so measuring can override it */
+    size_t size = (size_t)THREAD_SIDE * THREAD_SIDE;
+    unsigned char *plane = malloc(size), *work = malloc(size);
+    if (!plane || !work) {
+        free(plane);
+        free(work);
+        return ERR_MEMORY;
+    }
+    fillPlane(plane, THREAD_SIDE, THREAD_SIDE, 1);
+
+    Tuning t = {0};
+    double t0 = nowMs();
+    t.threads = tuneThreads(plane, work, verbose);
+    t.bandRows = tuneBands(plane, work, verbose);
+    if (!tuneStages(plane, work, t.stageNs, verbose))
+        memset(t.stageNs, 0, sizeof(t.stageNs));
+    measureDeadline(&t.costs); /* screens on the pool just chosen */
+    t.haveCosts = true;
+    bw_set_threads(0);
+    free(plane);
+    free(work);
+
+    ErrorCode r = writeProfile(path, &t);
+    if (verbose)
+        fprintf(stderr, "%s %s after %.1f s: %d threads, bands of %d rows or more\n",
+                r == ERR_OK ? "Wrote" : "Could not write", path, (nowMs() - t0) / 1e3,
+                t.threads, t.bandRows);
+    return r;
+}
@@ -0,0 +1,219 @@
+/*
+ * File: bw_vector.c
+ * ---------------------------
+ * Description:
+ *   Vector export of the packed 1-bit output. Each row is split into
+ *   horizontal black runs, runs that exactly repeat the span of a run in
+ *   the previous row extend that rectangle downwards, and every finished
+ *   rectangle is streamed out as an SVG subpath or an RS-274X region.
+ *
+ *   The scan touches each packed row once and keeps only the rectangles
+ *   open on the previous row, so memory stays O(width) for any height.
+ *
+ * Author: Bahey Shalash
+ * Version: 2.1.2
+ * Date: 19/04/2025
+ */
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bw_internal.h"
+
+#define NM_PER_INCH 25400000LL
+
+typedef struct {
+    int x0, x1, y0;
+} OpenRect;
+
+typedef struct {
+    FILE *fp;
+    VectorKind kind;
+    int h, dpi;
+    long long rects;
+    size_t n;
+    bool failed;
+    char buf[1 << 16];
+} VecWriter;
+
+static void flushOut(VecWriter *vw) {
+    if (vw->n && fwrite(vw->buf, 1, vw->n, vw->fp) != vw->n)
+        vw->failed = true;
+    vw->n = 0;
+}
+
+static void putStr(VecWriter *vw, const char *s) {
+    size_t len = strlen(s);
+    if (vw->n + len > sizeof(vw->buf))
+        flushOut(vw);
+    memcpy(vw->buf + vw->n, s, len);
+    vw->n += len;
+}
+
+static void putLong(VecWriter *vw, long long v) {
+    char tmp[24];
+    int i = sizeof(tmp);
+    bool neg = v < 0;
+    unsigned long long u = neg ? -(unsigned long long)v : (unsigned long long)v;
+    tmp[--i] = '\0';
+    do {
+        tmp[--i] = (char)('0' + u % 10);
+        u /= 10;
+    } while (u);
+    if (neg)
+        tmp[--i] = '-';
+    putStr(vw, tmp + i);
+}
+
+/* Pixel coordinate to Gerber 4.6 millimetre units (nanometres). */
+static long long toNm(const VecWriter *vw, long long px) {
+    return (px * NM_PER_INCH + vw->dpi / 2) / vw->dpi;
+}
+
+static void gerberVertex(VecWriter *vw, int x, int y, const char *op) {
+    putStr(vw, "X");
+    putLong(vw, toNm(vw, x));
+    putStr(vw, "Y");
+    putLong(vw, toNm(vw, vw->h - y)); /* Gerber's Y axis points up */
+    putStr(vw, op);
+}
+
+static void emitRect(VecWriter *vw, int x0, int y0, int x1, int y1) {
+    vw->rects++;
+    if (vw->kind == VECTOR_SVG) {
+        putStr(vw, "M");
+        putLong(vw, x0);
+        putStr(vw, " ");
+        putLong(vw, y0);
+        putStr(vw, "h");
+        putLong(vw, x1 - x0);
+        putStr(vw, "v");
+        putLong(vw, y1 - y0);
+        putStr(vw, "h");
+        putLong(vw, x0 - x1);
+        putStr(vw, "z\n");
+    } else {
+        putStr(vw, "G36*\n");
+        gerberVertex(vw, x0, y0, "D02*\n");
+        gerberVertex(vw, x1, y0, "D01*\n");
+        gerberVertex(vw, x1, y1, "D01*\n");
+        gerberVertex(vw, x0, y1, "D01*\n");
+        gerberVertex(vw, x0, y0, "D01*\n");
+        putStr(vw, "G37*\n");
+    }
+}
+
+static void writeHeader(VecWriter *vw, int w) {
+    char line[512];
+    if (vw->kind == VECTOR_SVG) {
+        snprintf(line, sizeof(line),
+                 "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                 "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%.4fmm\" "
+                 "height=\"%.4fmm\" viewBox=\"0 0 %d %d\" "
+                 "shape-rendering=\"crispEdges\">\n"
+                 "<path fill=\"#000\" d=\"\n",
+                 w * 25.4 / vw->dpi, vw->h * 25.4 / vw->dpi, w, vw->h);
+    } else {
+        snprintf(line, sizeof(line),
+                 "G04 libbwconvert %dx%d px at %d dpi*\n"
+                 "%%FSLAX46Y46*%%\n"
+                 "%%MOMM*%%\n"
+                 "%%LPD*%%\n"
+                 "G01*\n",
+                 w, vw->h, vw->dpi);
+    }
+    putStr(vw, line);
+}
+
+static void writeFooter(VecWriter *vw) {
+    putStr(vw, vw->kind == VECTOR_SVG ? "\"/>\n</svg>\n" : "M02*\n");
+}
+
+/* Merge the runs of each row with the rectangles still open from the row above. */
+static ErrorCode mergeRuns(VecWriter *vw, const BWBitmap *bm) {
+    size_t cap = bm->w / 2 + 1;
+    BWRun *runs = malloc(cap * sizeof(*runs));
+    OpenRect *open = malloc(cap * sizeof(*open));
+    OpenRect *next = malloc(cap * sizeof(*next));
+    if (!runs || !open || !next) {
+        free(runs);
+        free(open);
+        free(next);
+        return ERR_MEMORY;
+    }
+
+    int nOpen = 0;
+    for (int y = 0; y < bm->h; y++) {
+        int n = scanBlackRuns(bm->bits + (size_t)y * bm->stride, bm->w, runs);
+        int i = 0, j = 0, nNext = 0;
+        while (i < nOpen || j < n) {
+            if (j >= n || (i < nOpen && open[i].x0 < runs[j].x0)) {
+                emitRect(vw, open[i].x0, open[i].y0, open[i].x1, y);
+                i++;
+            } else if (i >= nOpen || runs[j].x0 < open[i].x0) {
+                next[nNext++] = (OpenRect){runs[j].x0, runs[j].x1, y};
+                j++;
+            } else {
+                if (open[i].x1 == runs[j].x1) {
+                    next[nNext++] = open[i];
+                } else {
+                    emitRect(vw, open[i].x0, open[i].y0, open[i].x1, y);
+                    next[nNext++] = (OpenRect){runs[j].x0, runs[j].x1, y};
+                }
+                i++;
+                j++;
+            }
+        }
+        OpenRect *tmp = open;
+        open = next;
+        next = tmp;
+        nOpen = nNext;
+    }
+    for (int i = 0; i < nOpen; i++)
+        emitRect(vw, open[i].x0, open[i].y0, open[i].x1, bm->h);
+
+    free(runs);
+    free(open);
+    free(next);
+    return ERR_OK;
+}
+
+ErrorCode writeVectorImage(FILE *fp, const BWBitmap *bm, VectorKind kind,
+                           const BWConfig *cfg) {
+    VecWriter *vw = malloc(sizeof(*vw));
+    if (!vw)
+        return ERR_MEMORY;
+    vw->fp = fp;
+    vw->kind = kind;
+    vw->h = bm->h;
+    vw->dpi = cfg->dpi > 0 ? cfg->dpi : BW_DEFAULT_DPI;
+    vw->rects = 0;
+    vw->n = 0;
+    vw->failed = false;
+
+    writeHeader(vw, bm->w);
+    ErrorCode r = mergeRuns(vw, bm);
+    writeFooter(vw);
+    flushOut(vw);
+    if (r == ERR_OK && (vw->failed || ferror(fp)))
+        r = ERR_WRITE;
+    if (cfg->verboseMode && r == ERR_OK)
+        fprintf(stderr, "Exported %lld rectangles\n", vw->rects);
+    free(vw);
+    return r;
+}
+
+ErrorCode saveVectorImage(const char *path, const BWBitmap *bm, VectorKind kind,
+                          const BWConfig *cfg) {
+    FILE *fp = openOutput(path);
+    if (!fp)
+        return ERR_WRITE;
+    if (cfg->verboseMode)
+        fprintf(stderr, "Writing '%s' (%s)\n", path,
+                kind == VECTOR_SVG ? "SVG" : "Gerber RS-274X");
+    ErrorCode r = writeVectorImage(fp, bm, kind, cfg);
+    if (!closeOutput(fp) && r == ERR_OK)
+        r = ERR_WRITE;
+    return r;
+}
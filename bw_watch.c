@@ -0,0 +1,437 @@
+/*
+ * File: bw_watch.c
+ * ---------------------------
+ * Description:
+ *   Hot-folder mode. An inotify watch on the input directory collects
+ *   close-write and moved-in events. A file is scheduled once it has been
+ *   quiet for the debounce interval, so an editor that saves in several
+ *   writes, or a copy still in progress, is converted once. Scheduling also
+ *   needs a real content change: a 64-bit hash of each file is remembered
+ *   once it converted successfully, and a save that rewrites identical
+ *   bytes (or only touches the mtime) does nothing. The hash is taken by the
+ *   worker, so a large file never holds up the thread draining events. If
+ *   the inotify queue overflows, the directory is scanned again as at start.
+ *
+ *   Conversions run on persistent worker threads, each with its own
+ *   BWWorkspace, so buffers stay allocated between files and a dropped file
+ *   is picked up by an already running thread.
+ *
+ * Author: Bahey Shalash
+ * Version: 2.1.2
+ * Date: 19/04/2025
+ */
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bw_internal.h"
+
+#ifdef __linux__
+#include <dirent.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#define MAX_WORKERS 64
+#define STOP_POLL_MS 200 /* how often a quiet loop looks at *stop */
+#define HASH_CHUNK (1 << 16)
+
+typedef struct {
+    char *name;          /* NULL: free slot */
+    uint64_t content;    /* hash of the last converted content, 0 = none */
+    unsigned generation; /* bumped on delete, so older jobs are not recorded */
+    double dueMs;        /* pending: convert once quiet until then */
+    bool pending;
+    bool queued;         /* a job for the file is queued or running */
+    bool rerun;          /* it became due meanwhile: schedule again once it ends */
+} WatchEntry;
+
+typedef struct WatchJob {
+    char input[PATH_MAX];
+    char output[PATH_MAX];
+    const char *name;    /* the entry's name, inside `input` */
+    uint64_t known;      /* content already converted, skipped */
+    uint64_t content;    /* set by the worker, 0 if unreadable */
+    unsigned generation; /* the entry's when queued */
+    bool convert;        /* false: only hash, the output is current */
+    bool converted;
+    ErrorCode result;
+    struct WatchJob *next; /* on Watch.finished */
+} WatchJob;
+
+typedef struct {
+    const char *inDir, *outDir;
+    BWConfig cfg;
+    int debounceMs;
+    WatchEntry *table;
+    size_t cap, used;
+    int pending;
+    BWQueue jobs;
+    BWBatchCallback done;
+    void *user;
+    pthread_mutex_t lock; /* serialises `done` and guards `finished` */
+    WatchJob *finished;   /* done, for the main thread to record */
+} Watch;
+
+static double nowMs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec * 1e-6;
+}
+
+/* FNV-1a over 8-byte words: fast enough to run on every save. */
+static uint64_t hashFile(const char *path, bool *ok) {
+    FILE *fp = fopen(path, "rb");
+    *ok = fp != NULL;
+    if (!fp)
+        return 0;
+    static _Thread_local unsigned char buf[HASH_CHUNK];
+    uint64_t h = 0xcbf29ce484222325ull;
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        size_t i = 0;
+        for (; i + 8 <= n; i += 8) {
+            uint64_t word;
+            memcpy(&word, buf + i, 8);
+            h = (h ^ word) * 0x100000001b3ull;
+        }
+        for (; i < n; i++)
+            h = (h ^ buf[i]) * 0x100000001b3ull;
+    }
+    *ok = !ferror(fp);
+    fclose(fp);
+    return h | 1; /* 0 means "never converted" */
+}
+
+static uint64_t hashName(const char *s) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    while (*s)
+        h = (h ^ (unsigned char)*s++) * 0x100000001b3ull;
+    return h;
+}
+
+/* Dotfiles, editor backups and partial downloads are never inputs. */
+static bool ignoredName(const char *name) {
+    size_t n = strlen(name);
+    static const char *const temp[] = {"~", ".tmp", ".part", ".crdownload", ".swp"};
+    if (name[0] == '.' || n == 0)
+        return true;
+    for (size_t i = 0; i < sizeof(temp) / sizeof(*temp); i++) {
+        size_t k = strlen(temp[i]);
+        if (n >= k && !strcmp(name + n - k, temp[i]))
+            return true;
+    }
+    return false;
+}
+
+/* ---- Name table (open addressing) ---- */
+
+static WatchEntry *findEntry(Watch *w, const char *name, bool create) {
+    if (create && (w->used + 1) * 10 > w->cap * 7) {
+        size_t cap = w->cap ? 2 * w->cap : 256;
+        WatchEntry *grown = calloc(cap, sizeof(*grown));
+        if (!grown)
+            return NULL;
+        for (size_t i = 0; i < w->cap; i++) {
+            if (!w->table[i].name)
+                continue;
+            size_t j = hashName(w->table[i].name) & (cap - 1);
+            while (grown[j].name)
+                j = (j + 1) & (cap - 1);
+            grown[j] = w->table[i];
+        }
+        free(w->table);
+        w->table = grown;
+        w->cap = cap;
+    }
+    if (!w->cap)
+        return NULL;
+    size_t i = hashName(name) & (w->cap - 1);
+    for (; w->table[i].name; i = (i + 1) & (w->cap - 1))
+        if (!strcmp(w->table[i].name, name))
+            return &w->table[i];
+    if (!create || !(w->table[i].name = strdup(name)))
+        return NULL;
+    w->used++;
+    return &w->table[i];
+}
+
+/* Deleted inputs keep their slot (tombstone-free table) but forget the
+ * content, so a file recreated with the same bytes is converted again. */
+static void forgetEntry(Watch *w, const char *name) {
+    WatchEntry *e = findEntry(w, name, false);
+    if (!e)
+        return;
+    e->content = 0;
+    e->generation++; /* a conversion still running is not recorded either */
+    if (e->pending)
+        w->pending--;
+    e->pending = false;
+    e->rerun = false;
+}
+
+static void touchEntry(Watch *w, const char *name) {
+    if (ignoredName(name))
+        return;
+    WatchEntry *e = findEntry(w, name, true);
+    if (!e)
+        return;
+    if (!e->pending)
+        w->pending++;
+    e->pending = true;
+    e->dueMs = nowMs() + w->debounceMs;
+}
+
+/* DIR/<name><extension of the output format>: the input's own extension
+ * stays, so a.png and a.jpg do not write the same output. */
+static bool outputPath(char *dst, const Watch *w, const char *name) {
+    static const char *const ext[] = {[BW_FORMAT_AUTO] = ".png", [BW_FORMAT_PNG] = ".png",
+                                      [BW_FORMAT_SVG] = ".svg", [BW_FORMAT_GERBER] = ".gbr",
+                                      [BW_FORMAT_GIF] = ".gif"};
+    int n = snprintf(dst, PATH_MAX, "%s/%s%s", w->outDir, name, ext[w->cfg.outputFormat]);
+    return n > 0 && n < PATH_MAX;
+}
+
+/* Hand `e` to a worker, which hashes the file and, with `convert`, converts
+ * it if the content changed. One job per file at a time. */
+static void queueJob(Watch *w, WatchEntry *e, bool convert) {
+    WatchJob *job = malloc(sizeof(*job));
+    if (!job)
+        return;
+    if (snprintf(job->input, PATH_MAX, "%s/%s", w->inDir, e->name) >= PATH_MAX ||
+        !outputPath(job->output, w, e->name)) {
+        free(job);
+        return;
+    }
+    job->name = job->input + strlen(w->inDir) + 1;
+    job->known = e->content;
+    job->generation = e->generation;
+    job->convert = convert;
+    e->queued = true;
+    metricQueue(QUEUE_WATCH, 1);
+    queuePush(&w->jobs, job);
+}
+
+static void schedule(Watch *w, WatchEntry *e) {
+    e->pending = false;
+    w->pending--;
+    if (e->queued)
+        e->rerun = true; /* the running job may have read the older bytes */
+    else
+        queueJob(w, e, true);
+}
+
+/* Schedule everything quiet long enough; returns ms until the next is due. */
+static int scheduleDue(Watch *w) {
+    double now = nowMs(), next = now + STOP_POLL_MS;
+    for (size_t i = 0; w->pending && i < w->cap; i++) {
+        WatchEntry *e = &w->table[i];
+        if (!e->name || !e->pending)
+            continue;
+        if (e->dueMs <= now)
+            schedule(w, e);
+        else if (e->dueMs < next)
+            next = e->dueMs;
+    }
+    int wait = (int)(next - now) + 1;
+    return wait < STOP_POLL_MS ? wait : STOP_POLL_MS;
+}
+
+/* Existing files whose output is missing or older are converted; the others
+ * only have their content remembered. Runs at start, and again when the
+ * inotify queue overflowed and events were lost. */
+static void scanExisting(Watch *w) {
+    DIR *dir = opendir(w->inDir);
+    if (!dir)
+        return;
+    for (struct dirent *d; (d = readdir(dir));) {
+        if (ignoredName(d->d_name))
+            continue;
+        char in[PATH_MAX], out[PATH_MAX];
+        struct stat si, so;
+        if (snprintf(in, PATH_MAX, "%s/%s", w->inDir, d->d_name) >= PATH_MAX ||
+            stat(in, &si) != 0 || !S_ISREG(si.st_mode) || !outputPath(out, w, d->d_name))
+            continue;
+        WatchEntry *e = findEntry(w, d->d_name, true);
+        if (!e || e->pending || e->queued)
+            continue;
+        if (stat(out, &so) == 0 && so.st_mtime >= si.st_mtime) {
+            if (!e->content)
+                queueJob(w, e, false); /* learn the content off this thread */
+        } else {
+            e->pending = true;
+            e->dueMs = 0.0;
+            w->pending++;
+        }
+    }
+    closedir(dir);
+}
+
+static void *watchWorker(void *arg) {
+    Watch *w = arg;
+    BWWorkspace ws = {0};
+    WatchJob *job;
+    while ((job = queuePop(&w->jobs))) {
+        metricQueue(QUEUE_WATCH, -1);
+        bool ok;
+        job->content = hashFile(job->input, &ok);
+        if (!ok)
+            job->content = 0; /* gone again */
+        /* saved without changing a byte: nothing to do */
+        job->converted = ok && job->convert && job->content != job->known;
+        BWBatchItem item = {.input = job->input, .output = job->output};
+        if (job->converted) {
+            double t0 = nowMs();
+            item.result = convertToBW(job->input, job->output, &w->cfg, NULL, &ws);
+            metricResult(item.result);
+            item.decodeMs = ws.stageMs[STAGE_DECODE];
+            item.ditherMs = ws.stageMs[STAGE_DITHER];
+            item.encodeMs = ws.stageMs[STAGE_ENCODE];
+            if (item.decodeMs + item.ditherMs + item.encodeMs == 0.0)
+                item.ditherMs = nowMs() - t0; /* CMYK and animations are not split */
+            memset(ws.stageMs, 0, sizeof(ws.stageMs));
+        }
+        job->result = item.result;
+        pthread_mutex_lock(&w->lock);
+        if (job->converted && w->done)
+            w->done(&item, w->user);
+        job->next = w->finished;
+        w->finished = job;
+        pthread_mutex_unlock(&w->lock);
+    }
+    workspaceFree(&ws);
+    return NULL;
+}
+
+/* Remember the content of each file hashed or converted since the last
+ * call. Only a success counts, so a failed conversion is retried on the next
+ * save. A file that became due while its job ran is scheduled again. */
+static void recordFinished(Watch *w) {
+    pthread_mutex_lock(&w->lock);
+    WatchJob *job = w->finished;
+    w->finished = NULL;
+    pthread_mutex_unlock(&w->lock);
+    while (job) {
+        WatchJob *next = job->next;
+        WatchEntry *e = findEntry(w, job->name, false);
+        if (e) {
+            e->queued = false;
+            if (job->generation == e->generation && job->content &&
+                (!job->converted || job->result == ERR_OK))
+                e->content = job->content;
+            if (e->rerun && !e->pending) {
+                e->pending = true;
+                e->dueMs = 0.0;
+                w->pending++;
+            }
+            e->rerun = false;
+        }
+        free(job);
+        job = next;
+    }
+}
+
+static void readEvents(Watch *w, int fd) {
+    _Alignas(struct inotify_event) char buf[64 * 1024];
+    ssize_t len;
+    bool overflow = false;
+    while ((len = read(fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + len;) {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            p += sizeof(*ev) + ev->len;
+            overflow |= (ev->mask & IN_Q_OVERFLOW) != 0;
+            if (!ev->len || (ev->mask & IN_ISDIR))
+                continue;
+            if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+                forgetEntry(w, ev->name);
+            else if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+                touchEntry(w, ev->name);
+            else if (ev->mask & IN_MODIFY) {
+                /* still being written: push back a pending deadline */
+                WatchEntry *e = findEntry(w, ev->name, false);
+                if (e && e->pending)
+                    e->dueMs = nowMs() + w->debounceMs;
+            }
+        }
+    }
+    if (overflow)
+        scanExisting(w); /* events were dropped: find what they were about */
+}
+
+int convert_watch_bw(const char *in_dir, const char *out_dir, const BWConfig *config,
+                     int jobs, int debounce_ms, BWBatchCallback done, void *user,
+                     const volatile sig_atomic_t *stop) {
+    Watch w = {.inDir = in_dir, .outDir = out_dir, .cfg = *config,
+               .debounceMs = debounce_ms >= 0 ? debounce_ms : 0, .done = done, .user = user};
+    char inReal[PATH_MAX], outReal[PATH_MAX];
+    if (isStdioPath(in_dir) || isStdioPath(out_dir))
+        return ERR_CONFIG;
+    if (realpath(in_dir, inReal) && realpath(out_dir, outReal) && !strcmp(inReal, outReal))
+        return ERR_CONFIG; /* outputs would be picked up as new inputs */
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0)
+        return ERR_LOAD;
+    if (inotify_add_watch(fd, in_dir,
+                          IN_CLOSE_WRITE | IN_MOVED_TO | IN_MODIFY | IN_DELETE |
+                              IN_MOVED_FROM) < 0) {
+        close(fd);
+        return ERR_LOAD;
+    }
+
+    long n = jobs > 0 ? jobs : sysconf(_SC_NPROCESSORS_ONLN);
+    n = n < 1 ? 1 : n > MAX_WORKERS ? MAX_WORKERS : n;
+    if (n > 1)
+        w.cfg.threads = 1; /* files are the parallelism */
+    if (queueInit(&w.jobs, 4 * (int)n) != ERR_OK) {
+        close(fd);
+        return ERR_MEMORY;
+    }
+    pthread_mutex_init(&w.lock, NULL);
+    pthread_t threads[MAX_WORKERS];
+    int started = 0;
+    while (started < n && pthread_create(&threads[started], NULL, watchWorker, &w) == 0)
+        started++;
+    ErrorCode r = started ? ERR_OK : ERR_MEMORY;
+
+    if (r == ERR_OK)
+        scanExisting(&w);
+    while (r == ERR_OK && !*stop) {
+        recordFinished(&w);
+        struct pollfd pfd = {fd, POLLIN, 0};
+        int ready = poll(&pfd, 1, scheduleDue(&w));
+        if (ready < 0 && errno != EINTR)
+            r = ERR_LOAD;
+        else if (ready > 0)
+            readEvents(&w, fd);
+    }
+
+    for (int i = 0; i < started; i++)
+        queuePush(&w.jobs, NULL);
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    recordFinished(&w);
+    close(fd);
+    queueFree(&w.jobs);
+    pthread_mutex_destroy(&w.lock);
+    for (size_t i = 0; i < w.cap; i++)
+        free(w.table[i].name);
+    free(w.table);
+    return r;
+}
+
+#else /* no inotify */
+
+int convert_watch_bw(const char *in_dir, const char *out_dir, const BWConfig *config,
+                     int jobs, int debounce_ms, BWBatchCallback done, void *user,
+                     const volatile sig_atomic_t *stop) {
+    (void)in_dir, (void)out_dir, (void)config, (void)jobs, (void)debounce_ms;
+    (void)done, (void)user, (void)stop;
+    return ERR_CONFIG;
+}
+
+#endif
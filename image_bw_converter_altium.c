@@ -14,54 +14,730 @@
  *
  * Usage:
  *   ./image_bw_converter [options] <input> <output>
+ *   ./image_bw_converter --y4m [options] < video.y4m > frames.raw
+ *   ./image_bw_converter -j N --out-dir DIR [options] inputs...
+ *   find . -name '*.png' -print0 | ./image_bw_converter --out-dir DIR
+ *   ./image_bw_converter -j N --manifest jobs.csv [--results out.csv] [--shard DIR] [options]
+ *   ./image_bw_converter --watch IN --out OUT [options]
+ *   ./image_bw_converter --serve SOCKET [-j N] [--queue N] [options]
+ *   Either path may be "-" for stdin / stdout (statistics then go to stderr).
  *
  * Options:
  *   -t threshold    brightness cutoff (0-255; default: 128)
  *   -i               invert after dithering
  *   -v               verbose mode
  *   -h               show this message
+ *   -l levels        output gray levels, 2-16 (default: 2)
+ *   --level-values L comma-separated ascending custom levels, e.g. 0,96,255
+ *   -p palette       dither RGB to a palette: rgb8, ega16, gray4 or a list
+ *                    of hex colours such as 000000,ff0000,ffffff
+ *   -a algorithm     diffusion (default), am (clustered-dot screen), ordered
+ *                    (8x8 Bayer), bluenoise or threshold
+ *   --deadline MS    step down to cheaper algorithms (bluenoise, ordered,
+ *                    threshold), then a smaller preview, to finish in MS
+ *   --lpi N          AM screen frequency in lines per inch (default: 50)
+ *   --angle DEG      AM screen angle in degrees (default: 45)
+ *   --dot shape      AM dot shape: round, ellipse, line, square
+ *   --threads N      worker threads for parallel stages (default: profile, else all cores)
+ *   --priority CLASS interactive (default) or batch: batch work yields the
+ *                    cores to interactive work at row-band boundaries
+ *   -k kernel        diffusion kernel: fs, jjn, stucki, sierra, atkinson
+ *   --cmyk           write C/M/Y/K separations as <output>_c/_m/_y/_k
+ *   --gcr N          black generation for --cmyk, percent (default: 100)
+ *   --ucr N          under-colour removal for --cmyk, percent (default: 100)
+ *   -f format        output format: png, svg, gerber or gif (default: from extension)
+ *   --temporal       animated GIF input: keep output where frames do not change
+ *   --temporal-tol N luma change still treated as static (default: 4)
+ *   --y4m            dither a Y4M video from stdin to raw 1-bit frames on stdout
+ *   --out-dir DIR    batch mode: convert every input into DIR (inputs from the
+ *                    command line, or NUL-delimited paths on stdin)
+ *   --manifest FILE  batch mode: run the jobs in a CSV or JSON Lines manifest
+ *   --results FILE   per-job status and timings of --manifest (default: stdout)
+ *   --shard DIR      --manifest as one of several workers, on any machines
+ *                    sharing DIR: each claims chunks of records with lease
+ *                    files, and all write the full results when done
+ *   --lease S        --shard: seconds before an unrenewed lease is taken
+ *                    over (default: 60)
+ *   -j N             batch worker threads (default: all cores)
+ *   --watch DIR      hot folder: convert new or changed files in DIR into
+ *                    --out/--out-dir until interrupted
+ *   --debounce MS    --watch: quiet time after a write (default: 250)
+ *   --serve SOCKET   conversion server on a Unix socket until interrupted
+ *                    (-j workers, --queue waiting requests; see bw_client)
+ *   --stages D:T:E   batch decode:dither:encode threads (0 = split from -j)
+ *   --queue N        batch stage queue depth (default: twice the consumers);
+ *                    --serve: requests waiting for a worker (default: 4 each)
+ *   --io MODE        batch file I/O: auto (io_uring, else I/O threads),
+ *                    threads or sync (default: auto)
+ *   --prefetch N     batch inputs read ahead of the decoders (default: 2 per
+ *                    decode thread, at least 4; 0 = none)
+ *   --drop-cache     batch: evict inputs and outputs from the page cache
+ *   --cache DIR      copy outputs converted before with the same input bytes
+ *                    and settings from DIR, and store new ones there
+ *   --cache-size MB  --cache: bound, least recently used evicted (default: 1024)
+ *   --luma-sidecar   keep each input's gray plane in .NAME.bwluma next to it
+ *                    and map it instead of decoding on later runs
+ *   --dpi N          output resolution for vector size and AM cells (default: 300)
+ *   --stats          print ink-coverage statistics of the output (batch mode:
+ *                    stage utilisation and queue depths)
+ *   --stats-tile N   tile edge for per-tile coverage (default: 64)
+ *   --metrics-port N serve Prometheus metrics on http://127.0.0.1:N/metrics
+ *   --metrics-file F rewrite F with the metrics every 10 s and at exit
  *   --version        show version info
  */
+#include <errno.h>
 #include <getopt.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
 
 #include "bw_converter.h"
 
+/* Image data on stdin and stdout moves in large chunks. glibc ignores
+ * setvbuf's size unless the buffer is given too. */
+static char stdinBuffer[1 << 20], stdoutBuffer[1 << 20];
+
 static void showUsage(const char *prog) {
     fprintf(stderr,
             "Usage: %s [options] <input> <output>\n"
+            "       %s --y4m [options] < video.y4m > frames.raw\n"
+            "       %s -j N --out-dir DIR [options] [inputs... | < paths0]\n"
+            "       %s -j N --manifest jobs.csv [--results out.csv] [--shard DIR] [options]\n"
+            "       %s --watch IN --out OUT [options]\n"
+            "       %s --serve SOCKET [-j N] [--queue N] [options]\n"
+            "<input>/<output> may be - for stdin/stdout\n"
             "Options:\n"
             "  -t threshold    brightness cutoff (0-255; default:128)\n"
             "  -i               invert after dithering\n"
             "  -v               verbose mode\n"
             "  -h               show this message\n"
+            "  -l levels        output gray levels, 2-16 (default:2)\n"
+            "  --level-values L custom ascending levels, e.g. 0,96,255\n"
+            "  -p palette       rgb8, ega16, gray4 or hex list (000000,ff0000,...)\n"
+            "  -a algorithm     diffusion (default), am, ordered, bluenoise or threshold\n"
+            "  --deadline MS    use cheaper algorithms, then a smaller preview, to fit MS\n"
+            "  --lpi N          AM screen frequency, lines per inch (default:50)\n"
+            "  --angle DEG      AM screen angle in degrees (default:45)\n"
+            "  --dot shape      AM dot: round, ellipse, line or square\n"
+            "  --threads N      worker threads (default: profile, else all cores)\n"
+            "  --priority CLASS interactive (default) or batch (only uses idle cores)\n"
+            "  -k kernel        fs, jjn, stucki, sierra or atkinson (default: fs)\n"
+            "  --cmyk           write C/M/Y/K separations <output>_c/_m/_y/_k\n"
+            "  --gcr N          CMYK black generation, percent (default:100)\n"
+            "  --ucr N          CMYK under-colour removal, percent (default:100)\n"
+            "  -f format        png, svg, gerber or gif (default: from extension)\n"
+            "  --temporal       GIF input: keep output where frames do not change\n"
+            "  --temporal-tol N luma change treated as static (default:4)\n"
+            "  --y4m            Y4M video on stdin to raw 1-bit frames on stdout\n"
+            "  --out-dir DIR    batch: convert all inputs into DIR; with no inputs,\n"
+            "                   read NUL-delimited paths from stdin\n"
+            "  --manifest FILE  batch: run the jobs in a CSV/JSONL manifest (input,\n"
+            "                   output, threshold, invert, algorithm, format)\n"
+            "  --results FILE   --manifest status and timings, CSV or .jsonl (default: -)\n"
+            "  --shard DIR      --manifest: share the work with other workers using DIR\n"
+            "  --lease S        --shard: seconds until a dead worker's chunk is retaken\n"
+            "                   (default:60)\n"
+            "  -j N             batch worker threads (default: all cores)\n"
+            "  --watch DIR      hot folder: convert new/changed files into --out DIR\n"
+            "  --debounce MS    --watch: quiet time after a write (default:250)\n"
+            "  --serve SOCKET   serve conversions on a Unix socket (see bw_client)\n"
+            "  --stages D:T:E   batch decode:dither:encode threads (0: split from -j)\n"
+            "  --queue N        batch stage queue depth (default: 2 per consumer);\n"
+            "                   --serve: waiting requests (default: 4 per worker)\n"
+            "  --io MODE        batch file I/O: auto, threads or sync (default:auto)\n"
+            "  --prefetch N     batch inputs read ahead (default: 2 per decoder, >= 4)\n"
+            "  --drop-cache     batch: evict inputs and outputs from the page cache\n"
+            "  --cache DIR      reuse outputs of identical conversions stored in DIR\n"
+            "  --cache-size MB  --cache: bound, least recently used evicted (default:1024)\n"
+            "  --luma-sidecar   reuse the gray plane kept in .NAME.bwluma next to inputs\n"
+            "  --dpi N          output resolution for vector size and AM cells (default:300)\n"
+            "  --stats          print ink-coverage statistics (batch: stage usage)\n"
+            "  --stats-tile N   tile edge for per-tile coverage (default:64)\n"
+            "  --metrics-port N Prometheus metrics on http://127.0.0.1:N/metrics\n"
+            "  --metrics-file F write the metrics to F every 10 s and at exit\n"
             "  --version        show version\n",
-            prog);
+            prog, prog, prog, prog, prog, prog);
 }
 
 static void showVersion(void) {
     printf("image_bw_converter version 2.1.2 (19/04/2025)\n");
+    printf("Kernels: %s (BW_ISA=scalar|sse2|avx2|avx512|neon to force)\n", bw_isa());
+}
+
+static void printStats(FILE *fp, const BWStats *st) {
+    static const char *const algos[] = {"diffusion", "am", "ordered", "threshold",
+                                        "bluenoise"};
+    fprintf(fp, "Size:          %dx%d px\n", st->width, st->height);
+    if (st->scale > 1)
+        fprintf(fp, "Algorithm:     %s, at 1/%d size to meet the deadline\n",
+                algos[st->algorithm], st->scale);
+    else
+        fprintf(fp, "Algorithm:     %s\n", algos[st->algorithm]);
+    fprintf(fp, "Black pixels:  %llu (%.4f%%)\n", st->blackPixels, 100.0 * st->blackFraction);
+
+    int frames = st->frames > 1 ? st->frames : 1;
+    if (frames > 1)
+        fprintf(fp, "Frames:        %d (counts summed over all frames)\n", frames);
+    double tmin = 1.0, tmax = 0.0;
+    for (int ty = 0; ty < st->tilesY; ty++) {
+        int th = st->height - ty * st->tileSize;
+        th = th < st->tileSize ? th : st->tileSize;
+        for (int tx = 0; tx < st->tilesX; tx++) {
+            int tw = st->width - tx * st->tileSize;
+            tw = tw < st->tileSize ? tw : st->tileSize;
+            double cov = st->tileBlack[ty * st->tilesX + tx] / ((double)tw * th * frames);
+            tmin = cov < tmin ? cov : tmin;
+            tmax = cov > tmax ? cov : tmax;
+        }
+    }
+    fprintf(fp, "Tiles:         %dx%d of %dpx, coverage min %.2f%% max %.2f%%\n", st->tilesX,
+           st->tilesY, st->tileSize, 100.0 * tmin, 100.0 * tmax);
+
+    if (st->separationCoverage[0] + st->separationCoverage[1] +
+            st->separationCoverage[2] + st->separationCoverage[3] >
+        0.0)
+        fprintf(fp, "Ink C/M/Y/K:   %.2f%% %.2f%% %.2f%% %.2f%% (tiles and runs: K)\n",
+               100.0 * st->separationCoverage[0], 100.0 * st->separationCoverage[1],
+               100.0 * st->separationCoverage[2], 100.0 * st->separationCoverage[3]);
+
+    fprintf(fp, "Black runs:\n");
+    for (int k = 0; k < BW_RUN_BINS; k++)
+        if (st->runHistogram[k])
+            fprintf(fp, "  %10u-%-10u %llu\n", 1u << k, (2u << k) - 1, st->runHistogram[k]);
+}
+
+/* ---- Batch mode ---- */
+
+static void printPipelineStats(FILE *fp, const BWPipelineStats *st) {
+    static const char *const stage[] = {"decode", "dither", "encode"};
+    static const char *const io[] = {"auto", "io_uring", "threads", "sync"};
+    fprintf(fp, "Wall time:     %.1f ms\n", st->wallMs);
+    fprintf(fp, "File I/O:      %s\n", io[st->io]);
+    for (int s = 0; s < 3; s++)
+        fprintf(fp, "Stage %-7s %2d thread%s, busy %10.1f ms, utilisation %5.1f%%\n",
+                stage[s], st->threads[s], st->threads[s] == 1 ? " " : "s", st->busyMs[s],
+                100.0 * st->utilisation[s]);
+    for (int q = 0; q < 2 && st->queueCapacity[0]; q++)
+        fprintf(fp, "Queue %s->%s: capacity %d, mean depth %.2f, max %d\n", stage[q],
+                stage[q + 1], st->queueCapacity[q], st->meanDepth[q], st->maxDepth[q]);
+}
+
+static void printLatency(FILE *fp, const char *what, const BWLatency *lat) {
+    static const char *const cls[] = {"interactive", "batch"};
+    for (int c = 0; c < BW_PRIORITY_COUNT; c++)
+        if (lat[c].count)
+            fprintf(fp, "%s wait, %-11s %6llu: mean %.2f, p50 %.2f, p99 %.2f, max %.2f ms\n",
+                    what, cls[c], lat[c].count, lat[c].meanMs, lat[c].p50Ms, lat[c].p99Ms,
+                    lat[c].maxMs);
+}
+
+typedef struct {
+    int done, total;
+    bool verbose;
+} BatchProgress;
+
+static void reportItem(const BWBatchItem *item, void *user) {
+    BatchProgress *p = user;
+    p->done++;
+    if (item->result != 0)
+        fprintf(stderr, "%s: %s\n", item->input, bw_error_string(item->result));
+    else if (p->verbose)
+        fprintf(stderr, "[%d/%d] %s -> %s\n", p->done, p->total, item->input,
+                item->output);
+}
+
+/* Split NUL-delimited paths (find -print0, xargs -0 style) read from `fp`. */
+static char **readPathList(FILE *fp, int *count, char **storage) {
+    size_t cap = 1 << 16, len = 0;
+    char *buf = malloc(cap + 1);
+    while (buf) {
+        len += fread(buf + len, 1, cap - len, fp);
+        if (len < cap)
+            break;
+        char *grown = realloc(buf, 2 * cap + 1);
+        if (!grown) {
+            free(buf);
+            return NULL;
+        }
+        buf = grown;
+        cap *= 2;
+    }
+    if (!buf)
+        return NULL;
+    buf[len] = '\0';
+    int n = 0;
+    for (size_t i = 0; i < len; i++)
+        n += buf[i] == '\0';
+    char **paths = malloc((n + 1) * sizeof(*paths));
+    if (!paths) {
+        free(buf);
+        return NULL;
+    }
+    n = 0;
+    for (size_t i = 0; i < len; i += strlen(buf + i) + 1)
+        if (buf[i])
+            paths[n++] = buf + i;
+    *count = n;
+    *storage = buf;
+    return paths;
+}
+
+/* DIR/<input base name><extension of the output format> */
+static char *batchOutputPath(const char *dir, const char *input, BWFormat fmt) {
+    static const char *const ext[] = {[BW_FORMAT_AUTO] = ".png", [BW_FORMAT_PNG] = ".png",
+                                      [BW_FORMAT_SVG] = ".svg", [BW_FORMAT_GERBER] = ".gbr",
+                                      [BW_FORMAT_GIF] = ".gif"};
+    const char *base = strrchr(input, '/');
+    base = base ? base + 1 : input;
+    const char *dot = strrchr(base, '.');
+    int stem = dot && dot != base ? (int)(dot - base) : (int)strlen(base);
+    size_t size = strlen(dir) + stem + 8;
+    char *path = malloc(size);
+    if (path)
+        snprintf(path, size, "%s/%.*s%s", dir, stem, base, ext[fmt]);
+    return path;
+}
+
+static volatile sig_atomic_t stopRequested;
+
+static void onStopSignal(int sig) {
+    (void)sig;
+    stopRequested = 1;
+}
+
+static void reportWatched(const BWBatchItem *item, void *user) {
+    (void)user;
+    if (item->result != 0)
+        fprintf(stderr, "%s: %s\n", item->input, bw_error_string(item->result));
+    else
+        fprintf(stderr, "%s -> %s (%.1f ms)\n", item->input, item->output,
+                item->decodeMs + item->ditherMs + item->encodeMs);
+}
+
+static void catchStopSignals(void) {
+    struct sigaction sa = {.sa_handler = onStopSignal};
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+}
+
+static int runWatch(const char *inDir, const char *outDir, const BWConfig *cfg, int jobs,
+                    int debounceMs) {
+    if (mkdir(outDir, 0777) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Cannot create '%s': %s\n", outDir, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    catchStopSignals();
+    fprintf(stderr, "Watching '%s' -> '%s' (Ctrl-C to stop)\n", inDir, outDir);
+    int rc = convert_watch_bw(inDir, outDir, cfg, jobs, debounceMs, reportWatched, NULL,
+                              &stopRequested);
+    if (rc != 0) {
+        fprintf(stderr, "Cannot watch '%s': %s\n", inDir, bw_error_string(rc));
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+static int runServer(const char *socketPath, const BWConfig *cfg, int jobs, int depth) {
+    catchStopSignals();
+    fprintf(stderr, "Serving on '%s' (Ctrl-C to stop)\n", socketPath);
+    BWLatency lat[BW_PRIORITY_COUNT];
+    int rc = convert_serve_bw(socketPath, cfg, jobs, depth, &stopRequested, lat);
+    if (rc != 0) {
+        if (rc == ERR_CONFIG)
+            fprintf(stderr, "Cannot serve on '%s': it exists and is not a stale socket\n",
+                    socketPath);
+        else
+            fprintf(stderr, "Cannot serve on '%s': %s\n", socketPath, bw_error_string(rc));
+        return EXIT_FAILURE;
+    }
+    printLatency(stderr, "Queue", lat);
+    return EXIT_SUCCESS;
+}
+
+/* Exporters run until exit, which writes the last file dump. */
+static bool startMetrics(int port, const char *file) {
+    int rc = port ? bw_metrics_serve(port) : 0;
+    if (rc != 0) {
+        fprintf(stderr, "Cannot serve metrics on port %d: %s\n", port, bw_error_string(rc));
+        return false;
+    }
+    rc = file ? bw_metrics_dump(file, 10000) : 0;
+    if (rc != 0) {
+        fprintf(stderr, "Cannot write metrics to '%s': %s\n", file, bw_error_string(rc));
+        return false;
+    }
+    if (port || file)
+        atexit(bw_metrics_stop);
+    return true;
+}
+
+static int runShard(const char *manifest, const char *dir, const char *results,
+                    const BWConfig *cfg, const BWPipelineConfig *pipe, int leaseSeconds) {
+    catchStopSignals();
+    int failed = 0;
+    int rc = convert_shard_bw(manifest, dir, results, cfg, pipe, leaseSeconds, &failed,
+                              &stopRequested);
+    if (rc != 0) {
+        fprintf(stderr, "Manifest '%s' in '%s': %s\n", manifest, dir, bw_error_string(rc));
+        if (rc == ERR_CONFIG)
+            fprintf(stderr, "'%s' holds the shards of another manifest or other settings;"
+                            " use an empty directory\n",
+                    dir);
+        return EXIT_FAILURE;
+    }
+    if (failed)
+        fprintf(stderr, "%d job%s failed here\n", failed, failed == 1 ? "" : "s");
+    return failed || stopRequested ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static int runBatch(char **inputs, int count, const char *outDir, const BWConfig *cfg,
+                    const BWPipelineConfig *pipe, bool wantStats) {
+    if (mkdir(outDir, 0777) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Cannot create '%s': %s\n", outDir, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    BWBatchItem *items = calloc(count, sizeof(*items));
+    if (!items)
+        return ERR_MEMORY;
+    int rc = 0;
+    for (int i = 0; i < count && rc == 0; i++) {
+        items[i].input = inputs[i];
+        items[i].output = batchOutputPath(outDir, inputs[i], cfg->outputFormat);
+        rc = items[i].output ? 0 : ERR_MEMORY;
+    }
+    if (rc == 0) {
+        BatchProgress progress = {0, count, cfg->verboseMode};
+        BWPipelineStats stats;
+        int failed = convert_pipeline_bw(items, count, cfg, pipe, reportItem, &progress,
+                                         &stats);
+        if (failed || cfg->verboseMode)
+            fprintf(stderr, "%d file%s converted, %d failed\n", count - failed,
+                    count - failed == 1 ? "" : "s", failed);
+        if (wantStats) {
+            BWLatency lat[BW_PRIORITY_COUNT];
+            bw_queue_latency(lat, 0);
+            printPipelineStats(stderr, &stats);
+            printLatency(stderr, "Task", lat);
+        }
+        rc = failed ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    for (int i = 0; i < count; i++)
+        free((char *)items[i].output);
+    free(items);
+    return rc;
+}
+
+static bool parseFormat(const char *name, BWFormat *fmt) {
+    if (!strcmp(name, "png"))
+        *fmt = BW_FORMAT_PNG;
+    else if (!strcmp(name, "svg"))
+        *fmt = BW_FORMAT_SVG;
+    else if (!strcmp(name, "gerber") || !strcmp(name, "gbr"))
+        *fmt = BW_FORMAT_GERBER;
+    else if (!strcmp(name, "gif"))
+        *fmt = BW_FORMAT_GIF;
+    else
+        return false;
+    return true;
+}
+
+static bool parseName(const char *name, const char *const *names, int count,
+                      int *value) {
+    for (int i = 0; i < count; i++) {
+        if (!strcmp(name, names[i])) {
+            *value = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool parseKernel(const char *name, BWKernel *kernel) {
+    static const char *const names[] = {"fs", "jjn", "stucki", "sierra", "atkinson"};
+    int v;
+    if (!parseName(name, names, 5, &v))
+        return false;
+    *kernel = (BWKernel)v;
+    return true;
+}
+
+static bool parseLevelValues(const char *list, BWConfig *cfg) {
+    int n = 0;
+    const char *p = list;
+    while (*p) {
+        char *end;
+        long v = strtol(p, &end, 10);
+        if (end == p || v < 0 || v > 255 || n == BW_MAX_LEVELS)
+            return false;
+        cfg->levelValues[n++] = (unsigned char)v;
+        p = *end == ',' ? end + 1 : end;
+        if (*end && *end != ',')
+            return false;
+    }
+    cfg->levels = n;
+    cfg->customLevels = true;
+    return n >= 2;
+}
+
+static bool parsePalette(const char *spec, BWConfig *cfg) {
+    if (bw_palette_preset(spec, cfg) == 0)
+        return true;
+    int n = 0;
+    const char *p = spec;
+    while (*p) {
+        if (*p == '#')
+            p++;
+        char *end;
+        unsigned long v = strtoul(p, &end, 16);
+        if (end - p != 6 || n == BW_MAX_PALETTE || (*end && *end != ','))
+            return false;
+        cfg->palette[3 * n] = (unsigned char)(v >> 16);
+        cfg->palette[3 * n + 1] = (unsigned char)(v >> 8);
+        cfg->palette[3 * n + 2] = (unsigned char)v;
+        n++;
+        p = *end ? end + 1 : end;
+    }
+    cfg->paletteSize = n;
+    return n >= 2;
 }
 
 int main(int argc, char *argv[]) {
-    int threshold = 128;
-    int invert = 0;
-    int verbose = 0;
+    BWConfig cfg;
+    bw_config_init(&cfg);
+    bool wantStats = false;
+    bool y4m = false;
+    const char *outDir = NULL;
+    const char *manifest = NULL;
+    const char *watchDir = NULL;
+    const char *serveSocket = NULL;
+    int debounceMs = 250;
+    const char *results = "-";
+    const char *shardDir = NULL;
+    int leaseSeconds = 60;
+    int metricsPort = 0;
+    const char *metricsFile = NULL;
+    const char *cacheDir = NULL;
+    long long cacheMB = 1024;
+    BWPipelineConfig pipe = {0};
 
-    struct option longOpts[] = {{"version", no_argument, 0, 'V'}, {0, 0, 0, 0}};
+    struct option longOpts[] = {{"version", no_argument, 0, 'V'},
+                                {"stats", no_argument, 0, 'S'},
+                                {"stats-tile", required_argument, 0, 'T'},
+                                {"dpi", required_argument, 0, 'D'},
+                                {"level-values", required_argument, 0, 'L'},
+                                {"cmyk", no_argument, 0, 'C'},
+                                {"gcr", required_argument, 0, 'G'},
+                                {"ucr", required_argument, 0, 'U'},
+                                {"lpi", required_argument, 0, 'P'},
+                                {"angle", required_argument, 0, 'A'},
+                                {"dot", required_argument, 0, 'O'},
+                                {"threads", required_argument, 0, 'N'},
+                                {"temporal", no_argument, 0, 'M'},
+                                {"temporal-tol", required_argument, 0, 'X'},
+                                {"y4m", no_argument, 0, 'Y'},
+                                {"out-dir", required_argument, 0, 'R'},
+                                {"manifest", required_argument, 0, 'Q'},
+                                {"results", required_argument, 0, 'W'},
+                                {"shard", required_argument, 0, 'J'},
+                                {"lease", required_argument, 0, 'F'},
+                                {"metrics-port", required_argument, 0, 'g'},
+                                {"metrics-file", required_argument, 0, 'm'},
+                                {"out", required_argument, 0, 'R'},
+                                {"watch", required_argument, 0, 'H'},
+                                {"debounce", required_argument, 0, 'B'},
+                                {"stages", required_argument, 0, 'E'},
+                                {"queue", required_argument, 0, 'K'},
+                                {"io", required_argument, 0, 'u'},
+                                {"prefetch", required_argument, 0, 'e'},
+                                {"drop-cache", no_argument, 0, 'c'},
+                                {"cache", required_argument, 0, 'x'},
+                                {"cache-size", required_argument, 0, 'z'},
+                                {"luma-sidecar", no_argument, 0, 'b'},
+                                {"deadline", required_argument, 0, 'd'},
+                                {"serve", required_argument, 0, 'Z'},
+                                {"priority", required_argument, 0, 'I'},
+                                {0, 0, 0, 0}};
     int opt;
-    while ((opt = getopt_long(argc, argv, "t:ivh", longOpts, NULL)) != -1) {
+    while ((opt = getopt_long(argc, argv, "t:ivhf:l:p:k:a:j:", longOpts, NULL)) != -1) {
         switch (opt) {
             case 't':
-                threshold = atoi(optarg);
+                cfg.brightnessThreshold = atoi(optarg);
                 break;
             case 'i':
-                invert = 1;
+                cfg.invertOutput = true;
                 break;
             case 'v':
-                verbose = 1;
+                cfg.verboseMode = true;
+                break;
+            case 'S':
+                wantStats = true;
+                break;
+            case 'T':
+                cfg.statsTileSize = atoi(optarg);
+                break;
+            case 'f':
+                if (!parseFormat(optarg, &cfg.outputFormat)) {
+                    fprintf(stderr, "Unknown format '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'D':
+                cfg.dpi = atoi(optarg);
+                break;
+            case 'l':
+                cfg.levels = atoi(optarg);
+                break;
+            case 'p':
+                if (!parsePalette(optarg, &cfg)) {
+                    fprintf(stderr, "Invalid palette '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'k':
+                if (!parseKernel(optarg, &cfg.diffusionKernel)) {
+                    fprintf(stderr, "Unknown kernel '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'a': {
+                static const char *const algos[] = {"diffusion", "am", "ordered",
+                                                    "threshold", "bluenoise"};
+                int v;
+                if (!parseName(optarg, algos, 5, &v)) {
+                    fprintf(stderr, "Unknown algorithm '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                cfg.algorithm = (BWAlgorithm)v;
+                break;
+            }
+            case 'O': {
+                static const char *const dots[] = {"round", "ellipse", "line", "square"};
+                int v;
+                if (!parseName(optarg, dots, 4, &v)) {
+                    fprintf(stderr, "Unknown dot shape '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                cfg.dotShape = (BWDotShape)v;
+                break;
+            }
+            case 'I': {
+                static const char *const classes[] = {"interactive", "batch"};
+                int v;
+                if (!parseName(optarg, classes, 2, &v)) {
+                    fprintf(stderr, "Unknown priority '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                cfg.priority = (BWPriority)v;
+                break;
+            }
+            case 'P':
+                cfg.screenLpi = atof(optarg);
+                break;
+            case 'A':
+                cfg.screenAngle = atof(optarg);
+                break;
+            case 'N':
+                cfg.threads = atoi(optarg);
+                bw_set_threads(cfg.threads); /* also caps nested work */
+                break;
+            case 'Y':
+                y4m = true;
+                break;
+            case 'R':
+                outDir = optarg;
+                break;
+            case 'Q':
+                manifest = optarg;
+                break;
+            case 'H':
+                watchDir = optarg;
+                break;
+            case 'Z':
+                serveSocket = optarg;
+                break;
+            case 'B':
+                debounceMs = atoi(optarg);
+                break;
+            case 'W':
+                results = optarg;
+                break;
+            case 'J':
+                shardDir = optarg;
+                break;
+            case 'F':
+                leaseSeconds = atoi(optarg);
+                break;
+            case 'g':
+                metricsPort = atoi(optarg);
+                break;
+            case 'm':
+                metricsFile = optarg;
+                break;
+            case 'j':
+                pipe.jobs = atoi(optarg);
+                break;
+            case 'E':
+                if (sscanf(optarg, "%d:%d:%d", &pipe.decodeThreads, &pipe.ditherThreads,
+                           &pipe.encodeThreads) != 3) {
+                    fprintf(stderr, "Invalid stage threads '%s' (want D:T:E)\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'K':
+                pipe.queueDepth = atoi(optarg);
+                break;
+            case 'u': {
+                static const char *const modes[] = {"auto", "uring", "threads", "sync"};
+                int v;
+                if (!parseName(optarg, modes, 4, &v)) {
+                    fprintf(stderr, "Unknown I/O mode '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                pipe.io = (BWIOMode)v;
+                break;
+            }
+            case 'e':
+                pipe.prefetch = atoi(optarg) > 0 ? atoi(optarg) : -1;
+                break;
+            case 'c':
+                pipe.dropCache = true;
+                break;
+            case 'x':
+                cacheDir = optarg;
+                break;
+            case 'z':
+                cacheMB = atoll(optarg);
+                break;
+            case 'b':
+                cfg.lumaSidecar = true;
+                break;
+            case 'd':
+                cfg.deadlineMs = atoi(optarg);
+                break;
+            case 'M':
+                cfg.temporalDither = true;
+                break;
+            case 'X':
+                cfg.temporalTolerance = atoi(optarg);
+                break;
+            case 'C':
+                cfg.separateCMYK = true;
+                break;
+            case 'G':
+                cfg.blackGeneration = atoi(optarg);
+                break;
+            case 'U':
+                cfg.underColorRemoval = atoi(optarg);
+                break;
+            case 'L':
+                if (!parseLevelValues(optarg, &cfg)) {
+                    fprintf(stderr, "Invalid level list '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
                 break;
             case 'h':
                 showUsage(argv[0]);
@@ -74,6 +750,88 @@ int main(int argc, char *argv[]) {
                 return EXIT_FAILURE;
         }
     }
+    if (!startMetrics(metricsPort, metricsFile))
+        return EXIT_FAILURE;
+    if (cacheDir && cacheMB <= 0) {
+        fprintf(stderr, "Invalid cache size %lld MB\n", cacheMB);
+        return EXIT_FAILURE;
+    }
+    if (cacheDir && bw_cache_open(cacheDir, (unsigned long long)cacheMB << 20) != 0) {
+        fprintf(stderr, "Cannot use '%s' as a cache\n", cacheDir);
+        return EXIT_FAILURE;
+    }
+    BWStats stats;
+    if (serveSocket) {
+        if (watchDir || manifest || outDir || wantStats || y4m || optind != argc) {
+            fprintf(stderr, "--serve takes no inputs, --watch, --manifest, --out-dir, "
+                            "--stats or --y4m\n");
+            return EXIT_FAILURE;
+        }
+        return runServer(serveSocket, &cfg, pipe.jobs, pipe.queueDepth);
+    }
+    if (watchDir) {
+        if (!outDir || manifest || wantStats || y4m || optind != argc) {
+            fprintf(stderr, "--watch needs --out DIR and takes no inputs, --manifest, "
+                            "--stats or --y4m\n");
+            return EXIT_FAILURE;
+        }
+        return runWatch(watchDir, outDir, &cfg, pipe.jobs, debounceMs);
+    }
+    if (manifest) {
+        if (y4m || outDir || optind != argc) {
+            fprintf(stderr, "--manifest takes no inputs, --out-dir or --y4m\n");
+            return EXIT_FAILURE;
+        }
+        if (shardDir)
+            return runShard(manifest, shardDir, results, &cfg, &pipe, leaseSeconds);
+        int failed = 0;
+        BWPipelineStats pstats;
+        int rc = convert_manifest_bw(manifest, results, &cfg, &pipe, &failed, &pstats);
+        if (rc != 0) {
+            fprintf(stderr, "Manifest '%s': %s\n", manifest, bw_error_string(rc));
+            return EXIT_FAILURE;
+        }
+        if (wantStats)
+            printPipelineStats(stderr, &pstats);
+        if (failed)
+            fprintf(stderr, "%d job%s failed\n", failed, failed == 1 ? "" : "s");
+        return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    if (outDir) {
+        if (y4m) {
+            fprintf(stderr, "--y4m is not available in batch mode\n");
+            return EXIT_FAILURE;
+        }
+        bool fromStdin = optind == argc || (optind + 1 == argc && !strcmp(argv[optind], "-"));
+        if (!fromStdin)
+            return runBatch(argv + optind, argc - optind, outDir, &cfg, &pipe, wantStats);
+        char *storage = NULL;
+        int count = 0;
+        char **paths = readPathList(stdin, &count, &storage);
+        if (!paths) {
+            fprintf(stderr, "Cannot read the input list\n");
+            return EXIT_FAILURE;
+        }
+        int rc = runBatch(paths, count, outDir, &cfg, &pipe, wantStats);
+        free(paths);
+        free(storage);
+        return rc;
+    }
+    if (y4m) {
+        /* stdout carries the frames, so statistics go to stderr */
+        if (optind != argc) {
+            showUsage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        setvbuf(stdin, stdinBuffer, _IOFBF, sizeof(stdinBuffer));
+        setvbuf(stdout, stdoutBuffer, _IOFBF, sizeof(stdoutBuffer));
+        int rc = convert_y4m_bw(stdin, stdout, &cfg, wantStats ? &stats : NULL);
+        if (rc == 0 && wantStats) {
+            printStats(stderr, &stats);
+            bw_stats_free(&stats);
+        }
+        return rc;
+    }
     if (optind + 2 != argc) {
         showUsage(argv[0]);
         return EXIT_FAILURE;
@@ -81,5 +839,13 @@ int main(int argc, char *argv[]) {
 
     const char *in = argv[optind];
     const char *out = argv[optind + 1];
-    return convert_image_bw(in, out, threshold, invert, verbose);
-}
\ No newline at end of file
+    bool toStdout = !strcmp(out, "-");
+    if (toStdout)
+        setvbuf(stdout, stdoutBuffer, _IOFBF, sizeof(stdoutBuffer));
+    int rc = convert_image_bw_ex(in, out, &cfg, wantStats ? &stats : NULL);
+    if (rc == 0 && wantStats) {
+        printStats(toStdout ? stderr : stdout, &stats);
+        bw_stats_free(&stats);
+    }
+    return rc;
+}